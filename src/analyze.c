@@ -0,0 +1,443 @@
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "error.h"
+#include "bsp.h"
+#include "jobs.h"
+#include "vfs/vfs.h"
+#include "analyze.h"
+
+extern int g_bezier_steps;
+
+struct map_stats {
+	char *path;
+	int ok;
+	int bytes;
+	double ms;
+	int lump_bytes[17];
+	int n_entities;
+	int n_faces;
+	int n_face_types[5]; /*by type, 0 is anything unknown*/
+	long n_triangles;
+	int n_vertices;
+	int n_leaves;
+	int n_clusters;
+	float pvs_mean, pvs_min, pvs_max; /*fraction of clusters visible*/
+	int n_lightmaps;
+	float draw_faces; /*mean faces in the PVS of a cluster*/
+	float draw_triangles;
+	long max_draw_triangles;
+};
+
+struct analyze_job {
+	struct vfs *vfs;
+	char **paths;
+	struct map_stats *stats;
+};
+
+/* Triangles as the viewer draws them */
+static int
+face_triangles(struct bsp_face *face)
+	{
+	switch (face->type)
+		{
+		case 1:
+		case 3: return face->n_meshverts/3;
+		case 2: return ((face->size[0]-1)/2)*((face->size[1]-1)/2)*g_bezier_steps*g_bezier_steps*2;
+		case 4: return 2;
+		}
+	return 0;
+	}
+
+static int
+count_bits(unsigned char *bytes, int n)
+	{
+	int count = 0;
+	int i;
+
+	for (i=0; i<n; i++) count += __builtin_popcount(bytes[i]);
+	return count;
+	}
+
+/***
+PVS density and what a camera in each cluster would draw:
+the faces of every leaf in a visible cluster, each face once.
+***/
+static void
+analyze_visibility(struct bsp *bsp, struct map_stats *st, int *face_tris)
+	{
+	struct bsp_leaf *leaves = bsp->directory[LEAVES].data;
+	int *leaffaces = bsp->directory[LEAFFACES].data;
+	unsigned char *visdata = bsp->directory[VISDATA].data;
+	int n_vecs = 0, sz_vecs = 0;
+	int *cluster_first, *cluster_leaves, *fill;
+	unsigned int *stamps;
+	double total_faces = 0, total_tris = 0, total_density = 0;
+	int c, v, i, j;
+
+	for (i=0; i<st->n_leaves; i++)
+		if (leaves[i].cluster+1 > st->n_clusters) st->n_clusters = leaves[i].cluster+1;
+
+	if (bsp->directory[VISDATA].length >= 8)
+		{
+		memcpy(&n_vecs, visdata, 4);
+		memcpy(&sz_vecs, visdata+4, 4);
+		if (n_vecs < st->n_clusters || (long)n_vecs*sz_vecs + 8 > bsp->directory[VISDATA].length)
+			n_vecs = 0;
+		}
+
+	st->pvs_min = st->pvs_max = st->pvs_mean = -1;
+	if (!st->n_clusters) return;
+
+	/* Leaves grouped by cluster */
+	cluster_first = calloc(st->n_clusters+1, sizeof(int));
+	cluster_leaves = malloc(sizeof(int)*(st->n_leaves+1));
+	fill = calloc(st->n_clusters, sizeof(int));
+	for (i=0; i<st->n_leaves; i++)
+		if (leaves[i].cluster >= 0) cluster_first[leaves[i].cluster+1]++;
+	for (c=0; c<st->n_clusters; c++) cluster_first[c+1] += cluster_first[c];
+	for (i=0; i<st->n_leaves; i++)
+		if (leaves[i].cluster >= 0)
+			cluster_leaves[cluster_first[leaves[i].cluster] + fill[leaves[i].cluster]++] = i;
+
+	stamps = calloc(st->n_faces, sizeof(unsigned int));
+
+	for (c=0; c<st->n_clusters; c++)
+		{
+		unsigned char *row = n_vecs ? visdata + 8 + (long)c*sz_vecs : 0;
+		long faces = 0, tris = 0;
+		float density = 1;
+
+		if (row)
+			{
+			density = (float)count_bits(row, sz_vecs)/st->n_clusters;
+			if (density > 1) density = 1;
+			}
+		if (st->pvs_min < 0 || density < st->pvs_min) st->pvs_min = density;
+		if (density > st->pvs_max) st->pvs_max = density;
+		total_density += density;
+
+		for (v=0; v<st->n_clusters; v++)
+			{
+			if (row && !(row[v >> 3] & (1 << (v & 7)))) continue;
+
+			for (i=cluster_first[v]; i<cluster_first[v+1]; i++)
+				{
+				struct bsp_leaf *leaf = &leaves[cluster_leaves[i]];
+
+				for (j=0; j<leaf->n_leaffaces; j++)
+					{
+					int face = leaffaces[leaf->leafface+j];
+
+					if (face < 0 || face >= st->n_faces || stamps[face] == (unsigned int)c+1) continue;
+					stamps[face] = c+1;
+					faces++;
+					tris += face_tris[face];
+					}
+				}
+			}
+
+		total_faces += faces;
+		total_tris += tris;
+		if (tris > st->max_draw_triangles) st->max_draw_triangles = tris;
+		}
+
+	st->pvs_mean = total_density/st->n_clusters;
+	st->draw_faces = total_faces/st->n_clusters;
+	st->draw_triangles = total_tris/st->n_clusters;
+
+	free(cluster_first);
+	free(cluster_leaves);
+	free(fill);
+	free(stamps);
+	}
+
+static void
+analyze_map(struct vfs *vfs, char *path, struct map_stats *st)
+	{
+	struct vfs_file file;
+	struct bsp bsp = {0};
+	struct map map = {0};
+	struct bsp_face *faces;
+	int *face_tris;
+	double t = jobsTime();
+	int i;
+
+	memset(st, 0, sizeof(struct map_stats));
+	st->path = path;
+
+	if (vfsRead(vfs, path, &file) != 0) return;
+	st->bytes = file.length;
+	if (bspLoadFromMemory(&bsp, file.data, file.length) < 0)
+		{
+		vfsClose(&file);
+		return;
+		}
+	vfsClose(&file);
+
+	bspLoadEntities(&bsp, &map);
+	st->n_entities = map.n_entities;
+
+	for (i=0; i<17; i++) st->lump_bytes[i] = bsp.directory[i].length;
+
+	faces = bsp.directory[FACES].data;
+	st->n_faces = bsp.directory[FACES].length/sizeof(struct bsp_face);
+	st->n_vertices = bsp.directory[VERTEXES].length/sizeof(struct bsp_vertex);
+	st->n_leaves = bsp.directory[LEAVES].length/sizeof(struct bsp_leaf);
+	st->n_lightmaps = bsp.directory[LIGHTMAPS].length/(128*128*3);
+
+	face_tris = malloc(sizeof(int)*(st->n_faces+1));
+	for (i=0; i<st->n_faces; i++)
+		{
+		int type = faces[i].type;
+		st->n_face_types[type >= 1 && type <= 4 ? type : 0]++;
+		face_tris[i] = face_triangles(&faces[i]);
+		st->n_triangles += face_tris[i];
+		}
+
+	analyze_visibility(&bsp, st, face_tris);
+
+	free(face_tris);
+	mapFree(&map);
+	bspFree(&bsp);
+
+	st->ok = 1;
+	st->ms = (jobsTime() - t)*1000;
+	}
+
+static void
+analyze_range(void *ctx, int begin, int end, int thread)
+	{
+	struct analyze_job *job = ctx;
+	int i;
+
+	for (i=begin; i<end; i++) analyze_map(job->vfs, job->paths[i], &job->stats[i]);
+	}
+
+/* Quoted, with quotes doubled, so commas and quotes in a path survive */
+static void
+print_csv_string(char *s)
+	{
+	putchar('"');
+	for (; *s; s++)
+		{
+		if (*s == '"') putchar('"');
+		putchar(*s);
+		}
+	putchar('"');
+	}
+
+static void
+print_json_string(char *s)
+	{
+	putchar('"');
+	for (; *s; s++)
+		{
+		unsigned char c = *s;
+
+		if (c == '"' || c == '\\') printf("\\%c", c);
+		else if (c < 0x20) printf("\\u%04x", c);
+		else putchar(c);
+		}
+	putchar('"');
+	}
+
+static void
+print_csv(struct map_stats *stats, int n)
+	{
+	int i, j;
+
+	printf("map,ok,bytes,ms,entities");
+	for (j=0; j<17; j++) printf(",%s_bytes", bspLumpName(j));
+	printf(",faces,planar,patches,meshes,billboards,triangles,vertices,leaves,clusters,"
+		"pvs_mean,pvs_min,pvs_max,lightmaps,draw_faces,draw_triangles,max_draw_triangles\n");
+
+	for (i=0; i<n; i++)
+		{
+		struct map_stats *st = &stats[i];
+
+		print_csv_string(st->path);
+		printf(",%i,%i,%.3f,%i", st->ok, st->bytes, st->ms, st->n_entities);
+		for (j=0; j<17; j++) printf(",%i", st->lump_bytes[j]);
+		printf(",%i,%i,%i,%i,%i,%li,%i,%i,%i,%.4f,%.4f,%.4f,%i,%.1f,%.1f,%li\n",
+			st->n_faces, st->n_face_types[1], st->n_face_types[2], st->n_face_types[3], st->n_face_types[4],
+			st->n_triangles, st->n_vertices, st->n_leaves, st->n_clusters,
+			st->pvs_mean, st->pvs_min, st->pvs_max, st->n_lightmaps,
+			st->draw_faces, st->draw_triangles, st->max_draw_triangles);
+		}
+	}
+
+static void
+print_json(struct map_stats *stats, int n)
+	{
+	int i, j;
+
+	printf("[\n");
+	for (i=0; i<n; i++)
+		{
+		struct map_stats *st = &stats[i];
+
+		printf("\t{\"map\": ");
+		print_json_string(st->path);
+		printf(", \"ok\": %s, \"bytes\": %i, \"ms\": %.3f, \"entities\": %i,\n",
+			st->ok ? "true" : "false", st->bytes, st->ms, st->n_entities);
+		printf("\t \"lumps\": {");
+		for (j=0; j<17; j++) printf("%s\"%s\": %i", j ? ", " : "", bspLumpName(j), st->lump_bytes[j]);
+		printf("},\n");
+		printf("\t \"faces\": %i, \"planar\": %i, \"patches\": %i, \"meshes\": %i, \"billboards\": %i,\n",
+			st->n_faces, st->n_face_types[1], st->n_face_types[2], st->n_face_types[3], st->n_face_types[4]);
+		printf("\t \"triangles\": %li, \"vertices\": %i, \"leaves\": %i, \"clusters\": %i,\n",
+			st->n_triangles, st->n_vertices, st->n_leaves, st->n_clusters);
+		printf("\t \"pvs_mean\": %.4f, \"pvs_min\": %.4f, \"pvs_max\": %.4f, \"lightmaps\": %i,\n",
+			st->pvs_mean, st->pvs_min, st->pvs_max, st->n_lightmaps);
+		printf("\t \"draw_faces\": %.1f, \"draw_triangles\": %.1f, \"max_draw_triangles\": %li}%s\n",
+			st->draw_faces, st->draw_triangles, st->max_draw_triangles, i+1 < n ? "," : "");
+		}
+	printf("]\n");
+	}
+
+/***
+Every .bsp in the directory and in its pk3s. The table goes to
+stdout, timings to stderr so the output can be piped.
+Returns the number of maps that failed to load.
+***/
+int
+analyzeMaps(char *directory, int json, int n_threads)
+	{
+	struct analyze_job job;
+	struct jobs *jobs;
+	char **paths;
+	int n_paths, n_failed = 0;
+	double t = jobsTime();
+	int i;
+
+	job.vfs = vfsCreate();
+	if (vfsMount(job.vfs, directory) < 0) error(-1, "Map directory doesn't exist.");
+
+	n_paths = vfsList(job.vfs, 0, ".bsp", &paths);
+	job.paths = paths;
+	job.stats = calloc(n_paths+1, sizeof(struct map_stats));
+
+	jobs = jobsCreate(n_threads);
+	jobsParallelFor(jobs, n_paths, 1, analyze_range, &job);
+
+	if (json) print_json(job.stats, n_paths);
+	else print_csv(job.stats, n_paths);
+
+	for (i=0; i<n_paths; i++) if (!job.stats[i].ok) n_failed++;
+	fprintf(stderr, "Analyze: %i maps (%i failed) from %i pk3s in %.1f ms on %i threads\n",
+		n_paths, n_failed, vfsArchiveCount(job.vfs), (jobsTime() - t)*1000, jobsThreadCount(jobs));
+
+	jobsDestroy(jobs);
+	free(job.stats);
+	vfsFreeList(paths, n_paths);
+	vfsDestroy(job.vfs);
+
+	return n_failed;
+	}
+
+static void
+report_map(struct bsp *bsp, struct map *map, char *path, long lump_bytes, long entity_bytes)
+	{
+	long total = 0;
+	int order[17], n_properties = 0, n_clusters = 0;
+	int i, j;
+
+	/* Largest lumps first */
+	for (i=0; i<17; i++)
+		{
+		int length = bsp->directory[i].length;
+
+		for (j=i; j>0 && bsp->directory[order[j-1]].length < length; j--) order[j] = order[j-1];
+		order[j] = i;
+		total += length;
+		}
+
+	printf("%s\n", path);
+	printf("\tlumps    %10li bytes, %li used, %i allocations:", lump_bytes, bsp->lumps.used, (int)bsp->lumps.n_allocs);
+	for (i=0; i<17 && total; i++)
+		{
+		int length = bsp->directory[order[i]].length;
+		if (100.0*length/total < 1) break;
+		printf(" %s %.1f%%", bspLumpName(order[i]), 100.0*length/total);
+		}
+	printf("\n");
+
+	for (i=0; i<map->n_entities; i++) n_properties += map->entities[i].n_properties;
+	for (i=0; i<map->n_models; i++) n_clusters += map->models[i].n_clusters;
+	printf("\tentities %10li bytes, %li used, %i allocations: %u entities, %i properties, %u brush models in %i clusters\n",
+		entity_bytes, map->arena.used, (int)map->arena.n_allocs, map->n_entities, n_properties, map->n_models, n_clusters);
+	}
+
+/***
+Loads every map in the directory one after the other and prints
+what it takes, then frees it all before the next. Whatever is
+still accounted for after that is a leak.
+Returns the number of maps that failed to load or leaked.
+***/
+int
+analyzeMemory(char *directory)
+	{
+	struct vfs *vfs = vfsCreate();
+	char **paths;
+	int n_paths, n_failed = 0;
+	int i, k;
+
+	if (vfsMount(vfs, directory) < 0) error(-1, "Map directory doesn't exist.");
+	n_paths = vfsList(vfs, 0, ".bsp", &paths);
+
+	for (i=0; i<n_paths; i++)
+		{
+		struct vfs_file file;
+		struct bsp bsp = {0};
+		struct map map = {0};
+		long before[MEM_SUBSYSTEMS], lump_bytes, entity_bytes;
+		int leaked = 0;
+
+		for (k=0; k<MEM_SUBSYSTEMS; k++) before[k] = memLive(k);
+
+		if (vfsRead(vfs, paths[i], &file) != 0)
+			{
+			printf("%s\n\tfailed to read\n", paths[i]);
+			n_failed++;
+			continue;
+			}
+		if (bspLoadFromMemory(&bsp, file.data, file.length) < 0)
+			{
+			printf("%s\n\tnot a version 46 BSP\n", paths[i]);
+			vfsClose(&file);
+			n_failed++;
+			continue;
+			}
+		vfsClose(&file);
+		lump_bytes = memLive(MEM_LUMPS) - before[MEM_LUMPS];
+
+		bspLoadEntities(&bsp, &map);
+		bspLoadModels(&bsp, &map);
+		entity_bytes = memLive(MEM_ENTITIES) - before[MEM_ENTITIES];
+
+		report_map(&bsp, &map, paths[i], lump_bytes, entity_bytes);
+
+		mapFree(&map);
+		bspFree(&bsp);
+
+		for (k=0; k<MEM_SUBSYSTEMS; k++)
+			{
+			if (memLive(k) == before[k]) continue;
+			printf("\tleaked %li bytes of %s\n", memLive(k) - before[k], memSubsystemName(k));
+			leaked = 1;
+			}
+		n_failed += leaked;
+		}
+
+	printf("\n");
+	memReport(stdout);
+
+	vfsFreeList(paths, n_paths);
+	vfsDestroy(vfs);
+
+	return n_failed;
+	}
@@ -0,0 +1,14 @@
+#ifndef ANALYZE_H
+#define ANALYZE_H
+
+/***
+Headless statistics over every BSP in a directory and its pk3s,
+maps processed in parallel, one CSV row or JSON object per map
+on stdout.
+***/
+
+int analyzeMaps(char *directory, int json, int n_threads);
+/* Loads and frees the maps one at a time, memory by subsystem */
+int analyzeMemory(char *directory);
+
+#endif /* ANALYZE_H */
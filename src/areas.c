@@ -0,0 +1,151 @@
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "error.h"
+#include "areas.h"
+
+/* Entities that sit on an areaportal and gate it */
+static int
+is_portal_entity(struct entity *e)
+	{
+	struct entity_property *prop = entityGetPropertyByName(e, "classname");
+
+	if (!prop) return 0;
+	return !strcmp(prop->value, "func_door") || !strcmp(prop->value, "func_areaportal");
+	}
+
+/***
+Find the portals: every door whose bounds touch exactly two
+areas connects them. Doors start closed unless spawnflags has
+START_OPEN (1).
+Returns the number of portals.
+***/
+int
+areasBuild(struct areas *areas, struct bsp *bsp, struct map *map)
+	{
+	struct bsp_leaf *leaves = bsp->directory[LEAVES].data;
+	int n_leaves = bsp->directory[LEAVES].length/sizeof(struct bsp_leaf);
+	int i, j;
+
+	areas->n_areas = 0;
+	areas->portals = 0;
+	areas->n_portals = 0;
+	areas->camera_area = -2;
+	areas->dirty = 1;
+
+	for (i=0; i<n_leaves; i++)
+		if (leaves[i].area+1 > areas->n_areas) areas->n_areas = leaves[i].area+1;
+
+	areas->reachable = calloc((areas->n_areas+31)/32 + 1, sizeof(unsigned int));
+
+	for (i=0; i<map->n_models; i++)
+		{
+		struct model_instance *inst = &map->models[i];
+		struct entity *e = &map->entities[inst->entity];
+		struct entity_property *prop;
+		struct area_portal *portal;
+		int touched[1024];
+		int found[2] = {-1, -1};
+		int n_touched;
+
+		if (!is_portal_entity(e)) continue;
+
+		n_touched = bspBoxLeaves(bsp, inst->mins, inst->maxs, touched, 1024);
+		for (j=0; j<n_touched; j++)
+			{
+			int area = leaves[touched[j]].area;
+			if (area < 0 || area == found[0] || area == found[1]) continue;
+			if (found[0] < 0) found[0] = area;
+			else if (found[1] < 0) found[1] = area;
+			else break; /*more than two, not a portal*/
+			}
+		if (j < n_touched || found[1] < 0) continue;
+
+		areas->n_portals++;
+		areas->portals = realloc(areas->portals, sizeof(struct area_portal)*areas->n_portals);
+		portal = &areas->portals[areas->n_portals-1];
+		portal->area[0] = found[0];
+		portal->area[1] = found[1];
+		portal->model = i;
+		portal->open = 0;
+
+		prop = entityGetPropertyByName(e, "spawnflags");
+		if (prop && (atoi(prop->value) & 1)) portal->open = 1;
+		}
+
+	printf("Areas: %i areas, %i portals\n", areas->n_areas, areas->n_portals);
+
+	return areas->n_portals;
+	}
+
+void
+areasFree(struct areas *areas)
+	{
+	free(areas->portals);
+	free(areas->reachable);
+	areas->portals = 0;
+	areas->reachable = 0;
+	areas->n_portals = 0;
+	}
+
+void
+areasSetAllPortals(struct areas *areas, int open)
+	{
+	int i;
+
+	for (i=0; i<areas->n_portals; i++) areas->portals[i].open = open;
+	areas->dirty = 1;
+	}
+
+/***
+Flood out from the camera's area through the open portals.
+Only does any work when the camera changes area or a portal
+changes state. Returns 1 if the reachable set was rebuilt.
+***/
+int
+areasUpdate(struct areas *areas, int camera_area)
+	{
+	int words = (areas->n_areas+31)/32 + 1;
+	int changed = 1;
+	int i;
+
+	if (!areas->dirty && camera_area == areas->camera_area) return 0;
+
+	areas->camera_area = camera_area;
+	areas->dirty = 0;
+
+	/* Outside the world or no areas: everything is reachable */
+	if (camera_area < 0 || camera_area >= areas->n_areas)
+		{
+		for (i=0; i<words; i++) areas->reachable[i] = ~0u;
+		return 1;
+		}
+
+	for (i=0; i<words; i++) areas->reachable[i] = 0;
+	areas->reachable[camera_area >> 5] |= 1u << (camera_area & 31);
+
+	/* Few portals, so sweep until nothing new is reached */
+	while (changed)
+		{
+		changed = 0;
+		for (i=0; i<areas->n_portals; i++)
+			{
+			struct area_portal *p = &areas->portals[i];
+			int in0, in1;
+
+			if (!p->open) continue;
+			in0 = areaIsReachable(areas, p->area[0]);
+			in1 = areaIsReachable(areas, p->area[1]);
+			if (in0 == in1) continue;
+
+			if (!in0) areas->reachable[p->area[0] >> 5] |= 1u << (p->area[0] & 31);
+			if (!in1) areas->reachable[p->area[1] >> 5] |= 1u << (p->area[1] & 31);
+			changed = 1;
+			}
+		}
+
+	return 1;
+	}
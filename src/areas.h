@@ -0,0 +1,38 @@
+#ifndef AREAS_H
+#define AREAS_H
+
+#include "bsp.h"
+
+/***
+Area portals.
+The compiler splits the world into areas wherever an areaportal
+brush sits; the door entity covering that brush opens or closes
+the connection. Leaves in areas that can't be reached from the
+camera's area through open portals are skipped, after the PVS.
+***/
+
+struct area_portal {
+	int area[2];
+	int model; /*index into map->models*/
+	int open;
+};
+
+struct areas {
+	int n_areas;
+	struct area_portal *portals;
+	int n_portals;
+	unsigned int *reachable; /*one bit per area*/
+	int camera_area;
+	int dirty; /*portal state changed, flood again*/
+};
+
+int areasBuild(struct areas *areas, struct bsp *bsp, struct map *map);
+void areasFree(struct areas *areas);
+int areasUpdate(struct areas *areas, int camera_area);
+void areasSetAllPortals(struct areas *areas, int open);
+
+/* One bit test per leaf, area -1 is outside every area */
+#define areaIsReachable(areas, area) \
+	((area) < 0 || ((areas)->reachable[(area) >> 5] & (1u << ((area) & 31))))
+
+#endif /* AREAS_H */
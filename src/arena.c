@@ -0,0 +1,258 @@
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "error.h"
+#include "arena.h"
+
+struct arena_block {
+	struct arena_block *next;
+	long size;
+	long used;
+	/* Data follows, aligned */
+};
+
+#define BLOCK_HEADER ((sizeof(struct arena_block) + ARENA_ALIGN-1) & ~(long)(ARENA_ALIGN-1))
+#define ALIGN(n) (((n) + ARENA_ALIGN-1) & ~(long)(ARENA_ALIGN-1))
+
+struct mem_stats {
+	long bytes; /*taken from the heap*/
+	long used; /*handed out of it*/
+	long peak; /*most bytes at once*/
+	long n_allocs;
+	long n_heap; /*heap allocations behind them*/
+};
+
+struct arena g_frame_arena = ARENA_INIT(MEM_FRAME);
+
+static struct mem_stats g_mem[MEM_SUBSYSTEMS];
+static pthread_mutex_t g_mem_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static char *subsystem_names[MEM_SUBSYSTEMS] = {
+	"lumps", "entities", "frame", "textures"
+};
+
+static void
+account(int subsystem, long bytes, long used, long n_allocs, long n_heap)
+	{
+	struct mem_stats *m = &g_mem[subsystem];
+
+	pthread_mutex_lock(&g_mem_lock);
+	m->bytes += bytes;
+	m->used += used;
+	m->n_allocs += n_allocs;
+	m->n_heap += n_heap;
+	if (m->bytes > m->peak) m->peak = m->bytes;
+	pthread_mutex_unlock(&g_mem_lock);
+	}
+
+/* The arena's allocations since it last accounted, with any block change */
+static void
+account_arena(struct arena *a, long bytes, long n_heap)
+	{
+	account(a->subsystem, bytes, a->used - a->accounted_used,
+		(long)(a->n_allocs - a->accounted_allocs), n_heap);
+	a->accounted_used = a->used;
+	a->accounted_allocs = a->n_allocs;
+	}
+
+void
+arenaInit(struct arena *a, int subsystem, long block_size)
+	{
+	memset(a, 0, sizeof(struct arena));
+	a->subsystem = subsystem;
+	a->block_size = block_size;
+	}
+
+static struct arena_block *
+new_block(struct arena *a, long size)
+	{
+	long block_size = a->block_size ? a->block_size : ARENA_DEFAULT_BLOCK;
+	struct arena_block *block;
+
+	if (size < block_size) size = block_size;
+	block = malloc(BLOCK_HEADER + size);
+	if (!block) error(-1, "Out of memory.");
+	block->size = size;
+	block->used = 0;
+	block->next = a->blocks;
+	a->blocks = block;
+	a->reserved += size;
+	account_arena(a, BLOCK_HEADER + size, 1);
+
+	return block;
+	}
+
+void *
+arenaAlloc(struct arena *a, long size)
+	{
+	struct arena_block *block = a->blocks;
+	void *data;
+
+	size = ALIGN(size);
+	if (!block || block->used + size > block->size) block = new_block(a, size);
+
+	data = (char *)block + BLOCK_HEADER + block->used;
+	block->used += size;
+	a->used += size;
+	if (a->used > a->peak) a->peak = a->used;
+	a->n_allocs++;
+	a->last = data;
+
+	return data;
+	}
+
+void *
+arenaRealloc(struct arena *a, void *data, long old_size, long size)
+	{
+	struct arena_block *block = a->blocks;
+	void *moved;
+
+	if (!data) return arenaAlloc(a, size);
+
+	old_size = ALIGN(old_size);
+	size = ALIGN(size);
+	if (data == a->last && block->used - old_size + size <= block->size)
+		{
+		block->used += size - old_size;
+		a->used += size - old_size;
+		if (a->used > a->peak) a->peak = a->used;
+		return data;
+		}
+
+	moved = arenaAlloc(a, size);
+	memcpy(moved, data, old_size < size ? old_size : size);
+
+	return moved;
+	}
+
+char *
+arenaStrdup(struct arena *a, char *string)
+	{
+	long length = strlen(string) + 1;
+	char *copy = arenaAlloc(a, length);
+
+	memcpy(copy, string, length);
+
+	return copy;
+	}
+
+int
+arenaOwns(struct arena *a, void *data)
+	{
+	struct arena_block *block;
+
+	for (block=a->blocks; block; block=block->next)
+		if ((char *)data >= (char *)block + BLOCK_HEADER && (char *)data < (char *)block + BLOCK_HEADER + block->size)
+			return 1;
+
+	return 0;
+	}
+
+static void
+free_blocks(struct arena *a)
+	{
+	struct arena_block *block, *next;
+	long n_blocks = 0;
+
+	for (block=a->blocks; block; block=next)
+		{
+		next = block->next;
+		n_blocks++;
+		free(block);
+		}
+	account(a->subsystem, -(a->reserved + n_blocks*BLOCK_HEADER), -a->accounted_used, -(long)a->accounted_allocs, -n_blocks);
+	a->blocks = 0;
+	a->reserved = 0;
+	a->used = 0;
+	a->n_allocs = 0;
+	a->last = 0;
+	a->accounted_used = 0;
+	a->accounted_allocs = 0;
+	}
+
+/***
+A frame that needed several blocks gets them merged into one, so
+after the first few frames the scratch is a single block that is
+never freed.
+***/
+void
+arenaReset(struct arena *a)
+	{
+	long peak = a->peak;
+
+	if (!a->blocks) return;
+
+	if (a->blocks->next)
+		{
+		free_blocks(a);
+		new_block(a, peak);
+		}
+	else
+		{
+		if (a->accounted_allocs) account(a->subsystem, 0, -a->accounted_used, -(long)a->accounted_allocs, 0);
+		a->blocks->used = 0;
+		a->used = 0;
+		a->n_allocs = 0;
+		a->last = 0;
+		a->accounted_used = 0;
+		a->accounted_allocs = 0;
+		}
+	a->peak = peak;
+	}
+
+void
+arenaFree(struct arena *a)
+	{
+	free_blocks(a);
+	a->peak = 0;
+	}
+
+void
+arenaFlush(struct arena *a)
+	{
+	if (a->used != a->accounted_used || a->n_allocs != a->accounted_allocs) account_arena(a, 0, 0);
+	}
+
+void
+memAccount(int subsystem, long bytes, int n_allocs)
+	{
+	account(subsystem, bytes, bytes, n_allocs, n_allocs);
+	}
+
+long
+memLive(int subsystem)
+	{
+	long bytes;
+
+	pthread_mutex_lock(&g_mem_lock);
+	bytes = g_mem[subsystem].bytes;
+	pthread_mutex_unlock(&g_mem_lock);
+
+	return bytes;
+	}
+
+char *
+memSubsystemName(int subsystem)
+	{
+	if (subsystem < 0 || subsystem >= MEM_SUBSYSTEMS) return "?";
+	return subsystem_names[subsystem];
+	}
+
+void
+memReport(FILE *fp)
+	{
+	int i;
+
+	pthread_mutex_lock(&g_mem_lock);
+	fprintf(fp, "%-10s %12s %12s %12s %10s %8s\n", "subsystem", "live bytes", "used bytes", "peak bytes", "allocs", "mallocs");
+	for (i=0; i<MEM_SUBSYSTEMS; i++)
+		{
+		struct mem_stats *m = &g_mem[i];
+		fprintf(fp, "%-10s %12li %12li %12li %10li %8li\n", subsystem_names[i], m->bytes, m->used, m->peak, m->n_allocs, m->n_heap);
+		}
+	pthread_mutex_unlock(&g_mem_lock);
+	}
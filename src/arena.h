@@ -0,0 +1,70 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stdio.h>
+
+/***
+Linear allocators with accounting, one per kind of data that lives
+and dies together: the lumps of a map, its entities, the scratch of
+a frame. Allocations come out of large blocks and are only given
+back all at once, by arenaReset or arenaFree. Each arena counts
+into a subsystem; memReport prints what every subsystem has live
+and the most it ever had.
+Not thread safe, an arena belongs to one thread at a time. The
+subsystem totals are locked, so an arena only adds its counts to
+them when it takes a new block, is reset or freed, or on
+arenaFlush; allocating from a block takes no lock.
+***/
+
+enum {
+	MEM_LUMPS,
+	MEM_ENTITIES,
+	MEM_FRAME,
+	MEM_TEXTURES, /*lightmap texture names*/
+	MEM_SUBSYSTEMS
+};
+
+/* Every allocation is aligned to this */
+#define ARENA_ALIGN (16)
+
+struct arena_block;
+
+struct arena {
+	int subsystem;
+	long block_size; /*smallest block, 0 for ARENA_DEFAULT_BLOCK*/
+	struct arena_block *blocks; /*newest first*/
+	long used; /*bytes handed out*/
+	long reserved; /*bytes in blocks*/
+	long peak; /*most used since the last arenaFree*/
+	unsigned long n_allocs;
+	void *last; /*top allocation, arenaRealloc grows it in place*/
+	long accounted_used; /*what the subsystem totals have of used and n_allocs*/
+	unsigned long accounted_allocs;
+};
+
+#define ARENA_DEFAULT_BLOCK (64*1024)
+/* Usable as is, without arenaInit */
+#define ARENA_INIT(subsystem) {subsystem, 0, 0, 0, 0, 0, 0, 0, 0, 0}
+
+/* Per frame scratch, everything in it is gone at the next arenaReset */
+extern struct arena g_frame_arena;
+
+void arenaInit(struct arena *a, int subsystem, long block_size);
+void *arenaAlloc(struct arena *a, long size);
+/* Grows the last allocation where it is when there is room, else copies */
+void *arenaRealloc(struct arena *a, void *data, long old_size, long size);
+char *arenaStrdup(struct arena *a, char *string);
+int arenaOwns(struct arena *a, void *data);
+/* Forget every allocation, keep one block as large as the peak */
+void arenaReset(struct arena *a);
+void arenaFree(struct arena *a);
+/* Bring the subsystem totals up to date with the arena, e.g. before memReport */
+void arenaFlush(struct arena *a);
+
+/* Memory a subsystem has from the heap outside an arena, negative to give it back */
+void memAccount(int subsystem, long bytes, int n_allocs);
+long memLive(int subsystem);
+char *memSubsystemName(int subsystem);
+void memReport(FILE *fp);
+
+#endif /* ARENA_H */
@@ -0,0 +1,399 @@
+#include <config.h>
+
+#include <math.h>
+
+#include "../error.h"
+#include "../bsp.h"
+#include "../jobs.h"
+#include "../trace.h"
+#include "bake.h"
+
+#define LM_SIZE (128)
+/* Same scale q3map uses to turn "light" values into photons */
+#define POINT_SCALE (7500.0f)
+/* Lightmaps are stored with one overbright bit */
+#define OVERBRIGHT (0.5f)
+/* Luxels this far (in texels) outside every triangle are left alone */
+#define LUXEL_REACH (0.75f)
+/* Contributions below this aren't worth a ray */
+#define MIN_LIGHT (0.5f)
+/* Shadow rays start this far off the surface */
+#define SURFACE_OFFSET (1.0f)
+
+struct bake_light {
+	float origin[3];
+	float photons;
+	float color[3];
+};
+
+struct luxel {
+	float position[3];
+	float normal[3];
+	float dist; /*texels outside the triangle it came from, -1 if unused*/
+};
+
+struct bake_context {
+	struct tracer *tracer;
+	struct trace_work *work; /*one per thread*/
+	struct bake_light *lights;
+	int n_lights;
+	float ambient[3];
+	struct luxel *luxels;
+	int *todo; /*luxel indices*/
+	float *colors; /*rgb per todo entry*/
+	unsigned long *rays; /*per thread*/
+};
+
+/* Closest point to p on the segment a-b, as a fraction */
+static float
+segment_fraction(float p[2], float a[2], float b[2])
+	{
+	float ab[2] = {b[0]-a[0], b[1]-a[1]};
+	float len2 = ab[0]*ab[0] + ab[1]*ab[1];
+	float t;
+
+	if (len2 == 0) return 0;
+	t = ((p[0]-a[0])*ab[0] + (p[1]-a[1])*ab[1])/len2;
+	if (t < 0) t = 0;
+	if (t > 1) t = 1;
+	return t;
+	}
+
+/***
+Rasterise one triangle into its lightmap.
+Every texel centre within LUXEL_REACH of the triangle (in lightmap
+space) gets the world position of the closest point on it, so
+texels straddling an edge are still lit.
+***/
+static void
+rasterise_triangle(struct luxel *lm, struct bsp_vertex *v[3], float face_normal[3], int planar)
+	{
+	float uv[3][2];
+	float min[2] = {1e30f, 1e30f}, max[2] = {-1e30f, -1e30f};
+	float area;
+	int x, y, k, c;
+
+	for (k=0; k<3; k++)
+		{
+		for (c=0; c<2; c++)
+			{
+			uv[k][c] = v[k]->texcoord[1][c] * LM_SIZE;
+			if (uv[k][c] < min[c]) min[c] = uv[k][c];
+			if (uv[k][c] > max[c]) max[c] = uv[k][c];
+			}
+		}
+
+	area = (uv[1][0]-uv[0][0])*(uv[2][1]-uv[0][1]) - (uv[2][0]-uv[0][0])*(uv[1][1]-uv[0][1]);
+	if (fabsf(area) < 1e-6f) return;
+
+	for (y=floorf(min[1]-LUXEL_REACH); y<=(int)ceilf(max[1]+LUXEL_REACH); y++)
+		{
+		if (y < 0 || y >= LM_SIZE) continue;
+		for (x=floorf(min[0]-LUXEL_REACH); x<=(int)ceilf(max[0]+LUXEL_REACH); x++)
+			{
+			struct luxel *l;
+			float p[2] = {x+0.5f, y+0.5f};
+			float b[3];
+			float dist = 0;
+
+			if (x < 0 || x >= LM_SIZE) continue;
+
+			b[1] = ((p[0]-uv[0][0])*(uv[2][1]-uv[0][1]) - (uv[2][0]-uv[0][0])*(p[1]-uv[0][1]))/area;
+			b[2] = ((uv[1][0]-uv[0][0])*(p[1]-uv[0][1]) - (p[0]-uv[0][0])*(uv[1][1]-uv[0][1]))/area;
+			b[0] = 1 - b[1] - b[2];
+
+			if (b[0] < 0 || b[1] < 0 || b[2] < 0)
+				{
+				/* Outside, snap to the nearest edge */
+				float best = 1e30f;
+				for (k=0; k<3; k++)
+					{
+					int k2 = (k+1)%3;
+					float t = segment_fraction(p, uv[k], uv[k2]);
+					float q[2] = {uv[k][0] + t*(uv[k2][0]-uv[k][0]), uv[k][1] + t*(uv[k2][1]-uv[k][1])};
+					float d = sqrtf((q[0]-p[0])*(q[0]-p[0]) + (q[1]-p[1])*(q[1]-p[1]));
+					if (d < best)
+						{
+						best = d;
+						b[k] = 1-t;
+						b[k2] = t;
+						b[(k+2)%3] = 0;
+						}
+					}
+				dist = best;
+				}
+
+			if (dist > LUXEL_REACH) continue;
+
+			l = &lm[y*LM_SIZE + x];
+			if (l->dist >= 0 && l->dist <= dist) continue;
+
+			l->dist = dist;
+			for (c=0; c<3; c++)
+				{
+				l->position[c] = b[0]*v[0]->position[c] + b[1]*v[1]->position[c] + b[2]*v[2]->position[c];
+				l->normal[c] = planar ? face_normal[c]
+					: b[0]*v[0]->normal[c] + b[1]*v[1]->normal[c] + b[2]*v[2]->normal[c];
+				}
+			}
+		}
+	}
+
+/* Patches use their control grid, close enough for lighting */
+static void
+rasterise_face(struct bsp *bsp, struct bsp_face *face, struct luxel *lm)
+	{
+	struct bsp_vertex *vertices = bsp->directory[VERTEXES].data;
+	int *meshverts = bsp->directory[MESHVERTS].data;
+	struct bsp_vertex *v[3];
+	int i, x, y;
+
+	switch (face->type)
+		{
+		case 1:
+		case 3:
+			for (i=0; i+2<face->n_meshverts; i+=3)
+				{
+				v[0] = &vertices[face->vertex + meshverts[face->meshvert+i]];
+				v[1] = &vertices[face->vertex + meshverts[face->meshvert+i+1]];
+				v[2] = &vertices[face->vertex + meshverts[face->meshvert+i+2]];
+				rasterise_triangle(lm, v, face->normal, face->type == 1);
+				}
+			break;
+		case 2:
+			for (y=0; y<face->size[1]-1; y++)
+				{
+				for (x=0; x<face->size[0]-1; x++)
+					{
+					struct bsp_vertex *grid = &vertices[face->vertex + y*face->size[0] + x];
+					v[0] = &grid[0];
+					v[1] = &grid[1];
+					v[2] = &grid[face->size[0]+1];
+					rasterise_triangle(lm, v, face->normal, 0);
+					v[1] = &grid[face->size[0]+1];
+					v[2] = &grid[face->size[0]];
+					rasterise_triangle(lm, v, face->normal, 0);
+					}
+				}
+			break;
+		}
+	}
+
+static void
+light_luxels(void *ctx, int begin, int end, int thread)
+	{
+	struct bake_context *b = ctx;
+	struct trace_work *w = &b->work[thread];
+	unsigned long rays = 0; /*the per thread slots share a cache line*/
+	int i, j, k;
+
+	for (i=begin; i<end; i++)
+		{
+		struct luxel *l = &b->luxels[b->todo[i]];
+		float *color = &b->colors[i*3];
+		float start[3];
+
+		for (k=0; k<3; k++)
+			{
+			color[k] = b->ambient[k];
+			start[k] = l->position[k] + l->normal[k]*SURFACE_OFFSET;
+			}
+
+		for (j=0; j<b->n_lights; j++)
+			{
+			struct bake_light *light = &b->lights[j];
+			float dir[3], dist2, dist, ndotl, add;
+
+			for (k=0; k<3; k++) dir[k] = light->origin[k] - l->position[k];
+			dist2 = dir[0]*dir[0] + dir[1]*dir[1] + dir[2]*dir[2];
+			if (dist2 < 1) dist2 = 1;
+			dist = sqrtf(dist2);
+
+			ndotl = (dir[0]*l->normal[0] + dir[1]*l->normal[1] + dir[2]*l->normal[2])/dist;
+			if (ndotl <= 0) continue;
+
+			add = light->photons/dist2 * ndotl;
+			if (add < MIN_LIGHT) continue;
+
+			rays++;
+			if (traceLine(b->tracer, w, start, light->origin, 0) < 1) continue;
+
+			for (k=0; k<3; k++) color[k] += add*light->color[k];
+			}
+		}
+	b->rays[thread] += rays;
+	}
+
+static int
+load_lights(struct map *map, struct bake_light **lights, float ambient[3])
+	{
+	int n = 0;
+	int i;
+
+	*lights = 0;
+	ambient[0] = ambient[1] = ambient[2] = 0;
+
+	for (i=0; i<map->n_entities; i++)
+		{
+		struct entity *e = &map->entities[i];
+		struct entity_property *prop = entityGetPropertyByName(e, "classname");
+		struct bake_light *l;
+		float intensity = 300;
+		float max;
+
+		if (!prop) continue;
+
+		if (!strcmp(prop->value, "worldspawn"))
+			{
+			float a = 0;
+			prop = entityGetPropertyByName(e, "_ambient");
+			if (!prop) prop = entityGetPropertyByName(e, "ambient");
+			if (prop) sscanf(prop->value, "%f", &a);
+			ambient[0] = ambient[1] = ambient[2] = a;
+			continue;
+			}
+
+		if (strcmp(prop->value, "light")) continue;
+
+		n++;
+		*lights = realloc(*lights, sizeof(struct bake_light)*n);
+		l = &(*lights)[n-1];
+		l->origin[0] = l->origin[1] = l->origin[2] = 0;
+		l->color[0] = l->color[1] = l->color[2] = 1;
+
+		prop = entityGetPropertyByName(e, "origin");
+		if (prop) sscanf(prop->value, "%f %f %f", &l->origin[0], &l->origin[1], &l->origin[2]);
+
+		prop = entityGetPropertyByName(e, "light");
+		if (!prop) prop = entityGetPropertyByName(e, "_light");
+		if (prop) sscanf(prop->value, "%f", &intensity);
+		l->photons = intensity * POINT_SCALE;
+
+		prop = entityGetPropertyByName(e, "_color");
+		if (prop) sscanf(prop->value, "%f %f %f", &l->color[0], &l->color[1], &l->color[2]);
+		max = l->color[0];
+		if (l->color[1] > max) max = l->color[1];
+		if (l->color[2] > max) max = l->color[2];
+		if (max > 0)
+			{
+			l->color[0] /= max;
+			l->color[1] /= max;
+			l->color[2] /= max;
+			}
+		}
+
+	return n;
+	}
+
+static void
+replace_entities(struct bsp *bsp, char *filename)
+	{
+	FILE *fp;
+	long length;
+	char *data;
+
+	fp = fopen(filename, "rb");
+	if (!fp) error(-1, "Failed to open entities file.");
+
+	fseek(fp, 0, SEEK_END);
+	length = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+
+	data = malloc(length+1);
+	if (fread(data, 1, length, fp) != length) error(-1, "Failed to read entities file.");
+	data[length] = 0;
+	fclose(fp);
+
+	bspReplaceLump(bsp, ENTITIES, data, length+1);
+	}
+
+int
+bakeLightmaps(struct bsp *bsp, char *out_file, char *entities_file, int n_threads)
+	{
+	struct map map = {0};
+	struct bake_context b = {0};
+	struct jobs *jobs;
+	struct bsp_face *faces;
+	unsigned char *lightmaps;
+	int n_faces, n_lightmaps, n_todo = 0;
+	unsigned long n_rays = 0;
+	double t_start, t_raster, t_light;
+	int i, k;
+
+	if (entities_file) replace_entities(bsp, entities_file);
+	bspLoadEntities(bsp, &map);
+
+	faces = bsp->directory[FACES].data;
+	n_faces = bsp->directory[FACES].length/sizeof(struct bsp_face);
+	lightmaps = bsp->directory[LIGHTMAPS].data;
+	n_lightmaps = bsp->directory[LIGHTMAPS].length/(LM_SIZE*LM_SIZE*3);
+
+	b.n_lights = load_lights(&map, &b.lights, b.ambient);
+	printf("Bake: %i lights, %i lightmaps, ambient %.1f\n", b.n_lights, n_lightmaps, b.ambient[0]);
+	if (b.n_lights == 0) printf("Bake: no light entities, only ambient will be written\n");
+
+	t_start = jobsTime();
+
+	/* Where is every luxel in the world? */
+	b.luxels = malloc(sizeof(struct luxel)*LM_SIZE*LM_SIZE*(n_lightmaps+1));
+	for (i=0; i<LM_SIZE*LM_SIZE*n_lightmaps; i++) b.luxels[i].dist = -1;
+
+	for (i=0; i<n_faces; i++)
+		{
+		if (faces[i].lm_index < 0 || faces[i].lm_index >= n_lightmaps) continue;
+		rasterise_face(bsp, &faces[i], &b.luxels[faces[i].lm_index*LM_SIZE*LM_SIZE]);
+		}
+
+	b.todo = malloc(sizeof(int)*LM_SIZE*LM_SIZE*(n_lightmaps+1));
+	for (i=0; i<LM_SIZE*LM_SIZE*n_lightmaps; i++)
+		if (b.luxels[i].dist >= 0) b.todo[n_todo++] = i;
+
+	t_raster = jobsTime();
+
+	/* Light them */
+	jobs = jobsCreate(n_threads);
+	b.tracer = tracerCreate(bsp);
+	/* Patch luxels lie on the control grid, off the curve, and would shadow themselves */
+	b.tracer->use_patches = 0;
+	b.work = malloc(sizeof(struct trace_work)*jobsThreadCount(jobs));
+	b.rays = calloc(jobsThreadCount(jobs), sizeof(unsigned long));
+	for (i=0; i<jobsThreadCount(jobs); i++) traceWorkInit(b.tracer, &b.work[i]);
+	b.colors = malloc(sizeof(float)*3*(n_todo+1));
+
+	jobsParallelFor(jobs, n_todo, 64, light_luxels, &b);
+
+	t_light = jobsTime();
+
+	for (i=0; i<n_todo; i++)
+		{
+		for (k=0; k<3; k++)
+			{
+			float c = b.colors[i*3+k]*OVERBRIGHT;
+			if (c > 255) c = 255;
+			lightmaps[b.todo[i]*3+k] = (unsigned char)c;
+			}
+		}
+
+	for (i=0; i<jobsThreadCount(jobs); i++) n_rays += b.rays[i];
+
+	printf("Bake: %i luxels in %.3fs, lit in %.3fs on %i threads\n",
+		n_todo, t_raster - t_start, t_light - t_raster, jobsThreadCount(jobs));
+	printf("Bake: %lu rays, %.0f rays/s\n", n_rays,
+		t_light > t_raster ? n_rays/(t_light - t_raster) : 0);
+
+	if (bspWrite(bsp, out_file) != 0) error(-1, "Failed to write baked bsp file.");
+	printf("Bake: wrote %s\n", out_file);
+
+	for (i=0; i<jobsThreadCount(jobs); i++) traceWorkFree(&b.work[i]);
+	free(b.work);
+	free(b.rays);
+	free(b.colors);
+	free(b.todo);
+	free(b.luxels);
+	free(b.lights);
+	tracerFree(b.tracer);
+	jobsDestroy(jobs);
+	mapFree(&map);
+
+	return 0;
+	}
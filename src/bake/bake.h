@@ -0,0 +1,15 @@
+#ifndef BAKE_H
+#define BAKE_H
+
+/***
+Offline lightmap baker.
+Relights the LIGHTMAPS lump of a freshly loaded bsp from the
+"light" entities and writes the result to a new BSP file. entities_file, if not null, replaces
+the ENTITIES lump (e.g. an edited entities.txt).
+n_threads <= 0 uses every core.
+***/
+struct bsp;
+
+int bakeLightmaps(struct bsp *bsp, char *out_file, char *entities_file, int n_threads);
+
+#endif /* BAKE_H */
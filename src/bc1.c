@@ -0,0 +1,835 @@
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#define USE_SIMD (1)
+#else
+#define USE_SIMD (0)
+#endif
+
+#include "error.h"
+#include "bc1.h"
+
+#define CACHE_MAGIC "BC1C"
+#define CACHE_VERSION (1)
+/* Least squares fits after the principal axis one */
+#define REFINE_PASSES (2)
+/* Iterations to find the principal axis */
+#define AXIS_ITERATIONS (8)
+
+/***
+A block as floats, one array per channel so that four pixels
+fill a register. The scalar paths add up lane by lane in the
+same order as the SSE2 ones and give the same blocks.
+***/
+struct block {
+	float c[3][16];
+};
+
+struct palette {
+	unsigned short q[2]; /*565 endpoints as written*/
+	float c[4][3];
+};
+
+static void
+load_block(unsigned char *rgb, int stride, int width, int height, struct block *b)
+	{
+	int x, y, k;
+
+	/* Blocks over the edge repeat the last row and column */
+	for (y=0; y<4; y++)
+		{
+		unsigned char *row = rgb + (y < height ? y : height-1)*stride;
+
+		for (x=0; x<4; x++)
+			{
+			unsigned char *p = row + (x < width ? x : width-1)*3;
+
+			for (k=0; k<3; k++) b->c[k][y*4+x] = p[k];
+			}
+		}
+	}
+
+#ifdef __SSE2__
+static float
+hsum(__m128 v)
+	{
+	float f[4];
+
+	_mm_storeu_ps(f, v);
+	return f[0] + f[1] + f[2] + f[3];
+	}
+#endif
+
+/* Mean and covariance (rr, rg, rb, gg, gb, bb) of the colours */
+static void
+block_stats(struct block *b, float mean[3], float cov[6], int simd)
+	{
+	float sums[6][4] = {{0}};
+	int i, j, k;
+
+#ifdef __SSE2__
+	if (simd)
+		{
+		__m128 s[3], m[3], c[6];
+
+		for (k=0; k<3; k++)
+			{
+			s[k] = _mm_setzero_ps();
+			for (i=0; i<16; i+=4) s[k] = _mm_add_ps(s[k], _mm_loadu_ps(&b->c[k][i]));
+			mean[k] = hsum(s[k]) / 16;
+			m[k] = _mm_set1_ps(mean[k]);
+			}
+
+		for (k=0; k<6; k++) c[k] = _mm_setzero_ps();
+		for (i=0; i<16; i+=4)
+			{
+			__m128 r = _mm_sub_ps(_mm_loadu_ps(&b->c[0][i]), m[0]);
+			__m128 g = _mm_sub_ps(_mm_loadu_ps(&b->c[1][i]), m[1]);
+			__m128 bl = _mm_sub_ps(_mm_loadu_ps(&b->c[2][i]), m[2]);
+
+			c[0] = _mm_add_ps(c[0], _mm_mul_ps(r, r));
+			c[1] = _mm_add_ps(c[1], _mm_mul_ps(r, g));
+			c[2] = _mm_add_ps(c[2], _mm_mul_ps(r, bl));
+			c[3] = _mm_add_ps(c[3], _mm_mul_ps(g, g));
+			c[4] = _mm_add_ps(c[4], _mm_mul_ps(g, bl));
+			c[5] = _mm_add_ps(c[5], _mm_mul_ps(bl, bl));
+			}
+		for (k=0; k<6; k++) cov[k] = hsum(c[k]);
+		return;
+		}
+#endif
+
+	for (k=0; k<3; k++)
+		{
+		for (i=0; i<16; i+=4)
+			for (j=0; j<4; j++) sums[k][j] += b->c[k][i+j];
+		mean[k] = (sums[k][0] + sums[k][1] + sums[k][2] + sums[k][3]) / 16;
+		}
+
+	memset(sums, 0, sizeof(sums));
+	for (i=0; i<16; i+=4)
+		for (j=0; j<4; j++)
+			{
+			float r = b->c[0][i+j] - mean[0];
+			float g = b->c[1][i+j] - mean[1];
+			float bl = b->c[2][i+j] - mean[2];
+
+			sums[0][j] += r*r;
+			sums[1][j] += r*g;
+			sums[2][j] += r*bl;
+			sums[3][j] += g*g;
+			sums[4][j] += g*bl;
+			sums[5][j] += bl*bl;
+			}
+	for (k=0; k<6; k++) cov[k] = sums[k][0] + sums[k][1] + sums[k][2] + sums[k][3];
+	}
+
+/* Power iteration, zero for a flat block */
+static void
+principal_axis(float cov[6], float axis[3])
+	{
+	float rows[3][3] = {
+		{cov[0], cov[1], cov[2]},
+		{cov[1], cov[3], cov[4]},
+		{cov[2], cov[4], cov[5]}};
+	float v[3], len;
+	int start = 0;
+	int i, k;
+
+	/* Start from the row of the channel that varies most */
+	if (rows[1][1] > rows[0][0]) start = 1;
+	if (rows[2][2] > rows[start][start]) start = 2;
+	memcpy(v, rows[start], sizeof(v));
+
+	for (i=0; i<AXIS_ITERATIONS; i++)
+		{
+		float w[3], largest = 0;
+
+		for (k=0; k<3; k++)
+			{
+			w[k] = rows[k][0]*v[0] + rows[k][1]*v[1] + rows[k][2]*v[2];
+			if (fabsf(w[k]) > largest) largest = fabsf(w[k]);
+			}
+		if (largest < 1e-6f) break;
+		for (k=0; k<3; k++) v[k] = w[k] / largest;
+		}
+
+	len = sqrtf(v[0]*v[0] + v[1]*v[1] + v[2]*v[2]);
+	if (len < 1e-6f)
+		{
+		axis[0] = axis[1] = axis[2] = 0;
+		return;
+		}
+	for (k=0; k<3; k++) axis[k] = v[k] / len;
+	}
+
+/* Extent of the colours along the axis, relative to the mean */
+static void
+axis_range(struct block *b, float mean[3], float axis[3], float *t_min, float *t_max, int simd)
+	{
+	int i;
+
+#ifdef __SSE2__
+	if (simd)
+		{
+		__m128 lo = _mm_set1_ps(1e30f), hi = _mm_set1_ps(-1e30f);
+		float f_lo[4], f_hi[4];
+
+		for (i=0; i<16; i+=4)
+			{
+			__m128 t = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(&b->c[0][i]), _mm_set1_ps(mean[0])), _mm_set1_ps(axis[0]));
+			t = _mm_add_ps(t, _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(&b->c[1][i]), _mm_set1_ps(mean[1])), _mm_set1_ps(axis[1])));
+			t = _mm_add_ps(t, _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(&b->c[2][i]), _mm_set1_ps(mean[2])), _mm_set1_ps(axis[2])));
+			lo = _mm_min_ps(lo, t);
+			hi = _mm_max_ps(hi, t);
+			}
+		_mm_storeu_ps(f_lo, lo);
+		_mm_storeu_ps(f_hi, hi);
+		*t_min = f_lo[0];
+		*t_max = f_hi[0];
+		for (i=1; i<4; i++)
+			{
+			if (f_lo[i] < *t_min) *t_min = f_lo[i];
+			if (f_hi[i] > *t_max) *t_max = f_hi[i];
+			}
+		return;
+		}
+#endif
+
+	*t_min = 1e30f;
+	*t_max = -1e30f;
+	for (i=0; i<16; i++)
+		{
+		float t = (b->c[0][i] - mean[0])*axis[0];
+		t += (b->c[1][i] - mean[1])*axis[1];
+		t += (b->c[2][i] - mean[2])*axis[2];
+		if (t < *t_min) *t_min = t;
+		if (t > *t_max) *t_max = t;
+		}
+	}
+
+static unsigned short
+quantize(float c[3])
+	{
+	int r = c[0]*(31/255.0f) + 0.5f;
+	int g = c[1]*(63/255.0f) + 0.5f;
+	int b = c[2]*(31/255.0f) + 0.5f;
+
+	if (r < 0) r = 0; else if (r > 31) r = 31;
+	if (g < 0) g = 0; else if (g > 63) g = 63;
+	if (b < 0) b = 0; else if (b > 31) b = 31;
+
+	return (r << 11) | (g << 5) | b;
+	}
+
+static void
+expand(unsigned short q, int c[3])
+	{
+	int r = q >> 11, g = (q >> 5) & 63, b = q & 31;
+
+	c[0] = (r << 3) | (r >> 2);
+	c[1] = (g << 2) | (g >> 4);
+	c[2] = (b << 3) | (b >> 2);
+	}
+
+/* Four colour mode needs the first endpoint to be the larger */
+static void
+make_palette(struct palette *p, unsigned short q0, unsigned short q1)
+	{
+	int c0[3], c1[3];
+	int k;
+
+	if (q0 < q1)
+		{
+		unsigned short t = q0;
+		q0 = q1;
+		q1 = t;
+		}
+	p->q[0] = q0;
+	p->q[1] = q1;
+	expand(q0, c0);
+	expand(q1, c1);
+
+	for (k=0; k<3; k++)
+		{
+		p->c[0][k] = c0[k];
+		p->c[1][k] = c1[k];
+		p->c[2][k] = (2*c0[k] + c1[k])/3;
+		p->c[3][k] = (c0[k] + 2*c1[k])/3;
+		/* A single colour, index 0 everywhere */
+		if (q0 == q1) p->c[1][k] = p->c[2][k] = p->c[3][k] = c0[k];
+		}
+	}
+
+/* Nearest palette entry for every pixel, returns the squared error */
+static float
+select_indices(struct block *b, struct palette *p, int indices[16], int simd)
+	{
+	float error[4] = {0};
+	int i, j, k;
+
+#ifdef __SSE2__
+	if (simd)
+		{
+		__m128 total = _mm_setzero_ps();
+
+		for (i=0; i<16; i+=4)
+			{
+			__m128 r = _mm_loadu_ps(&b->c[0][i]);
+			__m128 g = _mm_loadu_ps(&b->c[1][i]);
+			__m128 bl = _mm_loadu_ps(&b->c[2][i]);
+			__m128 best = _mm_set1_ps(1e30f);
+			__m128 best_index = _mm_setzero_ps();
+
+			for (k=0; k<4; k++)
+				{
+				__m128 dr = _mm_sub_ps(r, _mm_set1_ps(p->c[k][0]));
+				__m128 dg = _mm_sub_ps(g, _mm_set1_ps(p->c[k][1]));
+				__m128 db = _mm_sub_ps(bl, _mm_set1_ps(p->c[k][2]));
+				__m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dr, dr), _mm_mul_ps(dg, dg)), _mm_mul_ps(db, db));
+				__m128 closer = _mm_cmplt_ps(d, best);
+
+				best = _mm_min_ps(best, d);
+				best_index = _mm_or_ps(_mm_and_ps(closer, _mm_set1_ps(k)), _mm_andnot_ps(closer, best_index));
+				}
+			_mm_storeu_si128((__m128i *)&indices[i], _mm_cvttps_epi32(best_index));
+			total = _mm_add_ps(total, best);
+			}
+		return hsum(total);
+		}
+#endif
+
+	for (i=0; i<16; i+=4)
+		for (j=0; j<4; j++)
+			{
+			float best = 1e30f;
+
+			for (k=0; k<4; k++)
+				{
+				float dr = b->c[0][i+j] - p->c[k][0];
+				float dg = b->c[1][i+j] - p->c[k][1];
+				float db = b->c[2][i+j] - p->c[k][2];
+				float d = (dr*dr + dg*dg) + db*db;
+
+				if (d < best)
+					{
+					best = d;
+					indices[i+j] = k;
+					}
+				}
+			error[j] += best;
+			}
+
+	return error[0] + error[1] + error[2] + error[3];
+	}
+
+/* Endpoints that best fit the colours for the indices chosen */
+static int
+refine(struct block *b, int indices[16], float e0[3], float e1[3])
+	{
+	static const float weights[4] = {1, 0, 2/3.0f, 1/3.0f};
+	float aa = 0, ab = 0, bb = 0, ax[3] = {0}, bx[3] = {0};
+	float det;
+	int i, k;
+
+	for (i=0; i<16; i++)
+		{
+		float a = weights[indices[i]];
+		float w = 1 - a;
+
+		aa += a*a;
+		ab += a*w;
+		bb += w*w;
+		for (k=0; k<3; k++)
+			{
+			ax[k] += a*b->c[k][i];
+			bx[k] += w*b->c[k][i];
+			}
+		}
+
+	det = aa*bb - ab*ab;
+	if (fabsf(det) < 1e-6f) return 0;
+
+	for (k=0; k<3; k++)
+		{
+		e0[k] = (ax[k]*bb - bx[k]*ab) / det;
+		e1[k] = (bx[k]*aa - ax[k]*ab) / det;
+		}
+
+	return 1;
+	}
+
+static float
+fit(struct block *b, float e0[3], float e1[3], struct palette *p, int indices[16], int simd)
+	{
+	make_palette(p, quantize(e0), quantize(e1));
+	return select_indices(b, p, indices, simd);
+	}
+
+static void
+encode_block(unsigned char *rgb, int stride, int width, int height, unsigned char *out, int simd)
+	{
+	struct block b;
+	struct palette best, p;
+	float mean[3], cov[6], axis[3];
+	float t_min, t_max, inset;
+	float e0[3], e1[3];
+	float best_error, e;
+	int best_indices[16], indices[16];
+	unsigned int bits = 0;
+	int i, k;
+
+	load_block(rgb, stride, width, height, &b);
+	block_stats(&b, mean, cov, simd);
+	principal_axis(cov, axis);
+	axis_range(&b, mean, axis, &t_min, &t_max, simd);
+
+	/* The extremes are rarely the best endpoints, pull them in a bit */
+	inset = (t_max - t_min) / 16;
+	t_min += inset;
+	t_max -= inset;
+	for (k=0; k<3; k++)
+		{
+		e0[k] = mean[k] + axis[k]*t_max;
+		e1[k] = mean[k] + axis[k]*t_min;
+		}
+	best_error = fit(&b, e0, e1, &best, best_indices, simd);
+
+	for (i=0; i<REFINE_PASSES && best_error > 0; i++)
+		{
+		if (!refine(&b, best_indices, e0, e1)) break;
+		e = fit(&b, e0, e1, &p, indices, simd);
+		if (e >= best_error) break;
+		best = p;
+		best_error = e;
+		memcpy(best_indices, indices, sizeof(indices));
+		}
+
+	for (i=0; i<16; i++) bits |= best_indices[i] << (i*2);
+	out[0] = best.q[0] & 255;
+	out[1] = best.q[0] >> 8;
+	out[2] = best.q[1] & 255;
+	out[3] = best.q[1] >> 8;
+	out[4] = bits & 255;
+	out[5] = (bits >> 8) & 255;
+	out[6] = (bits >> 16) & 255;
+	out[7] = bits >> 24;
+	}
+
+/* One 4x4 block, stride is bytes between rows */
+void
+bc1EncodeBlock(unsigned char *rgb, int stride, unsigned char out[BC1_BLOCK_SIZE])
+	{
+	encode_block(rgb, stride, 4, 4, out, USE_SIMD);
+	}
+
+struct encode_job {
+	unsigned char **images;
+	unsigned char **out;
+	int width, height;
+	int blocks_x, blocks_y;
+	int simd;
+};
+
+/* A range of block rows, across all the images */
+static void
+encode_rows(void *ctx, int begin, int end, int thread)
+	{
+	struct encode_job *e = ctx;
+	int i, x;
+
+	for (i=begin; i<end; i++)
+		{
+		int y = i % e->blocks_y;
+		unsigned char *src = e->images[i / e->blocks_y] + y*4*e->width*3;
+		unsigned char *dst = e->out[i / e->blocks_y] + y*e->blocks_x*BC1_BLOCK_SIZE;
+
+		for (x=0; x<e->blocks_x; x++)
+			encode_block(src + x*4*3, e->width*3, e->width - x*4, e->height - y*4,
+				dst + x*BC1_BLOCK_SIZE, e->simd);
+		}
+	}
+
+static void
+encode_images(struct jobs *jobs, unsigned char **images, int n_images, int width, int height, unsigned char **out, int simd)
+	{
+	struct encode_job e;
+
+	e.images = images;
+	e.out = out;
+	e.width = width;
+	e.height = height;
+	e.blocks_x = (width+3)/4;
+	e.blocks_y = (height+3)/4;
+	e.simd = simd;
+
+	if (jobs) jobsParallelFor(jobs, n_images*e.blocks_y, 1, encode_rows, &e);
+	else encode_rows(&e, 0, n_images*e.blocks_y, 0);
+	}
+
+/***
+Encode images of the same size, out[i] must have BC1_SIZE bytes.
+With jobs the block rows of all of them are shared out together.
+***/
+void
+bc1Encode(struct jobs *jobs, unsigned char **images, int n_images, int width, int height, unsigned char **out)
+	{
+	encode_images(jobs, images, n_images, width, height, out, USE_SIMD);
+	}
+
+void
+bc1Decode(unsigned char *blocks, int width, int height, unsigned char *rgb)
+	{
+	int blocks_x = (width+3)/4;
+	int bx, by, x, y, k;
+
+	for (by=0; by<(height+3)/4; by++)
+	for (bx=0; bx<blocks_x; bx++)
+		{
+		unsigned char *block = blocks + (by*blocks_x + bx)*BC1_BLOCK_SIZE;
+		unsigned short q0 = block[0] | (block[1] << 8);
+		unsigned short q1 = block[2] | (block[3] << 8);
+		unsigned int bits = block[4] | (block[5] << 8) | (block[6] << 16) | ((unsigned int)block[7] << 24);
+		int c[4][3];
+
+		expand(q0, c[0]);
+		expand(q1, c[1]);
+		for (k=0; k<3; k++)
+			{
+			if (q0 > q1)
+				{
+				c[2][k] = (2*c[0][k] + c[1][k])/3;
+				c[3][k] = (c[0][k] + 2*c[1][k])/3;
+				}
+			else
+				{
+				c[2][k] = (c[0][k] + c[1][k])/2;
+				c[3][k] = 0;
+				}
+			}
+
+		for (y=0; y<4 && by*4+y<height; y++)
+		for (x=0; x<4 && bx*4+x<width; x++)
+			{
+			int index = (bits >> ((y*4+x)*2)) & 3;
+			unsigned char *p = rgb + ((by*4+y)*width + bx*4+x)*3;
+
+			for (k=0; k<3; k++) p[k] = c[index][k];
+			}
+		}
+	}
+
+double
+bc1Psnr(unsigned char *a, unsigned char *b, int length)
+	{
+	double mse = 0;
+	int i;
+
+	for (i=0; i<length; i++) mse += (a[i]-b[i])*(a[i]-b[i]);
+	mse /= length;
+	if (mse == 0) return 99;
+
+	return 10*log10(255.0*255.0/mse);
+	}
+
+/* FNV-1a, 64 bits since it is kept on disk */
+static unsigned long long
+hash_image(unsigned char *data, int length)
+	{
+	unsigned long long h = 14695981039346656037ull;
+	int i;
+
+	for (i=0; i<length; i++)
+		{
+		h ^= data[i];
+		h *= 1099511628211ull;
+		}
+
+	return h;
+	}
+
+static struct bc1_entry *
+find_entry(struct bc1_cache *cache, unsigned long long hash, int width, int height)
+	{
+	int i;
+
+	for (i=0; i<cache->n_entries; i++)
+		{
+		struct bc1_entry *e = &cache->entries[i];
+
+		if (e->hash == hash && e->width == width && e->height == height) return e;
+		}
+
+	return 0;
+	}
+
+static struct bc1_entry *
+add_entry(struct bc1_cache *cache, unsigned long long hash, int width, int height)
+	{
+	struct bc1_entry *e;
+
+	if (cache->n_entries == cache->max_entries)
+		{
+		cache->max_entries = cache->max_entries ? cache->max_entries*2 : 64;
+		cache->entries = realloc(cache->entries, sizeof(struct bc1_entry)*cache->max_entries);
+		if (!cache->entries) error(-1, "Out of memory for the BC1 cache.");
+		}
+
+	e = &cache->entries[cache->n_entries++];
+	e->hash = hash;
+	e->width = width;
+	e->height = height;
+	e->blocks = malloc(BC1_SIZE(width, height));
+	e->used = 0;
+
+	return e;
+	}
+
+/* An empty cache if the file is missing or not one of ours */
+struct bc1_cache *
+bc1CacheLoad(char *path)
+	{
+	struct bc1_cache *cache = calloc(1, sizeof(struct bc1_cache));
+	char magic[4];
+	int version, n, i;
+	FILE *fp;
+
+	fp = fopen(path, "rb");
+	if (!fp) return cache;
+
+	if (fread(magic, 4, 1, fp) != 1 || memcmp(magic, CACHE_MAGIC, 4)
+		|| fread(&version, sizeof(int), 1, fp) != 1 || version != CACHE_VERSION
+		|| fread(&n, sizeof(int), 1, fp) != 1)
+		{
+		fclose(fp);
+		return cache;
+		}
+
+	for (i=0; i<n; i++)
+		{
+		unsigned long long hash;
+		int size[2];
+		struct bc1_entry *e;
+
+		if (fread(&hash, sizeof(hash), 1, fp) != 1 || fread(size, sizeof(size), 1, fp) != 1) break;
+		if (size[0] <= 0 || size[1] <= 0 || size[0] > 4096 || size[1] > 4096) break;
+
+		e = add_entry(cache, hash, size[0], size[1]);
+		if (fread(e->blocks, BC1_SIZE(size[0], size[1]), 1, fp) != 1)
+			{
+			free(e->blocks);
+			cache->n_entries--;
+			break;
+			}
+		}
+	fclose(fp);
+
+	printf("BC1 cache: %i images from %s\n", cache->n_entries, path);
+
+	return cache;
+	}
+
+/* Only what was used this run is kept */
+int
+bc1CacheSave(struct bc1_cache *cache, char *path)
+	{
+	int n_used = 0;
+	int version = CACHE_VERSION;
+	FILE *fp;
+	int i;
+
+	for (i=0; i<cache->n_entries; i++) n_used += cache->entries[i].used;
+	if (!cache->dirty && n_used == cache->n_entries) return 0;
+
+	fp = fopen(path, "wb");
+	if (!fp) return -1;
+
+	fwrite(CACHE_MAGIC, 4, 1, fp);
+	fwrite(&version, sizeof(int), 1, fp);
+	fwrite(&n_used, sizeof(int), 1, fp);
+	for (i=0; i<cache->n_entries; i++)
+		{
+		struct bc1_entry *e = &cache->entries[i];
+		int size[2] = {e->width, e->height};
+
+		if (!e->used) continue;
+		fwrite(&e->hash, sizeof(e->hash), 1, fp);
+		fwrite(size, sizeof(size), 1, fp);
+		fwrite(e->blocks, BC1_SIZE(e->width, e->height), 1, fp);
+		}
+
+	if (fclose(fp)) return -1;
+	cache->dirty = 0;
+
+	return 0;
+	}
+
+void
+bc1CacheFree(struct bc1_cache *cache)
+	{
+	int i;
+
+	if (!cache) return;
+	for (i=0; i<cache->n_entries; i++) free(cache->entries[i].blocks);
+	free(cache->entries);
+	free(cache);
+	}
+
+int
+bc1CacheEncode(struct bc1_cache *cache, struct jobs *jobs, unsigned char **images, int n_images, int width, int height, unsigned char **out)
+	{
+	unsigned char **sources = malloc(sizeof(unsigned char *)*n_images);
+	unsigned char **targets = malloc(sizeof(unsigned char *)*n_images);
+	int n_missed = 0;
+	int i;
+
+	for (i=0; i<n_images; i++)
+		{
+		unsigned long long hash = hash_image(images[i], width*height*3);
+		struct bc1_entry *e = find_entry(cache, hash, width, height);
+
+		/* Added straight away so repeats in this batch are found */
+		if (!e)
+			{
+			e = add_entry(cache, hash, width, height);
+			sources[n_missed] = images[i];
+			targets[n_missed] = e->blocks;
+			n_missed++;
+			}
+		e->used = 1;
+		out[i] = e->blocks;
+		}
+
+	if (n_missed)
+		{
+		bc1Encode(jobs, sources, n_missed, width, height, targets);
+		cache->dirty = 1;
+		}
+	cache->hits += n_images - n_missed;
+	cache->misses += n_missed;
+
+	free(sources);
+	free(targets);
+
+	return n_images - n_missed;
+	}
+
+#define BENCH_PASSES (4)
+
+/* Best of a few runs, in seconds */
+static double
+time_encode(struct jobs *jobs, unsigned char **images, int n, unsigned char **out, int simd)
+	{
+	double best = 1e30;
+	int pass;
+
+	for (pass=0; pass<BENCH_PASSES; pass++)
+		{
+		double t = jobsTime();
+
+		encode_images(jobs, images, n, 128, 128, out, simd);
+		t = jobsTime() - t;
+		if (t < best) best = t;
+		}
+
+	return best;
+	}
+
+/***
+Encode the map's lightmaps with the scalar and the SSE2 paths on
+one thread, then with 1, 2, 4... threads, and print the quality
+and throughput of each. Also times a cold and a warm cache.
+***/
+int
+bc1Benchmark(struct bsp *bsp, int max_threads)
+	{
+	int n = bsp->directory[LIGHTMAPS].length/(128*128*3);
+	int size = BC1_SIZE(128, 128);
+	unsigned char **images, **scalar, **simd, **cached;
+	unsigned char *scalar_blocks, *simd_blocks, *decoded;
+	double megapixels = n*128*128/1e6;
+	double t_scalar, t_simd, t_cold, t_warm, base_time = 0;
+	struct bc1_cache *cache;
+	int n_differ = 0;
+	int n_threads;
+	int i;
+
+	if (!n)
+		{
+		printf("BC1: the map has no lightmaps\n");
+		return 0;
+		}
+	if (max_threads <= 0) max_threads = jobsCoreCount();
+
+	images = malloc(sizeof(unsigned char *)*n);
+	scalar = malloc(sizeof(unsigned char *)*n);
+	simd = malloc(sizeof(unsigned char *)*n);
+	cached = malloc(sizeof(unsigned char *)*n);
+	scalar_blocks = malloc(size*n);
+	simd_blocks = malloc(size*n);
+	decoded = malloc(128*128*3*n);
+	for (i=0; i<n; i++)
+		{
+		images[i] = (unsigned char *)bsp->directory[LIGHTMAPS].data + 128*128*3*i;
+		scalar[i] = scalar_blocks + size*i;
+		simd[i] = simd_blocks + size*i;
+		}
+
+	t_scalar = time_encode(0, images, n, scalar, 0);
+	t_simd = time_encode(0, images, n, simd, 1);
+	for (i=0; i<n*size; i+=BC1_BLOCK_SIZE)
+		n_differ += memcmp(scalar_blocks+i, simd_blocks+i, BC1_BLOCK_SIZE) != 0;
+	bc1Decode(simd_blocks, 128, 128*n, decoded);
+
+	printf("BC1: %i lightmaps, %.2f Mpixels, %i KB to %i KB\n",
+		n, megapixels, 128*128*3*n/1024, size*n/1024);
+	printf("BC1: PSNR %.2f dB\n", bc1Psnr(images[0], decoded, 128*128*3*n));
+	printf("BC1: scalar %.2f ms (%.1f Mpixels/s), %s %.2f ms (%.1f Mpixels/s), %.2fx, %i blocks differ\n",
+		t_scalar*1000, megapixels/t_scalar,
+		USE_SIMD ? "SSE2" : "no SSE2,", t_simd*1000, megapixels/t_simd,
+		t_scalar/t_simd, n_differ);
+
+	for (n_threads=1; ; n_threads*=2)
+		{
+		struct jobs *jobs;
+		double t;
+
+		if (n_threads > max_threads) n_threads = max_threads;
+		jobs = jobsCreate(n_threads);
+
+		t = time_encode(jobs, images, n, simd, USE_SIMD);
+		if (n_threads == 1) base_time = t;
+		printf("BC1: %2i threads, %.2f ms, %.1f Mpixels/s, %.2fx\n",
+			n_threads, t*1000, megapixels/t, base_time/t);
+
+		jobsDestroy(jobs);
+		if (n_threads == max_threads) break;
+		}
+
+	cache = calloc(1, sizeof(struct bc1_cache));
+	t_cold = jobsTime();
+	bc1CacheEncode(cache, 0, images, n, 128, 128, cached);
+	t_cold = jobsTime() - t_cold;
+	t_warm = jobsTime();
+	bc1CacheEncode(cache, 0, images, n, 128, 128, cached);
+	t_warm = jobsTime() - t_warm;
+	printf("BC1: cache cold %.2f ms, warm %.2f ms (%i hits)\n",
+		t_cold*1000, t_warm*1000, cache->hits);
+	bc1CacheFree(cache);
+
+	free(images);
+	free(scalar);
+	free(simd);
+	free(cached);
+	free(scalar_blocks);
+	free(simd_blocks);
+	free(decoded);
+
+	return 0;
+	}
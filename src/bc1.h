@@ -0,0 +1,50 @@
+#ifndef BC1_H
+#define BC1_H
+
+#include "bsp.h"
+#include "jobs.h"
+
+/***
+BC1 (DXT1) block compression for lightmaps and textures.
+Each 4x4 block is fitted along the principal axis of its colours
+and refined once by least squares; the per pixel work is SSE2
+when the compiler has it. Images are RGB, 8 bytes per block out,
+a sixth of the 48 bytes in.
+The cache keeps encoded images by content so unchanged lightmaps
+aren't encoded again on the next start or after a reload.
+***/
+
+#define BC1_BLOCK_SIZE (8)
+/* Bytes for a width x height image */
+#define BC1_SIZE(width, height) ((((width)+3)/4) * (((height)+3)/4) * BC1_BLOCK_SIZE)
+
+struct bc1_entry {
+	unsigned long long hash;
+	int width, height;
+	unsigned char *blocks;
+	int used; /*this run, only these are saved*/
+};
+
+struct bc1_cache {
+	struct bc1_entry *entries;
+	int n_entries;
+	int max_entries;
+	int dirty;
+	int hits;
+	int misses;
+};
+
+void bc1EncodeBlock(unsigned char *rgb, int stride, unsigned char out[BC1_BLOCK_SIZE]);
+void bc1Encode(struct jobs *jobs, unsigned char **images, int n_images, int width, int height, unsigned char **out);
+void bc1Decode(unsigned char *blocks, int width, int height, unsigned char *rgb);
+double bc1Psnr(unsigned char *a, unsigned char *b, int length);
+
+struct bc1_cache *bc1CacheLoad(char *path);
+int bc1CacheSave(struct bc1_cache *cache, char *path);
+void bc1CacheFree(struct bc1_cache *cache);
+/* out[i] points into the cache, returns how many were already in it */
+int bc1CacheEncode(struct bc1_cache *cache, struct jobs *jobs, unsigned char **images, int n_images, int width, int height, unsigned char **out);
+
+int bc1Benchmark(struct bsp *bsp, int n_threads);
+
+#endif /* BC1_H */
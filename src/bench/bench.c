@@ -0,0 +1,527 @@
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include "../error.h"
+#include "../options/options.h"
+#include "../bsp.h"
+#include "../mipmap.h"
+
+/***
+Micro-benchmarks of the loader and the per frame hot paths, run by
+`make bench` on the bundled maps.
+Each benchmark is calibrated until a sample takes BENCH_SAMPLE_TIME,
+warmed up once, then timed BENCH_SAMPLES times; the JSON has the
+median, spread and extremes per operation. With --compare a result
+is a regression when both its median and its fastest sample are more
+than the threshold slower than the baseline's, so a run disturbed by
+the rest of the machine doesn't flag one.
+***/
+
+#define BENCH_SAMPLES (21)
+#define BENCH_SAMPLE_TIME (0.01)
+#define BENCH_DEFAULT_THRESHOLD (0.10)
+/* Random points for findCluster, fixed seed so every run asks the same */
+#define BENCH_POINTS (4096)
+
+/* Bsp.c draws through these, nothing here does */
+unsigned int *g_lm_texture_ids = 0;
+struct compact_vertices *g_compact_vertices = 0;
+extern int g_bezier_steps;
+
+/* Results land here so nothing gets optimised away */
+volatile long g_sink;
+
+struct bench_result {
+	char name[128];
+	char *unit;
+	long iterations; /*per sample*/
+	double median, mean, stddev, min, max; /*ns per operation*/
+};
+
+struct bench_map {
+	char *path;
+	struct bsp bsp;
+	struct map map;
+	int n_clusters;
+	float (*points)[3];
+	unsigned char *lightmaps; /*as loaded, restored before each lighten*/
+	unsigned int *stamps; /*per face*/
+	unsigned int stamp;
+	int cluster; /*next row to walk*/
+	int point;
+};
+
+/* Runs the operation n times */
+typedef void (*bench_fn)(struct bench_map *m, long n);
+
+static double
+now(void)
+	{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec*1e-9;
+	}
+
+static int
+compare_doubles(const void *a, const void *b)
+	{
+	double x = *(double *)a, y = *(double *)b;
+	return x < y ? -1 : x > y;
+	}
+
+static void
+bench_load(struct bench_map *m, long n)
+	{
+	long i;
+
+	for (i=0; i<n; i++)
+		{
+		struct bsp bsp = {0};
+		bspLoad(&bsp, m->path);
+		g_sink += bsp.directory[FACES].length;
+		bspFree(&bsp);
+		}
+	}
+
+static void
+bench_entities(struct bench_map *m, long n)
+	{
+	long i;
+
+	for (i=0; i<n; i++)
+		{
+		struct map map = {0};
+		bspLoadEntities(&m->bsp, &map);
+		g_sink += map.n_entities;
+		mapFree(&map);
+		}
+	}
+
+static void
+bench_find_cluster(struct bench_map *m, long n)
+	{
+	long i;
+
+	for (i=0; i<n; i++)
+		{
+		float *p = m->points[m->point++ & (BENCH_POINTS-1)];
+		g_sink += findCluster(&m->bsp, p[0], p[1], p[2]);
+		}
+	}
+
+/* A whole PVS row per operation */
+static void
+bench_pvs_row(struct bench_map *m, long n)
+	{
+	void *visdata = m->bsp.directory[VISDATA].data;
+	long i;
+	int c;
+
+	for (i=0; i<n; i++)
+		{
+		int row = m->cluster++ % m->n_clusters;
+		long visible = 0;
+
+		for (c=0; c<m->n_clusters; c++) visible += clusterIsVisible(row, c, visdata);
+		g_sink += visible;
+		}
+	}
+
+/* Every patch in the map, tessellated as drawPatch does */
+static void
+bench_patches(struct bench_map *m, long n)
+	{
+	struct bsp_face *faces = m->bsp.directory[FACES].data;
+	int n_faces = m->bsp.directory[FACES].length/sizeof(struct bsp_face);
+	struct bsp_vertex *verts = m->bsp.directory[VERTEXES].data;
+	int steps = g_bezier_steps;
+	long i;
+	int f, x, y;
+
+	for (i=0; i<n; i++)
+		{
+		float sum = 0;
+
+		for (f=0; f<n_faces; f++)
+			{
+			struct bsp_face *face = &faces[f];
+			int w = face->size[0];
+			int pw = (w-1)/2, ph = (face->size[1]-1)/2;
+			int p;
+
+			if (face->type != 2) continue;
+			for (p=0; p<pw*ph; p++)
+				{
+				float patch[3][3][5];
+
+				bspPatchControlPoints(face, &verts[face->vertex], p, patch);
+				for (y=0; y<=steps; y++)
+					for (x=0; x<=steps; x++)
+						{
+						float point[5] = {0};
+						get_point_on_patch(patch, (float)x/steps, (float)y/steps, point);
+						sum += point[0];
+						}
+				}
+			}
+		g_sink += (long)sum;
+		}
+	}
+
+static void
+restore_lightmaps(struct bench_map *m)
+	{
+	memcpy(m->bsp.directory[LIGHTMAPS].data, m->lightmaps, m->bsp.directory[LIGHTMAPS].length);
+	}
+
+static void
+bench_lighten(struct bench_map *m, long n)
+	{
+	long i;
+
+	for (i=0; i<n; i++) bspLightenLightmaps(&m->bsp);
+	g_sink += ((unsigned char *)m->bsp.directory[LIGHTMAPS].data)[0];
+	}
+
+/* Every lightmap's whole chain, on this thread */
+static void
+bench_mipmaps(struct bench_map *m, long n, int filter)
+	{
+	int n_lightmaps = m->bsp.directory[LIGHTMAPS].length/(128*128*3);
+	long size = mipmapChainSize(128, 128, 3);
+	unsigned char *chain = malloc(size);
+	long i;
+	int j;
+
+	for (i=0; i<n; i++)
+		for (j=0; j<n_lightmaps; j++)
+			{
+			unsigned char *image = (unsigned char *)m->bsp.directory[LIGHTMAPS].data + 128*128*3*j;
+			mipmapGenerate(0, &image, 1, 128, 128, 3, filter, &chain);
+			}
+	g_sink += chain[size-1];
+	free(chain);
+	}
+
+static void
+bench_mipmaps_box(struct bench_map *m, long n)
+	{
+	bench_mipmaps(m, n, MIPMAP_BOX);
+	}
+
+static void
+bench_mipmaps_kaiser(struct bench_map *m, long n)
+	{
+	bench_mipmaps(m, n, MIPMAP_KAISER);
+	}
+
+/* The faces in a cluster's PVS, each once, as the draw list finds them */
+static void
+bench_leaf_faces(struct bench_map *m, long n)
+	{
+	struct bsp_leaf *leaves = m->bsp.directory[LEAVES].data;
+	int n_leaves = m->bsp.directory[LEAVES].length/sizeof(struct bsp_leaf);
+	int *leaffaces = m->bsp.directory[LEAFFACES].data;
+	void *visdata = m->bsp.directory[VISDATA].data;
+	long i;
+	int l, j;
+
+	for (i=0; i<n; i++)
+		{
+		int cluster = m->cluster++ % m->n_clusters;
+		long faces = 0;
+
+		m->stamp++;
+		for (l=0; l<n_leaves; l++)
+			{
+			struct bsp_leaf *leaf = &leaves[l];
+
+			if (leaf->cluster < 0 || !clusterIsVisible(cluster, leaf->cluster, visdata)) continue;
+			for (j=0; j<leaf->n_leaffaces; j++)
+				{
+				int f = leaffaces[leaf->leafface + j];
+				if (m->stamps[f] == m->stamp) continue;
+				m->stamps[f] = m->stamp;
+				faces++;
+				}
+			}
+		g_sink += faces;
+		}
+	}
+
+/***
+Doubles the count until a sample takes BENCH_SAMPLE_TIME. A
+benchmark that changes its data (lightening) gets it restored
+before every sample, outside the timing, and runs once a sample.
+***/
+static void
+run_bench(struct bench_map *m, char *name, char *unit, bench_fn fn, int restore, struct bench_result *r)
+	{
+	double samples[BENCH_SAMPLES], sum = 0, sum2 = 0;
+	long n = 1;
+	int i;
+
+	memset(r, 0, sizeof(struct bench_result));
+	snprintf(r->name, sizeof(r->name), "%s/%s", strrchr(m->path, '/') ? strrchr(m->path, '/')+1 : m->path, name);
+	r->unit = unit;
+
+	if (!restore)
+		for (;;)
+			{
+			double t = now();
+			fn(m, n);
+			if (now() - t >= BENCH_SAMPLE_TIME || n >= (1L << 30)) break;
+			n *= 2;
+			}
+	r->iterations = n;
+
+	/* Warm up, then the samples */
+	for (i=-1; i<BENCH_SAMPLES; i++)
+		{
+		double t;
+
+		if (restore) restore_lightmaps(m);
+		t = now();
+		fn(m, n);
+		t = (now() - t)*1e9/n;
+		if (i >= 0) samples[i] = t;
+		}
+
+	for (i=0; i<BENCH_SAMPLES; i++)
+		{
+		sum += samples[i];
+		sum2 += samples[i]*samples[i];
+		}
+	qsort(samples, BENCH_SAMPLES, sizeof(double), compare_doubles);
+	r->median = samples[BENCH_SAMPLES/2];
+	r->mean = sum/BENCH_SAMPLES;
+	r->stddev = sqrt(fmax(0, sum2/BENCH_SAMPLES - r->mean*r->mean));
+	r->min = samples[0];
+	r->max = samples[BENCH_SAMPLES-1];
+
+	fprintf(stderr, "%-32s %12.1f ns/%s  (+-%.1f%%, %li per sample)\n",
+		r->name, r->median, unit, r->mean > 0 ? 100*r->stddev/r->mean : 0, n);
+	}
+
+static int
+open_map(struct bench_map *m, char *path)
+	{
+	struct bsp_leaf *leaves;
+	struct bsp_model *world;
+	int n_leaves, i, k;
+	FILE *fp = fopen(path, "rb");
+
+	if (!fp) return -1;
+	fclose(fp);
+
+	memset(m, 0, sizeof(struct bench_map));
+	m->path = path;
+	bspLoad(&m->bsp, path);
+	bspLoadEntities(&m->bsp, &m->map);
+
+	leaves = m->bsp.directory[LEAVES].data;
+	n_leaves = m->bsp.directory[LEAVES].length/sizeof(struct bsp_leaf);
+	for (i=0; i<n_leaves; i++)
+		if (leaves[i].cluster+1 > m->n_clusters) m->n_clusters = leaves[i].cluster+1;
+
+	/* Uniform in the world's bounds */
+	world = m->bsp.directory[MODELS].data;
+	srand(1);
+	m->points = malloc(sizeof(float)*3*BENCH_POINTS);
+	for (i=0; i<BENCH_POINTS; i++)
+		for (k=0; k<3; k++)
+			m->points[i][k] = world->mins[k] + (world->maxs[k] - world->mins[k])*rand()/(float)RAND_MAX;
+
+	m->lightmaps = malloc(m->bsp.directory[LIGHTMAPS].length + 1);
+	memcpy(m->lightmaps, m->bsp.directory[LIGHTMAPS].data, m->bsp.directory[LIGHTMAPS].length);
+	m->stamps = calloc(m->bsp.directory[FACES].length/sizeof(struct bsp_face) + 1, sizeof(unsigned int));
+
+	return 0;
+	}
+
+static void
+close_map(struct bench_map *m)
+	{
+	free(m->points);
+	free(m->lightmaps);
+	free(m->stamps);
+	mapFree(&m->map);
+	bspFree(&m->bsp);
+	}
+
+static void
+write_json(FILE *fp, struct bench_result *results, int n)
+	{
+	int i;
+
+	fprintf(fp, "{\n\t\"samples\": %i,\n\t\"benchmarks\": [\n", BENCH_SAMPLES);
+	for (i=0; i<n; i++)
+		{
+		struct bench_result *r = &results[i];
+
+		fprintf(fp, "\t\t{\"name\": \"%s\", \"unit\": \"%s\", \"iterations\": %li, "
+			"\"median_ns\": %.3f, \"mean_ns\": %.3f, \"stddev_ns\": %.3f, \"min_ns\": %.3f, \"max_ns\": %.3f}%s\n",
+			r->name, r->unit, r->iterations, r->median, r->mean, r->stddev, r->min, r->max, i+1 < n ? "," : "");
+		}
+	fprintf(fp, "\t]\n}\n");
+	}
+
+/* Only reads what write_json writes */
+static int
+baseline_value(char *json, char *name, char *key, double *value)
+	{
+	char pattern[160];
+	char *entry, *end, *field;
+
+	snprintf(pattern, sizeof(pattern), "\"name\": \"%s\"", name);
+	entry = strstr(json, pattern);
+	if (!entry) return 0;
+	end = strchr(entry, '}');
+	snprintf(pattern, sizeof(pattern), "\"%s\": ", key);
+	field = strstr(entry, pattern);
+	if (!field || (end && field > end)) return 0;
+	*value = atof(field + strlen(pattern));
+
+	return 1;
+	}
+
+/* Read before the run, the results may be written over it */
+static char *
+read_baseline(char *baseline_file)
+	{
+	FILE *fp = fopen(baseline_file, "rb");
+	char *json;
+	long length;
+
+	if (!fp) error(-1, "Can't open the baseline.");
+	fseek(fp, 0, SEEK_END);
+	length = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+	json = malloc(length+1);
+	if (fread(json, 1, length, fp) != length) error(-1, "Can't read the baseline.");
+	json[length] = 0;
+	fclose(fp);
+
+	return json;
+	}
+
+/* Returns the number of regressions */
+static int
+compare(char *json, struct bench_result *results, int n, double threshold)
+	{
+	int n_regressions = 0;
+	int i;
+
+	fprintf(stderr, "\n%-32s %12s %12s %8s\n", "compared to baseline", "baseline ns", "now ns", "change");
+	for (i=0; i<n; i++)
+		{
+		struct bench_result *r = &results[i];
+		double base, base_min;
+		char *verdict = "";
+
+		if (!baseline_value(json, r->name, "median_ns", &base) || base <= 0)
+			{
+			fprintf(stderr, "%-32s %12s %12.1f\n", r->name, "-", r->median);
+			continue;
+			}
+		if (!baseline_value(json, r->name, "min_ns", &base_min)) base_min = base;
+
+		if (r->median > base*(1 + threshold) && r->min > base_min*(1 + threshold))
+			{
+			verdict = "  REGRESSION";
+			n_regressions++;
+			}
+		else if (r->median < base*(1 - threshold) && r->min < base_min*(1 - threshold)) verdict = "  faster";
+
+		fprintf(stderr, "%-32s %12.1f %12.1f %+7.1f%%%s\n", r->name, base, r->median, 100*(r->median/base - 1), verdict);
+		}
+	fprintf(stderr, "%i regressions over %.0f%%\n", n_regressions, threshold*100);
+
+	return n_regressions;
+	}
+
+int
+main(int argc, char *argv[])
+	{
+	struct option options[6] = {0};
+	char *maps_dir = "resources/maps";
+	char *output = "bench.json";
+	char *baseline = 0;
+	char *names[] = {"gothic.bsp", "test.bsp"};
+	struct bench_result results[64];
+	double threshold = BENCH_DEFAULT_THRESHOLD;
+	FILE *fp;
+	int n_results = 0;
+	int i;
+
+	set_option(&options[0], "maps", 'm', 1, 0, 0);
+	set_option(&options[1], "output", 'o', 1, 0, 0);
+	set_option(&options[2], "compare", 'c', 1, 0, 0);
+	set_option(&options[3], "threshold", 0, 1, 0, 0);
+	set_option(&options[4], "help", 'h', 0, 0, 0);
+	options[5].name = NULL;
+
+	get_options(argc, argv, options);
+	if (options[4].flag)
+		{
+		puts("usage:\n	bsp_bench [-m <map directory>] [-o <results.json, default bench.json>] [-c <baseline.json>] [--threshold <fraction>]");
+		return 0;
+		}
+	if (options[0].flag) maps_dir = options[0].arg;
+	if (options[3].flag) threshold = atof(options[3].arg);
+	if (options[1].flag) output = options[1].arg;
+	if (options[2].flag) baseline = read_baseline(options[2].arg);
+
+	/* Loading prints the bsp header every time, keep it off the terminal */
+	if (!freopen("/dev/null", "w", stdout)) error(-1, "Can't silence stdout.");
+
+	for (i=0; i<2; i++)
+		{
+		struct bench_map m;
+		char path[1024];
+
+		snprintf(path, sizeof(path), "%s/%s", maps_dir, names[i]);
+		if (open_map(&m, path) != 0)
+			{
+			fprintf(stderr, "Bench: no %s, skipped\n", path);
+			continue;
+			}
+		run_bench(&m, "bspLoad", "map", bench_load, 0, &results[n_results++]);
+		run_bench(&m, "bspLoadEntities", "map", bench_entities, 0, &results[n_results++]);
+		run_bench(&m, "findCluster", "lookup", bench_find_cluster, 0, &results[n_results++]);
+		if (m.n_clusters && m.bsp.directory[VISDATA].length > 8)
+			{
+			run_bench(&m, "clusterIsVisible_row", "row", bench_pvs_row, 0, &results[n_results++]);
+			run_bench(&m, "leaf_faces", "cluster", bench_leaf_faces, 0, &results[n_results++]);
+			}
+		run_bench(&m, "patch_tessellation", "map", bench_patches, 0, &results[n_results++]);
+		run_bench(&m, "lighten_lightmaps", "map", bench_lighten, 1, &results[n_results++]);
+		if (m.bsp.directory[LIGHTMAPS].length >= 128*128*3)
+			{
+			run_bench(&m, "mipmaps_box", "map", bench_mipmaps_box, 0, &results[n_results++]);
+			run_bench(&m, "mipmaps_kaiser", "map", bench_mipmaps_kaiser, 0, &results[n_results++]);
+			}
+
+		close_map(&m);
+		}
+
+	fp = fopen(output, "w");
+	if (!fp) error(-1, "Can't write the results.");
+	write_json(fp, results, n_results);
+	fclose(fp);
+	fprintf(stderr, "Bench: wrote %s\n", output);
+
+	if (baseline)
+		{
+		int n_regressions = compare(baseline, results, n_results, threshold);
+		free(baseline);
+		return n_regressions ? 1 : 0;
+		}
+
+	return 0;
+	}
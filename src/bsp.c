@@ -2,14 +2,29 @@
 
 #include "error.h"
 #include "bsp.h"
+#include "frustum.h"
+#include "compact.h"
 
 extern unsigned int *g_lm_texture_ids;
+extern struct compact_vertices *g_compact_vertices;
 int g_bezier_steps = 4;
 
 /***
 Functions
 ***/
 
+/* One block for every lump and its terminating 0 */
+static long
+lumps_size(struct bsp *bsp)
+	{
+	long size = 0;
+	int i;
+
+	for (i=0; i<17; i++) size += (bsp->directory[i].length + 1 + ARENA_ALIGN-1) & ~(long)(ARENA_ALIGN-1);
+
+	return size;
+	}
+
 int
 bspLoad(struct bsp  *bsp, char *filename)
 	{
@@ -34,22 +49,190 @@ bspLoad(struct bsp  *bsp, char *filename)
 
 	for (i=0; i<17; i++)
 		{
-		unsigned int position = 0;
-		struct directory_entry *ent = 0;
-
-		ent = &bsp->directory[i];
 		fread(&bsp->directory[i].offset, 4, 1, fp);
 		fread(&bsp->directory[i].length, 4, 1, fp);
+		}
 
-		// Load lump
-		position = ftell(fp);
+	/* Lumps, all in one block */
+	arenaInit(&bsp->lumps, MEM_LUMPS, lumps_size(bsp));
+	for (i=0; i<17; i++)
+		{
+		struct directory_entry *ent = &bsp->directory[i];
+
+		ent->data = arenaAlloc(&bsp->lumps, ent->length + 1);
 		fseek(fp, ent->offset, SEEK_SET);
-		ent->data = malloc(ent->length);
 		fread(ent->data, 1, ent->length, fp);
-		fseek(fp, position, SEEK_SET);
+		((char *)ent->data)[ent->length] = 0;
 
 		//printf("lump [%02i] %7i, %7i\n", i, ent->offset, ent->length);
 		}
+	fclose(fp);
+
+	return 0;
+	}
+
+/***
+Same as bspLoad but from a file already in memory, e.g. one
+read out of a pk3. The lumps are copied, data can be released.
+Returns -1 without loading anything if it isn't a version 46
+BSP, so batch tools can skip bad files.
+***/
+int
+bspLoadFromMemory(struct bsp *bsp, void *data, int length)
+	{
+	unsigned char *bytes = data;
+	unsigned int magic = 0;
+	int version = 0;
+	int i;
+
+	if (length < 8 + 17*8) return -1;
+
+	memcpy(&magic, bytes, 4);
+	memcpy(&version, bytes+4, 4);
+	if (magic != 0x50534249 || version != 46) return -1;
+
+	for (i=0; i<17; i++)
+		{
+		int offset, size;
+
+		memcpy(&offset, bytes + 8 + i*8, 4);
+		memcpy(&size, bytes + 8 + i*8 + 4, 4);
+		if (offset < 0 || size < 0 || offset > length || size > length - offset) return -1;
+		}
+
+	for (i=0; i<17; i++)
+		{
+		memcpy(&bsp->directory[i].offset, bytes + 8 + i*8, 4);
+		memcpy(&bsp->directory[i].length, bytes + 8 + i*8 + 4, 4);
+		}
+
+	arenaInit(&bsp->lumps, MEM_LUMPS, lumps_size(bsp));
+	for (i=0; i<17; i++)
+		{
+		struct directory_entry *ent = &bsp->directory[i];
+
+		ent->data = arenaAlloc(&bsp->lumps, ent->length + 1);
+		memcpy(ent->data, bytes + ent->offset, ent->length);
+		((char *)ent->data)[ent->length] = 0;
+		}
+
+	return 0;
+	}
+
+static char *lump_names[17] = {
+	"entities", "textures", "planes", "nodes", "leaves", "leaffaces",
+	"leafbrushes", "models", "brushes", "brushsides", "vertexes",
+	"meshverts", "effects", "faces", "lightmaps", "lightvols", "visdata"
+};
+
+char *
+bspLumpName(int lump)
+	{
+	if (lump < 0 || lump >= 17) return "?";
+	return lump_names[lump];
+	}
+
+/* A lump that isn't in the arena came from bspReplaceLump */
+static void
+free_lump(struct bsp *bsp, int lump)
+	{
+	struct directory_entry *ent = &bsp->directory[lump];
+
+	if (ent->data && !arenaOwns(&bsp->lumps, ent->data))
+		{
+		free(ent->data);
+		memAccount(MEM_LUMPS, -ent->length, -1);
+		}
+	ent->data = 0;
+	ent->length = 0;
+	}
+
+void
+bspFree(struct bsp *bsp)
+	{
+	int i;
+
+	for (i=0; i<17; i++) free_lump(bsp, i);
+	arenaFree(&bsp->lumps);
+	}
+
+/***
+Swap in a new lump, data is malloc'ed and now belongs to the bsp.
+What it replaces is freed unless it is part of the loaded block,
+which only goes as a whole.
+***/
+void
+bspReplaceLump(struct bsp *bsp, int lump, void *data, int length)
+	{
+	free_lump(bsp, lump);
+	bsp->directory[lump].data = data;
+	bsp->directory[lump].length = length;
+	memAccount(MEM_LUMPS, length, 1);
+	}
+
+/* Brighten the lightmap lump in place by LIGHTEN, once per load */
+void
+bspLightenLightmaps(struct bsp *bsp)
+	{
+	unsigned char *c = bsp->directory[LIGHTMAPS].data;
+	int n = bsp->directory[LIGHTMAPS].length/(128*128*3)*128*128*3;
+	int i;
+
+	for (i=0; i<n; i++)
+		{
+		float i_c = c[i];
+		i_c *= LIGHTEN;
+		if (i_c>255) i_c = 255;
+		c[i] = i_c;
+		}
+	}
+
+/* Entities and placed models from bspLoadEntities/bspLoadModels */
+void
+mapFree(struct map *map)
+	{
+	arenaFree(&map->arena);
+	memset(map, 0, sizeof(struct map));
+	}
+
+/***
+Write all 17 lumps back out, each 4 byte aligned,
+in directory order. Returns -1 if the file can't be written.
+***/
+int
+bspWrite(struct bsp *bsp, char *filename)
+	{
+	FILE *fp = 0;
+	unsigned int magic = 0x50534249;
+	int version = 46;
+	int offset = 8 + 17*8;
+	int i;
+
+	fp = fopen(filename, "wb");
+	if (!fp) return -1;
+
+	fwrite(&magic, 4, 1, fp);
+	fwrite(&version, 4, 1, fp);
+
+	for (i=0; i<17; i++)
+		{
+		int length = bsp->directory[i].length;
+		fwrite(&offset, 4, 1, fp);
+		fwrite(&length, 4, 1, fp);
+		offset += (length + 3) & ~3;
+		}
+
+	for (i=0; i<17; i++)
+		{
+		int length = bsp->directory[i].length;
+		int pad = ((length + 3) & ~3) - length;
+		int zero = 0;
+
+		fwrite(bsp->directory[i].data, 1, length, fp);
+		fwrite(&zero, 1, pad, fp);
+		}
+
+	if (fclose(fp) != 0) return -1;
 
 	return 0;
 	}
@@ -83,7 +266,7 @@ C2	+---c---+
 #define LERP(a,b,t) (a+(b-a)*t)
 
 void
-get_point_on_patch(float patch[3][3][5], float x, float y, float point[3])
+get_point_on_patch(float patch[3][3][5], float x, float y, float point[5])
 	{
 	float Bu[3];
 	float Bv[3];
@@ -152,6 +335,32 @@ drawPatchFaces(float p[3][3][5])
 		}
 	}
 
+/* The i'th 3x3 patch of a grid w control points wide, x,y,z and lightmap s,t */
+static void
+get_patch(int w, struct bsp_vertex *verts, int i, float patch[3][3][5])
+	{
+	int pw = (w-1)/2;
+	int index = (i%pw)*2 + (i/pw)*2*w;
+	int j, x, y;
+
+	for (j=0; j<3*3; j++)
+		{
+		x = j%3;
+		y = j/3;
+		patch[x][y][0] = verts[index + x + (y*w)].position[0];
+		patch[x][y][1] = verts[index + x + (y*w)].position[1];
+		patch[x][y][2] = verts[index + x + (y*w)].position[2];
+		patch[x][y][3] = verts[index + x + (y*w)].texcoord[1][0];
+		patch[x][y][4] = verts[index + x + (y*w)].texcoord[1][1];
+		}
+	}
+
+void
+bspPatchControlPoints(struct bsp_face *face, struct bsp_vertex *verts, int i, float patch[3][3][5])
+	{
+	get_patch(face->size[0], verts, i, patch);
+	}
+
 void
 drawPatch(int w, int h, struct bsp_vertex *verts, int n_verts)
 	{
@@ -160,28 +369,14 @@ drawPatch(int w, int h, struct bsp_vertex *verts, int n_verts)
 	/* Calculate how many patches we need to deal with */
 	int pw = (w-1)/2;
 	int ph = (h-1)/2;
-	int i, j, x, y;
+	int i;
 
 	/* Process each patch */
 	glBegin(GL_TRIANGLES);
 	for (i=0; i<pw*ph; i++)
 		{
-		int px = i%pw;
-		int py = i/pw;
-		int index = (px*2) + ((py*2)*w);
-			/* Get patch */
-			for (j=0; j<3*3; j++)
-				{
-				float *v;
-				x = j%3;
-				y = j/3;
-				patch[x][y][0] = verts[index + x + (y*w)].position[0];
-				patch[x][y][1] = verts[index + x + (y*w)].position[1];
-				patch[x][y][2] = verts[index + x + (y*w)].position[2];
-				patch[x][y][3] = verts[index + x + (y*w)].texcoord[1][0];
-				patch[x][y][4] = verts[index + x + (y*w)].texcoord[1][1];
-				}
-				drawPatchFaces(patch);
+		get_patch(w, verts, i, patch);
+		drawPatchFaces(patch);
 
 		}
 	glEnd();
@@ -189,11 +384,79 @@ drawPatch(int w, int h, struct bsp_vertex *verts, int n_verts)
 	}
 
 
+/***
+Same as the type 1/3 path of drawBspFace but fetching the
+compact vertices. Positions are dequantised by the modelview
+matrix and lightmap coordinates by the texture matrix, only
+the octahedral normals are decoded here, pre-scaled so that
+the non-uniform modelview scale leaves their direction alone.
+***/
+static void
+draw_compact_face(struct bsp_face *face, struct bsp *bsp, int normals)
+	{
+	static float *decoded_normals = 0;
+	static int n_decoded = 0;
+	struct compact_vertices *c = g_compact_vertices;
+	struct bsp_face *faces = bsp->directory[FACES].data;
+	struct cvertex_box *box = &c->boxes[c->face_box[face - faces]];
+	struct bsp_cvertex *cv = &c->vertices[face->vertex];
+	int *meshverts = bsp->directory[MESHVERTS].data;
+	int i;
+
+	glMatrixMode(GL_TEXTURE);
+	glPushMatrix();
+	glScalef(1.0f/LM_TEXCOORD_SCALE, 1.0f/LM_TEXCOORD_SCALE, 1);
+	glMatrixMode(GL_MODELVIEW);
+	glPushMatrix();
+	glTranslatef(box->centre[0], box->centre[1], box->centre[2]);
+	glScalef(box->scale[0], box->scale[1], box->scale[2]);
+
+	glEnableClientState(GL_VERTEX_ARRAY);
+	glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+	glVertexPointer(3, GL_SHORT, sizeof(struct bsp_cvertex), cv->position);
+	glTexCoordPointer(2, GL_SHORT, sizeof(struct bsp_cvertex), cv->lm_texcoord);
+
+	if (normals)
+		{
+		if (face->n_vertexes > n_decoded)
+			{
+			n_decoded = face->n_vertexes;
+			decoded_normals = realloc(decoded_normals, sizeof(float)*3*n_decoded);
+			}
+		for (i=0; i<face->n_vertexes; i++)
+			{
+			struct bsp_vertex v;
+			compactVerticesDecode(c, &cv[i], c->face_box[face - faces], &v);
+			/* The modelview scale reaches the normals as its inverse, pre-scaling cancels it */
+			decoded_normals[i*3+0] = v.normal[0]*box->scale[0];
+			decoded_normals[i*3+1] = v.normal[1]*box->scale[1];
+			decoded_normals[i*3+2] = v.normal[2]*box->scale[2];
+			}
+		glEnable(GL_NORMALIZE); /*only the length is left to fix*/
+		glEnableClientState(GL_NORMAL_ARRAY);
+		glNormalPointer(GL_FLOAT, 0, decoded_normals);
+		}
+
+	glDrawElements(GL_TRIANGLES, face->n_meshverts, GL_UNSIGNED_INT, &meshverts[face->meshvert]);
+
+	if (normals)
+		{
+		glDisableClientState(GL_NORMAL_ARRAY);
+		glDisable(GL_NORMALIZE);
+		}
+	glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+	glDisableClientState(GL_VERTEX_ARRAY);
+
+	glPopMatrix();
+	glMatrixMode(GL_TEXTURE);
+	glPopMatrix();
+	glMatrixMode(GL_MODELVIEW);
+	}
+
 void
 drawBspFace(struct bsp_face *face, struct bsp *bsp)
 	{
 	int total=0;
-	int i=0;
 	int base=0;
 	int *meshverts=0;
 	struct bsp_vertex *vertices=0;
@@ -219,21 +482,31 @@ drawBspFace(struct bsp_face *face, struct bsp *bsp)
 			glEnable(GL_LIGHTING);
 			glEnable(GL_LIGHT0);
 		case 1:
-			glBegin(GL_TRIANGLES);
-			for (i=0; i<total; i++)
+			if (g_compact_vertices)
+				{
+				draw_compact_face(face, bsp, normals);
+				if (normals) glDisable(GL_LIGHTING);
+				break;
+				}
+			/* Indexed so the post-transform cache gets used,
+			   see bspOptimizeMeshes */
+			glEnableClientState(GL_VERTEX_ARRAY);
+			glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+			glVertexPointer(3, GL_FLOAT, sizeof(struct bsp_vertex), vertices[base].position);
+			glTexCoordPointer(2, GL_FLOAT, sizeof(struct bsp_vertex), vertices[base].texcoord[1]);
+			if (normals)
 				{
-				struct bsp_vertex *vertex;
-				int offset = meshverts[face->meshvert+i];
-				vertex = &vertices[base + offset];
-				if (normals) glNormal3f(vertex->normal[0], vertex->normal[1], vertex->normal[2]);
-				glTexCoord2f(vertex->texcoord[1][0],vertex->texcoord[1][1] );
-				glVertex3f(vertex->position[0], vertex->position[1], vertex->position[2] );
+				glEnableClientState(GL_NORMAL_ARRAY);
+				glNormalPointer(GL_FLOAT, sizeof(struct bsp_vertex), vertices[base].normal);
 				}
-			glEnd();
+			glDrawElements(GL_TRIANGLES, total, GL_UNSIGNED_INT, &meshverts[face->meshvert]);
 			if (normals)
 				{
+				glDisableClientState(GL_NORMAL_ARRAY);
 				glDisable(GL_LIGHTING);
 				}
+			glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+			glDisableClientState(GL_VERTEX_ARRAY);
 			break;
 		case 2: /*Patch - is not in the mesh verts?*/
 			drawPatch(face->size[0],face->size[1], &vertices[face->vertex], face->n_vertexes);
@@ -241,6 +514,283 @@ drawBspFace(struct bsp_face *face, struct bsp *bsp)
 		}
 	}
 
+/***
+	A = point
+	B = point on the plane
+	P = plane normal
+	dotProduct(A-B, P);
+
+	n = normal
+***/
+
+int 
+infrontOfPlane(float n[3], float pos[3], float dist)
+	{
+	float result = (pos[0])*n[0] + (pos[1])*n[1] + (pos[2])*n[2] - dist;
+	if (result > 0) return 1;
+	return 0;
+	}
+
+int 
+findLeaf(struct bsp *bsp, float x, float y, float z)
+	{
+	struct bsp_node* nodes = 0;
+	struct bsp_plane *planes = 0;
+	struct bsp_node *node = 0;
+	int leaf = 0;
+	float pos[3] = {x,y,z};
+
+	planes = bsp->directory[PLANES].data;
+	nodes = bsp->directory[NODES].data;
+	node = &nodes[0];
+
+	while(1)
+		{
+		struct bsp_plane *plane = 0;
+
+		plane = &planes[node->plane];
+
+		if (infrontOfPlane(plane->normal, pos, plane->dist))
+			{
+			if (node->children[0] >= 0) 
+				{
+				node = &nodes[node->children[0]];
+				} 
+			else 
+				{
+				leaf = -(node->children[0]+1);
+				break;
+				}
+			} 
+			else 
+				{
+				if (node->children[1] >= 0) 
+					{
+					node = &nodes[node->children[1]];
+					} 
+				else 
+					{
+					leaf = -(node->children[1]+1);
+					break;
+					}
+				}
+		}
+	return leaf;
+	}
+
+int 
+findCluster(struct bsp *bsp, float x, float y, float z)
+	{
+	struct bsp_leaf *leaves = bsp->directory[LEAVES].data;
+
+	return leaves[findLeaf(bsp, x, y, z)].cluster;
+	}
+
+int 
+clusterIsVisible(int current_cluster, int test_cluster, void *visdata) 
+	{
+	//	int n_vecs = *((int *)visdata);
+	int sz_vecs = *((int *)(visdata+4));
+	unsigned char *vecs = (unsigned char *)(visdata+8);
+
+	if (1<<(current_cluster%8) & vecs[test_cluster*sz_vecs + (current_cluster/8)])
+		return 1;
+
+	return 0;
+	}
+
+/***
+Collect every leaf the box touches.
+Returns the number of leaves written.
+***/
+static int
+box_leaves_r(struct bsp *bsp, int node_index, float mins[3], float maxs[3],
+		int *leaves, int n, int max_leaves)
+	{
+	struct bsp_node *nodes = bsp->directory[NODES].data;
+	struct bsp_plane *planes = bsp->directory[PLANES].data;
+
+	while (node_index >= 0)
+		{
+		struct bsp_node *node = &nodes[node_index];
+		struct bsp_plane *plane = &planes[node->plane];
+		float front = 0, back = 0;
+		int k;
+
+		/* Distance of the nearest and furthest corners */
+		for (k=0; k<3; k++)
+			{
+			if (plane->normal[k] > 0)
+				{
+				front += plane->normal[k]*maxs[k];
+				back += plane->normal[k]*mins[k];
+				}
+			else
+				{
+				front += plane->normal[k]*mins[k];
+				back += plane->normal[k]*maxs[k];
+				}
+			}
+
+		if (back > plane->dist) node_index = node->children[0];
+		else if (front <= plane->dist) node_index = node->children[1];
+		else
+			{
+			n = box_leaves_r(bsp, node->children[0], mins, maxs, leaves, n, max_leaves);
+			node_index = node->children[1];
+			}
+		}
+
+	if (n < max_leaves) leaves[n++] = -(node_index+1);
+
+	return n;
+	}
+
+int
+bspBoxLeaves(struct bsp *bsp, float mins[3], float maxs[3], int *leaves, int max_leaves)
+	{
+	return box_leaves_r(bsp, 0, mins, maxs, leaves, 0, max_leaves);
+	}
+
+/***
+Clusters of every leaf the box touches, duplicates removed.
+A leaf is only reached once, so the touched list never needs
+more than the leaf count.
+***/
+int
+bspBoxClusters(struct bsp *bsp, float mins[3], float maxs[3], int *clusters, int max_clusters)
+	{
+	struct bsp_leaf *leaves = bsp->directory[LEAVES].data;
+	int n_leaves = bsp->directory[LEAVES].length/sizeof(struct bsp_leaf);
+	int *touched = malloc(sizeof(int)*(n_leaves+1));
+	int n_touched, n = 0;
+	int i, j;
+
+	n_touched = bspBoxLeaves(bsp, mins, maxs, touched, n_leaves+1);
+
+	for (i=0; i<n_touched; i++)
+		{
+		int cluster = leaves[touched[i]].cluster;
+
+		if (cluster < 0) continue;
+		for (j=0; j<n; j++) if (clusters[j] == cluster) break;
+		if (j == n && n < max_clusters) clusters[n++] = cluster;
+		}
+	free(touched);
+
+	return n;
+	}
+
+/***
+Find every entity using an inline model ("model" "*N")
+and work out where it sits in the world.
+Model 0 is the world itself, drawn through the leaves.
+***/
+int
+bspLoadModels(struct bsp *bsp, struct map *map)
+	{
+	struct bsp_model *models = bsp->directory[MODELS].data;
+	int n_models = bsp->directory[MODELS].length/sizeof(struct bsp_model);
+	int n_clusters = 0;
+	int *clusters;
+	int i;
+
+	/* The header is the cluster count and the row size */
+	if (bsp->directory[VISDATA].length >= 8) n_clusters = *((int *)bsp->directory[VISDATA].data);
+	/* Every cluster at most once, so a model can touch them all */
+	clusters = malloc(sizeof(int)*(n_clusters+1));
+
+	/* At most one per entity */
+	map->models = arenaAlloc(&map->arena, sizeof(struct model_instance)*(map->n_entities+1));
+	map->n_models = 0;
+
+	for (i=0; i<map->n_entities; i++)
+		{
+		struct entity_property *prop;
+		struct model_instance *inst;
+		struct bsp_model *model;
+		int model_index = 0;
+		int k;
+
+		prop = entityGetPropertyByName(&map->entities[i], "model");
+		if (!prop || prop->value[0] != '*') continue;
+
+		model_index = atoi(prop->value+1);
+		if (model_index <= 0 || model_index >= n_models) continue;
+		model = &models[model_index];
+
+		inst = &map->models[map->n_models++];
+		inst->model = model_index;
+		inst->entity = i;
+		inst->origin[0] = inst->origin[1] = inst->origin[2] = 0;
+
+		prop = entityGetPropertyByName(&map->entities[i], "origin");
+		if (prop) sscanf(prop->value, "%f %f %f", &inst->origin[0], &inst->origin[1], &inst->origin[2]);
+
+		for (k=0; k<3; k++)
+			{
+			inst->mins[k] = model->mins[k] + inst->origin[k];
+			inst->maxs[k] = model->maxs[k] + inst->origin[k];
+			}
+
+		inst->n_clusters = 0;
+		inst->clusters = 0;
+		if (n_clusters == 0) continue;
+
+		inst->n_clusters = bspBoxClusters(bsp, inst->mins, inst->maxs, clusters, n_clusters);
+		inst->clusters = arenaAlloc(&map->arena, sizeof(int)*inst->n_clusters);
+		memcpy(inst->clusters, clusters, sizeof(int)*inst->n_clusters);
+		}
+
+	free(clusters);
+	printf("Brush models: %u placed of %i\n", map->n_models, n_models-1);
+
+	return 0;
+	}
+
+/***
+Draw the inline brush models.
+A model is skipped when its bounds are outside the frustum, or
+when none of the clusters it touches is visible from current_cluster
+(pass -1 to disable the PVS test).
+Returns the number of models drawn.
+***/
+int
+drawBspModels(struct bsp *bsp, struct map *map, struct frustum *frustum, int current_cluster)
+	{
+	struct bsp_model *models = bsp->directory[MODELS].data;
+	struct bsp_face *faces = bsp->directory[FACES].data;
+	int drawn = 0;
+	int i, j;
+
+	for (i=0; i<map->n_models; i++)
+		{
+		struct model_instance *inst = &map->models[i];
+		struct bsp_model *model = &models[inst->model];
+
+		if (frustum && frustumCullBox(frustum, inst->mins, inst->maxs)) continue;
+
+		if (current_cluster >= 0 && inst->n_clusters > 0)
+			{
+			int visible = 0;
+			for (j=0; j<inst->n_clusters && !visible; j++)
+				visible = clusterIsVisible(current_cluster, inst->clusters[j], bsp->directory[VISDATA].data);
+			if (!visible) continue;
+			}
+
+		glPushMatrix();
+		glTranslatef(inst->origin[0], inst->origin[1], inst->origin[2]);
+		for (j=0; j<model->n_faces; j++)
+			{
+			drawBspFace(&faces[model->face + j], bsp);
+			}
+		glPopMatrix();
+		drawn++;
+		}
+
+	return drawn;
+	}
+
 /*Get string in quotes*/
 int
 get_string(char *string, char *dest)
@@ -272,10 +822,26 @@ get_string(char *string, char *dest)
 	return count;
 	}
 
+/* The properties read so far become the entity's, in the map's arena */
+static void
+finish_entity(struct map *map, struct entity *e, struct entity_property *props, int n_props)
+	{
+	e->properties = arenaAlloc(&map->arena, sizeof(struct entity_property)*(n_props+1));
+	memcpy(e->properties, props, sizeof(struct entity_property)*n_props);
+	e->n_properties = n_props;
+	}
+
+/***
+Entities, their properties and strings all go in the map's arena.
+Both arrays are collected on the heap while they grow and copied
+in once their size is known.
+***/
 int 
 bspLoadEntities(struct bsp *bsp, struct map *map)
 	{
-	struct entity *current_entity=0;
+	struct entity *entities = 0;
+	struct entity_property *props = 0;
+	unsigned int max_entities = 0, n_props = 0, max_props = 0;
 	unsigned int entity_string_length=0;
 	unsigned pos = 0;
 	char *entity_string;
@@ -285,8 +851,8 @@ bspLoadEntities(struct bsp *bsp, struct map *map)
 	entity_string = bsp->directory[ENTITIES].data;
 	entity_string_length = bsp->directory[ENTITIES].length;
 
-	/*initialize entities pointer*/
-	map->entities = malloc(sizeof(struct entity));
+	/* The strings are shorter than the lump, room for the rest too */
+	arenaInit(&map->arena, MEM_ENTITIES, entity_string_length*2 + 4096);
 
 	while (pos < entity_string_length)
 		{
@@ -300,17 +866,24 @@ bspLoadEntities(struct bsp *bsp, struct map *map)
 		/*Look for opening \{*/
 		if (c == '{') 
 			{ /*New entity*/
+			if (in_entity) finish_entity(map, &entities[entity_count-1], props, n_props);
 			in_entity=1; 
 			pos++;
 
+			if (entity_count == max_entities)
+				{
+				max_entities = max_entities ? max_entities*2 : 64;
+				entities = realloc(entities, sizeof(struct entity)*max_entities);
+				}
 			entity_count++;
-			map->entities = realloc(map->entities, sizeof(struct entity)*entity_count);
-			current_entity = &map->entities[entity_count-1];
-			current_entity->n_properties = 0;
-			current_entity->properties = malloc(sizeof(struct entity_property));
+			n_props = 0;
 			}
 
-		if (c == '}') in_entity=0;
+		if (c == '}' && in_entity)
+			{
+			finish_entity(map, &entities[entity_count-1], props, n_props);
+			in_entity=0;
+			}
 		
 		if (in_entity) 
 			{
@@ -318,30 +891,38 @@ bspLoadEntities(struct bsp *bsp, struct map *map)
 			char value[128];
 			struct entity_property *property;
 
-			current_entity->n_properties++;
-			current_entity->properties = realloc(current_entity->properties, sizeof(struct entity_property)*current_entity->n_properties);
-			property = &current_entity->properties[current_entity->n_properties-1];
-
 			count = get_string(entity_string+pos, prop);
 			pos += count;
 
-			if (prop[0]==0) continue; /*we have an '{'*/
+			if (prop[0]==0) /*we have an '{'*/
+				continue;
 
 			count = get_string(entity_string+pos, value);
 			pos += count;
 			//printf("%s = %s\n", prop, value);
 			
-			property->name = malloc(strlen(prop) + 1);
-			property->value = malloc(strlen(value) + 1);
-			strcpy(property->name, prop);
-			strcpy(property->value, value);
+			if (n_props == max_props)
+				{
+				max_props = max_props ? max_props*2 : 16;
+				props = realloc(props, sizeof(struct entity_property)*max_props);
+				}
+			property = &props[n_props++];
+			property->name = arenaStrdup(&map->arena, prop);
+			property->value = arenaStrdup(&map->arena, value);
 			}
 
 		else pos++;
 		}
+	/* Unterminated last entity */
+	if (in_entity) finish_entity(map, &entities[entity_count-1], props, n_props);
 
+	map->entities = arenaAlloc(&map->arena, sizeof(struct entity)*(entity_count+1));
+	memcpy(map->entities, entities, sizeof(struct entity)*entity_count);
 	map->n_entities = entity_count;
 
+	free(entities);
+	free(props);
+
 	return 0;
 	}
 
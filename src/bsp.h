@@ -5,6 +5,8 @@
 #include <ctype.h>
 #include <string.h>
 
+#include "arena.h"
+
 #define LIGHTEN (2.5)
 
 enum {
@@ -52,6 +54,26 @@ struct bsp_vertex {
 	unsigned char color[4];
 };
 
+struct bsp_model {
+	float mins[3];
+	float maxs[3];
+	int face;
+	int n_faces;
+	int brush;
+	int n_brushes;
+};
+
+struct bsp_brush {
+	int brushside;
+	int n_brushsides;
+	int texture;
+};
+
+struct bsp_brushside {
+	int plane;
+	int texture;
+};
+
 struct bsp_leaf {
 	int cluster;
 	int area;
@@ -88,6 +110,7 @@ struct directory_entry {
 
 struct bsp{
 	struct directory_entry directory[17];
+	struct arena lumps; /*the lumps as loaded, see bspReplaceLump*/
 } ;
 
 /* Structs for drawing - not from BSP files */
@@ -107,26 +130,59 @@ struct entity {
 	unsigned int n_properties;
 };
 
+/* Inline brush model placed by an entity ("model" "*N") */
+struct model_instance {
+	int model;
+	int entity;
+	float origin[3];
+	float mins[3]; /*world space bounds*/
+	float maxs[3];
+	int *clusters; /*clusters the bounds touch*/
+	int n_clusters;
+};
+
 struct map {
 	struct leaf *leaves; /*Same order as indexed in BSP file*/
 	struct entity *entities;
 	unsigned int n_entities;
+	struct model_instance *models;
+	unsigned int n_models;
+	struct arena arena; /*entities, properties, strings and models*/
 };
 
+struct frustum;
+
 /***
 FUNCTIONS
 ***/
 
 int bspLoad(struct bsp  *bsp, char *filename);
+int bspLoadFromMemory(struct bsp *bsp, void *data, int length);
+int bspWrite(struct bsp *bsp, char *filename);
+void bspFree(struct bsp *bsp);
+void bspReplaceLump(struct bsp *bsp, int lump, void *data, int length);
+void bspLightenLightmaps(struct bsp *bsp);
+char *bspLumpName(int lump);
+void mapFree(struct map *map);
 #define LERP(a,b,t) (a+(b-a)*t)
 void curve(float c[3], struct bsp_vertex *v, float t);
 void texlerp(float tc0[2], float tc1[2], float tc2[2], float tc3[2]
 		, float fx, float fy, float *s, float *t);
+void get_point_on_patch(float patch[3][3][5], float x, float y, float point[5]);
+/* Control points of a patch face's i'th 3x3 patch, verts from the face's first vertex */
+void bspPatchControlPoints(struct bsp_face *face, struct bsp_vertex *verts, int i, float patch[3][3][5]);
 void drawPatch(int w, int h, struct bsp_vertex *verts, int n_verts);
 void drawBspFace(struct bsp_face *face, struct bsp *bsp);
 /*Get string in quotes*/
 int get_string(char *string, char *dest);
 int bspLoadEntities(struct bsp *bsp, struct map *map);
 struct entity_property *entityGetPropertyByName(struct entity *e, char *name);
+int findLeaf(struct bsp *bsp, float x, float y, float z);
+int findCluster(struct bsp *bsp, float x, float y, float z);
+int clusterIsVisible(int current_cluster, int test_cluster, void *visdata);
+int bspBoxLeaves(struct bsp *bsp, float mins[3], float maxs[3], int *leaves, int max_leaves);
+int bspBoxClusters(struct bsp *bsp, float mins[3], float maxs[3], int *clusters, int max_clusters);
+int bspLoadModels(struct bsp *bsp, struct map *map);
+int drawBspModels(struct bsp *bsp, struct map *map, struct frustum *frustum, int current_cluster);
 
 #endif /* BSP_H */
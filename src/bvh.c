@@ -0,0 +1,854 @@
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "error.h"
+#include "bvh.h"
+
+#define BVH_BINS (16)
+/* Always a leaf at or below this, never one above the max */
+#define BVH_MIN_LEAF (2)
+#define BVH_MAX_LEAF (16)
+/* Cost of a node visit against one triangle test */
+#define BVH_TRAVERSAL_COST (1.0f)
+#define BVH_STACK (64)
+/* Deeper ranges stay one leaf, so a traversal's stack can't overflow */
+#define BVH_MAX_DEPTH (BVH_STACK-2)
+/* Hits closer than this are the surface the ray started on */
+#define BVH_EPSILON (1e-3f)
+
+struct bvh_nodes {
+	struct bvh_node *nodes;
+	int n_nodes;
+	int max_nodes;
+	int depth;
+};
+
+/* A subtree left for the workers */
+struct bvh_task {
+	int node;
+	int first;
+	int count;
+	int depth;
+};
+
+struct bvh_build {
+	struct bvh_triangle *triangles;
+	int n_triangles;
+	int max_triangles;
+
+	float (*mins)[3];
+	float (*maxs)[3];
+	float (*centre)[3];
+	int *indices;
+
+	struct bvh_task *tasks;
+	int n_tasks;
+	int max_tasks;
+	struct bvh_nodes *local; /*one per task*/
+	int task_depth;
+};
+
+/* Like minss/maxss, fminf is a libm call without -ffast-math */
+static inline float min_f(float a, float b) { return a < b ? a : b; }
+static inline float max_f(float a, float b) { return a > b ? a : b; }
+
+static void
+add_triangle(struct bvh_build *b, float *a, float *c1, float *c2, int face)
+	{
+	struct bvh_triangle *t;
+	int k;
+
+	if (b->n_triangles >= b->max_triangles)
+		{
+		b->max_triangles = b->max_triangles ? b->max_triangles*2 : 4096;
+		b->triangles = realloc(b->triangles, sizeof(struct bvh_triangle)*b->max_triangles);
+		}
+
+	t = &b->triangles[b->n_triangles++];
+	for (k=0; k<3; k++)
+		{
+		t->v0[k] = a[k];
+		t->e1[k] = c1[k] - a[k];
+		t->e2[k] = c2[k] - a[k];
+		}
+	t->face = face;
+	}
+
+/* Patches at a fixed detail, the view's g_bezier_steps can change */
+static void
+add_patch(struct bvh_build *b, struct bsp_face *face, struct bsp_vertex *verts, int face_index)
+	{
+	int w = face->size[0];
+	int pw = (w-1)/2;
+	int ph = (face->size[1]-1)/2;
+	float step_size = 1.0f/BVH_PATCH_STEPS;
+	float patch[3][3][5];
+	int i, j;
+
+	for (i=0; i<pw*ph; i++)
+		{
+		bspPatchControlPoints(face, verts, i, patch);
+
+		for (j=0; j<BVH_PATCH_STEPS*BVH_PATCH_STEPS; j++)
+			{
+			float fx = (j%BVH_PATCH_STEPS) * step_size;
+			float fy = (j/BVH_PATCH_STEPS) * step_size;
+			float p00[5] = {0}, p10[5] = {0}, p11[5] = {0}, p01[5] = {0};
+
+			get_point_on_patch(patch, fx, fy, p00);
+			get_point_on_patch(patch, fx+step_size, fy, p10);
+			get_point_on_patch(patch, fx+step_size, fy+step_size, p11);
+			get_point_on_patch(patch, fx, fy+step_size, p01);
+
+			add_triangle(b, p00, p01, p10, face_index);
+			add_triangle(b, p10, p01, p11, face_index);
+			}
+		}
+	}
+
+static int
+alloc_nodes(struct bvh_nodes *ns, int n)
+	{
+	int first = ns->n_nodes;
+
+	if (ns->n_nodes + n > ns->max_nodes)
+		{
+		while (ns->n_nodes + n > ns->max_nodes) ns->max_nodes = ns->max_nodes ? ns->max_nodes*2 : 256;
+		ns->nodes = realloc(ns->nodes, sizeof(struct bvh_node)*ns->max_nodes);
+		}
+	ns->n_nodes += n;
+
+	return first;
+	}
+
+static float
+half_area(float mins[3], float maxs[3])
+	{
+	float d[3] = {maxs[0]-mins[0], maxs[1]-mins[1], maxs[2]-mins[2]};
+	return d[0]*d[1] + d[1]*d[2] + d[2]*d[0];
+	}
+
+static void
+grow_box(float mins[3], float maxs[3], float bmins[3], float bmaxs[3])
+	{
+	int k;
+
+	for (k=0; k<3; k++)
+		{
+		if (bmins[k] < mins[k]) mins[k] = bmins[k];
+		if (bmaxs[k] > maxs[k]) maxs[k] = bmaxs[k];
+		}
+	}
+
+static int
+bin_of(float c, float cmin, float scale)
+	{
+	int bin = (int)((c - cmin)*scale);
+	if (bin < 0) bin = 0;
+	if (bin > BVH_BINS-1) bin = BVH_BINS-1;
+	return bin;
+	}
+
+/***
+Build the subtree for indices[first..first+count) into node.
+At task_depth the range is handed to the workers instead.
+***/
+static void
+build_r(struct bvh_build *b, struct bvh_nodes *ns, int node, int first, int count,
+		int depth, int task_depth)
+	{
+	float mins[3] = {1e30f, 1e30f, 1e30f}, maxs[3] = {-1e30f, -1e30f, -1e30f};
+	float cmins[3] = {1e30f, 1e30f, 1e30f}, cmaxs[3] = {-1e30f, -1e30f, -1e30f};
+	float best_cost = 1e30f;
+	int best_axis = -1, best_split = 0;
+	int axis, i, mid, children;
+
+	for (i=first; i<first+count; i++)
+		{
+		int t = b->indices[i];
+		grow_box(mins, maxs, b->mins[t], b->maxs[t]);
+		grow_box(cmins, cmaxs, b->centre[t], b->centre[t]);
+		}
+
+	memcpy(ns->nodes[node].mins, mins, sizeof(mins));
+	memcpy(ns->nodes[node].maxs, maxs, sizeof(maxs));
+	if (depth > ns->depth) ns->depth = depth;
+
+	if (count <= BVH_MIN_LEAF || depth >= BVH_MAX_DEPTH)
+		{
+		ns->nodes[node].first = first;
+		ns->nodes[node].count = count;
+		return;
+		}
+
+	if (depth == task_depth)
+		{
+		struct bvh_task *task;
+
+		if (b->n_tasks >= b->max_tasks)
+			{
+			b->max_tasks = b->max_tasks ? b->max_tasks*2 : 64;
+			b->tasks = realloc(b->tasks, sizeof(struct bvh_task)*b->max_tasks);
+			}
+		task = &b->tasks[b->n_tasks++];
+		task->node = node;
+		task->first = first;
+		task->count = count;
+		task->depth = depth;
+		return;
+		}
+
+	/* Binned SAH on each axis */
+	for (axis=0; axis<3; axis++)
+		{
+		float extent = cmaxs[axis] - cmins[axis];
+		float bin_mins[BVH_BINS][3], bin_maxs[BVH_BINS][3];
+		int bin_count[BVH_BINS] = {0};
+		float right_area[BVH_BINS];
+		int right_count[BVH_BINS];
+		float lmins[3] = {1e30f, 1e30f, 1e30f}, lmaxs[3] = {-1e30f, -1e30f, -1e30f};
+		float rmins[3] = {1e30f, 1e30f, 1e30f}, rmaxs[3] = {-1e30f, -1e30f, -1e30f};
+		float scale;
+		int n_left = 0, n_right = 0;
+
+		if (extent <= 0) continue;
+		scale = BVH_BINS/extent;
+
+		for (i=0; i<BVH_BINS; i++)
+			{
+			bin_mins[i][0] = bin_mins[i][1] = bin_mins[i][2] = 1e30f;
+			bin_maxs[i][0] = bin_maxs[i][1] = bin_maxs[i][2] = -1e30f;
+			}
+
+		for (i=first; i<first+count; i++)
+			{
+			int t = b->indices[i];
+			int bin = bin_of(b->centre[t][axis], cmins[axis], scale);
+			bin_count[bin]++;
+			grow_box(bin_mins[bin], bin_maxs[bin], b->mins[t], b->maxs[t]);
+			}
+
+		/* Right side of each split, then sweep the left */
+		for (i=BVH_BINS-1; i>0; i--)
+			{
+			n_right += bin_count[i];
+			if (bin_count[i]) grow_box(rmins, rmaxs, bin_mins[i], bin_maxs[i]);
+			right_count[i] = n_right;
+			right_area[i] = n_right ? half_area(rmins, rmaxs) : 0;
+			}
+
+		for (i=0; i<BVH_BINS-1; i++)
+			{
+			float cost;
+
+			n_left += bin_count[i];
+			if (bin_count[i]) grow_box(lmins, lmaxs, bin_mins[i], bin_maxs[i]);
+			if (!n_left || !right_count[i+1]) continue;
+
+			cost = half_area(lmins, lmaxs)*n_left + right_area[i+1]*right_count[i+1];
+			if (cost < best_cost)
+				{
+				best_cost = cost;
+				best_axis = axis;
+				best_split = i;
+				}
+			}
+		}
+
+	/* Splitting has to beat testing everything here */
+	if (count <= BVH_MAX_LEAF
+		&& (best_axis < 0 || BVH_TRAVERSAL_COST*half_area(mins, maxs) + best_cost >= half_area(mins, maxs)*count))
+		{
+		ns->nodes[node].first = first;
+		ns->nodes[node].count = count;
+		return;
+		}
+
+	mid = count/2;
+	if (best_axis >= 0)
+		{
+		float scale = BVH_BINS/(cmaxs[best_axis] - cmins[best_axis]);
+		int l = first, r = first+count-1;
+
+		while (l <= r)
+			{
+			int t = b->indices[l];
+			if (bin_of(b->centre[t][best_axis], cmins[best_axis], scale) <= best_split) l++;
+			else
+				{
+				b->indices[l] = b->indices[r];
+				b->indices[r--] = t;
+				}
+			}
+		mid = l - first;
+		}
+	else best_axis = 0; /*all centroids in one place, split the list*/
+
+	children = alloc_nodes(ns, 2);
+	ns->nodes[node].first = children;
+	ns->nodes[node].count = -(best_axis+1);
+
+	build_r(b, ns, children, first, mid, depth+1, task_depth);
+	build_r(b, ns, children+1, first+mid, count-mid, depth+1, task_depth);
+	}
+
+static void
+build_tasks(void *ctx, int begin, int end, int thread)
+	{
+	struct bvh_build *b = ctx;
+	int i;
+
+	for (i=begin; i<end; i++)
+		{
+		struct bvh_task *task = &b->tasks[i];
+		struct bvh_nodes *ns = &b->local[i];
+
+		alloc_nodes(ns, 1);
+		build_r(b, ns, 0, task->first, task->count, task->depth, -1);
+		}
+	}
+
+/* Local node i > 0 goes to base+i-1, the root replaces the placeholder */
+static void
+stitch_task(struct bvh_nodes *global, struct bvh_task *task, struct bvh_nodes *local)
+	{
+	int base = alloc_nodes(global, local->n_nodes-1);
+	int i;
+
+	for (i=0; i<local->n_nodes; i++)
+		{
+		struct bvh_node n = local->nodes[i];
+
+		if (n.count <= 0) n.first = base + n.first - 1;
+		if (i == 0) global->nodes[task->node] = n;
+		else global->nodes[base+i-1] = n;
+		}
+
+	if (local->depth > global->depth) global->depth = local->depth;
+	}
+
+/***
+Gather the triangles of every face and build the tree. jobs can
+be 0 to build on the calling thread only.
+***/
+struct bvh *
+bvhCreate(struct bsp *bsp, struct jobs *jobs)
+	{
+	return bvhCreateFaces(bsp, jobs, 0);
+	}
+
+/* Only the faces with use_face[face] set, every face if it's 0 */
+struct bvh *
+bvhCreateFaces(struct bsp *bsp, struct jobs *jobs, unsigned char *use_face)
+	{
+	struct bsp_face *faces = bsp->directory[FACES].data;
+	struct bsp_vertex *vertices = bsp->directory[VERTEXES].data;
+	int *meshverts = bsp->directory[MESHVERTS].data;
+	int n_faces = bsp->directory[FACES].length/sizeof(struct bsp_face);
+	int n_threads = jobs ? jobsThreadCount(jobs) : 1;
+	struct bvh_build b = {0};
+	struct bvh_nodes global = {0};
+	struct bvh *bvh;
+	double t0 = jobsTime();
+	int i, j, k;
+
+	for (i=0; i<n_faces; i++)
+		{
+		struct bsp_face *face = &faces[i];
+		struct bsp_vertex *base = &vertices[face->vertex];
+
+		if (use_face && !use_face[i]) continue;
+
+		switch (face->type)
+			{
+			case 1:
+			case 3:
+				for (j=0; j+2<face->n_meshverts; j+=3)
+					add_triangle(&b, base[meshverts[face->meshvert+j]].position,
+						base[meshverts[face->meshvert+j+1]].position,
+						base[meshverts[face->meshvert+j+2]].position, i);
+				break;
+			case 2:
+				add_patch(&b, face, base, i);
+				break;
+			}
+		}
+
+	bvh = calloc(1, sizeof(struct bvh));
+	if (!b.n_triangles)
+		{
+		bvh->nodes = calloc(1, sizeof(struct bvh_node));
+		bvh->n_nodes = 1;
+		return bvh;
+		}
+
+	b.mins = malloc(sizeof(float)*3*b.n_triangles);
+	b.maxs = malloc(sizeof(float)*3*b.n_triangles);
+	b.centre = malloc(sizeof(float)*3*b.n_triangles);
+	b.indices = malloc(sizeof(int)*b.n_triangles);
+
+	for (i=0; i<b.n_triangles; i++)
+		{
+		struct bvh_triangle *t = &b.triangles[i];
+
+		for (k=0; k<3; k++)
+			{
+			float p1 = t->v0[k] + t->e1[k], p2 = t->v0[k] + t->e2[k];
+			b.mins[i][k] = min_f(t->v0[k], min_f(p1, p2));
+			b.maxs[i][k] = max_f(t->v0[k], max_f(p1, p2));
+			b.centre[i][k] = (b.mins[i][k] + b.maxs[i][k])*0.5f;
+			}
+		b.indices[i] = i;
+		}
+
+	/* Enough subtrees below the split depth to keep every thread busy */
+	b.task_depth = -1;
+	if (n_threads > 1)
+		for (b.task_depth=0; (1 << b.task_depth) < n_threads*4; b.task_depth++);
+
+	alloc_nodes(&global, 1);
+	build_r(&b, &global, 0, 0, b.n_triangles, 0, b.task_depth);
+
+	if (b.n_tasks)
+		{
+		b.local = calloc(b.n_tasks, sizeof(struct bvh_nodes));
+		jobsParallelFor(jobs, b.n_tasks, 1, build_tasks, &b);
+
+		for (i=0; i<b.n_tasks; i++)
+			{
+			stitch_task(&global, &b.tasks[i], &b.local[i]);
+			free(b.local[i].nodes);
+			}
+		free(b.local);
+		free(b.tasks);
+		}
+
+	/* Leaves index the triangles directly */
+	bvh->triangles = malloc(sizeof(struct bvh_triangle)*b.n_triangles);
+	for (i=0; i<b.n_triangles; i++) bvh->triangles[i] = b.triangles[b.indices[i]];
+	bvh->n_triangles = b.n_triangles;
+	bvh->nodes = realloc(global.nodes, sizeof(struct bvh_node)*global.n_nodes);
+	bvh->n_nodes = global.n_nodes;
+	bvh->depth = global.depth;
+	bvh->build_time = jobsTime() - t0;
+
+	free(b.triangles);
+	free(b.mins);
+	free(b.maxs);
+	free(b.centre);
+	free(b.indices);
+
+	return bvh;
+	}
+
+void
+bvhFree(struct bvh *bvh)
+	{
+	if (!bvh) return;
+	free(bvh->nodes);
+	free(bvh->triangles);
+	free(bvh);
+	}
+
+/* Distance the ray enters the box, or 1e30 if it misses before best */
+static float
+box_entry(struct bvh_node *n, float o[3], float inv[3], float best)
+	{
+	float tx0 = (n->mins[0]-o[0])*inv[0], tx1 = (n->maxs[0]-o[0])*inv[0];
+	float ty0 = (n->mins[1]-o[1])*inv[1], ty1 = (n->maxs[1]-o[1])*inv[1];
+	float tz0 = (n->mins[2]-o[2])*inv[2], tz1 = (n->maxs[2]-o[2])*inv[2];
+	float tnear = max_f(max_f(min_f(tx0, tx1), min_f(ty0, ty1)), max_f(min_f(tz0, tz1), 0));
+	float tfar = min_f(min_f(max_f(tx0, tx1), max_f(ty0, ty1)), min_f(max_f(tz0, tz1), best));
+
+	return tnear <= tfar ? tnear : 1e30f;
+	}
+
+/* Moller-Trumbore, both sides */
+static int
+hit_triangle(struct bvh_triangle *t, float o[3], float d[3], float best, float *dist, float *u, float *v)
+	{
+	float p[3] = {d[1]*t->e2[2] - d[2]*t->e2[1], d[2]*t->e2[0] - d[0]*t->e2[2], d[0]*t->e2[1] - d[1]*t->e2[0]};
+	float det = t->e1[0]*p[0] + t->e1[1]*p[1] + t->e1[2]*p[2];
+	float s[3], q[3], inv, tu, tv, tt;
+
+	if (fabsf(det) < 1e-8f) return 0;
+	inv = 1.0f/det;
+
+	s[0] = o[0] - t->v0[0];
+	s[1] = o[1] - t->v0[1];
+	s[2] = o[2] - t->v0[2];
+	tu = (s[0]*p[0] + s[1]*p[1] + s[2]*p[2])*inv;
+	if (tu < 0 || tu > 1) return 0;
+
+	q[0] = s[1]*t->e1[2] - s[2]*t->e1[1];
+	q[1] = s[2]*t->e1[0] - s[0]*t->e1[2];
+	q[2] = s[0]*t->e1[1] - s[1]*t->e1[0];
+	tv = (d[0]*q[0] + d[1]*q[1] + d[2]*q[2])*inv;
+	if (tv < 0 || tu + tv > 1) return 0;
+
+	tt = (t->e2[0]*q[0] + t->e2[1]*q[1] + t->e2[2]*q[2])*inv;
+	if (tt <= BVH_EPSILON || tt >= best) return 0;
+
+	*dist = tt;
+	*u = tu;
+	*v = tv;
+	return 1;
+	}
+
+/* Nearest hit, or any hit at all when any is set */
+static int
+traverse(struct bvh *bvh, float o[3], float d[3], float max_distance, struct bvh_hit *hit, int any)
+	{
+	struct bvh_node *nodes = bvh->nodes;
+	float inv[3] = {1.0f/d[0], 1.0f/d[1], 1.0f/d[2]};
+	int stack[BVH_STACK];
+	float stack_t[BVH_STACK];
+	int sp = 0;
+	float best = max_distance;
+	int node = 0;
+
+	hit->face = -1;
+	hit->distance = max_distance;
+	if (!bvh->n_triangles || box_entry(&nodes[0], o, inv, best) >= 1e30f) return 0;
+
+	for (;;)
+		{
+		struct bvh_node *n = &nodes[node];
+
+		if (n->count > 0)
+			{
+			int i;
+
+			for (i=n->first; i<n->first+n->count; i++)
+				{
+				struct bvh_triangle *t = &bvh->triangles[i];
+				float dist, u, v;
+
+				if (!hit_triangle(t, o, d, best, &dist, &u, &v)) continue;
+				best = dist;
+				hit->face = t->face;
+				hit->distance = dist;
+				hit->u = u;
+				hit->v = v;
+				if (any) return 1;
+				}
+			}
+		else
+			{
+			float t0 = box_entry(&nodes[n->first], o, inv, best);
+			float t1 = box_entry(&nodes[n->first+1], o, inv, best);
+
+			if (t0 < 1e30f && t1 < 1e30f)
+				{
+				/* Nearest first, the other one waits, at most one a level */
+				int near = t0 <= t1 ? n->first : n->first+1;
+				stack[sp] = near == n->first ? n->first+1 : n->first;
+				stack_t[sp++] = t0 <= t1 ? t1 : t0;
+				node = near;
+				continue;
+				}
+			if (t0 < 1e30f) { node = n->first; continue; }
+			if (t1 < 1e30f) { node = n->first+1; continue; }
+			}
+
+		/* Pop, skipping boxes that are now behind the nearest hit */
+		while (sp && stack_t[sp-1] > best) sp--;
+		if (!sp) break;
+		node = stack[--sp];
+		}
+
+	return hit->face >= 0;
+	}
+
+/***
+Nearest face along the ray. Returns 1 and fills hit if one is
+closer than max_distance.
+***/
+int
+bvhRaycast(struct bvh *bvh, float origin[3], float dir[3], float max_distance, struct bvh_hit *hit)
+	{
+	return traverse(bvh, origin, dir, max_distance, hit, 0);
+	}
+
+/* Nothing in the way between the two points */
+int
+bvhVisible(struct bvh *bvh, float from[3], float to[3])
+	{
+	float d[3] = {to[0]-from[0], to[1]-from[1], to[2]-from[2]};
+	float len = sqrtf(d[0]*d[0] + d[1]*d[1] + d[2]*d[2]);
+	struct bvh_hit hit;
+
+	if (len <= BVH_EPSILON) return 1;
+	d[0] /= len;
+	d[1] /= len;
+	d[2] /= len;
+
+	return !traverse(bvh, from, d, len - BVH_EPSILON, &hit, 1);
+	}
+
+/***
+Four rays at once, best when they start close together and
+point roughly the same way. Returns a bit per ray that hit.
+***/
+int
+bvhRaycast4(struct bvh *bvh, float origins[4][3], float dirs[4][3], float max_distance, struct bvh_hit hits[4])
+	{
+#ifdef __SSE2__
+	struct bvh_node *nodes = bvh->nodes;
+	__m128 ox = _mm_setr_ps(origins[0][0], origins[1][0], origins[2][0], origins[3][0]);
+	__m128 oy = _mm_setr_ps(origins[0][1], origins[1][1], origins[2][1], origins[3][1]);
+	__m128 oz = _mm_setr_ps(origins[0][2], origins[1][2], origins[2][2], origins[3][2]);
+	__m128 dx = _mm_setr_ps(dirs[0][0], dirs[1][0], dirs[2][0], dirs[3][0]);
+	__m128 dy = _mm_setr_ps(dirs[0][1], dirs[1][1], dirs[2][1], dirs[3][1]);
+	__m128 dz = _mm_setr_ps(dirs[0][2], dirs[1][2], dirs[2][2], dirs[3][2]);
+	__m128 one = _mm_set1_ps(1);
+	__m128 ix = _mm_div_ps(one, dx), iy = _mm_div_ps(one, dy), iz = _mm_div_ps(one, dz);
+	__m128 zero = _mm_setzero_ps();
+	__m128 eps = _mm_set1_ps(BVH_EPSILON);
+	__m128 det_eps = _mm_set1_ps(1e-8f);
+	__m128 abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+	__m128 best = _mm_set1_ps(max_distance);
+	__m128 best_u = zero, best_v = zero;
+	int faces[4] = {-1, -1, -1, -1};
+	int stack[BVH_STACK];
+	int sp = 0;
+	float best_out[4], u_out[4], v_out[4];
+	int mask = 0;
+	int i;
+
+	if (bvh->n_triangles) stack[sp++] = 0;
+
+	while (sp)
+		{
+		struct bvh_node *n = &nodes[stack[--sp]];
+		__m128 tx0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(n->mins[0]), ox), ix);
+		__m128 tx1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(n->maxs[0]), ox), ix);
+		__m128 ty0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(n->mins[1]), oy), iy);
+		__m128 ty1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(n->maxs[1]), oy), iy);
+		__m128 tz0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(n->mins[2]), oz), iz);
+		__m128 tz1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(n->maxs[2]), oz), iz);
+		__m128 tnear = _mm_max_ps(_mm_max_ps(_mm_min_ps(tx0, tx1), _mm_min_ps(ty0, ty1)),
+			_mm_max_ps(_mm_min_ps(tz0, tz1), zero));
+		__m128 tfar = _mm_min_ps(_mm_min_ps(_mm_max_ps(tx0, tx1), _mm_max_ps(ty0, ty1)),
+			_mm_min_ps(_mm_max_ps(tz0, tz1), best));
+
+		/* Skip when no ray in the packet touches the box */
+		if (!_mm_movemask_ps(_mm_cmple_ps(tnear, tfar))) continue;
+
+		if (n->count > 0)
+			{
+			for (i=n->first; i<n->first+n->count; i++)
+				{
+				struct bvh_triangle *t = &bvh->triangles[i];
+				__m128 e1x = _mm_set1_ps(t->e1[0]), e1y = _mm_set1_ps(t->e1[1]), e1z = _mm_set1_ps(t->e1[2]);
+				__m128 e2x = _mm_set1_ps(t->e2[0]), e2y = _mm_set1_ps(t->e2[1]), e2z = _mm_set1_ps(t->e2[2]);
+				__m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+				__m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+				__m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+				__m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+				__m128 inv = _mm_div_ps(one, det);
+				__m128 sx = _mm_sub_ps(ox, _mm_set1_ps(t->v0[0]));
+				__m128 sy = _mm_sub_ps(oy, _mm_set1_ps(t->v0[1]));
+				__m128 sz = _mm_sub_ps(oz, _mm_set1_ps(t->v0[2]));
+				__m128 u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(sx, px), _mm_mul_ps(sy, py)), _mm_mul_ps(sz, pz)), inv);
+				__m128 qx = _mm_sub_ps(_mm_mul_ps(sy, e1z), _mm_mul_ps(sz, e1y));
+				__m128 qy = _mm_sub_ps(_mm_mul_ps(sz, e1x), _mm_mul_ps(sx, e1z));
+				__m128 qz = _mm_sub_ps(_mm_mul_ps(sx, e1y), _mm_mul_ps(sy, e1x));
+				__m128 v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)), inv);
+				__m128 dist = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), inv);
+				__m128 hit = _mm_cmpge_ps(_mm_and_ps(det, abs_mask), det_eps);
+				int lanes, k;
+
+				hit = _mm_and_ps(hit, _mm_and_ps(_mm_cmpge_ps(u, zero), _mm_cmple_ps(u, one)));
+				hit = _mm_and_ps(hit, _mm_and_ps(_mm_cmpge_ps(v, zero), _mm_cmple_ps(_mm_add_ps(u, v), one)));
+				hit = _mm_and_ps(hit, _mm_and_ps(_mm_cmpgt_ps(dist, eps), _mm_cmplt_ps(dist, best)));
+
+				lanes = _mm_movemask_ps(hit);
+				if (!lanes) continue;
+
+				best = _mm_or_ps(_mm_and_ps(hit, dist), _mm_andnot_ps(hit, best));
+				best_u = _mm_or_ps(_mm_and_ps(hit, u), _mm_andnot_ps(hit, best_u));
+				best_v = _mm_or_ps(_mm_and_ps(hit, v), _mm_andnot_ps(hit, best_v));
+				for (k=0; k<4; k++) if (lanes & (1<<k)) faces[k] = t->face;
+				}
+			}
+		else
+			{
+			/* Near child on top, by the first ray's direction, one more than the depth at most */
+			int axis = -n->count-1;
+			int near_first = dirs[0][axis] >= 0;
+
+			stack[sp++] = near_first ? n->first+1 : n->first;
+			stack[sp++] = near_first ? n->first : n->first+1;
+			}
+		}
+
+	_mm_storeu_ps(best_out, best);
+	_mm_storeu_ps(u_out, best_u);
+	_mm_storeu_ps(v_out, best_v);
+	for (i=0; i<4; i++)
+		{
+		hits[i].face = faces[i];
+		hits[i].distance = best_out[i];
+		hits[i].u = u_out[i];
+		hits[i].v = v_out[i];
+		if (faces[i] >= 0) mask |= 1 << i;
+		}
+
+	return mask;
+#else
+	int mask = 0;
+	int i;
+
+	for (i=0; i<4; i++)
+		if (bvhRaycast(bvh, origins[i], dirs[i], max_distance, &hits[i])) mask |= 1 << i;
+
+	return mask;
+#endif
+	}
+
+/* Rays for the benchmark, four to a packet */
+#define BENCH_PACKETS (1 << 16)
+#define BENCH_DISTANCE (8192.0f)
+
+struct bench_rays {
+	struct bvh *bvh;
+	float (*origins)[4][3];
+	float (*dirs)[4][3];
+	struct bvh_hit (*hits)[4];
+};
+
+static float
+bench_random(unsigned int *seed)
+	{
+	*seed = *seed*1664525u + 1013904223u;
+	return (*seed >> 8)*(1.0f/16777216.0f)*2 - 1;
+	}
+
+static void
+random_direction(unsigned int *seed, float d[3])
+	{
+	float len;
+
+	do
+		{
+		d[0] = bench_random(seed);
+		d[1] = bench_random(seed);
+		d[2] = bench_random(seed);
+		len = d[0]*d[0] + d[1]*d[1] + d[2]*d[2];
+		}
+	while (len > 1 || len < 0.01f);
+
+	len = sqrtf(len);
+	d[0] /= len;
+	d[1] /= len;
+	d[2] /= len;
+	}
+
+static void
+bench_packets(void *ctx, int begin, int end, int thread)
+	{
+	struct bench_rays *r = ctx;
+	int i;
+
+	for (i=begin; i<end; i++)
+		bvhRaycast4(r->bvh, r->origins[i], r->dirs[i], BENCH_DISTANCE, r->hits[i]);
+	}
+
+/***
+Build the BVH on one thread and on n_threads, then time random
+rays from inside the map one at a time, as packets and as
+packets across the threads.
+***/
+int
+bvhBenchmark(struct bsp *bsp, int n_threads)
+	{
+	struct bsp_leaf *leaves = bsp->directory[LEAVES].data;
+	int n_leaves = bsp->directory[LEAVES].length/sizeof(struct bsp_leaf);
+	struct bench_rays rays;
+	struct jobs *jobs;
+	struct bvh *bvh;
+	unsigned int seed = 1;
+	double serial_build, t;
+	long n_hits = 0;
+	int i, j;
+
+	bvh = bvhCreate(bsp, 0);
+	serial_build = bvh->build_time;
+	bvhFree(bvh);
+
+	jobs = jobsCreate(n_threads);
+	bvh = bvhCreate(bsp, jobs);
+	printf("BVH: %i triangles, %i nodes, depth %i\n", bvh->n_triangles, bvh->n_nodes, bvh->depth);
+	printf("BVH: built in %.2f ms on 1 thread, %.2f ms on %i\n",
+		serial_build*1000, bvh->build_time*1000, jobsThreadCount(jobs));
+
+	rays.bvh = bvh;
+	rays.origins = malloc(sizeof(float)*4*3*BENCH_PACKETS);
+	rays.dirs = malloc(sizeof(float)*4*3*BENCH_PACKETS);
+	rays.hits = malloc(sizeof(struct bvh_hit)*4*BENCH_PACKETS);
+
+	/* Each packet starts in one leaf and spreads a little around one direction */
+	for (i=0; i<BENCH_PACKETS; i++)
+		{
+		struct bsp_leaf *leaf;
+		float centre[3], d[3];
+
+		do leaf = &leaves[(int)((bench_random(&seed)*0.5f + 0.5f)*(n_leaves-1))];
+		while (leaf->cluster < 0 && n_leaves > 1);
+
+		centre[0] = (leaf->mins[0]+leaf->maxs[0])*0.5f;
+		centre[1] = (leaf->mins[1]+leaf->maxs[1])*0.5f;
+		centre[2] = (leaf->mins[2]+leaf->maxs[2])*0.5f;
+		random_direction(&seed, d);
+
+		for (j=0; j<4; j++)
+			{
+			float *dir = rays.dirs[i][j];
+			float len;
+
+			memcpy(rays.origins[i][j], centre, sizeof(centre));
+			dir[0] = d[0] + bench_random(&seed)*0.02f;
+			dir[1] = d[1] + bench_random(&seed)*0.02f;
+			dir[2] = d[2] + bench_random(&seed)*0.02f;
+			len = sqrtf(dir[0]*dir[0] + dir[1]*dir[1] + dir[2]*dir[2]);
+			dir[0] /= len;
+			dir[1] /= len;
+			dir[2] /= len;
+			}
+		}
+
+	t = jobsTime();
+	for (i=0; i<BENCH_PACKETS; i++)
+		for (j=0; j<4; j++)
+			n_hits += bvhRaycast(bvh, rays.origins[i][j], rays.dirs[i][j], BENCH_DISTANCE, &rays.hits[i][j]);
+	t = jobsTime() - t;
+	printf("BVH: single rays, 1 thread: %.2f Mrays/s, %.1f%% hit\n",
+		BENCH_PACKETS*4/t*1e-6, 100.0*n_hits/(BENCH_PACKETS*4));
+
+	t = jobsTime();
+	bench_packets(&rays, 0, BENCH_PACKETS, 0);
+	t = jobsTime() - t;
+	printf("BVH: packets of 4, 1 thread: %.2f Mrays/s\n", BENCH_PACKETS*4/t*1e-6);
+
+	t = jobsTime();
+	jobsParallelFor(jobs, BENCH_PACKETS, 256, bench_packets, &rays);
+	t = jobsTime() - t;
+	printf("BVH: packets of 4, %i threads: %.2f Mrays/s\n", jobsThreadCount(jobs), BENCH_PACKETS*4/t*1e-6);
+
+	free(rays.origins);
+	free(rays.dirs);
+	free(rays.hits);
+	bvhFree(bvh);
+	jobsDestroy(jobs);
+
+	return 0;
+	}
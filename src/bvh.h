@@ -0,0 +1,58 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include "bsp.h"
+#include "jobs.h"
+
+/***
+Bounding volume hierarchy over every world triangle, patches
+tessellated, for picking and line of sight.
+Built top down with binned SAH; the top levels are split on
+the calling thread and the subtrees below them on the workers.
+Nodes are 32 bytes and the two children of a node are always
+next to each other, so a node only needs the first one.
+***/
+
+/* Subdivisions per 3x3 patch section, like g_bezier_steps */
+#define BVH_PATCH_STEPS (8)
+
+struct bvh_node {
+	float mins[3];
+	int first; /*first child, or first triangle if a leaf*/
+	float maxs[3];
+	int count; /*triangles if > 0, otherwise -(split axis+1)*/
+};
+
+/* Stored ready for Moller-Trumbore */
+struct bvh_triangle {
+	float v0[3];
+	float e1[3];
+	float e2[3];
+	int face;
+};
+
+struct bvh {
+	struct bvh_node *nodes;
+	int n_nodes;
+	struct bvh_triangle *triangles;
+	int n_triangles;
+	int depth;
+	double build_time;
+};
+
+struct bvh_hit {
+	int face; /*-1 if nothing was hit*/
+	float distance;
+	float u, v; /*barycentrics, the hit is v0 + u*e1 + v*e2*/
+};
+
+struct bvh *bvhCreate(struct bsp *bsp, struct jobs *jobs);
+struct bvh *bvhCreateFaces(struct bsp *bsp, struct jobs *jobs, unsigned char *use_face);
+void bvhFree(struct bvh *bvh);
+/* dir must be unit length, distances are along it */
+int bvhRaycast(struct bvh *bvh, float origin[3], float dir[3], float max_distance, struct bvh_hit *hit);
+int bvhRaycast4(struct bvh *bvh, float origins[4][3], float dirs[4][3], float max_distance, struct bvh_hit hits[4]);
+int bvhVisible(struct bvh *bvh, float from[3], float to[3]);
+int bvhBenchmark(struct bsp *bsp, int n_threads);
+
+#endif /* BVH_H */
@@ -0,0 +1,67 @@
+#include <config.h>
+
+#include <math.h>
+
+#include "vmath.h"
+#include "camera.h"
+
+void
+cameraSetProjection(struct camera *c, float left, float right, float bottom, float top,
+		float znear, float zfar)
+	{
+	mat4Frustum(c->projection, left, right, bottom, top, znear, zfar);
+	}
+
+static void
+axes_from_quat(float q[4], float forward[3], float right[3], float up[3])
+	{
+	float x_axis[3] = {1,0,0};
+	float y_axis[3] = {0,1,0};
+	float z_axis[3] = {0,0,1};
+
+	quatRotate(forward, q, x_axis);
+	quatRotate(right, q, y_axis);
+	vec3Scale(right, right, -1); /*y is left in Quake*/
+	quatRotate(up, q, z_axis);
+	}
+
+void
+cameraAxesFromAngles(float pitch, float yaw, float roll,
+		float forward[3], float right[3], float up[3])
+	{
+	float q[4];
+
+	quatFromAngles(q, pitch, yaw, roll);
+	axes_from_quat(q, forward, right, up);
+	}
+
+/***
+Quake has x forward, y left, z up; GL eye space has x right,
+y up and looks down -z. The rows of the view rotation are the
+camera's right, up and back vectors.
+***/
+void
+cameraUpdate(struct camera *c, float position[3], float pitch, float yaw, float roll)
+	{
+	float *v = c->view;
+	int i;
+
+	for (i=0; i<3; i++) c->position[i] = position[i];
+	quatFromAngles(c->orientation, pitch, yaw, roll);
+	axes_from_quat(c->orientation, c->forward, c->right, c->up);
+
+	for (i=0; i<3; i++)
+		{
+		v[i*4+0] = c->right[i];
+		v[i*4+1] = c->up[i];
+		v[i*4+2] = -c->forward[i];
+		v[i*4+3] = 0;
+		}
+	v[12] = -vec3Dot(c->right, c->position);
+	v[13] = -vec3Dot(c->up, c->position);
+	v[14] = vec3Dot(c->forward, c->position);
+	v[15] = 1;
+
+	mat4Multiply(c->view_projection, c->projection, c->view);
+	frustumFromMatrix(&c->frustum, c->view_projection);
+	}
@@ -0,0 +1,29 @@
+#ifndef CAMERA_H
+#define CAMERA_H
+
+#include "frustum.h"
+
+/***
+Everything the renderer and culling need about the view,
+worked out on the CPU once per frame. Plain data, so other
+threads can cull with it.
+***/
+struct camera {
+	float position[3];
+	float orientation[4]; /*quaternion*/
+	float forward[3]; /*world space axes*/
+	float right[3];
+	float up[3];
+	float view[16];
+	float projection[16];
+	float view_projection[16];
+	struct frustum frustum;
+};
+
+void cameraSetProjection(struct camera *c, float left, float right, float bottom, float top,
+		float znear, float zfar);
+void cameraAxesFromAngles(float pitch, float yaw, float roll,
+		float forward[3], float right[3], float up[3]);
+void cameraUpdate(struct camera *c, float position[3], float pitch, float yaw, float roll);
+
+#endif /* CAMERA_H */
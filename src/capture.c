@@ -0,0 +1,412 @@
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <SDL.h>
+#include <SDL_opengl.h>
+#include <IL/il.h>
+
+#include "error.h"
+#include "jobs.h"
+#include "capture.h"
+
+/* Frames waiting to be written, the render thread blocks past this */
+#define CAPTURE_SLOTS (8)
+#define CAPTURE_WRITERS (2)
+
+#ifndef GL_PIXEL_PACK_BUFFER
+#define GL_PIXEL_PACK_BUFFER (0x88EB)
+#endif
+#ifndef GL_STREAM_READ
+#define GL_STREAM_READ (0x88E1)
+#endif
+#ifndef GL_READ_ONLY
+#define GL_READ_ONLY (0x88B8)
+#endif
+
+enum {SLOT_FREE, SLOT_QUEUED, SLOT_WRITING};
+/* What a read is for, a frame can be both */
+enum {KIND_NONE = 0, KIND_SCREENSHOT = 1, KIND_SEQUENCE = 2};
+
+struct capture_slot {
+	int state;
+	int kind;
+	int number; /*in the sequence*/
+	int shot; /*screenshot number*/
+	int w, h;
+	unsigned char *pixels; /*BGR if in the sequence, RGB otherwise*/
+	int size;
+};
+
+struct capture {
+	pthread_t writers[CAPTURE_WRITERS];
+	pthread_mutex_t lock;
+	pthread_cond_t queued;
+	pthread_cond_t freed;
+	pthread_mutex_t il_lock; /*DevIL has one bound image*/
+	struct capture_slot slots[CAPTURE_SLOTS];
+	int quit;
+
+	/* Read back, two buffers in flight */
+	int have_pbo;
+	unsigned int pbo[2];
+	int pbo_kind[2];
+	int pbo_number[2];
+	int pbo_shot[2];
+	int pbo_w[2], pbo_h[2];
+	int pbo_size[2];
+	int pbo_index;
+
+	PFNGLGENBUFFERSPROC gen_buffers;
+	PFNGLDELETEBUFFERSPROC delete_buffers;
+	PFNGLBINDBUFFERPROC bind_buffer;
+	PFNGLBUFFERDATAPROC buffer_data;
+	PFNGLMAPBUFFERPROC map_buffer;
+	PFNGLUNMAPBUFFERPROC unmap_buffer;
+
+	int screenshot_requested;
+	int continuous;
+	int next_screenshot;
+	int next_frame;
+
+	unsigned long n_written;
+	unsigned long n_stalls;
+	unsigned long n_captured;
+	double render_time; /*seconds spent on the render thread*/
+};
+
+static int
+next_free_number(char *format, int n)
+	{
+	char name[256];
+
+	for (;; n++)
+		{
+		snprintf(name, sizeof(name), format, n);
+		if (access(name, F_OK) != 0) return n;
+		}
+	}
+
+/* Uncompressed, bottom up like GL, so the rows go out as they are */
+static void
+write_tga(char *name, unsigned char *pixels, int w, int h)
+	{
+	unsigned char header[18] = {0};
+	FILE *fp = fopen(name, "wb");
+
+	if (!fp)
+		{
+		printf("Capture: couldn't write %s\n", name);
+		return;
+		}
+
+	header[2] = 2;
+	header[12] = w & 0xff;
+	header[13] = w >> 8;
+	header[14] = h & 0xff;
+	header[15] = h >> 8;
+	header[16] = 24;
+	fwrite(header, 1, sizeof(header), fp);
+	fwrite(pixels, 1, (size_t)w*h*3, fp);
+	fclose(fp);
+	}
+
+static void
+write_slot(struct capture *c, struct capture_slot *s)
+	{
+	char name[256];
+	int i;
+
+	if (s->kind & KIND_SEQUENCE)
+		{
+		snprintf(name, sizeof(name), "frame%06d.tga", s->number);
+		write_tga(name, s->pixels, s->w, s->h);
+
+		/* Back to RGB for DevIL */
+		if (s->kind & KIND_SCREENSHOT)
+			for (i=0; i<s->w*s->h*3; i+=3)
+				{
+				unsigned char b = s->pixels[i];
+				s->pixels[i] = s->pixels[i+2];
+				s->pixels[i+2] = b;
+				}
+		}
+
+	if (s->kind & KIND_SCREENSHOT)
+		{
+		snprintf(name, sizeof(name), "screenshot%04d.png", s->shot);
+		pthread_mutex_lock(&c->il_lock);
+		ilTexImage(s->w, s->h, 1, 3, IL_RGB, IL_UNSIGNED_BYTE, s->pixels);
+		if (ilSaveImage(name)) printf("Screenshot saved to %s\n", name);
+		else printf("Capture: couldn't write %s\n", name);
+		pthread_mutex_unlock(&c->il_lock);
+		}
+	}
+
+static void *
+writer_thread(void *arg)
+	{
+	struct capture *c = arg;
+
+	pthread_mutex_lock(&c->lock);
+	for (;;)
+		{
+		struct capture_slot *s = 0;
+		int i;
+
+		for (i=0; i<CAPTURE_SLOTS && !s; i++)
+			if (c->slots[i].state == SLOT_QUEUED) s = &c->slots[i];
+
+		if (!s)
+			{
+			if (c->quit) break;
+			pthread_cond_wait(&c->queued, &c->lock);
+			continue;
+			}
+
+		s->state = SLOT_WRITING;
+		pthread_mutex_unlock(&c->lock);
+
+		write_slot(c, s);
+
+		pthread_mutex_lock(&c->lock);
+		s->state = SLOT_FREE;
+		c->n_written++;
+		pthread_cond_signal(&c->freed);
+		}
+	pthread_mutex_unlock(&c->lock);
+
+	return 0;
+	}
+
+/* A free slot big enough for the frame, waits for a writer if none */
+static struct capture_slot *
+get_slot(struct capture *c, int size)
+	{
+	struct capture_slot *s = 0;
+	int stalled = 0;
+	int i;
+
+	pthread_mutex_lock(&c->lock);
+	for (;;)
+		{
+		for (i=0; i<CAPTURE_SLOTS && !s; i++)
+			if (c->slots[i].state == SLOT_FREE) s = &c->slots[i];
+		if (s) break;
+		stalled = 1;
+		pthread_cond_wait(&c->freed, &c->lock);
+		}
+	if (stalled) c->n_stalls++;
+	pthread_mutex_unlock(&c->lock);
+
+	if (s->size < size)
+		{
+		s->pixels = realloc(s->pixels, size);
+		s->size = size;
+		}
+
+	return s;
+	}
+
+static void
+queue_slot(struct capture *c, struct capture_slot *s, int kind, int number, int shot, int w, int h)
+	{
+	s->kind = kind;
+	s->number = number;
+	s->shot = shot;
+	s->w = w;
+	s->h = h;
+
+	pthread_mutex_lock(&c->lock);
+	s->state = SLOT_QUEUED;
+	c->n_captured++;
+	pthread_cond_signal(&c->queued);
+	pthread_mutex_unlock(&c->lock);
+	}
+
+struct capture *
+captureCreate(void)
+	{
+	struct capture *c = calloc(1, sizeof(struct capture));
+	int i;
+
+	pthread_mutex_init(&c->lock, 0);
+	pthread_mutex_init(&c->il_lock, 0);
+	pthread_cond_init(&c->queued, 0);
+	pthread_cond_init(&c->freed, 0);
+
+	for (i=0; i<CAPTURE_WRITERS; i++)
+		if (pthread_create(&c->writers[i], 0, writer_thread, c))
+			error(-1, "Failed to start capture thread.");
+
+	/* Pixel buffer objects are GL 2.1, fall back to plain reads */
+	c->gen_buffers = SDL_GL_GetProcAddress("glGenBuffers");
+	c->delete_buffers = SDL_GL_GetProcAddress("glDeleteBuffers");
+	c->bind_buffer = SDL_GL_GetProcAddress("glBindBuffer");
+	c->buffer_data = SDL_GL_GetProcAddress("glBufferData");
+	c->map_buffer = SDL_GL_GetProcAddress("glMapBuffer");
+	c->unmap_buffer = SDL_GL_GetProcAddress("glUnmapBuffer");
+	c->have_pbo = c->gen_buffers && c->delete_buffers && c->bind_buffer
+		&& c->buffer_data && c->map_buffer && c->unmap_buffer;
+	if (c->have_pbo) c->gen_buffers(2, c->pbo);
+
+	c->next_screenshot = next_free_number("screenshot%04d.png", 0);
+	printf("Capture: %s readback, %i writer threads\n",
+		c->have_pbo ? "asynchronous" : "synchronous", CAPTURE_WRITERS);
+
+	return c;
+	}
+
+/* Hand the frame read into pbo i last time to the writers */
+static void
+collect_pbo(struct capture *c, int i)
+	{
+	struct capture_slot *s;
+	void *data;
+
+	if (c->pbo_kind[i] == KIND_NONE) return;
+
+	s = get_slot(c, c->pbo_w[i]*c->pbo_h[i]*3);
+	c->bind_buffer(GL_PIXEL_PACK_BUFFER, c->pbo[i]);
+	data = c->map_buffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+	if (data)
+		{
+		memcpy(s->pixels, data, c->pbo_w[i]*c->pbo_h[i]*3);
+		c->unmap_buffer(GL_PIXEL_PACK_BUFFER);
+		queue_slot(c, s, c->pbo_kind[i], c->pbo_number[i], c->pbo_shot[i], c->pbo_w[i], c->pbo_h[i]);
+		}
+	else
+		{
+		pthread_mutex_lock(&c->lock);
+		s->state = SLOT_FREE;
+		pthread_mutex_unlock(&c->lock);
+		}
+	c->bind_buffer(GL_PIXEL_PACK_BUFFER, 0);
+	c->pbo_kind[i] = KIND_NONE;
+	}
+
+/***
+Call once a frame after drawing, before the swap. Starts a read
+of this frame if one was asked for and passes on the one that
+was started last frame.
+***/
+void
+captureFrame(struct capture *c, int w, int h)
+	{
+	int kind = KIND_NONE;
+	int number = 0, shot = 0;
+	double t = jobsTime();
+
+	if (c->screenshot_requested)
+		{
+		kind |= KIND_SCREENSHOT;
+		shot = c->next_screenshot++;
+		c->screenshot_requested = 0;
+		}
+	if (c->continuous)
+		{
+		kind |= KIND_SEQUENCE;
+		number = c->next_frame++;
+		}
+
+	if (kind == KIND_NONE && !c->pbo_kind[0] && !c->pbo_kind[1]) return;
+
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
+
+	if (!c->have_pbo)
+		{
+		if (kind != KIND_NONE)
+			{
+			struct capture_slot *s = get_slot(c, w*h*3);
+			glReadPixels(0, 0, w, h, (kind & KIND_SEQUENCE) ? GL_BGR : GL_RGB, GL_UNSIGNED_BYTE, s->pixels);
+			queue_slot(c, s, kind, number, shot, w, h);
+			}
+		c->render_time += jobsTime() - t;
+		return;
+		}
+
+	collect_pbo(c, c->pbo_index^1);
+
+	if (kind != KIND_NONE)
+		{
+		int i = c->pbo_index;
+
+		c->bind_buffer(GL_PIXEL_PACK_BUFFER, c->pbo[i]);
+		if (c->pbo_size[i] != w*h*3)
+			{
+			c->buffer_data(GL_PIXEL_PACK_BUFFER, w*h*3, 0, GL_STREAM_READ);
+			c->pbo_size[i] = w*h*3;
+			}
+		/* Returns straight away, the copy finishes while the next frame is drawn */
+		glReadPixels(0, 0, w, h, (kind & KIND_SEQUENCE) ? GL_BGR : GL_RGB, GL_UNSIGNED_BYTE, 0);
+		c->bind_buffer(GL_PIXEL_PACK_BUFFER, 0);
+
+		c->pbo_kind[i] = kind;
+		c->pbo_number[i] = number;
+		c->pbo_shot[i] = shot;
+		c->pbo_w[i] = w;
+		c->pbo_h[i] = h;
+		}
+
+	c->pbo_index ^= 1;
+	c->render_time += jobsTime() - t;
+	}
+
+void
+captureScreenshot(struct capture *c)
+	{
+	c->screenshot_requested = 1;
+	}
+
+void
+captureSetContinuous(struct capture *c, int on)
+	{
+	if (on && !c->continuous)
+		{
+		c->next_frame = next_free_number("frame%06d.tga", c->next_frame);
+		printf("Capture: recording from frame%06d.tga\n", c->next_frame);
+		}
+	else if (!on && c->continuous)
+		printf("Capture: stopped at frame%06d.tga\n", c->next_frame-1);
+	c->continuous = on;
+	}
+
+int
+captureIsContinuous(struct capture *c)
+	{
+	return c->continuous;
+	}
+
+/* Finishes the reads in flight and waits for every file */
+void
+captureDestroy(struct capture *c)
+	{
+	int i;
+
+	if (c->have_pbo)
+		{
+		collect_pbo(c, 0);
+		collect_pbo(c, 1);
+		c->delete_buffers(2, c->pbo);
+		}
+
+	pthread_mutex_lock(&c->lock);
+	c->quit = 1;
+	pthread_cond_broadcast(&c->queued);
+	pthread_mutex_unlock(&c->lock);
+	for (i=0; i<CAPTURE_WRITERS; i++) pthread_join(c->writers[i], 0);
+
+	if (c->n_captured)
+		printf("Capture: %lu frames written, %lu stalls, %.3f ms/frame on the render thread\n",
+			c->n_written, c->n_stalls, 1000.0*c->render_time/c->n_captured);
+
+	for (i=0; i<CAPTURE_SLOTS; i++) free(c->slots[i].pixels);
+	pthread_mutex_destroy(&c->lock);
+	pthread_mutex_destroy(&c->il_lock);
+	pthread_cond_destroy(&c->queued);
+	pthread_cond_destroy(&c->freed);
+	free(c);
+	}
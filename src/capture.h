@@ -0,0 +1,21 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+/***
+Screenshots and frame sequences without stalling the renderer.
+Frames are read back into one of two pixel buffers and picked
+up a frame later, once the copy is done; encoding and writing
+happen on background threads. Screenshots are numbered PNGs,
+continuous capture writes numbered TGAs of every frame.
+***/
+
+struct capture;
+
+struct capture *captureCreate(void);
+void captureDestroy(struct capture *c);
+void captureScreenshot(struct capture *c);
+void captureSetContinuous(struct capture *c, int on);
+int captureIsContinuous(struct capture *c);
+void captureFrame(struct capture *c, int w, int h);
+
+#endif /* CAPTURE_H */
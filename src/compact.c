@@ -0,0 +1,307 @@
+#include <config.h>
+
+#include <math.h>
+
+#include "error.h"
+#include "compact.h"
+
+/***
+Half floats, round to nearest.
+Denormals flush to zero, fine for texture coordinates.
+***/
+unsigned short
+floatToHalf(float f)
+	{
+	union { float f; unsigned int u; } v;
+	unsigned int sign, mantissa;
+	int exponent;
+
+	v.f = f;
+	sign = (v.u >> 16) & 0x8000;
+	exponent = ((v.u >> 23) & 0xff) - 127 + 15;
+	mantissa = v.u & 0x7fffff;
+
+	if (exponent <= 0) return sign;
+	if (exponent >= 31) return sign | 0x7c00;
+
+	mantissa += 0x1000; /*round*/
+	if (mantissa & 0x800000)
+		{
+		mantissa = 0;
+		exponent++;
+		if (exponent >= 31) return sign | 0x7c00;
+		}
+
+	return sign | (exponent << 10) | (mantissa >> 13);
+	}
+
+float
+halfToFloat(unsigned short h)
+	{
+	union { float f; unsigned int u; } v;
+	unsigned int sign = (h & 0x8000) << 16;
+	unsigned int exponent = (h >> 10) & 0x1f;
+	unsigned int mantissa = h & 0x3ff;
+
+	if (exponent == 0) v.u = sign;
+	else if (exponent == 31) v.u = sign | 0x7f800000 | (mantissa << 13);
+	else v.u = sign | ((exponent - 15 + 127) << 23) | (mantissa << 13);
+
+	return v.f;
+	}
+
+/***
+Octahedral normals.
+Cigolle et al., "A Survey of Efficient Representations for
+Independent Unit Vectors", JCGT 2014.
+***/
+static float
+sign_not_zero(float f)
+	{
+	return f < 0 ? -1.0f : 1.0f;
+	}
+
+static void
+oct_encode(float n[3], signed char out[2])
+	{
+	float l1 = fabsf(n[0]) + fabsf(n[1]) + fabsf(n[2]);
+	float x, y;
+
+	if (l1 == 0)
+		{
+		out[0] = out[1] = 0;
+		return;
+		}
+
+	x = n[0]/l1;
+	y = n[1]/l1;
+
+	if (n[2] < 0)
+		{
+		float tx = (1 - fabsf(y)) * sign_not_zero(x);
+		float ty = (1 - fabsf(x)) * sign_not_zero(y);
+		x = tx;
+		y = ty;
+		}
+
+	out[0] = (signed char)roundf(x*127.0f);
+	out[1] = (signed char)roundf(y*127.0f);
+	}
+
+static void
+oct_decode(signed char in[2], float n[3])
+	{
+	float x = in[0]/127.0f;
+	float y = in[1]/127.0f;
+	float z = 1 - fabsf(x) - fabsf(y);
+	float len;
+
+	if (z < 0)
+		{
+		float tx = (1 - fabsf(y)) * sign_not_zero(x);
+		float ty = (1 - fabsf(x)) * sign_not_zero(y);
+		x = tx;
+		y = ty;
+		}
+
+	len = sqrtf(x*x + y*y + z*z);
+	if (len == 0) len = 1;
+	n[0] = x/len;
+	n[1] = y/len;
+	n[2] = z/len;
+	}
+
+void
+compactVerticesDecode(struct compact_vertices *c, struct bsp_cvertex *cv,
+		int box, struct bsp_vertex *out)
+	{
+	struct cvertex_box *b = &c->boxes[box];
+	int k;
+
+	for (k=0; k<3; k++) out->position[k] = b->centre[k] + cv->position[k]*b->scale[k];
+	out->texcoord[0][0] = halfToFloat(cv->texcoord[0]);
+	out->texcoord[0][1] = halfToFloat(cv->texcoord[1]);
+	out->texcoord[1][0] = cv->lm_texcoord[0]/LM_TEXCOORD_SCALE;
+	out->texcoord[1][1] = cv->lm_texcoord[1]/LM_TEXCOORD_SCALE;
+	oct_decode(cv->normal, out->normal);
+	memcpy(out->color, cv->color, 4);
+	}
+
+static short
+quantize(float v, float centre, float scale)
+	{
+	float q = roundf((v - centre)/scale);
+	if (q < -32768) q = -32768;
+	if (q > 32767) q = 32767;
+	return (short)q;
+	}
+
+/***
+Build the compact copy of the VERTEXES lump.
+Each model gets a box fitted to the vertices of its faces,
+so the world and every brush model keep their own precision.
+***/
+struct compact_vertices *
+compactVerticesBuild(struct bsp *bsp)
+	{
+	struct bsp_face *faces = bsp->directory[FACES].data;
+	struct bsp_model *models = bsp->directory[MODELS].data;
+	struct bsp_vertex *vertices = bsp->directory[VERTEXES].data;
+	int n_faces = bsp->directory[FACES].length/sizeof(struct bsp_face);
+	int n_models = bsp->directory[MODELS].length/sizeof(struct bsp_model);
+	struct compact_vertices *c;
+	int *vertex_box;
+	char *lightmapped;
+	float (*mins)[3], (*maxs)[3];
+	int i, j, k;
+
+	c = calloc(1, sizeof(struct compact_vertices));
+	c->n_vertices = bsp->directory[VERTEXES].length/sizeof(struct bsp_vertex);
+	c->vertices = calloc(c->n_vertices, sizeof(struct bsp_cvertex));
+	c->face_box = malloc(sizeof(int)*n_faces);
+	/* Last box catches faces no model claims */
+	c->n_boxes = n_models + 1;
+	c->boxes = malloc(sizeof(struct cvertex_box)*c->n_boxes);
+	mins = malloc(sizeof(float)*3*c->n_boxes);
+	maxs = malloc(sizeof(float)*3*c->n_boxes);
+	vertex_box = malloc(sizeof(int)*c->n_vertices);
+	lightmapped = calloc(c->n_vertices, 1);
+
+	for (i=0; i<n_faces; i++) c->face_box[i] = n_models;
+	for (i=0; i<n_models; i++)
+		{
+		for (j=0; j<models[i].n_faces; j++)
+			{
+			int f = models[i].face + j;
+			if (f >= 0 && f < n_faces) c->face_box[f] = i;
+			}
+		}
+
+	for (i=0; i<c->n_boxes; i++)
+		{
+		for (k=0; k<3; k++)
+			{
+			mins[i][k] = 1e30f;
+			maxs[i][k] = -1e30f;
+			}
+		}
+
+	for (i=0; i<c->n_vertices; i++) vertex_box[i] = n_models;
+	for (i=0; i<n_faces; i++)
+		{
+		int box = c->face_box[i];
+		for (j=0; j<faces[i].n_vertexes; j++)
+			{
+			int v = faces[i].vertex + j;
+			if (v < 0 || v >= c->n_vertices) continue;
+			vertex_box[v] = box;
+			if (faces[i].lm_index >= 0) lightmapped[v] = 1;
+			for (k=0; k<3; k++)
+				{
+				if (vertices[v].position[k] < mins[box][k]) mins[box][k] = vertices[v].position[k];
+				if (vertices[v].position[k] > maxs[box][k]) maxs[box][k] = vertices[v].position[k];
+				}
+			}
+		}
+
+	for (i=0; i<c->n_boxes; i++)
+		{
+		for (k=0; k<3; k++)
+			{
+			float extent = maxs[i][k] - mins[i][k];
+			if (extent < 0) extent = 0, mins[i][k] = maxs[i][k] = 0;
+			c->boxes[i].centre[k] = (mins[i][k] + maxs[i][k]) * 0.5f;
+			c->boxes[i].scale[k] = extent > 0 ? extent/65534.0f : 1.0f;
+			if (extent > 0 && c->boxes[i].scale[k]*0.5f > c->position_bound)
+				c->position_bound = c->boxes[i].scale[k]*0.5f;
+			}
+		}
+
+	/* Quantize and measure the error against the original */
+	for (i=0; i<c->n_vertices; i++)
+		{
+		struct bsp_vertex *v = &vertices[i];
+		struct bsp_cvertex *cv = &c->vertices[i];
+		struct cvertex_box *b = &c->boxes[vertex_box[i]];
+		struct bsp_vertex d;
+		float dot;
+
+		for (k=0; k<3; k++) cv->position[k] = quantize(v->position[k], b->centre[k], b->scale[k]);
+		cv->texcoord[0] = floatToHalf(v->texcoord[0][0]);
+		cv->texcoord[1] = floatToHalf(v->texcoord[0][1]);
+		for (k=0; k<2; k++)
+			{
+			float t = v->texcoord[1][k];
+			if (t < 0) t = 0;
+			if (t > 1) t = 1;
+			cv->lm_texcoord[k] = (short)roundf(t*LM_TEXCOORD_SCALE);
+			}
+		oct_encode(v->normal, cv->normal);
+		memcpy(cv->color, v->color, 4);
+
+		compactVerticesDecode(c, cv, vertex_box[i], &d);
+
+		for (k=0; k<3; k++)
+			{
+			float e = fabsf(d.position[k] - v->position[k]);
+			if (e > c->max_position_error) c->max_position_error = e;
+			}
+		/* Only lightmapped faces sample the lightmap coordinates */
+		for (k=0; k<2 && lightmapped[i]; k++)
+			{
+			float e = fabsf(d.texcoord[1][k] - v->texcoord[1][k]);
+			if (e > c->max_texcoord_error) c->max_texcoord_error = e;
+			}
+
+		dot = d.normal[0]*v->normal[0] + d.normal[1]*v->normal[1] + d.normal[2]*v->normal[2];
+		if (v->normal[0] || v->normal[1] || v->normal[2])
+			{
+			float len = sqrtf(v->normal[0]*v->normal[0] + v->normal[1]*v->normal[1] + v->normal[2]*v->normal[2]);
+			float angle;
+			dot /= len;
+			if (dot > 1) dot = 1;
+			angle = acosf(dot) * (180.0f/M_PI);
+			if (angle > c->max_normal_error) c->max_normal_error = angle;
+			}
+		}
+
+	free(mins);
+	free(maxs);
+	free(vertex_box);
+	free(lightmapped);
+
+	return c;
+	}
+
+/***
+Memory used by vertices and the error introduced.
+Positions must stay within half a quantisation step,
+lightmap coordinates within half a 15 bit step.
+***/
+void
+compactVerticesReport(struct bsp *bsp, struct compact_vertices *c)
+	{
+	unsigned int before = c->n_vertices * sizeof(struct bsp_vertex);
+	unsigned int after = c->n_vertices * sizeof(struct bsp_cvertex)
+		+ c->n_boxes * sizeof(struct cvertex_box);
+	float bound = c->position_bound;
+
+	printf("Compact vertices: %i vertices, %u -> %u bytes (%.1f%%)\n",
+		c->n_vertices, before, after, before ? 100.0f*after/before : 0);
+	printf("	position error %.4f (bound %.4f), lightmap uv error %.6f, normal error %.2f deg\n",
+		c->max_position_error, bound, c->max_texcoord_error, c->max_normal_error);
+
+	if (c->max_position_error > bound*1.001f + 1e-4f
+		|| c->max_texcoord_error > 0.5f/LM_TEXCOORD_SCALE + 1e-6f)
+		printf("	WARNING: compact vertices exceed the error bound\n");
+	}
+
+void
+compactVerticesFree(struct compact_vertices *c)
+	{
+	if (!c) return;
+	free(c->vertices);
+	free(c->boxes);
+	free(c->face_box);
+	free(c);
+	}
@@ -0,0 +1,50 @@
+#ifndef COMPACT_H
+#define COMPACT_H
+
+#include "bsp.h"
+
+/***
+Compact vertex, 20 bytes instead of the 44 of struct bsp_vertex.
+position	16 bit, relative to the box of the model owning the face
+normal		octahedral, 8 bits per component
+texcoord[0]	surface, half float (tiles so can leave 0..1)
+texcoord[1]	lightmap, 0..1 in 15 bits
+***/
+struct bsp_cvertex {
+	short position[3];
+	signed char normal[2];
+	unsigned short texcoord[2];
+	short lm_texcoord[2];
+	unsigned char color[4];
+};
+
+/* Dequantisation is centre + q*scale, for each axis */
+struct cvertex_box {
+	float centre[3];
+	float scale[3];
+};
+
+struct compact_vertices {
+	struct bsp_cvertex *vertices; /*Same order as the VERTEXES lump*/
+	int n_vertices;
+	struct cvertex_box *boxes; /*One per model*/
+	int n_boxes;
+	int *face_box; /*Box index of each face*/
+	float position_bound; /*Half the largest quantisation step*/
+	float max_position_error;
+	float max_normal_error; /*Degrees*/
+	float max_texcoord_error;
+};
+
+#define LM_TEXCOORD_SCALE (32767.0f)
+
+struct compact_vertices *compactVerticesBuild(struct bsp *bsp);
+void compactVerticesDecode(struct compact_vertices *c, struct bsp_cvertex *cv,
+		int box, struct bsp_vertex *out);
+void compactVerticesReport(struct bsp *bsp, struct compact_vertices *c);
+void compactVerticesFree(struct compact_vertices *c);
+
+unsigned short floatToHalf(float f);
+float halfToFloat(unsigned short h);
+
+#endif /* COMPACT_H */
@@ -0,0 +1,370 @@
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <SDL_opengl.h>
+
+#include "error.h"
+#include "dlight.h"
+
+extern int g_bezier_steps;
+
+void
+dlightsCreate(struct dlights *dl, struct bsp *bsp)
+	{
+	struct bsp_face *faces = bsp->directory[FACES].data;
+	struct bsp_vertex *vertices = bsp->directory[VERTEXES].data;
+	int n_faces = bsp->directory[FACES].length/sizeof(struct bsp_face);
+	int i, j, k;
+
+	memset(dl, 0, sizeof(struct dlights));
+	dl->face_bounds = malloc(sizeof(float)*2*3*n_faces);
+	dl->stamps = calloc(n_faces, sizeof(unsigned int));
+
+	/* Patches stay inside their control points, so this covers them too */
+	for (i=0; i<n_faces; i++)
+		{
+		for (k=0; k<3; k++)
+			{
+			dl->face_bounds[i][0][k] = 1e30f;
+			dl->face_bounds[i][1][k] = -1e30f;
+			}
+		for (j=0; j<faces[i].n_vertexes; j++)
+			{
+			float *p = vertices[faces[i].vertex+j].position;
+			for (k=0; k<3; k++)
+				{
+				if (p[k] < dl->face_bounds[i][0][k]) dl->face_bounds[i][0][k] = p[k];
+				if (p[k] > dl->face_bounds[i][1][k]) dl->face_bounds[i][1][k] = p[k];
+				}
+			}
+		}
+	}
+
+void
+dlightsFree(struct dlights *dl)
+	{
+	free(dl->face_bounds);
+	free(dl->stamps);
+	memset(dl, 0, sizeof(struct dlights));
+	}
+
+/* Returns the light's index or -1 when full */
+int
+dlightsAdd(struct dlights *dl, float origin[3], float radius, float color[3])
+	{
+	struct dlight *l;
+
+	if (dl->n_lights >= MAX_DLIGHTS) return -1;
+
+	l = &dl->lights[dl->n_lights];
+	memcpy(l->origin, origin, sizeof(float)*3);
+	memcpy(l->color, color, sizeof(float)*3);
+	l->radius = radius;
+
+	return dl->n_lights++;
+	}
+
+void
+dlightsClear(struct dlights *dl)
+	{
+	dl->n_lights = 0;
+	dl->n_pairs = 0;
+	}
+
+static int
+sphere_touches_box(float centre[3], float radius, float mins[3], float maxs[3])
+	{
+	float d = 0;
+	int k;
+
+	for (k=0; k<3; k++)
+		{
+		float e = 0;
+		if (centre[k] < mins[k]) e = mins[k] - centre[k];
+		else if (centre[k] > maxs[k]) e = centre[k] - maxs[k];
+		d += e*e;
+		}
+
+	return d <= radius*radius;
+	}
+
+static void
+add_pair(struct dlights *dl, int light, int face)
+	{
+	if (dl->n_pairs >= dl->max_pairs)
+		{
+		int old = dl->max_pairs;
+		dl->max_pairs = dl->max_pairs ? dl->max_pairs*2 : 1024;
+		dl->pairs = arenaRealloc(&g_frame_arena, dl->pairs,
+			sizeof(struct dlight_pair)*old, sizeof(struct dlight_pair)*dl->max_pairs);
+		}
+	dl->pairs[dl->n_pairs].light = light;
+	dl->pairs[dl->n_pairs].face = face;
+	dl->n_pairs++;
+	}
+
+/* Take the faces of one leaf the light reaches */
+static void
+light_leaf(struct dlights *dl, struct bsp *bsp, int light, struct bsp_leaf *leaf,
+		unsigned int *visible, unsigned int frame)
+	{
+	struct dlight *l = &dl->lights[light];
+	struct bsp_face *faces = bsp->directory[FACES].data;
+	struct bsp_vertex *vertices = bsp->directory[VERTEXES].data;
+	int *leaffaces = bsp->directory[LEAFFACES].data;
+	int i;
+
+	dl->n_leaves++;
+
+	for (i=0; i<leaf->n_leaffaces; i++)
+		{
+		int face_index = leaffaces[leaf->leafface+i];
+		struct bsp_face *face = &faces[face_index];
+
+		/* Shared between leaves, test once per light */
+		if (dl->stamps[face_index] == dl->stamp) continue;
+		dl->stamps[face_index] = dl->stamp;
+
+		if (visible && visible[face_index] != frame) continue;
+		if (face->type != 1 && face->type != 2 && face->type != 3) continue;
+
+		dl->n_faces_tested++;
+		if (!sphere_touches_box(l->origin, l->radius, dl->face_bounds[face_index][0], dl->face_bounds[face_index][1]))
+			continue;
+
+		/* Planar faces facing away or out of reach */
+		if (face->type == 1)
+			{
+			float *p = vertices[face->vertex].position;
+			float d = (l->origin[0]-p[0])*face->normal[0]
+				+ (l->origin[1]-p[1])*face->normal[1]
+				+ (l->origin[2]-p[2])*face->normal[2];
+			if (d < 0 || d > l->radius) continue;
+			}
+
+		add_pair(dl, light, face_index);
+		}
+	}
+
+/***
+Find the faces every light touches. If visible isn't 0 only
+faces with visible[face] == frame are taken, e.g. the stamps of
+this frame's draw list. Returns the number of light x face pairs.
+The walk keeps at most one node a level, so a stack as long as
+the node count always holds it.
+***/
+int
+dlightsFindFaces(struct dlights *dl, struct bsp *bsp, unsigned int *visible, unsigned int frame)
+	{
+	struct bsp_node *nodes = bsp->directory[NODES].data;
+	struct bsp_plane *planes = bsp->directory[PLANES].data;
+	struct bsp_leaf *leaves = bsp->directory[LEAVES].data;
+	int n_nodes = bsp->directory[NODES].length/sizeof(struct bsp_node);
+	int *stack;
+	int i;
+
+	dl->pairs = 0;
+	dl->n_pairs = 0;
+	dl->max_pairs = 0;
+	dl->n_nodes = 0;
+	dl->n_leaves = 0;
+	dl->n_faces_tested = 0;
+	if (!dl->n_lights) return 0;
+
+	stack = arenaAlloc(&g_frame_arena, sizeof(int)*(n_nodes+1));
+
+	for (i=0; i<dl->n_lights; i++)
+		{
+		struct dlight *l = &dl->lights[i];
+		int n_stack = 0;
+
+		if (++dl->stamp == 0)
+			{
+			memset(dl->stamps, 0, sizeof(unsigned int)*(bsp->directory[FACES].length/sizeof(struct bsp_face)));
+			dl->stamp = 1;
+			}
+
+		stack[n_stack++] = 0;
+		while (n_stack)
+			{
+			int node_index = stack[--n_stack];
+
+			while (node_index >= 0)
+				{
+				struct bsp_node *node = &nodes[node_index];
+				struct bsp_plane *plane = &planes[node->plane];
+				float d = plane->normal[0]*l->origin[0] + plane->normal[1]*l->origin[1]
+					+ plane->normal[2]*l->origin[2] - plane->dist;
+
+				dl->n_nodes++;
+				if (d > l->radius) node_index = node->children[0];
+				else if (d < -l->radius) node_index = node->children[1];
+				else
+					{
+					/* Straddles the plane, come back for the back side */
+					stack[n_stack++] = node->children[1];
+					node_index = node->children[0];
+					}
+				}
+
+			light_leaf(dl, bsp, i, &leaves[-(node_index+1)], visible, frame);
+			}
+		}
+
+	return dl->n_pairs;
+	}
+
+static float *
+reserve_vertices(struct dlights *dl, int n)
+	{
+	float *v;
+
+	if (dl->n_vertices + n > dl->max_vertices)
+		{
+		int old = dl->max_vertices;
+		while (dl->n_vertices + n > dl->max_vertices)
+			dl->max_vertices = dl->max_vertices ? dl->max_vertices*2 : 4096;
+		dl->vertices = arenaRealloc(&g_frame_arena, dl->vertices,
+			sizeof(float)*6*old, sizeof(float)*6*dl->max_vertices);
+		}
+
+	v = &dl->vertices[dl->n_vertices*6];
+	dl->n_vertices += n;
+
+	return v;
+	}
+
+/* One vertex of the pass, linear falloff and lambert */
+static void
+light_vertex(struct dlight *l, float p[3], float n[3], float *out)
+	{
+	float d[3] = {l->origin[0]-p[0], l->origin[1]-p[1], l->origin[2]-p[2]};
+	float dist = sqrtf(d[0]*d[0] + d[1]*d[1] + d[2]*d[2]);
+	float scale = 0;
+
+	if (dist < l->radius)
+		{
+		float lambert = 1;
+		if (dist > 0.001f) lambert = (d[0]*n[0] + d[1]*n[1] + d[2]*n[2])/dist;
+		if (lambert > 0) scale = (1 - dist/l->radius)*lambert;
+		}
+
+	out[0] = p[0];
+	out[1] = p[1];
+	out[2] = p[2];
+	out[3] = l->color[0]*scale;
+	out[4] = l->color[1]*scale;
+	out[5] = l->color[2]*scale;
+	}
+
+static void
+light_triangle(struct dlight *l, float *a, float *b, float *c, float *out)
+	{
+	float e0[3] = {b[0]-a[0], b[1]-a[1], b[2]-a[2]};
+	float e1[3] = {c[0]-a[0], c[1]-a[1], c[2]-a[2]};
+	float n[3] = {e0[1]*e1[2]-e0[2]*e1[1], e0[2]*e1[0]-e0[0]*e1[2], e0[0]*e1[1]-e0[1]*e1[0]};
+	float len = sqrtf(n[0]*n[0] + n[1]*n[1] + n[2]*n[2]);
+
+	/* Front faces are clockwise, the cross product points out the back */
+	if (len > 0) { n[0] /= -len; n[1] /= -len; n[2] /= -len; }
+	light_vertex(l, a, n, out);
+	light_vertex(l, b, n, out+6);
+	light_vertex(l, c, n, out+12);
+	}
+
+/* Same tessellation as drawPatch so the depths match */
+static void
+light_patch(struct dlights *dl, struct dlight *l, struct bsp_face *face, struct bsp_vertex *verts)
+	{
+	int w = face->size[0];
+	int pw = (w-1)/2;
+	int ph = (face->size[1]-1)/2;
+	int steps = g_bezier_steps;
+	float step_size = 1.0f/steps;
+	float patch[3][3][5];
+	int i, j;
+
+	for (i=0; i<pw*ph; i++)
+		{
+		bspPatchControlPoints(face, verts, i, patch);
+
+		for (j=0; j<steps*steps; j++)
+			{
+			float fx = (j%steps) * step_size;
+			float fy = (j/steps) * step_size;
+			float p00[5] = {0}, p10[5] = {0}, p11[5] = {0}, p01[5] = {0};
+			float *out = reserve_vertices(dl, 6);
+
+			get_point_on_patch(patch, fx, fy, p00);
+			get_point_on_patch(patch, fx+step_size, fy, p10);
+			get_point_on_patch(patch, fx+step_size, fy+step_size, p11);
+			get_point_on_patch(patch, fx, fy+step_size, p01);
+
+			light_triangle(l, p00, p01, p10, out);
+			light_triangle(l, p10, p01, p11, out+18);
+			}
+		}
+	}
+
+/***
+Draw every light x face pair in one additive pass, on top of
+the world already in the depth buffer.
+***/
+void
+dlightsDraw(struct dlights *dl, struct bsp *bsp)
+	{
+	struct bsp_face *faces = bsp->directory[FACES].data;
+	struct bsp_vertex *vertices = bsp->directory[VERTEXES].data;
+	int *meshverts = bsp->directory[MESHVERTS].data;
+	float *out;
+	int i, j;
+
+	if (!dl->n_pairs) return;
+
+	dl->vertices = 0;
+	dl->n_vertices = 0;
+	dl->max_vertices = 0;
+	for (i=0; i<dl->n_pairs; i++)
+		{
+		struct dlight *l = &dl->lights[dl->pairs[i].light];
+		struct bsp_face *face = &faces[dl->pairs[i].face];
+		struct bsp_vertex *base = &vertices[face->vertex];
+
+		if (face->type == 2)
+			{
+			light_patch(dl, l, face, base);
+			continue;
+			}
+
+		out = reserve_vertices(dl, face->n_meshverts);
+		for (j=0; j<face->n_meshverts; j++)
+			{
+			struct bsp_vertex *v = &base[meshverts[face->meshvert+j]];
+			light_vertex(l, v->position, v->normal, out + j*6);
+			}
+		}
+
+	glPushAttrib(GL_ENABLE_BIT | GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT | GL_POLYGON_BIT);
+	glDisable(GL_TEXTURE_2D);
+	glEnable(GL_BLEND);
+	glBlendFunc(GL_ONE, GL_ONE);
+	glDepthMask(GL_FALSE);
+	glDepthFunc(GL_LEQUAL);
+	/* The compact vertices don't land on exactly the same depths */
+	glEnable(GL_POLYGON_OFFSET_FILL);
+	glPolygonOffset(-1, -1);
+
+	glEnableClientState(GL_VERTEX_ARRAY);
+	glEnableClientState(GL_COLOR_ARRAY);
+	glVertexPointer(3, GL_FLOAT, sizeof(float)*6, dl->vertices);
+	glColorPointer(3, GL_FLOAT, sizeof(float)*6, dl->vertices+3);
+	glDrawArrays(GL_TRIANGLES, 0, dl->n_vertices);
+	glDisableClientState(GL_COLOR_ARRAY);
+	glDisableClientState(GL_VERTEX_ARRAY);
+
+	glPopAttrib();
+	glColor3f(1,1,1);
+	}
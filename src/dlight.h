@@ -0,0 +1,57 @@
+#ifndef DLIGHT_H
+#define DLIGHT_H
+
+#include "bsp.h"
+
+/***
+Dynamic point lights.
+Each light's sphere is pushed down the NODES tree so only the
+leaves it reaches are looked at, and only faces whose bounds it
+touches get lit. All light x face pairs go out in one additive
+pass on top of the lightmapped world.
+***/
+
+#define MAX_DLIGHTS (256)
+
+struct dlight {
+	float origin[3];
+	float radius;
+	float color[3]; /*0..1, added to the lightmap*/
+};
+
+struct dlight_pair {
+	int light;
+	int face;
+};
+
+struct dlights {
+	struct dlight lights[MAX_DLIGHTS];
+	int n_lights;
+
+	float (*face_bounds)[2][3]; /*per face, 0 = mins 1 = maxs*/
+	unsigned int *stamps; /*per face, last light that took it*/
+	unsigned int stamp;
+
+	/* Both in g_frame_arena, good until it is reset */
+	struct dlight_pair *pairs; /*the faces each light touches*/
+	int n_pairs;
+	int max_pairs;
+
+	float *vertices; /*x y z r g b per vertex for the pass*/
+	int n_vertices;
+	int max_vertices;
+
+	/* This frame */
+	int n_nodes;
+	int n_leaves;
+	int n_faces_tested;
+};
+
+void dlightsCreate(struct dlights *dl, struct bsp *bsp);
+void dlightsFree(struct dlights *dl);
+int dlightsAdd(struct dlights *dl, float origin[3], float radius, float color[3]);
+void dlightsClear(struct dlights *dl);
+int dlightsFindFaces(struct dlights *dl, struct bsp *bsp, unsigned int *visible, unsigned int frame);
+void dlightsDraw(struct dlights *dl, struct bsp *bsp);
+
+#endif /* DLIGHT_H */
@@ -0,0 +1,532 @@
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+
+#include "error.h"
+#include "drawlist.h"
+#include "camera.h"
+
+/* Enough leaves per job to pay for the hand off */
+#define LEAF_GRAIN (64)
+/* How far behind its plane the eye has to be, against rounding */
+#define BACKFACE_EPSILON (0.125f)
+/* Fewer faces than this are tested on the calling thread */
+#define FACE_TEST_GRAIN (4096)
+/* Radius of a face the frustum test can't go by */
+#define NO_BOUNDS (1e30f)
+
+enum {FACE_KEPT, FACE_BACKFACING, FACE_OUTSIDE};
+
+struct drawlist_job {
+	struct drawlist *dl;
+	struct bsp *bsp;
+	struct drawlist_view *view;
+};
+
+/***
+The plane is the face's own with its distance from the first
+vertex, turned round for a face only seen from behind and left as
+0 0 0 1, always in front, when it mustn't be tested. The sphere is
+around the centre of the vertices' box; a patch lies within its
+control points.
+***/
+static void
+set_face(struct drawlist_face *r, struct bsp *bsp, int face_index, int test)
+	{
+	struct bsp_face *face = &((struct bsp_face *)bsp->directory[FACES].data)[face_index];
+	struct bsp_vertex *vertices = bsp->directory[VERTEXES].data;
+	int n_vertices = bsp->directory[VERTEXES].length/sizeof(struct bsp_vertex);
+	float mins[3] = {1e30f, 1e30f, 1e30f}, maxs[3] = {-1e30f, -1e30f, -1e30f};
+	float radius2 = 0;
+	int i, k;
+
+	memset(r->plane, 0, sizeof(r->plane));
+	r->plane[3] = 1;
+	r->centre[0] = r->centre[1] = r->centre[2] = 0;
+	r->radius = NO_BOUNDS;
+
+	if (face->type == 4 || face->n_vertexes <= 0 || face->vertex < 0 || face->vertex + face->n_vertexes > n_vertices)
+		test = FACE_TEST_NONE;
+	if (face->type != 1 && (test == FACE_TEST_FRONT || test == FACE_TEST_BACK)) test = FACE_TEST_BOUNDS;
+	if (test == FACE_TEST_NONE) return;
+
+	for (i=0; i<face->n_vertexes; i++)
+		for (k=0; k<3; k++)
+			{
+			float x = vertices[face->vertex + i].position[k];
+			if (x < mins[k]) mins[k] = x;
+			if (x > maxs[k]) maxs[k] = x;
+			}
+	for (k=0; k<3; k++) r->centre[k] = (mins[k] + maxs[k])*0.5f;
+	for (i=0; i<face->n_vertexes; i++)
+		{
+		float *v = vertices[face->vertex + i].position;
+		float d2 = 0;
+
+		for (k=0; k<3; k++) d2 += (v[k] - r->centre[k])*(v[k] - r->centre[k]);
+		if (d2 > radius2) radius2 = d2;
+		}
+	/* A little over, the test is on floats */
+	r->radius = sqrtf(radius2)*1.001f + 0.01f;
+
+	if (test == FACE_TEST_FRONT || test == FACE_TEST_BACK)
+		{
+		float *v = vertices[face->vertex].position;
+		float sign = test == FACE_TEST_FRONT ? 1 : -1;
+
+		for (k=0; k<3; k++) r->plane[k] = face->normal[k]*sign;
+		r->plane[3] = -(face->normal[0]*v[0] + face->normal[1]*v[1] + face->normal[2]*v[2])*sign;
+		}
+	}
+
+void
+drawlistCreate(struct drawlist *dl, struct bsp *bsp, int n_threads)
+	{
+	int n_lightmaps = bsp->directory[LIGHTMAPS].length/(128*128*3);
+	int i;
+
+	dl->n_threads = n_threads;
+	dl->threads = calloc(n_threads, sizeof(struct drawlist_thread));
+	dl->n_total_faces = bsp->directory[FACES].length/sizeof(struct bsp_face);
+
+	for (i=0; i<n_threads; i++)
+		{
+		dl->threads[i].capacity = 1024;
+		dl->threads[i].faces = malloc(sizeof(int)*dl->threads[i].capacity);
+		}
+
+	dl->stamps = calloc(dl->n_total_faces, sizeof(unsigned int));
+	dl->frame = 0;
+	dl->faces = malloc(sizeof(int)*(dl->n_total_faces+1));
+	dl->n_faces = 0;
+	dl->n_buckets = n_lightmaps+1;
+	dl->buckets = calloc(dl->n_buckets+1, sizeof(int));
+	dl->bucket_fill = calloc(dl->n_buckets, sizeof(int));
+	dl->face_bucket = malloc(sizeof(int)*(dl->n_total_faces+1));
+	for (i=0; i<dl->n_total_faces; i++)
+		{
+		int bucket = ((struct bsp_face *)bsp->directory[FACES].data)[i].lm_index+1;
+
+		if (bucket < 0 || bucket >= dl->n_buckets) bucket = 0;
+		dl->face_bucket[i] = bucket;
+		}
+
+	/* Planar faces are one sided unless drawlistSetFaceTests says */
+	dl->face_table = malloc(sizeof(struct drawlist_face)*(dl->n_total_faces+1));
+	for (i=0; i<dl->n_total_faces; i++) set_face(&dl->face_table[i], bsp, i, FACE_TEST_FRONT);
+	dl->n_leaves = 0;
+	dl->n_backfacing = dl->n_outside = 0;
+	dl->cull_time = dl->merge_time = dl->test_time = 0;
+	}
+
+void
+drawlistFree(struct drawlist *dl)
+	{
+	int i;
+
+	for (i=0; i<dl->n_threads; i++) free(dl->threads[i].faces);
+	free(dl->threads);
+	free(dl->stamps);
+	free(dl->faces);
+	free(dl->buckets);
+	free(dl->bucket_fill);
+	free(dl->face_bucket);
+	free(dl->face_table);
+	memset(dl, 0, sizeof(struct drawlist));
+	}
+
+/* Group the faces some other way, e.g. by shader, see shadersBindMap */
+void
+drawlistSetBuckets(struct drawlist *dl, int *face_bucket, int n_buckets)
+	{
+	memcpy(dl->face_bucket, face_bucket, sizeof(int)*dl->n_total_faces);
+	dl->n_buckets = n_buckets;
+	dl->buckets = realloc(dl->buckets, sizeof(int)*(n_buckets+1));
+	dl->bucket_fill = realloc(dl->bucket_fill, sizeof(int)*(n_buckets+1));
+	}
+
+void
+drawlistSetFaceTests(struct drawlist *dl, struct bsp *bsp, int *face_test)
+	{
+	int i;
+
+	for (i=0; i<dl->n_total_faces; i++) set_face(&dl->face_table[i], bsp, i, face_test[i]);
+	}
+
+/* Runs on the workers, only touches its own thread list */
+static void
+cull_leaves(void *ctx, int begin, int end, int thread)
+	{
+	struct drawlist_job *job = ctx;
+	struct drawlist_thread *t = &job->dl->threads[thread];
+	struct drawlist_view *view = job->view;
+	struct bsp_leaf *leaves = job->bsp->directory[LEAVES].data;
+	int *leaffaces = job->bsp->directory[LEAFFACES].data;
+	void *visdata = job->bsp->directory[VISDATA].data;
+	int i, j;
+
+	for (i=begin; i<end; i++)
+		{
+		struct bsp_leaf *leaf = &leaves[i];
+
+		if (leaf->cluster < 0) continue;
+		if (view->cluster != -1 && !clusterIsVisible(view->cluster, leaf->cluster, visdata)) continue;
+		if (view->areas && !areaIsReachable(view->areas, leaf->area))
+			{
+			t->n_area_culled++;
+			continue;
+			}
+		if (view->frustum)
+			{
+			float mins[3] = {leaf->mins[0], leaf->mins[1], leaf->mins[2]};
+			float maxs[3] = {leaf->maxs[0], leaf->maxs[1], leaf->maxs[2]};
+			if (frustumCullBox(view->frustum, mins, maxs)) continue;
+			}
+
+		if (t->n_faces + leaf->n_leaffaces > t->capacity)
+			{
+			while (t->n_faces + leaf->n_leaffaces > t->capacity) t->capacity *= 2;
+			t->faces = realloc(t->faces, sizeof(int)*t->capacity);
+			}
+
+		for (j=0; j<leaf->n_leaffaces; j++)
+			t->faces[t->n_faces++] = leaffaces[leaf->leafface+j];
+		t->n_leaves++;
+		}
+	}
+
+static int
+test_face(struct drawlist_face *r, float eye[3], struct frustum *frustum)
+	{
+	int i;
+
+	if (((r->plane[0]*eye[0] + r->plane[1]*eye[1]) + r->plane[2]*eye[2]) + r->plane[3] < -BACKFACE_EPSILON)
+		return FACE_BACKFACING;
+	if (frustum)
+		for (i=0; i<6; i++)
+			{
+			float *p = frustum->planes[i];
+			if (((p[0]*r->centre[0] + p[1]*r->centre[1]) + p[2]*r->centre[2]) + p[3] < -r->radius)
+				return FACE_OUTSIDE;
+			}
+
+	return FACE_KEPT;
+	}
+
+/***
+Keeps the faces of a list that pass, in order. Four records at a
+time are transposed into a register per plane component and one
+per sphere component, then tested side by side; the scalar tail
+does the same sums in the same order. A face that is dropped gets
+its stamp back, so later users of the stamps, e.g. the dynamic
+lights, skip it too.
+***/
+static void
+test_list(struct drawlist *dl, struct drawlist_thread *t, struct drawlist_view *view)
+	{
+	struct drawlist_face *table = dl->face_table;
+	float *eye = view->eye;
+	int n = 0;
+	int i = 0, j;
+
+#ifdef __SSE__
+		{
+		__m128 ex = _mm_set1_ps(eye[0]), ey = _mm_set1_ps(eye[1]), ez = _mm_set1_ps(eye[2]);
+		__m128 epsilon = _mm_set1_ps(-BACKFACE_EPSILON);
+		__m128 planes[6][4];
+		int n_planes = view->frustum ? 6 : 0;
+
+		for (j=0; j<n_planes; j++)
+			{
+			planes[j][0] = _mm_set1_ps(view->frustum->planes[j][0]);
+			planes[j][1] = _mm_set1_ps(view->frustum->planes[j][1]);
+			planes[j][2] = _mm_set1_ps(view->frustum->planes[j][2]);
+			planes[j][3] = _mm_set1_ps(view->frustum->planes[j][3]);
+			}
+
+		for (; i+4<=t->n_faces; i+=4)
+			{
+			int *f = &t->faces[i];
+			__m128 nx = _mm_loadu_ps(table[f[0]].plane), ny = _mm_loadu_ps(table[f[1]].plane);
+			__m128 nz = _mm_loadu_ps(table[f[2]].plane), nd = _mm_loadu_ps(table[f[3]].plane);
+			__m128 cx = _mm_loadu_ps(table[f[0]].centre), cy = _mm_loadu_ps(table[f[1]].centre);
+			__m128 cz = _mm_loadu_ps(table[f[2]].centre), r = _mm_loadu_ps(table[f[3]].centre);
+			__m128 side, outside = _mm_setzero_ps();
+			int back_mask, outside_mask;
+			int faces[4] = {f[0], f[1], f[2], f[3]};
+
+			/* A face per register until here */
+			_MM_TRANSPOSE4_PS(nx, ny, nz, nd);
+			_MM_TRANSPOSE4_PS(cx, cy, cz, r);
+
+			side = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, ex), _mm_mul_ps(ny, ey)), _mm_mul_ps(nz, ez)), nd);
+			back_mask = _mm_movemask_ps(_mm_cmplt_ps(side, epsilon));
+
+			r = _mm_sub_ps(_mm_setzero_ps(), r);
+			for (j=0; j<n_planes; j++)
+				{
+				__m128 d = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(planes[j][0], cx),
+					_mm_mul_ps(planes[j][1], cy)), _mm_mul_ps(planes[j][2], cz)), planes[j][3]);
+				outside = _mm_or_ps(outside, _mm_cmplt_ps(d, r));
+				}
+			outside_mask = _mm_movemask_ps(outside);
+
+			for (j=0; j<4; j++)
+				{
+				if (back_mask & (1 << j)) t->n_backfacing++;
+				else if (outside_mask & (1 << j)) t->n_outside++;
+				else
+					{
+					t->faces[n++] = faces[j];
+					continue;
+					}
+				dl->stamps[faces[j]] = 0;
+				}
+			}
+		}
+#endif
+	for (; i<t->n_faces; i++)
+		{
+		int face = t->faces[i];
+
+		switch (test_face(&table[face], eye, view->frustum))
+			{
+			case FACE_BACKFACING: t->n_backfacing++; break;
+			case FACE_OUTSIDE: t->n_outside++; break;
+			default: t->faces[n++] = face; continue;
+			}
+		dl->stamps[face] = 0;
+		}
+	t->n_faces = n;
+	}
+
+/* A range of thread lists, after the duplicates are gone */
+static void
+test_lists(void *ctx, int begin, int end, int thread)
+	{
+	struct drawlist_job *job = ctx;
+	int i;
+
+	for (i=begin; i<end; i++) test_list(job->dl, &job->dl->threads[i], job->view);
+	}
+
+/***
+Build the list for one view. Returns the number of faces.
+Faces are shared between leaves, so the same face can turn up
+in several thread lists; the merge keeps the first. The face
+tests then run on the workers, a thread list each, unless there
+are too few faces to be worth handing out.
+***/
+int
+drawlistBuild(struct drawlist *dl, struct jobs *jobs, struct bsp *bsp, struct drawlist_view *view)
+	{
+	int n_leaves = bsp->directory[LEAVES].length/sizeof(struct bsp_leaf);
+	struct drawlist_job job = {dl, bsp, view};
+	int n_threads = jobs ? jobsThreadCount(jobs) : 1;
+	int n_unique = 0, n_merged = 0;
+	double t0, t1, t2;
+	int i, j;
+
+	if (n_threads > dl->n_threads) error(-1, "Draw list has fewer thread lists than the job system.");
+
+	t0 = jobsTime();
+
+	for (i=0; i<dl->n_threads; i++)
+		{
+		dl->threads[i].n_faces = 0;
+		dl->threads[i].n_leaves = 0;
+		dl->threads[i].n_area_culled = 0;
+		dl->threads[i].n_backfacing = 0;
+		dl->threads[i].n_outside = 0;
+		}
+
+	if (jobs) jobsParallelFor(jobs, n_leaves, LEAF_GRAIN, cull_leaves, &job);
+	else cull_leaves(&job, 0, n_leaves, 0);
+
+	t1 = jobsTime();
+
+	/* New frame, zero the stamps when the counter wraps */
+	if (++dl->frame == 0)
+		{
+		memset(dl->stamps, 0, sizeof(unsigned int)*dl->n_total_faces);
+		dl->frame = 1;
+		}
+
+	/* Drop duplicates */
+	dl->n_leaves = 0;
+	dl->n_area_culled = 0;
+	for (i=0; i<dl->n_threads; i++)
+		{
+		struct drawlist_thread *t = &dl->threads[i];
+		int n = 0;
+
+		for (j=0; j<t->n_faces; j++)
+			{
+			int face = t->faces[j];
+
+			if (dl->stamps[face] == dl->frame) continue;
+			dl->stamps[face] = dl->frame;
+			t->faces[n++] = face;
+			}
+		t->n_faces = n;
+		n_merged += n;
+		dl->n_leaves += t->n_leaves;
+		dl->n_area_culled += t->n_area_culled;
+		}
+
+	t2 = jobsTime();
+	if (view->eye)
+		{
+		if (jobs && n_merged >= FACE_TEST_GRAIN) jobsParallelFor(jobs, dl->n_threads, 1, test_lists, &job);
+		else test_lists(&job, 0, dl->n_threads, 0);
+		}
+	dl->test_time = jobsTime() - t2;
+
+	/* Count each bucket */
+	memset(dl->bucket_fill, 0, sizeof(int)*dl->n_buckets);
+	dl->n_backfacing = 0;
+	dl->n_outside = 0;
+	for (i=0; i<dl->n_threads; i++)
+		{
+		struct drawlist_thread *t = &dl->threads[i];
+
+		for (j=0; j<t->n_faces; j++) dl->bucket_fill[dl->face_bucket[t->faces[j]]]++;
+		n_unique += t->n_faces;
+		dl->n_backfacing += t->n_backfacing;
+		dl->n_outside += t->n_outside;
+		}
+
+	/* Counting sort by bucket */
+	dl->buckets[0] = 0;
+	for (i=0; i<dl->n_buckets; i++)
+		{
+		dl->buckets[i+1] = dl->buckets[i] + dl->bucket_fill[i];
+		dl->bucket_fill[i] = dl->buckets[i];
+		}
+
+	for (i=0; i<dl->n_threads; i++)
+		{
+		struct drawlist_thread *t = &dl->threads[i];
+
+		for (j=0; j<t->n_faces; j++)
+			{
+			int face = t->faces[j];
+
+			dl->faces[dl->bucket_fill[dl->face_bucket[face]]++] = face;
+			}
+		}
+
+	dl->n_faces = n_unique;
+	dl->cull_time = t1 - t0;
+	dl->merge_time = jobsTime() - t1;
+
+	return n_unique;
+	}
+
+/* Views used by the benchmark, spread over the whole map */
+#define BENCH_POSITIONS (256)
+#define BENCH_YAWS (4)
+#define BENCH_PASSES (4)
+
+/***
+Build the draw list from the same set of views with 1, 2, 4...
+threads and print the time per list against the thread count.
+***/
+int
+drawlistBenchmark(struct bsp *bsp, struct areas *areas, int max_threads)
+	{
+	struct bsp_leaf *leaves = bsp->directory[LEAVES].data;
+	int n_leaves = bsp->directory[LEAVES].length/sizeof(struct bsp_leaf);
+	float positions[BENCH_POSITIONS][3];
+	int n_positions = 0;
+	struct camera camera = {0};
+	struct drawlist dl = {0};
+	double base_time = 0;
+	int n_threads;
+	int i;
+
+	if (max_threads <= 0) max_threads = jobsCoreCount();
+
+	/* Centres of leaves that can see something */
+	for (i=0; i<n_leaves && n_positions<BENCH_POSITIONS; i++)
+		{
+		struct bsp_leaf *leaf = &leaves[(long)i*7919 % n_leaves];
+
+		if (leaf->cluster < 0 || leaf->n_leaffaces == 0) continue;
+		positions[n_positions][0] = (leaf->mins[0]+leaf->maxs[0])*0.5f;
+		positions[n_positions][1] = (leaf->mins[1]+leaf->maxs[1])*0.5f;
+		positions[n_positions][2] = (leaf->mins[2]+leaf->maxs[2])*0.5f;
+		n_positions++;
+		}
+	if (!n_positions) error(-1, "No leaves to view from.");
+
+	cameraSetProjection(&camera, -1, 1, -0.75, 0.75, 1, 5000);
+	drawlistCreate(&dl, bsp, max_threads);
+
+	printf("Draw list: %i leaves, %i faces, %i views\n", n_leaves, dl.n_total_faces, n_positions*BENCH_YAWS);
+
+	for (n_threads=1; ; n_threads*=2)
+		{
+		struct jobs *jobs;
+		double cull = 0, merge = 0, test = 0, total;
+		long n_faces = 0, n_backfacing = 0, n_outside = 0;
+		int pass, p, y;
+
+		if (n_threads > max_threads) n_threads = max_threads;
+		jobs = jobsCreate(n_threads);
+
+		for (pass=0; pass<BENCH_PASSES; pass++)
+		for (p=0; p<n_positions; p++)
+		for (y=0; y<BENCH_YAWS; y++)
+			{
+			struct drawlist_view view;
+
+			cameraUpdate(&camera, positions[p], 0, y*360.0f/BENCH_YAWS, 0);
+			view.cluster = findCluster(bsp, positions[p][0], positions[p][1], positions[p][2]);
+			view.frustum = &camera.frustum;
+			view.areas = 0;
+			view.eye = positions[p];
+			if (areas)
+				{
+				areasUpdate(areas, leaves[findLeaf(bsp, positions[p][0], positions[p][1], positions[p][2])].area);
+				view.areas = areas;
+				}
+
+			n_faces += drawlistBuild(&dl, jobs, bsp, &view);
+			cull += dl.cull_time;
+			merge += dl.merge_time;
+			test += dl.test_time;
+			n_backfacing += dl.n_backfacing;
+			n_outside += dl.n_outside;
+			}
+
+		total = (cull + merge)/(BENCH_PASSES*n_positions*BENCH_YAWS);
+		if (n_threads == 1) base_time = total;
+
+		printf("Draw list: %2i threads, %7.3f ms per list (cull %.3f, merge %.3f of which face tests %.3f), %.1f faces, %.2fx\n",
+			n_threads, total*1000,
+			cull*1000/(BENCH_PASSES*n_positions*BENCH_YAWS),
+			merge*1000/(BENCH_PASSES*n_positions*BENCH_YAWS),
+			test*1000/(BENCH_PASSES*n_positions*BENCH_YAWS),
+			(double)n_faces/(BENCH_PASSES*n_positions*BENCH_YAWS),
+			base_time/total);
+		if (n_threads == 1)
+			printf("Draw list: face tests took out %.1f back facing and %.1f outside the frustum per list\n",
+				(double)n_backfacing/(BENCH_PASSES*n_positions*BENCH_YAWS),
+				(double)n_outside/(BENCH_PASSES*n_positions*BENCH_YAWS));
+
+		jobsDestroy(jobs);
+		if (n_threads == max_threads) break;
+		}
+
+	drawlistFree(&dl);
+
+	return 0;
+	}
@@ -0,0 +1,88 @@
+#ifndef DRAWLIST_H
+#define DRAWLIST_H
+
+#include "bsp.h"
+#include "frustum.h"
+#include "areas.h"
+#include "jobs.h"
+
+/***
+The set of faces to draw this frame, built off the GL thread.
+Leaves are split across the workers; each fills its own list
+with no locking, then the lists are merged, duplicates dropped
+and the faces bucketed, by lightmap unless drawlistSetBuckets
+says otherwise. Only the submission of the finished list has to
+happen on the GL thread.
+Before bucketing, the face tests drop faces the PVS and the leaf
+boxes let through but that can't be seen: planar faces from
+behind, and faces whose bounding sphere is outside the frustum.
+They go over each worker's list four faces at a time.
+***/
+
+/* What the face tests may assume of a face, see drawlistSetFaceTests */
+enum {
+	FACE_TEST_NONE, /*no plane or bounds to go by, e.g. moved by its shader*/
+	FACE_TEST_BOUNDS, /*two sided, only the frustum test*/
+	FACE_TEST_FRONT, /*planar, only seen from in front (the default)*/
+	FACE_TEST_BACK /*planar, only seen from behind*/
+};
+
+/* A face for the face tests, records of four are loaded and transposed */
+struct drawlist_face {
+	float plane[4]; /*facing folded in, seen when plane.eye + plane[3] >= 0*/
+	float centre[3];
+	float radius; /*of a sphere around the vertices*/
+};
+
+struct drawlist_thread {
+	int *faces;
+	int n_faces;
+	int capacity;
+	int n_leaves;
+	int n_area_culled;
+	int n_backfacing;
+	int n_outside;
+};
+
+struct drawlist {
+	int n_threads;
+	struct drawlist_thread *threads;
+
+	unsigned int *stamps; /*per face, frame it was last added*/
+	unsigned int frame;
+
+	int n_total_faces;
+	int *faces; /*visible faces, grouped by bucket*/
+	int n_faces;
+	int *buckets; /*n_buckets+1 offsets into faces*/
+	int *bucket_fill;
+	int n_buckets;
+	int *face_bucket; /*lightmap+1 unless set, bucket 0 is no lightmap*/
+	struct drawlist_face *face_table;
+
+	int n_leaves; /*leaves that passed every test*/
+	int n_area_culled; /*in the PVS but behind a closed portal*/
+	int n_backfacing; /*faces the face tests took out*/
+	int n_outside;
+	double cull_time; /*seconds, parallel part*/
+	double merge_time;
+	double test_time; /*face tests, part of merge_time*/
+};
+
+/* What a leaf has to pass to be drawn */
+struct drawlist_view {
+	int cluster; /*-1 to skip the PVS*/
+	struct frustum *frustum; /*0 to skip*/
+	struct areas *areas; /*0 to skip*/
+	float *eye; /*0 to skip the face tests*/
+};
+
+void drawlistCreate(struct drawlist *dl, struct bsp *bsp, int n_threads);
+void drawlistFree(struct drawlist *dl);
+void drawlistSetBuckets(struct drawlist *dl, int *face_bucket, int n_buckets);
+/* A FACE_TEST_ per face, e.g. from the shaders, in place of the ones by face type */
+void drawlistSetFaceTests(struct drawlist *dl, struct bsp *bsp, int *face_test);
+int drawlistBuild(struct drawlist *dl, struct jobs *jobs, struct bsp *bsp, struct drawlist_view *view);
+int drawlistBenchmark(struct bsp *bsp, struct areas *areas, int max_threads);
+
+#endif /* DRAWLIST_H */
@@ -0,0 +1,77 @@
+#include <config.h>
+
+#include <math.h>
+
+#include "frustum.h"
+
+/***
+Extract the planes from projection*modelview.
+Gribb & Hartmann, "Fast Extraction of Viewing Frustum Planes
+from the World-View-Projection Matrix".
+***/
+void
+frustumFromMatrix(struct frustum *f, float m[16])
+	{
+	int i;
+
+	for (i=0; i<3; i++)
+		{
+		/* left/bottom/near then right/top/far */
+		f->planes[i*2][0] = m[3] + m[i];
+		f->planes[i*2][1] = m[7] + m[4+i];
+		f->planes[i*2][2] = m[11] + m[8+i];
+		f->planes[i*2][3] = m[15] + m[12+i];
+
+		f->planes[i*2+1][0] = m[3] - m[i];
+		f->planes[i*2+1][1] = m[7] - m[4+i];
+		f->planes[i*2+1][2] = m[11] - m[8+i];
+		f->planes[i*2+1][3] = m[15] - m[12+i];
+		}
+
+	for (i=0; i<6; i++)
+		{
+		float *p = f->planes[i];
+		float len = sqrtf(p[0]*p[0] + p[1]*p[1] + p[2]*p[2]);
+
+		if (len == 0) continue;
+		p[0] /= len;
+		p[1] /= len;
+		p[2] /= len;
+		p[3] /= len;
+		}
+	}
+
+/* Returns 1 if the box is completely outside */
+int
+frustumCullBox(struct frustum *f, float mins[3], float maxs[3])
+	{
+	int i;
+
+	for (i=0; i<6; i++)
+		{
+		float *p = f->planes[i];
+		/* Corner furthest along the plane normal */
+		float x = p[0] > 0 ? maxs[0] : mins[0];
+		float y = p[1] > 0 ? maxs[1] : mins[1];
+		float z = p[2] > 0 ? maxs[2] : mins[2];
+
+		if (p[0]*x + p[1]*y + p[2]*z + p[3] < 0) return 1;
+		}
+
+	return 0;
+	}
+
+/* Returns 1 if the sphere is completely outside */
+int
+frustumCullSphere(struct frustum *f, float c[3], float radius)
+	{
+	int i;
+
+	for (i=0; i<6; i++)
+		{
+		float *p = f->planes[i];
+		if (p[0]*c[0] + p[1]*c[1] + p[2]*c[2] + p[3] < -radius) return 1;
+		}
+
+	return 0;
+	}
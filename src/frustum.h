@@ -0,0 +1,15 @@
+#ifndef FRUSTUM_H
+#define FRUSTUM_H
+
+/* Planes point inwards: a point p is inside when
+	n.p + d >= 0 for all six planes.
+*/
+struct frustum {
+	float planes[6][4];
+};
+
+void frustumFromMatrix(struct frustum *f, float clip[16]);
+int frustumCullBox(struct frustum *f, float mins[3], float maxs[3]);
+int frustumCullSphere(struct frustum *f, float centre[3], float radius);
+
+#endif /* FRUSTUM_H */
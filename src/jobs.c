@@ -0,0 +1,272 @@
+#include <config.h>
+
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "error.h"
+#include "jobs.h"
+
+struct job_range {
+	pthread_mutex_t lock;
+	int begin;
+	int end;
+};
+
+struct jobs;
+
+struct job_worker {
+	struct jobs *jobs;
+	pthread_t thread;
+	int index;
+};
+
+struct jobs {
+	int n_threads;
+	struct job_worker *workers;
+	struct job_range *ranges;
+
+	pthread_mutex_t lock;
+	pthread_cond_t start;
+	pthread_cond_t done;
+	unsigned int generation;
+	int n_running;
+	int quit;
+
+	/* Current parallel for */
+	job_range_fn fn;
+	void *ctx;
+	int grain;
+};
+
+int
+jobsCoreCount(void)
+	{
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	if (n < 1) n = 1;
+	return n;
+	}
+
+/* Seconds on a monotonic clock */
+double
+jobsTime(void)
+	{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec*1e-9;
+	}
+
+/* Take up to grain items from the front of our own range */
+static int
+pop_own(struct job_range *r, int grain, int *begin, int *end)
+	{
+	int ok = 0;
+
+	pthread_mutex_lock(&r->lock);
+	if (r->begin < r->end)
+		{
+		*begin = r->begin;
+		*end = r->begin + grain < r->end ? r->begin + grain : r->end;
+		r->begin = *end;
+		ok = 1;
+		}
+	pthread_mutex_unlock(&r->lock);
+
+	return ok;
+	}
+
+/* Move the back half of the fullest other range into ours */
+static int
+steal(struct jobs *jobs, int self)
+	{
+	int victim = -1;
+	int most = 0;
+	int i;
+
+	for (i=0; i<jobs->n_threads; i++)
+		{
+		int left;
+		if (i == self) continue;
+		left = jobs->ranges[i].end - jobs->ranges[i].begin; /*racy hint only*/
+		if (left > most)
+			{
+			most = left;
+			victim = i;
+			}
+		}
+
+	if (victim < 0) return 0;
+
+		{
+		struct job_range *v = &jobs->ranges[victim];
+		struct job_range *r = &jobs->ranges[self];
+		int begin = 0, end = 0;
+
+		pthread_mutex_lock(&v->lock);
+		if (v->end - v->begin > 0)
+			{
+			int mid = v->begin + (v->end - v->begin)/2;
+			begin = mid;
+			end = v->end;
+			v->end = mid;
+			}
+		pthread_mutex_unlock(&v->lock);
+
+		if (begin == end) return 1; /*lost the race, look again*/
+
+		pthread_mutex_lock(&r->lock);
+		r->begin = begin;
+		r->end = end;
+		pthread_mutex_unlock(&r->lock);
+		}
+
+	return 1;
+	}
+
+static void
+run(struct jobs *jobs, int self)
+	{
+	int begin, end;
+
+	while (1)
+		{
+		if (pop_own(&jobs->ranges[self], jobs->grain, &begin, &end))
+			{
+			jobs->fn(jobs->ctx, begin, end, self);
+			continue;
+			}
+		if (!steal(jobs, self)) break;
+		}
+	}
+
+static void *
+worker_main(void *arg)
+	{
+	struct job_worker *w = arg;
+	struct jobs *jobs = w->jobs;
+	unsigned int generation = 0;
+
+	while (1)
+		{
+		pthread_mutex_lock(&jobs->lock);
+		while (jobs->generation == generation && !jobs->quit)
+			pthread_cond_wait(&jobs->start, &jobs->lock);
+		generation = jobs->generation;
+		if (jobs->quit)
+			{
+			pthread_mutex_unlock(&jobs->lock);
+			break;
+			}
+		pthread_mutex_unlock(&jobs->lock);
+
+		run(jobs, w->index);
+
+		pthread_mutex_lock(&jobs->lock);
+		jobs->n_running--;
+		if (jobs->n_running == 0) pthread_cond_signal(&jobs->done);
+		pthread_mutex_unlock(&jobs->lock);
+		}
+
+	return 0;
+	}
+
+/* n_threads <= 0 uses every core */
+struct jobs *
+jobsCreate(int n_threads)
+	{
+	struct jobs *jobs;
+	int i;
+
+	if (n_threads <= 0) n_threads = jobsCoreCount();
+
+	jobs = calloc(1, sizeof(struct jobs));
+	jobs->n_threads = n_threads;
+	jobs->workers = calloc(n_threads, sizeof(struct job_worker));
+	jobs->ranges = calloc(n_threads, sizeof(struct job_range));
+	pthread_mutex_init(&jobs->lock, 0);
+	pthread_cond_init(&jobs->start, 0);
+	pthread_cond_init(&jobs->done, 0);
+
+	for (i=0; i<n_threads; i++)
+		{
+		pthread_mutex_init(&jobs->ranges[i].lock, 0);
+		jobs->workers[i].jobs = jobs;
+		jobs->workers[i].index = i;
+		}
+
+	/* Thread 0 is whoever calls jobsParallelFor */
+	for (i=1; i<n_threads; i++)
+		{
+		if (pthread_create(&jobs->workers[i].thread, 0, worker_main, &jobs->workers[i]) != 0)
+			error(-1, "Failed to create worker thread.");
+		}
+
+	return jobs;
+	}
+
+void
+jobsDestroy(struct jobs *jobs)
+	{
+	int i;
+
+	if (!jobs) return;
+
+	pthread_mutex_lock(&jobs->lock);
+	jobs->quit = 1;
+	pthread_cond_broadcast(&jobs->start);
+	pthread_mutex_unlock(&jobs->lock);
+
+	for (i=1; i<jobs->n_threads; i++) pthread_join(jobs->workers[i].thread, 0);
+	for (i=0; i<jobs->n_threads; i++) pthread_mutex_destroy(&jobs->ranges[i].lock);
+
+	pthread_mutex_destroy(&jobs->lock);
+	pthread_cond_destroy(&jobs->start);
+	pthread_cond_destroy(&jobs->done);
+	free(jobs->workers);
+	free(jobs->ranges);
+	free(jobs);
+	}
+
+int
+jobsThreadCount(struct jobs *jobs)
+	{
+	return jobs ? jobs->n_threads : 1;
+	}
+
+/* Returns when every item has been processed */
+void
+jobsParallelFor(struct jobs *jobs, int n, int grain, job_range_fn fn, void *ctx)
+	{
+	int i;
+
+	if (n <= 0) return;
+	if (grain < 1) grain = 1;
+
+	if (!jobs || jobs->n_threads == 1 || n <= grain)
+		{
+		fn(ctx, 0, n, 0);
+		return;
+		}
+
+	jobs->fn = fn;
+	jobs->ctx = ctx;
+	jobs->grain = grain;
+
+	for (i=0; i<jobs->n_threads; i++)
+		{
+		jobs->ranges[i].begin = (long)n*i/jobs->n_threads;
+		jobs->ranges[i].end = (long)n*(i+1)/jobs->n_threads;
+		}
+
+	pthread_mutex_lock(&jobs->lock);
+	jobs->n_running = jobs->n_threads - 1;
+	jobs->generation++;
+	pthread_cond_broadcast(&jobs->start);
+	pthread_mutex_unlock(&jobs->lock);
+
+	run(jobs, 0);
+
+	pthread_mutex_lock(&jobs->lock);
+	while (jobs->n_running > 0) pthread_cond_wait(&jobs->done, &jobs->lock);
+	pthread_mutex_unlock(&jobs->lock);
+	}
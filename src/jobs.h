@@ -0,0 +1,25 @@
+#ifndef JOBS_H
+#define JOBS_H
+
+/***
+Worker threads for the offline tools, the loaders and the
+per frame draw list.
+jobsParallelFor splits a range across the workers; a worker that
+runs out steals half of what is left of the busiest one.
+The calling thread works too, as thread 0.
+Not reentrant: don't call jobsParallelFor from inside a job.
+***/
+
+struct jobs;
+
+/* begin..end-1 of the range, thread is 0..jobsThreadCount()-1 */
+typedef void (*job_range_fn)(void *ctx, int begin, int end, int thread);
+
+struct jobs *jobsCreate(int n_threads);
+void jobsDestroy(struct jobs *jobs);
+int jobsThreadCount(struct jobs *jobs);
+void jobsParallelFor(struct jobs *jobs, int n, int grain, job_range_fn fn, void *ctx);
+int jobsCoreCount(void);
+double jobsTime(void);
+
+#endif /* JOBS_H */
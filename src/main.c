@@ -3,20 +3,53 @@
 #include "error.h"
 #include "options/options.h"
 #include "bsp.h"
+#include "camera.h"
+#include "vcache.h"
+#include "compact.h"
+#include "bake/bake.h"
+#include "vfs/vfs.h"
+#include "jobs.h"
+#include "areas.h"
+#include "drawlist.h"
+#include "dlight.h"
+#include "bvh.h"
+#include "capture.h"
+#include "analyze.h"
+#include "reload.h"
+#include "bc1.h"
+#include "shader.h"
+#include "trace.h"
+#include "revis.h"
+#include "navmesh.h"
+#include "stream.h"
+#include "probe.h"
+#include "mipmap.h"
 
 #include <stdio.h>
+#include <math.h>
 #include <SDL.h>
 #include <SDL_opengl.h>
 #include <IL/il.h>
 
 #define SPEED (300.0)
+/* Simulation rate, rendering runs as fast as it is allowed to */
+#define TICK_RATE (120)
+/* Don't try to catch up on more than this after a stall */
+#define MAX_FRAME_TIME (0.25)
+/* Encoded lightmaps, next to entities.txt */
+#define BC1_CACHE_FILE "lightmaps.bc1"
+/* Lightmap mip chains, next to it */
+#define MIPMAP_CACHE_FILE "lightmaps.mip"
 
-char g_usage[] = {PACKAGE_STRING"\nusage:\n	"PACKAGE_NAME" [-b <bsp file name>] [-d <display>]"};
+char g_usage[] = {PACKAGE_STRING"\nusage:\n	"PACKAGE_NAME" [-g <game directory>] [-b <bsp file name>] [-d <display>] [-c] [-v] [-f <fps limit>] [--record <file>] [--replay <file>] [--capture] [--compress] [--stream <MB>] [--mip-filter <box|kaiser|none>]\n	"PACKAGE_NAME" -b <bsp file name> --bake <output bsp> [--entities <file>] [-t <threads>]\n	"PACKAGE_NAME" -b <bsp file name> --bench-drawlist [-t <threads>]\n	"PACKAGE_NAME" -b <bsp file name> --bench-bvh [-t <threads>]\n	"PACKAGE_NAME" -b <bsp file name> --bench-bc1 [-t <threads>]\n	"PACKAGE_NAME" -b <bsp file name> --bench-trace [-t <threads>]\n	"PACKAGE_NAME" -b <bsp file name> --revis <output bsp> [--vis-samples <n>] [-t <threads>]\n	"PACKAGE_NAME" -b <bsp file name> --navmesh <output file> [-t <threads>]\n	"PACKAGE_NAME" -b <bsp file name> --probes <output directory> [--probe-size <pixels>] [-t <threads>]\n	"PACKAGE_NAME" --analyze <directory> [--json] [-t <threads>]\n	"PACKAGE_NAME" --mem-report <directory>"};
 
 unsigned int *g_lm_texture_ids=0;
+struct compact_vertices *g_compact_vertices=0;
 extern int g_bezier_steps;
 SDL_Window *g_window=0;
 unsigned int g_il_image_id=0;
+/* Only set when lightmaps are uploaded as BC1 */
+PFNGLCOMPRESSEDTEXIMAGE2DPROC g_compressed_tex_image_2d=0;
 
 char keys[1024];
 
@@ -69,7 +102,7 @@ setup_sdl(int w, int h, int x, int y)
 	}
 
 int
-setup_opengl(int w, int h, int x, int y)
+setup_opengl(struct camera *camera, int w, int h, int x, int y)
 	{
 	int max_tunits=0;
 	float aspect = (float)h/(float)w;
@@ -77,9 +110,9 @@ setup_opengl(int w, int h, int x, int y)
 	glGetIntegerv(GL_MAX_COMBINED_TEXTURE_IMAGE_UNITS, &max_tunits);
 	printf("Max Texture Units: %i\n", max_tunits);
 
+	cameraSetProjection(camera, -1, 1, -aspect, aspect, 1, 5000);
 	glMatrixMode(GL_PROJECTION);
-	glLoadIdentity();
-	glFrustum(-1, 1, -aspect, aspect, 1, 5000);
+	glLoadMatrixf(camera->projection);
 	glMatrixMode(GL_MODELVIEW);
 
 	glEnable(GL_DEPTH_TEST);
@@ -105,6 +138,51 @@ playerMove(struct player *p, float x, float y, float z, float rx, float ry, floa
 	return 0;
 	}
 
+/* One fixed step of movement */
+void
+playerTick(struct player *p, unsigned int mouse_state, float dt)
+	{
+	float forward[3], right[3], up[3];
+	float move[3] = {0};
+	int k;
+
+	cameraAxesFromAngles(p->rx, p->rz, p->ry, forward, right, up);
+
+	for (k=0; k<3; k++)
+		{
+		if (keys[SDL_SCANCODE_W]) move[k] += forward[k];
+		if (keys[SDL_SCANCODE_S]) move[k] -= forward[k];
+		if (keys[SDL_SCANCODE_A]) move[k] -= right[k];
+		if (keys[SDL_SCANCODE_D]) move[k] += right[k];
+		if (mouse_state & SDL_BUTTON(SDL_BUTTON_MIDDLE)) move[k] -= forward[k];
+		}
+
+	p->x += dt*SPEED*move[0];
+	p->y += dt*SPEED*move[1];
+	p->z += dt*SPEED*move[2];
+	}
+
+/* Angles take the short way round */
+static float
+lerp_angle(float a, float b, float t)
+	{
+	float d = b - a;
+	if (d > 180) d -= 360;
+	if (d < -180) d += 360;
+	return a + d*t;
+	}
+
+void
+playerInterpolate(struct player *out, struct player *a, struct player *b, float t)
+	{
+	out->x = LERP(a->x, b->x, t);
+	out->y = LERP(a->y, b->y, t);
+	out->z = LERP(a->z, b->z, t);
+	out->rx = lerp_angle(a->rx, b->rx, t);
+	out->ry = lerp_angle(a->ry, b->ry, t);
+	out->rz = lerp_angle(a->rz, b->rz, t);
+	}
+
 /* Spawn player at deathmatch spawn point index spawn_dest
 	if index is invalid then loop back to 0th spawn point
 */
@@ -151,8 +229,7 @@ spawnPlayer(struct player* p, struct map *m, int spawn_dest)
 					else printf("angle: none, defaulting to 0\n");
 
 				z+=26; /*Height of the player's eyes?*/
-				/*We have to add 90 degrees for some reason, wrong matrix?*/
-				playerMove(p, x,y,z, 0,0,rz+90);
+				playerMove(p, x,y,z, 0,0,rz);
 				return spawn_dest;
 				}
 			found++;
@@ -190,120 +267,188 @@ setup_icon(SDL_Window *w)
 	SDL_SetWindowIcon(w, surface);
 	}
 
-void 
-take_screenshot(SDL_Window *window)
+/* Room in g_lm_texture_ids for n lightmaps, 0 frees it */
+void
+resize_lightmap_ids(int n)
 	{
-	int w=0,h=0;
-	void *pixels=0;
-	
-	/* Get image of OpenGL display */
-	SDL_GetWindowSize(window, &w, &h);
-	pixels = malloc(w*h*3);
-	glPixelStorei(GL_PACK_ALIGNMENT, 1);
-	glReadPixels(0, 0, w, h, GL_RGB, GL_UNSIGNED_BYTE, pixels);
-
-	/* Use IL to save png */
-  	// w,h,depth(3d image), channels
-	ilTexImage(w, h, 1, 3, IL_RGB, IL_UNSIGNED_BYTE, pixels);
-	ilSaveImage("screenshot.png");
-	printf("Screenshot saved\n");
-
-	/* Free image data */
-	free(pixels);
+	static int n_ids = 0;
+
+	if (n == n_ids) return;
+	if (n == 0)
+		{
+		free(g_lm_texture_ids);
+		g_lm_texture_ids = 0;
+		memAccount(MEM_TEXTURES, -(long)sizeof(unsigned int)*(n_ids+1), -1);
+		}
+	else
+		{
+		g_lm_texture_ids = realloc(g_lm_texture_ids, sizeof(unsigned int)*(n+1));
+		memAccount(MEM_TEXTURES, (long)sizeof(unsigned int)*(n - n_ids + (n_ids ? 0 : 1)), n_ids ? 0 : 1);
+		}
+	n_ids = n;
 	}
 
 /***
-	A = point
-	B = point on the plane
-	P = plane normal
-	dotProduct(A-B, P);
-
-	n = normal
+Load lightmaps into textures, again after a reload. The texture
+names are kept if the count hasn't changed. With a mip cache each
+lightmap gets a full chain, made on the workers or taken from the
+cache, and is sampled trilinearly. With a BC1 cache every level is
+BC1 encoded on the workers first, or taken from the cache.
 ***/
-
-int 
-infrontOfPlane(float n[3], float pos[3], float dist)
+void
+upload_lightmaps(struct bsp *bsp, struct jobs *jobs, struct bc1_cache *cache,
+	struct mipmap_cache *mip_cache, int mip_filter)
 	{
-	float result = (pos[0])*n[0] + (pos[1])*n[1] + (pos[2])*n[2] - dist;
-	if (result > 0) return 1;
-	return 0;
-	}
+	static unsigned int n_uploaded = 0;
+	unsigned int n_lightmaps=0;
+	unsigned char **images = 0, **chains = 0, **blocks = 0, **level_images = 0;
+	long texture_bytes = 0, base_bytes = 0;
+	int n_levels = 1;
+	int i, level, w, h;
 
-int 
-findCluster(struct bsp *bsp, float x, float y, float z)
-	{
-	struct bsp_node* nodes = 0;
-	struct bsp_plane *planes = 0;
-	struct bsp_leaf *leaves = 0;
-	unsigned int n_nodes = 0;
-	struct bsp_node *node = 0;
-	struct bsp_leaf *leaf = 0;
-	float pos[3] = {x,y,z};
+	n_lightmaps = bsp->directory[LIGHTMAPS].length/(128*128*3);
 
-	leaves = bsp->directory[LEAVES].data;
-	planes = bsp->directory[PLANES].data;
-	nodes = bsp->directory[NODES].data;
-	n_nodes = bsp->directory[NODES].length/sizeof(struct bsp_node);
-	node = &nodes[0];
+	if (n_lightmaps != n_uploaded)
+		{
+		if (n_uploaded) glDeleteTextures(n_uploaded, g_lm_texture_ids);
+		resize_lightmap_ids(n_lightmaps);
+		glGenTextures(n_lightmaps, g_lm_texture_ids);		/*Generate*/
+		n_uploaded = n_lightmaps;
+		}
 
-	while(1)
+	printf("Lightmap Count: %u\n", n_lightmaps);
+
+	bspLightenLightmaps(bsp);
+	if (!n_lightmaps) return;
+
+	images = malloc(sizeof(unsigned char *)*n_lightmaps);
+	level_images = malloc(sizeof(unsigned char *)*n_lightmaps);
+	for (i=0; i<n_lightmaps; i++)
+		images[i] = (unsigned char *)bsp->directory[LIGHTMAPS].data + (128*128*3)*i;
+
+	if (mip_cache)
 		{
-		struct bsp_plane *plane = 0;
+		double t = jobsTime();
+		int n_cached;
+
+		chains = malloc(sizeof(unsigned char *)*n_lightmaps);
+		n_cached = mipmapCacheGenerate(mip_cache, jobs, images, n_lightmaps, 128, 128, 3, mip_filter, chains);
+		t = jobsTime() - t;
+		n_levels = mipmapLevels(128, 128);
+		printf("Lightmaps: %s mipmaps, %i levels, %i made and %i from the cache in %.2f ms",
+			mipmapFilterName(mip_filter), n_levels, n_lightmaps - n_cached, n_cached, t*1000);
+		if (n_cached < n_lightmaps) printf(", %.1f Mpixels/s", (n_lightmaps - n_cached)*128*128/1e6/t);
+		printf("\n");
+		if (mipmapCacheSave(mip_cache, MIPMAP_CACHE_FILE) < 0) printf("Failed to write %s\n", MIPMAP_CACHE_FILE);
+		}
 
-		plane = &planes[node->plane];
+	if (cache)
+		{
+		double t = jobsTime();
+		int n_cached = 0;
 
-		if (infrontOfPlane(plane->normal, pos, plane->dist))
+		blocks = malloc(sizeof(unsigned char *)*n_lightmaps*n_levels);
+		for (level=0; level<n_levels; level++)
 			{
-			if (node->children[0] >= 0) 
-				{
-				node = &nodes[node->children[0]];
-				} 
-			else 
-				{
-				leaf = &leaves[-(node->children[0]+1)];
-				break;
-				}
-			} 
-			else 
-				{
-				if (node->children[1] >= 0) 
-					{
-					node = &nodes[node->children[1]];
-					} 
-				else 
-					{
-					leaf = &leaves[-(node->children[1]+1)];
-					break;
-					}
-				}
+			mipmapLevelSize(128, 128, level, &w, &h);
+			for (i=0; i<n_lightmaps; i++)
+				level_images[i] = level ? mipmapLevel(chains[i], 128, 128, 3, level) : images[i];
+			n_cached += bc1CacheEncode(cache, jobs, level_images, n_lightmaps, w, h, blocks + level*n_lightmaps);
+			}
+		printf("Lightmaps: BC1, %i encoded and %i from the cache in %.1f ms\n",
+			n_lightmaps*n_levels - n_cached, n_cached, (jobsTime() - t)*1000);
+		if (bc1CacheSave(cache, BC1_CACHE_FILE) < 0) printf("Failed to write %s\n", BC1_CACHE_FILE);
+		}
+
+	/* Rows of the smallest levels aren't a multiple of 4 bytes */
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	for (i=0; i<n_lightmaps; i++)
+		{
+		glBindTexture(GL_TEXTURE_2D, g_lm_texture_ids[i]); 	/*Bind*/
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, chains ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
+
+		//glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT );
+		//glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT );
+		for (level=0; level<n_levels; level++)
+			{
+			void *data = level ? mipmapLevel(chains[i], 128, 128, 3, level) : images[i];
+			long bytes;
+
+			mipmapLevelSize(128, 128, level, &w, &h);
+			bytes = blocks ? BC1_SIZE(w, h) : w*h*3;
+			if (blocks)
+				g_compressed_tex_image_2d(GL_TEXTURE_2D, level, GL_COMPRESSED_RGB_S3TC_DXT1_EXT, w, h, 0,
+					bytes, blocks[level*n_lightmaps + i]);
+			else
+				glTexImage2D(GL_TEXTURE_2D, level, GL_RGB, w, h, 0, GL_RGB, GL_UNSIGNED_BYTE, data); /*Load data*/
+			texture_bytes += bytes;
+			if (level == 0) base_bytes += bytes;
+			}
 		}
-	return leaf->cluster;
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+
+	printf("Lightmaps: %li KB of textures%s", texture_bytes/1024, blocks ? " (BC1)" : "");
+	if (n_levels > 1)
+		printf(", %li KB of it mip levels (+%.1f%%)", (texture_bytes - base_bytes)/1024,
+			100.0*(texture_bytes - base_bytes)/base_bytes);
+	if (blocks) printf(", %li KB uncompressed", (long)n_lightmaps*(128*128*3 + (chains ? mipmapChainSize(128, 128, 3) : 0))/1024);
+	printf("\n");
+
+	free(images);
+	free(level_images);
+	free(chains);
+	free(blocks);
 	}
 
-int 
-clusterIsVisible(int current_cluster, int test_cluster, void *visdata) 
+/* Buckets first..last-1 of the draw list, each with its shader's state */
+void
+draw_buckets(struct drawlist *dl, struct shaders *shaders, struct bsp *bsp, struct stream *stream, int first, int last)
 	{
-	//	int n_vecs = *((int *)visdata);
-	int sz_vecs = *((int *)(visdata+4));
-	unsigned char *vecs = (unsigned char *)(visdata+8);
+	struct bsp_face *faces = bsp->directory[FACES].data;
+	int b, i;
 
-	if (1<<(current_cluster%8) & vecs[test_cluster*sz_vecs + (current_cluster/8)])
-		return 1;
+	for (b=first; b<last && b<dl->n_buckets; b++)
+		{
+		if (dl->buckets[b] == dl->buckets[b+1]) continue;
+		if (!shadersApply(shaders, shaders->bucket_shader[b])) continue;
 
-	return 0;
+		for (i=dl->buckets[b]; i<dl->buckets[b+1]; i++)
+			if (!stream || !streamDrawFace(stream, dl->faces[i])) drawBspFace(&faces[dl->faces[i]], bsp);
+		}
+	shadersApply(shaders, -1);
 	}
 
-int
-check_file_exists(char *filename)
-{
-	FILE *fp;
+/* Print what is under the crosshair */
+void
+pick_face(struct bvh *bvh, struct bsp *bsp, struct map *map, struct camera *camera)
+	{
+	struct bsp_face *faces = bsp->directory[FACES].data;
+	struct texture *textures = bsp->directory[TEXTURES].data;
+	struct bsp_model *models = bsp->directory[MODELS].data;
+	struct bvh_hit hit;
+	int i;
 
-	fp = fopen(filename, "rb");
-	if (!fp) return 0;
-	fclose(fp);
+	if (!bvhRaycast(bvh, camera->position, camera->forward, 65536, &hit))
+		{
+		printf("Pick: nothing\n");
+		return;
+		}
+
+	printf("Pick: face %i (%s) at %.1f, uv %.2f %.2f\n", hit.face,
+		textures[faces[hit.face].texture].name, hit.distance, hit.u, hit.v);
 
-	return 1;
-}
+	/* Faces of brush models belong to an entity */
+	for (i=0; i<map->n_models; i++)
+		{
+		struct bsp_model *m = &models[map->models[i].model];
+		struct entity_property *prop;
+
+		if (hit.face < m->face || hit.face >= m->face + m->n_faces) continue;
+		prop = entityGetPropertyByName(&map->entities[map->models[i].entity], "classname");
+		printf("Pick: entity %i (%s)\n", map->models[i].entity, prop ? prop->value : "?");
+		}
+	}
 
 int
 main(int argc, char *argv[])
@@ -315,24 +460,66 @@ main(int argc, char *argv[])
 	int quit = 0;
 	struct bsp bsp = {0};
 	struct map map = {0};
+	struct areas areas = {0};
 	char *filename = 0;
 	int i = 0;
 	struct player player={0};
-
-	float identity[16] = 
-		{
-		-1,0,0,0,
-		0,0,1,0,
-		0,1,0,0,
-		0,0,0,1,
-		};	
-	struct option options[3] = {0};
+	struct camera camera = {0};
+	struct option options[28] = {0};
+	int n_threads = 0;
+	struct vfs *vfs = 0;
+	struct vfs_file file;
+	struct jobs *jobs = 0;
+	struct drawlist drawlist = {0};
+	struct dlights dlights;
+	unsigned long dlight_pairs = 0;
+	/* Faces the draw list's face tests took out, over the whole run */
+	struct {unsigned long n_faces, n_backfacing, n_outside; int most;} face_tests = {0};
+	struct bvh *bvh = 0;
+	struct capture *capture = 0;
+	double drawlist_time = 0;
+	struct reload *reload = 0;
+	struct bc1_cache *bc1_cache = 0;
+	struct mipmap_cache *mip_cache = 0;
+	int mip_filter = MIPMAP_BOX;
+	struct shaders *shaders = 0;
+	struct stream *stream = 0;
+	long stream_budget = 0;
+	unsigned int lump_hashes[17];
+	double start_time = jobsTime();
+	double cold_start = 0;
 
 	/* Get command line options */
 	set_option(&options[0], "bsp-file", 'b', 1, 0, 0);
 	set_option(&options[1], "display", 'd', 1, 0, 0);
-
-	options[2].name = NULL;
+	set_option(&options[2], "compact", 'c', 0, 0, 0);
+	set_option(&options[3], "vsync", 'v', 0, 0, 0);
+	set_option(&options[4], "fps", 'f', 1, 0, 0);
+	set_option(&options[5], "record", 0, 1, 0, 0);
+	set_option(&options[6], "replay", 0, 1, 0, 0);
+	set_option(&options[7], "bake", 0, 1, 0, 0);
+	set_option(&options[8], "entities", 0, 1, 0, 0);
+	set_option(&options[9], "threads", 't', 1, 0, 0);
+	set_option(&options[10], "game", 'g', 1, 0, 0);
+
+	set_option(&options[11], "bench-drawlist", 0, 0, 0, 0);
+	set_option(&options[12], "bench-bvh", 0, 0, 0, 0);
+	set_option(&options[13], "capture", 0, 0, 0, 0);
+	set_option(&options[14], "analyze", 0, 1, 0, 0);
+	set_option(&options[15], "json", 0, 0, 0, 0);
+	set_option(&options[16], "compress", 0, 0, 0, 0);
+	set_option(&options[17], "bench-bc1", 0, 0, 0, 0);
+	set_option(&options[18], "bench-trace", 0, 0, 0, 0);
+	set_option(&options[19], "revis", 0, 1, 0, 0);
+	set_option(&options[20], "vis-samples", 0, 1, 0, 0);
+	set_option(&options[21], "navmesh", 0, 1, 0, 0);
+	set_option(&options[22], "stream", 0, 1, 0, 0);
+	set_option(&options[23], "mem-report", 0, 1, 0, 0);
+	set_option(&options[24], "probes", 0, 1, 0, 0);
+	set_option(&options[25], "probe-size", 0, 1, 0, 0);
+	set_option(&options[26], "mip-filter", 0, 1, 0, 0);
+
+	options[27].name = NULL;
 
 	get_options(argc, argv, options);
 
@@ -341,14 +528,81 @@ main(int argc, char *argv[])
 		display_index = atoi(options[1].arg);
 	}
 
+	if (options[9].flag) n_threads = atoi(options[9].arg);
+	if (options[22].flag) stream_budget = atol(options[22].arg)*1024*1024;
+	if (options[26].flag && (mip_filter = mipmapFilterByName(options[26].arg)) < 0)
+		error(-1, "The mip filter is box, kaiser or none.");
+
+	/* Statistics over a whole directory of maps, no bsp file needed */
+	if (options[14].flag) return analyzeMaps(options[14].arg, options[15].flag, n_threads) ? 1 : 0;
+	if (options[23].flag) return analyzeMemory(options[23].arg) ? 1 : 0;
+
 	filename = options[0].arg;
 	if (!filename) {
 		puts(g_usage);
 		return -1;
 	}
-	if (!check_file_exists(filename))
+
+	/* Files come from the game directory and the pk3s in it */
+	vfs = vfsCreate();
+		{
+		char *game = options[10].flag ? options[10].arg : ".";
+		char path[1024];
+		double t = jobsTime();
+		int n_archives = vfsMount(vfs, game);
+
+		if (n_archives < 0) error(-1, "Game directory doesn't exist.");
+		printf("VFS: %s, %i pk3s, %i files, mounted in %.2f ms\n",
+			game, n_archives, vfsEntryCount(vfs), (jobsTime() - t)*1000);
+
+		/* The hash table and the stat of the loose directories apart, one hides the other */
+		t = jobsTime();
+		for (i=0; i<1000; i++) vfsInArchive(vfs, filename);
+		printf("VFS: archive lookup %.2f us", (jobsTime() - t)*1000);
+		t = jobsTime();
+		for (i=0; i<1000; i++) vfsLoosePath(vfs, filename, path, sizeof(path));
+		printf(", loose lookup %.2f us\n", (jobsTime() - t)*1000);
+		}
+
+	if (!vfsExists(vfs, filename))
 		error(-1, "File doesn't exist.");
 
+	if (vfsRead(vfs, filename, &file) != 0) error(-1, "Failed to read bsp file.");
+	if (bspLoadFromMemory(&bsp, file.data, file.length) < 0) error(-1, "Not a version 46 BSP file.");
+	vfsClose(&file);
+	/* Before anything edits the lumps in place */
+	reloadHashLumps(&bsp, lump_hashes);
+
+	/* Offline tools, no window needed */
+	if (options[7].flag)
+		{
+		return bakeLightmaps(&bsp, options[7].arg,
+			options[8].flag ? options[8].arg : 0, n_threads);
+		}
+
+	if (options[19].flag)
+		{
+		return revisMap(&bsp, options[19].arg,
+			options[20].flag ? atoi(options[20].arg) : REVIS_DEFAULT_SAMPLES, n_threads);
+		}
+
+	if (options[21].flag) return navmeshGenerate(&bsp, options[21].arg, n_threads);
+	if (options[24].flag)
+		return probeCapture(&bsp, options[24].arg,
+			options[25].flag ? atoi(options[25].arg) : PROBE_DEFAULT_SIZE, n_threads);
+
+	if (options[11].flag)
+		{
+		bspLoadEntities(&bsp, &map);
+		bspLoadModels(&bsp, &map);
+		areasBuild(&areas, &bsp, &map);
+		return drawlistBenchmark(&bsp, &areas, n_threads);
+		}
+
+	if (options[12].flag) return bvhBenchmark(&bsp, n_threads);
+	if (options[17].flag) return bc1Benchmark(&bsp, n_threads);
+	if (options[18].flag) return traceBenchmark(&bsp, n_threads);
+
 	printf(PACKAGE_STRING"\n");
 
 	if (SDL_Init(SDL_INIT_VIDEO) <0)
@@ -378,51 +632,63 @@ main(int argc, char *argv[])
 	SDL_Rect b_rect;
 	SDL_GetDisplayUsableBounds(display_index, &b_rect);
 	setup_sdl(dm.w, dm.h, b_rect.x, b_rect.y);
-	setup_opengl(dm.w, dm.h, b_rect.x, b_rect.y);
+	setup_opengl(&camera, dm.w, dm.h, b_rect.x, b_rect.y);
 	setup_icon(g_window);
 
-	bspLoad(&bsp, filename);
+		{
+		float acmr_before = 0, acmr_after = 0;
+		int n_tris = bspOptimizeMeshes(&bsp, &acmr_before, &acmr_after);
+		printf("Vertex cache: %i triangles, ACMR %.3f -> %.3f\n", n_tris, acmr_before, acmr_after);
+		}
+
+	if (options[2].flag)
+		{
+		g_compact_vertices = compactVerticesBuild(&bsp);
+		compactVerticesReport(&bsp, g_compact_vertices);
+		}
 
 	FILE *fp_ents = 0;
 	fp_ents = fopen("entities.txt", "wb");
 	fprintf(fp_ents, "%s", bsp.directory[ENTITIES].data);
 	fclose(fp_ents);
 	bspLoadEntities(&bsp, &map);
-
-	int n_faces=0;
-
-	n_faces = bsp.directory[FACES].length/sizeof(struct bsp_face);
-	/*Load lightmaps into textures*/
-
-	unsigned int n_lightmaps=0;
-
-	n_lightmaps = bsp.directory[LIGHTMAPS].length/(128*128*3);
-	g_lm_texture_ids = malloc(sizeof(unsigned int) * n_lightmaps);
-
-	printf("Lightmap Count: %u\n", n_lightmaps);
-	glGenTextures(n_lightmaps, g_lm_texture_ids);		/*Generate*/
-
-	for (i=0; i<bsp.directory[LIGHTMAPS].length / (128*128*3); i++)
+	bspLoadModels(&bsp, &map);
+	areasBuild(&areas, &bsp, &map);
+
+	jobs = jobsCreate(n_threads);
+	drawlistCreate(&drawlist, &bsp, jobsThreadCount(jobs));
+	printf("Draw list: %i threads\n", jobsThreadCount(jobs));
+	shaders = shadersLoad(vfs, jobs);
+	shadersBindMap(shaders, &bsp);
+	drawlistSetBuckets(&drawlist, shaders->face_bucket, shaders->n_buckets);
+	drawlistSetFaceTests(&drawlist, &bsp, shaders->face_test);
+	dlightsCreate(&dlights, &bsp);
+
+	capture = captureCreate();
+	if (options[13].flag) captureSetContinuous(capture, 1);
+
+	bvh = bvhCreate(&bsp, jobs);
+	printf("BVH: %i triangles, %i nodes, built in %.2f ms\n", bvh->n_triangles, bvh->n_nodes, bvh->build_time*1000);
+
+	if (options[16].flag && stream_budget)
+		printf("BC1: not with --stream, lightmaps stay uncompressed\n");
+	else if (options[16].flag)
 		{
-		int j=0;
-		void *data = bsp.directory[LIGHTMAPS].data + (128*128*3)*i;
-		unsigned char* c=data;
-
-		glBindTexture(GL_TEXTURE_2D, g_lm_texture_ids[i]); 	/*Bind*/
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-
-		//glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT );
-		//glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT );
-		/*Lighten*/
-		for (j=0; j<128*128*3;j++)
-			{
-			float i_c = c[j];
-			i_c *= LIGHTEN;
-			if (i_c>255) i_c = 255;
-			c[j] = i_c;
-			}
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, 128, 128, 0, GL_RGB, GL_UNSIGNED_BYTE, data); /*Load data*/
+		g_compressed_tex_image_2d = SDL_GL_GetProcAddress("glCompressedTexImage2D");
+		if (g_compressed_tex_image_2d && SDL_GL_ExtensionSupported("GL_EXT_texture_compression_s3tc"))
+			bc1_cache = bc1CacheLoad(BC1_CACHE_FILE);
+		else printf("BC1: no S3TC support, lightmaps stay uncompressed\n");
+		}
+	if (stream_budget)
+		{
+		bspLightenLightmaps(&bsp);
+		resize_lightmap_ids(bsp.directory[LIGHTMAPS].length/(128*128*3));
+		stream = streamCreate(&bsp, stream_budget, mip_filter);
+		}
+	else
+		{
+		if (mip_filter != MIPMAP_NONE) mip_cache = mipmapCacheLoad(MIPMAP_CACHE_FILE);
+		upload_lightmaps(&bsp, jobs, bc1_cache, mip_cache, mip_filter);
 		}
 
 	/*List textures*/
@@ -434,18 +700,165 @@ main(int argc, char *argv[])
 		}
 
 	int shift = 0;
-	float time_delta = 0;
-	unsigned int last_time;
+	int current_cluster = 0;
+	int doors_open = -1; /*as the map's spawnflags have them until 'o'*/
+	int report_areas = 0;
+	int report_dlights = 0;
+	struct player prev_player;
+	struct player view;
+	int mouse_x = 0, mouse_y = 0;
+	unsigned int mouse_state = 0;
+	double accumulator = 0;
+	double fps_limit = 0;
+	Uint64 frequency = SDL_GetPerformanceFrequency();
+	Uint64 last_counter, start_counter;
+	unsigned long frames = 0, ticks = 0;
+	FILE *fp_record = 0;
+	FILE *fp_replay = 0;
+
 	spawnPlayer(&player, &map, spawn_point++); 
 	//playerMove(&player, 0,0,0,0,0,0);
-	int current_cluster = 0;
+	prev_player = player;
+	view = player;
+
+	/* Swap interval 0 lets us measure real throughput */
+	if (SDL_GL_SetSwapInterval(options[3].flag ? 1 : 0) != 0)
+		printf("Could not set the swap interval\n");
+	if (options[4].flag) fps_limit = atof(options[4].arg);
+
+	if (options[5].flag)
+		{
+		fp_record = fopen(options[5].arg, "w");
+		if (!fp_record) error(-1, "Can't open the record file.");
+		}
+	if (options[6].flag)
+		{
+		fp_replay = fopen(options[6].arg, "r");
+		if (!fp_replay) error(-1, "Can't open the replay file.");
+		}
 
 	if (SDL_SetRelativeMouseMode(SDL_TRUE) == 0) printf("Captured mouse\n");
 	else printf("Could not capture the mouse\n");
 
+		{
+		char path[1024];
+
+		if (vfsLoosePath(vfs, filename, path, sizeof(path))) reload = reloadCreate(path);
+		else printf("Reload: %s is inside a pk3, not watching it\n", filename);
+		}
+
+	cold_start = jobsTime() - start_time;
+	printf("Cold start: %.1f ms\n", cold_start*1000);
+
+	start_counter = last_counter = SDL_GetPerformanceCounter();
+
 	while (!quit)
 		{
-		last_time = SDL_GetTicks();
+		Uint64 frame_start = SDL_GetPerformanceCounter();
+		double frame_time = (double)(frame_start - last_counter)/frequency;
+
+		last_counter = frame_start;
+		arenaReset(&g_frame_arena);
+
+		/* A new build of the map: swap in the lumps that changed and
+		   only rebuild what depends on them. The player stays put. */
+			{
+			struct bsp fresh;
+			double detected;
+
+			if (reloadPoll(reload, &fresh, &detected))
+				{
+				unsigned int fresh_hashes[17];
+				unsigned int changed;
+				int restream;
+				double t = jobsTime();
+
+				reloadHashLumps(&fresh, fresh_hashes);
+				changed = reloadDiff(lump_hashes, fresh_hashes);
+				if (changed & RELOAD_GEOMETRY) changed |= RELOAD_GEOMETRY;
+				memcpy(lump_hashes, fresh_hashes, sizeof(lump_hashes));
+
+				/* The stream thread reads the lumps, it has to be gone before they're swapped */
+				restream = stream && (changed & (RELOAD_GEOMETRY | (1 << LIGHTMAPS) | (1 << LEAVES) | (1 << LEAFFACES) | (1 << VISDATA)));
+				if (restream)
+					{
+					streamDestroy(stream);
+					stream = 0;
+					}
+
+				/* Copied out, the rest of the new build goes with its arena */
+				for (i=0; i<17; i++)
+					{
+					if (changed & (1 << i))
+						{
+						int length = fresh.directory[i].length;
+						char *data = malloc(length+1);
+
+						memcpy(data, fresh.directory[i].data, length);
+						data[length] = 0;
+						bspReplaceLump(&bsp, i, data, length);
+						}
+					}
+				bspFree(&fresh);
+
+				if (changed & RELOAD_GEOMETRY)
+					{
+					float acmr_before = 0, acmr_after = 0;
+					bspOptimizeMeshes(&bsp, &acmr_before, &acmr_after);
+					bvhFree(bvh);
+					bvh = bvhCreate(&bsp, jobs);
+					}
+				if (g_compact_vertices && (changed & (RELOAD_GEOMETRY | (1 << MODELS))))
+					{
+					compactVerticesFree(g_compact_vertices);
+					g_compact_vertices = compactVerticesBuild(&bsp);
+					}
+				if (restream)
+					{
+					if (changed & (1 << LIGHTMAPS)) bspLightenLightmaps(&bsp);
+					resize_lightmap_ids(bsp.directory[LIGHTMAPS].length/(128*128*3));
+					stream = streamCreate(&bsp, stream_budget, mip_filter);
+					}
+				else if (changed & (1 << LIGHTMAPS)) upload_lightmaps(&bsp, jobs, bc1_cache, mip_cache, mip_filter);
+				if (changed & ((1 << ENTITIES) | (1 << MODELS) | (1 << PLANES) | (1 << NODES) | (1 << LEAVES)))
+					{
+					mapFree(&map);
+					bspLoadEntities(&bsp, &map);
+					bspLoadModels(&bsp, &map);
+					areasFree(&areas);
+					areasBuild(&areas, &bsp, &map);
+					/* Doors stay the way 'o' left them */
+					if (doors_open >= 0) areasSetAllPortals(&areas, doors_open);
+					}
+				if (changed & (RELOAD_GEOMETRY | (1 << LIGHTMAPS) | (1 << TEXTURES)))
+					{
+					struct dlight lights[MAX_DLIGHTS];
+					int n_lights = dlights.n_lights;
+
+					drawlistFree(&drawlist);
+					drawlistCreate(&drawlist, &bsp, jobsThreadCount(jobs));
+					shadersBindMap(shaders, &bsp);
+					drawlistSetBuckets(&drawlist, shaders->face_bucket, shaders->n_buckets);
+					drawlistSetFaceTests(&drawlist, &bsp, shaders->face_test);
+
+					/* Same lights on the new faces */
+					memcpy(lights, dlights.lights, sizeof(struct dlight)*n_lights);
+					dlightsFree(&dlights);
+					dlightsCreate(&dlights, &bsp);
+					for (i=0; i<n_lights; i++)
+						dlightsAdd(&dlights, lights[i].origin, lights[i].radius, lights[i].color);
+					}
+
+				printf("Reload:");
+				for (i=0; i<17; i++) if (changed & (1 << i)) printf(" %s", bspLumpName(i));
+				if (!changed) printf(" nothing changed");
+				printf("\nReload: applied in %.1f ms, %.1f ms after the write, cold start %.1f ms\n",
+					(jobsTime() - t)*1000, (jobsTime() - detected)*1000, cold_start*1000);
+				}
+			}
+		if (frame_time > MAX_FRAME_TIME) frame_time = MAX_FRAME_TIME;
+		accumulator += frame_time;
+
 		while (SDL_PollEvent(&event))
 			{
 			switch (event.type)
@@ -459,13 +872,29 @@ main(int argc, char *argv[])
 					switch(event.key.keysym.sym)
 						{
 						case SDLK_p: pvs_enabled = !pvs_enabled; break;
+						case SDLK_l:
+							{
+							static float colors[4][3] = {{1,0.5,0.2}, {0.2,0.5,1}, {0.3,1,0.3}, {1,1,1}};
+							float position[3] = {view.x, view.y, view.z};
+							if (dlightsAdd(&dlights, position, 300, colors[dlights.n_lights%4]) < 0)
+								printf("Dynamic lights: all %i in use\n", MAX_DLIGHTS);
+							report_dlights = 1;
+							}
+							break;
+						case SDLK_k: dlightsClear(&dlights); break;
+						case SDLK_e: pick_face(bvh, &bsp, &map, &camera); break;
+						case SDLK_o:
+							doors_open = doors_open != 1;
+							areasSetAllPortals(&areas, doors_open);
+							break;
 						case SDLK_UP: g_bezier_steps++; break;
 						case SDLK_DOWN: g_bezier_steps--; if (g_bezier_steps < 1) g_bezier_steps = 1; break;
-						case SDLK_r: spawn_point = spawnPlayer(&player, &map, spawn_point); spawn_point++; break;
-						case SDLK_F1: 
-							take_screenshot(g_window);
-
+						case SDLK_r: 
+							spawn_point = spawnPlayer(&player, &map, spawn_point); spawn_point++;
+							prev_player = player;
 							break;
+						case SDLK_F1: captureScreenshot(capture); break;
+						case SDLK_F2: captureSetContinuous(capture, !captureIsContinuous(capture)); break;
 						case SDLK_ESCAPE: quit = 1; break;
 						case SDLK_LSHIFT: shift=1; break;
 						}
@@ -481,124 +910,186 @@ main(int argc, char *argv[])
 				}
 			}
 
-		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+			{
+			int mx,my;
+			mouse_state = SDL_GetRelativeMouseState(&mx, &my);
+			mouse_x += mx;
+			mouse_y += my;
+			}
 
-		glLoadMatrixf(identity);
-		glRotatef(-player.rx, 1,0,0);
-		glRotatef(-player.ry, 0,1,0);
-		glRotatef(-player.rz, 0,0,1);
-		glTranslatef(-player.x,-player.y,-player.z);
+		/* Fixed steps, deterministic whatever the frame rate */
+		while (accumulator >= 1.0/TICK_RATE)
+			{
+			prev_player = player;
 
-		float mat[16];
+			if (fp_replay)
+				{
+				/* The recorded path steers, the mouse is dropped */
+				mouse_x = mouse_y = 0;
+				if (fscanf(fp_replay, "%f %f %f %f %f %f", &player.x, &player.y, &player.z,
+					&player.rx, &player.ry, &player.rz) != 6)
+					{
+					quit = 1;
+					break;
+					}
+				}
+			else
+				{
+				player.rz -= mouse_x/5.0;
+				player.rx += mouse_y/5.0;
+				mouse_x = mouse_y = 0;
 
-		glGetFloatv(GL_MODELVIEW_MATRIX, mat);
+				if (player.rz>360) player.rz-=360;
+				if (player.rz<0) player.rz+=360;
+				if (player.rx>90) player.rx=90;
+				if (player.rx<-90) player.rx=-90;
 
-		int mx,my;
-		unsigned int mouse_state = 0;
-		mouse_state = SDL_GetRelativeMouseState(&mx, &my);
+				playerTick(&player, mouse_state, 1.0/TICK_RATE);
+				}
 
-		//if (mouse_state & SDL_BUTTON(SDL_BUTTON_RIGHT)) 
-		if (1) 
-			{
-			player.rz -= mx/5.0;
-			player.rx += my/5.0;
+			if (fp_record) fprintf(fp_record, "%f %f %f %f %f %f\n", player.x, player.y, player.z,
+				player.rx, player.ry, player.rz);
 
-			if (player.rz>360) player.rz-=360;
-			if (player.rx>360) player.rx-=360;
+			accumulator -= 1.0/TICK_RATE;
+			ticks++;
 			}
 
-		//if (mouse_state & SDL_BUTTON(SDL_BUTTON_LEFT))
-		/* Forward */
-		if (keys[SDL_SCANCODE_W])
+		/* Draw between the last two steps */
+		playerInterpolate(&view, &prev_player, &player, accumulator*TICK_RATE);
+
+		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
 			{
-			/* ModelView Matrix has the backward vector?*/
-			player.x -= time_delta*(SPEED*mat[2]);
-			player.y -= time_delta*(SPEED*mat[6]);
-			player.z -= time_delta*(SPEED*mat[10]);
+			float position[3] = {view.x, view.y, view.z};
+			/* rx is pitch, rz yaw and ry roll */
+			cameraUpdate(&camera, position, view.rx, view.rz, view.ry);
+			glLoadMatrixf(camera.view);
 			}
 
-		/* Backward */
-		if (keys[SDL_SCANCODE_S])
+		if (pvs_enabled) 
 			{
-			/* ModelView Matrix has the backward vector?*/
-			player.x += time_delta*(SPEED*mat[2]);
-			player.y += time_delta*(SPEED*mat[6]);
-			player.z += time_delta*(SPEED*mat[10]);
+			current_cluster = findCluster(&bsp, view.x, view.y, view.z);
 			}
-		/* Left */
-		if (keys[SDL_SCANCODE_A])
+
 			{
-			/* ModelView Matrix has the backward vector?*/
-			player.x -= time_delta*(SPEED*mat[0]);
-			player.y -= time_delta*(SPEED*mat[4]);
-			player.z -= time_delta*(SPEED*mat[8]);
+			struct bsp_leaf *leaves = bsp.directory[LEAVES].data;
+			int camera_leaf = findLeaf(&bsp, view.x, view.y, view.z);
+
+			if (areasUpdate(&areas, leaves[camera_leaf].area)) report_areas = 1;
+			if (stream) streamUpdate(stream, leaves[camera_leaf].cluster);
 			}
-		/* Right */
-		if (keys[SDL_SCANCODE_D])
+
+		/* Visibility and culling on the workers, submission here */
 			{
-			/* ModelView Matrix has the backward vector?*/
-			player.x += time_delta*(SPEED*mat[0]);
-			player.y += time_delta*(SPEED*mat[4]);
-			player.z += time_delta*(SPEED*mat[8]);
+			struct drawlist_view dl_view;
+
+			dl_view.cluster = pvs_enabled ? current_cluster : -1;
+			dl_view.frustum = &camera.frustum;
+			dl_view.areas = &areas;
+			dl_view.eye = camera.position;
+			drawlistBuild(&drawlist, jobs, &bsp, &dl_view);
+			drawlist_time += drawlist.cull_time + drawlist.merge_time;
+			face_tests.n_faces += drawlist.n_faces + drawlist.n_backfacing + drawlist.n_outside;
+			face_tests.n_backfacing += drawlist.n_backfacing;
+			face_tests.n_outside += drawlist.n_outside;
+			if (drawlist.n_backfacing + drawlist.n_outside > face_tests.most)
+				face_tests.most = drawlist.n_backfacing + drawlist.n_outside;
+			if (stream) streamDrawn(stream, drawlist.faces, drawlist.n_faces);
+
+			shadersUpdate(shaders, (double)(frame_start - start_counter)/frequency);
+			draw_buckets(&drawlist, shaders, &bsp, stream, 0, shaders->first_blend_bucket);
 			}
 
+		drawBspModels(&bsp, &map, &camera.frustum, pvs_enabled ? current_cluster : -1);
+		/* Blended shaders over everything opaque */
+		draw_buckets(&drawlist, shaders, &bsp, stream, shaders->first_blend_bucket, shaders->n_buckets);
 
-		if (mouse_state & SDL_BUTTON(SDL_BUTTON_MIDDLE))
+		/* Only lights faces the draw list took this frame */
+		if (dlights.n_lights)
 			{
-			player.x += time_delta*(SPEED*mat[2]);
-			player.y += time_delta*(SPEED*mat[6]);
-			player.z += time_delta*(SPEED*mat[10]);
-			}
-
-		int n_leaves;
+			dlight_pairs += dlightsFindFaces(&dlights, &bsp, drawlist.stamps, drawlist.frame);
+			dlightsDraw(&dlights, &bsp);
 
-		n_leaves = bsp.directory[LEAVES].length/sizeof(struct bsp_leaf);
+			if (report_dlights)
+				{
+				printf("Dynamic lights: %i lights, %i nodes, %i leaves, %i faces tested, %i pairs\n",
+					dlights.n_lights, dlights.n_nodes, dlights.n_leaves, dlights.n_faces_tested, dlights.n_pairs);
+				report_dlights = 0;
+				}
+			}
 
-		if (pvs_enabled) 
+		if (report_areas)
 			{
-			current_cluster = findCluster(&bsp, player.x, player.y, player.z);
+			printf("Area %i: %i leaves culled beyond the PVS\n", areas.camera_area, drawlist.n_area_culled);
+			report_areas = 0;
 			}
 
-		for (i=0; i<n_leaves; i++)
 			{
-			struct bsp_leaf *leaves;
-			struct bsp_leaf *leaf;
-			struct bsp_face *faces;
-			int *leaffaces = bsp.directory[LEAFFACES].data;
-			int j;
-	
-			leaves = bsp.directory[LEAVES].data;
-			faces = bsp.directory[FACES].data;
-			leaf = &leaves[i];
+			int w = 0, h = 0;
+			SDL_GetWindowSize(g_window, &w, &h);
+			captureFrame(capture, w, h);
+			}
 
-			if (leaf->cluster <0)
-				{
-				continue;
-				}
+		SDL_GL_SwapWindow(g_window);
+		frames++;
 
-			/*If pvs_enables and we are not outside 
-			  of a cluster and cluster is not visible 
-			  then just skip it.
-			*/
-			if (pvs_enabled && current_cluster != -1 && !clusterIsVisible(current_cluster, leaf->cluster, bsp.directory[VISDATA].data))
-				{
-				continue;
-				}
+		/* Sleep off most of the remaining time, spin the rest */
+		if (fps_limit > 0)
+			{
+			Uint64 target = frame_start + (Uint64)(frequency/fps_limit);
+			Uint64 now = SDL_GetPerformanceCounter();
 
-			for (j=0; j<leaf->n_leaffaces;j++)
+			while (now < target)
 				{
-				int face_index;
-				face_index = leaffaces[leaf->leafface+j];
-				drawBspFace(&faces[face_index], &bsp);
+				if ((double)(target - now)/frequency > 0.002) SDL_Delay(1);
+				now = SDL_GetPerformanceCounter();
 				}
 			}
+		}
 
-		SDL_GL_SwapWindow(g_window);
-
-		SDL_Delay(2);
-		time_delta = (SDL_GetTicks() - last_time)/1000.0;
+		{
+		double seconds = (double)(SDL_GetPerformanceCounter() - start_counter)/frequency;
+		if (seconds > 0 && frames > 0)
+			printf("Frames: %lu in %.2fs, %.3f ms/frame (%.1f fps), %lu ticks\n",
+				frames, seconds, 1000.0*seconds/frames, frames/seconds, ticks);
+		if (frames > 0)
+			printf("Draw list: %.3f ms/frame on %i threads\n",
+				1000.0*drawlist_time/frames, jobsThreadCount(jobs));
+		if (frames > 0 && face_tests.n_faces)
+			printf("Face tests: %.1f back facing and %.1f outside the frustum taken out per frame, "
+				"%.1f%% of %.1f faces, at most %i in a frame\n",
+				(double)face_tests.n_backfacing/frames, (double)face_tests.n_outside/frames,
+				100.0*(face_tests.n_backfacing + face_tests.n_outside)/face_tests.n_faces,
+				(double)face_tests.n_faces/frames, face_tests.most);
+		if (frames > 0 && dlight_pairs)
+			printf("Dynamic lights: %.1f light x face pairs/frame\n", (double)dlight_pairs/frames);
 		}
 
+	if (fp_record) fclose(fp_record);
+	if (fp_replay) fclose(fp_replay);
+
+	if (stream) streamReport(stream);
+	arenaFlush(&bsp.lumps);
+	arenaFlush(&map.arena);
+	arenaFlush(&g_frame_arena);
+	memReport(stdout);
+	streamDestroy(stream);
+	reloadDestroy(reload);
+	bc1CacheFree(bc1_cache);
+	mipmapCacheFree(mip_cache);
+	shadersFree(shaders);
+	captureDestroy(capture);
+	bvhFree(bvh);
+	dlightsFree(&dlights);
+	drawlistFree(&drawlist);
+	jobsDestroy(jobs);
+	areasFree(&areas);
+	if (g_compact_vertices) compactVerticesFree(g_compact_vertices);
+	resize_lightmap_ids(0);
+	mapFree(&map);
+	bspFree(&bsp);
+	arenaFree(&g_frame_arena);
+	vfsDestroy(vfs);
 	ilDeleteImage(g_il_image_id);
 	SDL_DestroyWindow(g_window);
 	SDL_Quit();
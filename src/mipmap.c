@@ -0,0 +1,619 @@
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#define USE_SIMD (1)
+#else
+#define USE_SIMD (0)
+#endif
+
+#include "error.h"
+#include "mipmap.h"
+
+#define CACHE_MAGIC "MIPC"
+#define CACHE_VERSION (1)
+/* Steps of the linear to sRGB table, fine enough for the darkest sRGB step */
+#define LINEAR_STEPS (65535)
+#define KAISER_TAPS (8)
+#define KAISER_BETA (4.0)
+
+static float g_to_linear[256];
+static unsigned char g_to_srgb[LINEAR_STEPS+1];
+static float g_kaiser[KAISER_TAPS];
+static pthread_once_t g_tables_once = PTHREAD_ONCE_INIT;
+
+/* An image as linear floats, channel after channel */
+struct level {
+	int width, height, channels;
+	float *data;
+};
+
+#define PLANE(l, c) ((l)->data + (long)(c)*(l)->width*(l)->height)
+
+/* Modified Bessel function of the first kind, order 0 */
+static double
+bessel_i0(double x)
+	{
+	double sum = 1, term = 1;
+	int k;
+
+	for (k=1; k<32; k++)
+		{
+		term *= (x/(2*k))*(x/(2*k));
+		sum += term;
+		}
+
+	return sum;
+	}
+
+static void
+init_tables(void)
+	{
+	double total = 0;
+	int i;
+
+	for (i=0; i<256; i++)
+		{
+		double c = i/255.0;
+		g_to_linear[i] = c <= 0.04045 ? c/12.92 : pow((c + 0.055)/1.055, 2.4);
+		}
+	for (i=0; i<=LINEAR_STEPS; i++)
+		{
+		double l = (double)i/LINEAR_STEPS;
+		double c = l <= 0.0031308 ? l*12.92 : 1.055*pow(l, 1/2.4) - 0.055;
+		g_to_srgb[i] = (unsigned char)(c*255 + 0.5);
+		}
+
+	/* Taps at half texel offsets around the centre of each 2x2 */
+	for (i=0; i<KAISER_TAPS; i++)
+		{
+		double d = i - (KAISER_TAPS-1)/2.0;
+		double t = d/(KAISER_TAPS/2);
+		double sinc = sin(M_PI*d/2)/(M_PI*d/2);
+
+		g_kaiser[i] = sinc*bessel_i0(KAISER_BETA*sqrt(1 - t*t))/bessel_i0(KAISER_BETA);
+		total += g_kaiser[i];
+		}
+	for (i=0; i<KAISER_TAPS; i++) g_kaiser[i] /= total;
+	}
+
+int
+mipmapLevels(int width, int height)
+	{
+	int size = width > height ? width : height;
+	int levels = 1;
+
+	while (size > 1)
+		{
+		size /= 2;
+		levels++;
+		}
+
+	return levels;
+	}
+
+void
+mipmapLevelSize(int width, int height, int level, int *level_width, int *level_height)
+	{
+	*level_width = width >> level > 0 ? width >> level : 1;
+	*level_height = height >> level > 0 ? height >> level : 1;
+	}
+
+long
+mipmapChainSize(int width, int height, int channels)
+	{
+	int n_levels = mipmapLevels(width, height);
+	long size = 0;
+	int i, w, h;
+
+	for (i=1; i<n_levels; i++)
+		{
+		mipmapLevelSize(width, height, i, &w, &h);
+		size += (long)w*h*channels;
+		}
+
+	return size;
+	}
+
+unsigned char *
+mipmapLevel(unsigned char *chain, int width, int height, int channels, int level)
+	{
+	int i, w, h;
+
+	for (i=1; i<level; i++)
+		{
+		mipmapLevelSize(width, height, i, &w, &h);
+		chain += (long)w*h*channels;
+		}
+
+	return chain;
+	}
+
+int
+mipmapFilterByName(char *name)
+	{
+	if (!strcmp(name, "box")) return MIPMAP_BOX;
+	if (!strcmp(name, "kaiser")) return MIPMAP_KAISER;
+	if (!strcmp(name, "none")) return MIPMAP_NONE;
+
+	return -1;
+	}
+
+char *
+mipmapFilterName(int filter)
+	{
+	switch (filter)
+		{
+		case MIPMAP_BOX: return "box";
+		case MIPMAP_KAISER: return "kaiser";
+		default: return "none";
+		}
+	}
+
+static void
+decode_image(unsigned char *image, struct level *l)
+	{
+	int n = l->width*l->height;
+	int i, c;
+
+	for (c=0; c<l->channels; c++)
+		{
+		float *plane = PLANE(l, c);
+
+		if (c < 3) for (i=0; i<n; i++) plane[i] = g_to_linear[image[i*l->channels + c]];
+		else for (i=0; i<n; i++) plane[i] = image[i*l->channels + c]*(1/255.0f);
+		}
+	}
+
+/* Rounds to nearest even both ways, so the scalar and SSE2 bytes agree */
+static void
+encode_level(struct level *l, unsigned char *out, int simd)
+	{
+	int n = l->width*l->height;
+	int i, c;
+
+	for (c=0; c<l->channels; c++)
+		{
+		float *plane = PLANE(l, c);
+		float scale = c < 3 ? LINEAR_STEPS : 255;
+		int q[4];
+
+		i = 0;
+#ifdef __SSE2__
+		if (simd)
+			for (; i+4<=n; i+=4)
+				{
+				__m128 v = _mm_loadu_ps(plane + i);
+
+				v = _mm_min_ps(_mm_max_ps(v, _mm_setzero_ps()), _mm_set1_ps(1));
+				_mm_storeu_si128((__m128i *)q, _mm_cvtps_epi32(_mm_mul_ps(v, _mm_set1_ps(scale))));
+				if (c < 3)
+					{
+					out[(i+0)*l->channels + c] = g_to_srgb[q[0]];
+					out[(i+1)*l->channels + c] = g_to_srgb[q[1]];
+					out[(i+2)*l->channels + c] = g_to_srgb[q[2]];
+					out[(i+3)*l->channels + c] = g_to_srgb[q[3]];
+					}
+				else
+					{
+					out[(i+0)*l->channels + c] = q[0];
+					out[(i+1)*l->channels + c] = q[1];
+					out[(i+2)*l->channels + c] = q[2];
+					out[(i+3)*l->channels + c] = q[3];
+					}
+				}
+#endif
+		for (; i<n; i++)
+			{
+			float v = plane[i] < 0 ? 0 : plane[i] > 1 ? 1 : plane[i];
+			int k = (int)lrintf(v*scale);
+
+			out[i*l->channels + c] = c < 3 ? g_to_srgb[k] : k;
+			}
+		}
+	}
+
+/* Odd sizes repeat their last row and column */
+static void
+box_level(struct level *src, struct level *dst, int simd)
+	{
+	int w = src->width, h = src->height;
+	int x, y, c;
+
+	for (c=0; c<src->channels; c++)
+		{
+		float *in = PLANE(src, c), *out = PLANE(dst, c);
+
+		for (y=0; y<dst->height; y++)
+			{
+			float *r0 = in + (2*y < h ? 2*y : h-1)*w;
+			float *r1 = in + (2*y+1 < h ? 2*y+1 : h-1)*w;
+			float *o = out + y*dst->width;
+
+			x = 0;
+#ifdef __SSE2__
+			/* Four outputs from eight texels of each row */
+			if (simd && !(w & 1))
+				for (; x+4<=dst->width; x+=4)
+					{
+					__m128 s0 = _mm_add_ps(_mm_loadu_ps(r0 + 2*x), _mm_loadu_ps(r1 + 2*x));
+					__m128 s1 = _mm_add_ps(_mm_loadu_ps(r0 + 2*x+4), _mm_loadu_ps(r1 + 2*x+4));
+					__m128 even = _mm_shuffle_ps(s0, s1, _MM_SHUFFLE(2, 0, 2, 0));
+					__m128 odd = _mm_shuffle_ps(s0, s1, _MM_SHUFFLE(3, 1, 3, 1));
+
+					_mm_storeu_ps(o + x, _mm_mul_ps(_mm_add_ps(even, odd), _mm_set1_ps(0.25f)));
+					}
+#endif
+			for (; x<dst->width; x++)
+				{
+				int x0 = 2*x < w ? 2*x : w-1;
+				int x1 = 2*x+1 < w ? 2*x+1 : w-1;
+
+				o[x] = ((r0[x0] + r1[x0]) + (r0[x1] + r1[x1]))*0.25f;
+				}
+			}
+		}
+	}
+
+static int
+clamp_index(int i, int n)
+	{
+	return i < 0 ? 0 : i >= n ? n-1 : i;
+	}
+
+/***
+Across, then down, four outputs at a time both ways. Across, the
+taps of neighbouring outputs are two texels apart, so each row is
+first split into its even and odd texels, edges repeated, and a
+tap reads four in a row from one of the halves. Negative lobes can
+take a texel below black, it is clamped.
+split needs room for two halves of width/2 + KAISER_TAPS.
+***/
+static void
+kaiser_level(struct level *src, struct level *dst, float *across, float *split, int simd)
+	{
+	int w = src->width, h = src->height;
+	int w2 = dst->width;
+	int half = w2 + KAISER_TAPS/2;
+	float *even = split, *odd = split + half;
+	int x, y, c, k;
+
+	for (c=0; c<src->channels; c++)
+		{
+		float *in = PLANE(src, c), *out = PLANE(dst, c);
+
+		for (y=0; y<h; y++)
+			{
+			float *row = in + y*w;
+			float *o = across + y*w2;
+
+			/* Output x, tap k reads texel 2x + k - (KAISER_TAPS/2-1) */
+			for (x=0; x<half; x++)
+				{
+				even[x] = row[clamp_index(2*x - (KAISER_TAPS/2-1), w)];
+				odd[x] = row[clamp_index(2*x+1 - (KAISER_TAPS/2-1), w)];
+				}
+
+			x = 0;
+#ifdef __SSE2__
+			if (simd)
+				for (; x+4<=w2; x+=4)
+					{
+					__m128 sum = _mm_setzero_ps();
+
+					for (k=0; k<KAISER_TAPS; k++)
+						sum = _mm_add_ps(sum, _mm_mul_ps(_mm_set1_ps(g_kaiser[k]),
+							_mm_loadu_ps((k & 1 ? odd : even) + x + k/2)));
+					_mm_storeu_ps(o + x, sum);
+					}
+#endif
+			for (; x<w2; x++)
+				{
+				float sum = 0;
+
+				for (k=0; k<KAISER_TAPS; k++) sum += g_kaiser[k]*(k & 1 ? odd : even)[x + k/2];
+				o[x] = sum;
+				}
+			}
+
+		for (y=0; y<dst->height; y++)
+			{
+			float *rows[KAISER_TAPS];
+			float *o = out + y*w2;
+
+			for (k=0; k<KAISER_TAPS; k++) rows[k] = across + clamp_index(2*y + k - (KAISER_TAPS/2-1), h)*w2;
+
+			x = 0;
+#ifdef __SSE2__
+			if (simd)
+				for (; x+4<=w2; x+=4)
+					{
+					__m128 sum = _mm_setzero_ps();
+
+					for (k=0; k<KAISER_TAPS; k++)
+						sum = _mm_add_ps(sum, _mm_mul_ps(_mm_set1_ps(g_kaiser[k]), _mm_loadu_ps(rows[k] + x)));
+					_mm_storeu_ps(o + x, _mm_max_ps(sum, _mm_setzero_ps()));
+					}
+#endif
+			for (; x<w2; x++)
+				{
+				float sum = 0;
+
+				for (k=0; k<KAISER_TAPS; k++) sum += g_kaiser[k]*rows[k][x];
+				o[x] = sum > 0 ? sum : 0;
+				}
+			}
+		}
+	}
+
+static void
+generate_chain(unsigned char *image, int width, int height, int channels, int filter, unsigned char *chain, int simd)
+	{
+	int n_levels = mipmapLevels(width, height);
+	struct level a, b, t;
+	float *across = 0, *split = 0;
+	int i;
+
+	a.width = width;
+	a.height = height;
+	a.channels = channels;
+	a.data = malloc(sizeof(float)*width*height*channels);
+	b.channels = channels;
+	mipmapLevelSize(width, height, 1, &b.width, &b.height);
+	b.data = malloc(sizeof(float)*b.width*b.height*channels);
+	if (filter == MIPMAP_KAISER)
+		{
+		across = malloc(sizeof(float)*(b.width*height + 2*(b.width + KAISER_TAPS)));
+		split = across + b.width*height;
+		}
+	if (!a.data || !b.data || (filter == MIPMAP_KAISER && !across)) error(-1, "Out of memory for mipmaps.");
+
+	decode_image(image, &a);
+	for (i=1; i<n_levels; i++)
+		{
+		mipmapLevelSize(width, height, i, &b.width, &b.height);
+		if (filter == MIPMAP_KAISER) kaiser_level(&a, &b, across, split, simd);
+		else box_level(&a, &b, simd);
+		encode_level(&b, mipmapLevel(chain, width, height, channels, i), simd);
+
+		/* Each buffer is big enough for every level after the one it held */
+		t = a;
+		a = b;
+		b = t;
+		}
+
+	free(a.data);
+	free(b.data);
+	free(across);
+	}
+
+struct generate_job {
+	unsigned char **images;
+	unsigned char **chains;
+	int width, height, channels;
+	int filter;
+	int simd;
+};
+
+static void
+generate_images(void *ctx, int begin, int end, int thread)
+	{
+	struct generate_job *g = ctx;
+	int i;
+
+	for (i=begin; i<end; i++)
+		generate_chain(g->images[i], g->width, g->height, g->channels, g->filter, g->chains[i], g->simd);
+	}
+
+void
+mipmapGenerate(struct jobs *jobs, unsigned char **images, int n_images,
+	int width, int height, int channels, int filter, unsigned char **chains)
+	{
+	struct generate_job g;
+
+	if (channels < 1 || channels > 4) error(-1, "Mipmaps need 1 to 4 channels.");
+	pthread_once(&g_tables_once, init_tables);
+
+	g.images = images;
+	g.chains = chains;
+	g.width = width;
+	g.height = height;
+	g.channels = channels;
+	g.filter = filter;
+	g.simd = USE_SIMD;
+
+	if (jobs) jobsParallelFor(jobs, n_images, 1, generate_images, &g);
+	else generate_images(&g, 0, n_images, 0);
+	}
+
+/* FNV-1a, 64 bits since it is kept on disk */
+static unsigned long long
+hash_image(unsigned char *data, long length)
+	{
+	unsigned long long h = 14695981039346656037ull;
+	long i;
+
+	for (i=0; i<length; i++)
+		{
+		h ^= data[i];
+		h *= 1099511628211ull;
+		}
+
+	return h;
+	}
+
+static struct mipmap_entry *
+find_entry(struct mipmap_cache *cache, unsigned long long hash, int width, int height, int channels, int filter)
+	{
+	int i;
+
+	for (i=0; i<cache->n_entries; i++)
+		{
+		struct mipmap_entry *e = &cache->entries[i];
+
+		if (e->hash == hash && e->width == width && e->height == height
+			&& e->channels == channels && e->filter == filter) return e;
+		}
+
+	return 0;
+	}
+
+static struct mipmap_entry *
+add_entry(struct mipmap_cache *cache, unsigned long long hash, int width, int height, int channels, int filter)
+	{
+	struct mipmap_entry *e;
+
+	if (cache->n_entries == cache->max_entries)
+		{
+		cache->max_entries = cache->max_entries ? cache->max_entries*2 : 64;
+		cache->entries = realloc(cache->entries, sizeof(struct mipmap_entry)*cache->max_entries);
+		if (!cache->entries) error(-1, "Out of memory for the mipmap cache.");
+		}
+
+	e = &cache->entries[cache->n_entries++];
+	e->hash = hash;
+	e->width = width;
+	e->height = height;
+	e->channels = channels;
+	e->filter = filter;
+	e->chain = malloc(mipmapChainSize(width, height, channels) + 1);
+	e->used = 0;
+
+	return e;
+	}
+
+/* An empty cache if the file is missing or not one of ours */
+struct mipmap_cache *
+mipmapCacheLoad(char *path)
+	{
+	struct mipmap_cache *cache = calloc(1, sizeof(struct mipmap_cache));
+	char magic[4];
+	int version, n, i;
+	FILE *fp;
+
+	fp = fopen(path, "rb");
+	if (!fp) return cache;
+
+	if (fread(magic, 4, 1, fp) != 1 || memcmp(magic, CACHE_MAGIC, 4)
+		|| fread(&version, sizeof(int), 1, fp) != 1 || version != CACHE_VERSION
+		|| fread(&n, sizeof(int), 1, fp) != 1)
+		{
+		fclose(fp);
+		return cache;
+		}
+
+	for (i=0; i<n; i++)
+		{
+		unsigned long long hash;
+		int key[4]; /*width, height, channels, filter*/
+		struct mipmap_entry *e;
+
+		if (fread(&hash, sizeof(hash), 1, fp) != 1 || fread(key, sizeof(key), 1, fp) != 1) break;
+		if (key[0] <= 0 || key[1] <= 0 || key[0] > 4096 || key[1] > 4096 || key[2] < 1 || key[2] > 4) break;
+
+		e = add_entry(cache, hash, key[0], key[1], key[2], key[3]);
+		if (fread(e->chain, mipmapChainSize(key[0], key[1], key[2]), 1, fp) != 1)
+			{
+			free(e->chain);
+			cache->n_entries--;
+			break;
+			}
+		}
+	fclose(fp);
+
+	printf("Mipmap cache: %i chains from %s\n", cache->n_entries, path);
+
+	return cache;
+	}
+
+/* Only what was used this run is kept */
+int
+mipmapCacheSave(struct mipmap_cache *cache, char *path)
+	{
+	int n_used = 0;
+	int version = CACHE_VERSION;
+	FILE *fp;
+	int i;
+
+	for (i=0; i<cache->n_entries; i++) n_used += cache->entries[i].used;
+	if (!cache->dirty && n_used == cache->n_entries) return 0;
+
+	fp = fopen(path, "wb");
+	if (!fp) return -1;
+
+	fwrite(CACHE_MAGIC, 4, 1, fp);
+	fwrite(&version, sizeof(int), 1, fp);
+	fwrite(&n_used, sizeof(int), 1, fp);
+	for (i=0; i<cache->n_entries; i++)
+		{
+		struct mipmap_entry *e = &cache->entries[i];
+		int key[4] = {e->width, e->height, e->channels, e->filter};
+
+		if (!e->used) continue;
+		fwrite(&e->hash, sizeof(e->hash), 1, fp);
+		fwrite(key, sizeof(key), 1, fp);
+		fwrite(e->chain, mipmapChainSize(e->width, e->height, e->channels), 1, fp);
+		}
+
+	if (fclose(fp)) return -1;
+	cache->dirty = 0;
+
+	return 0;
+	}
+
+void
+mipmapCacheFree(struct mipmap_cache *cache)
+	{
+	int i;
+
+	if (!cache) return;
+	for (i=0; i<cache->n_entries; i++) free(cache->entries[i].chain);
+	free(cache->entries);
+	free(cache);
+	}
+
+int
+mipmapCacheGenerate(struct mipmap_cache *cache, struct jobs *jobs, unsigned char **images, int n_images,
+	int width, int height, int channels, int filter, unsigned char **chains)
+	{
+	unsigned char **sources = malloc(sizeof(unsigned char *)*(n_images+1));
+	unsigned char **targets = malloc(sizeof(unsigned char *)*(n_images+1));
+	int n_missed = 0;
+	int i;
+
+	for (i=0; i<n_images; i++)
+		{
+		unsigned long long hash = hash_image(images[i], (long)width*height*channels);
+		struct mipmap_entry *e = find_entry(cache, hash, width, height, channels, filter);
+
+		/* Added straight away so repeats in this batch are found */
+		if (!e)
+			{
+			e = add_entry(cache, hash, width, height, channels, filter);
+			sources[n_missed] = images[i];
+			targets[n_missed] = e->chain;
+			n_missed++;
+			}
+		e->used = 1;
+		chains[i] = e->chain;
+		}
+
+	if (n_missed)
+		{
+		mipmapGenerate(jobs, sources, n_missed, width, height, channels, filter, targets);
+		cache->dirty = 1;
+		}
+	cache->hits += n_images - n_missed;
+	cache->misses += n_missed;
+
+	free(sources);
+	free(targets);
+
+	return n_images - n_missed;
+	}
@@ -0,0 +1,71 @@
+#ifndef MIPMAP_H
+#define MIPMAP_H
+
+#include "jobs.h"
+
+/***
+Mip chains for trilinear filtering, made on the workers at load
+time. Colour is averaged in linear light, not on the sRGB bytes,
+so that distant lightmaps keep their brightness instead of going
+dark where bright and dark texels meet; alpha, the fourth channel,
+is averaged as is. Every level is made from the one above kept as
+linear floats, one array per channel, so the rounding to bytes
+happens once per level and the 2x2 and vertical filter passes run
+four texels at a time with SSE.
+The box filter is the plain 2x2 average. Kaiser is an 8 tap
+Kaiser windowed sinc in each direction, sharper at a distance but
+it rings a little at hard edges.
+The cache keeps chains by the content and size of the image so
+unchanged lightmaps aren't filtered again on the next start.
+***/
+
+enum {
+	MIPMAP_NONE,
+	MIPMAP_BOX,
+	MIPMAP_KAISER
+};
+
+/* Levels in a full chain, the image itself included */
+int mipmapLevels(int width, int height);
+/* Size of a level, level 0 is the image */
+void mipmapLevelSize(int width, int height, int level, int *level_width, int *level_height);
+/* Bytes for every level after the image, as mipmapGenerate writes them */
+long mipmapChainSize(int width, int height, int channels);
+/* Where a level (from 1) starts in a chain */
+unsigned char *mipmapLevel(unsigned char *chain, int width, int height, int channels, int level);
+/* The filter named by a --mip-filter argument, -1 if none is */
+int mipmapFilterByName(char *name);
+char *mipmapFilterName(int filter);
+
+/***
+Images of the same size, chains[i] must have mipmapChainSize bytes
+and gets levels 1 to the 1x1 one, largest first. With jobs the
+images are shared out over the workers.
+***/
+void mipmapGenerate(struct jobs *jobs, unsigned char **images, int n_images,
+	int width, int height, int channels, int filter, unsigned char **chains);
+
+struct mipmap_entry {
+	unsigned long long hash;
+	int width, height, channels, filter;
+	unsigned char *chain;
+	int used; /*this run, only these are saved*/
+};
+
+struct mipmap_cache {
+	struct mipmap_entry *entries;
+	int n_entries;
+	int max_entries;
+	int dirty;
+	int hits;
+	int misses;
+};
+
+struct mipmap_cache *mipmapCacheLoad(char *path);
+int mipmapCacheSave(struct mipmap_cache *cache, char *path);
+void mipmapCacheFree(struct mipmap_cache *cache);
+/* chains[i] points into the cache, returns how many were already in it */
+int mipmapCacheGenerate(struct mipmap_cache *cache, struct jobs *jobs, unsigned char **images, int n_images,
+	int width, int height, int channels, int filter, unsigned char **chains);
+
+#endif /* MIPMAP_H */
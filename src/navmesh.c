@@ -0,0 +1,787 @@
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "error.h"
+#include "trace.h"
+#include "navmesh.h"
+
+/* Blocks players but isn't drawn */
+#define CONTENTS_PLAYERCLIP (0x10000)
+/* Subtrees per thread, more than one so the stealing has something to take */
+#define SUBTREES_PER_THREAD (8)
+/* Above the world: a floor with nothing over it */
+#define NAV_OPEN (1 << 30)
+
+struct nav_span {
+	int column;
+	int zlo, zhi; /*cells above the origin*/
+	int walkable; /*the top is flat enough to stand on*/
+};
+
+struct span_list {
+	struct nav_span *spans;
+	int n_spans;
+	int max_spans;
+};
+
+struct nav_floor {
+	int z, ceiling;
+	int neighbours[4]; /*+x, +y, -x, -y, -1 if a player can't step there*/
+	int region; /*-1 eroded or dropped*/
+	int dist; /*cells from the edge*/
+	int poly;
+	int x, y;
+};
+
+struct nav_build {
+	struct bsp *bsp;
+	int width, height; /*columns*/
+	float origin[3];
+	int top; /*cells*/
+
+	int n_subtrees;
+	int *subtrees; /*node index, or -(leaf+1)*/
+	struct span_list *lists; /*per thread*/
+	int **brush_stamps; /*per thread*/
+	int *stamp;
+	int n_brushes;
+
+	int *floor_first; /*per column, n_columns+1*/
+	struct nav_floor *floors;
+	int n_floors;
+
+	long bytes, peak_bytes;
+};
+
+/* Working memory is counted by hand, size is what was asked for */
+static void
+nav_account(struct nav_build *b, long size)
+	{
+	b->bytes += size;
+	if (b->bytes > b->peak_bytes) b->peak_bytes = b->bytes;
+	}
+
+static void *
+nav_alloc(struct nav_build *b, long size)
+	{
+	nav_account(b, size);
+	return malloc(size ? size : 1);
+	}
+
+static void
+nav_free(struct nav_build *b, void *p, long size)
+	{
+	nav_account(b, -size);
+	free(p);
+	}
+
+static void
+add_span(struct span_list *l, int column, int zlo, int zhi, int walkable)
+	{
+	if (l->n_spans == l->max_spans)
+		{
+		l->max_spans = l->max_spans ? l->max_spans*2 : 4096;
+		l->spans = realloc(l->spans, sizeof(struct nav_span)*l->max_spans);
+		}
+	l->spans[l->n_spans].column = column;
+	l->spans[l->n_spans].zlo = zlo;
+	l->spans[l->n_spans].zhi = zhi;
+	l->spans[l->n_spans].walkable = walkable;
+	l->n_spans++;
+	}
+
+/***
+Split the tree from the root down, breadth first, until there are
+enough subtrees to go round. Leaves stay as they are.
+***/
+static void
+find_subtrees(struct nav_build *b, int wanted)
+	{
+	struct bsp_node *nodes = b->bsp->directory[NODES].data;
+	int max = wanted*2 + 2;
+	int n = 1, i;
+
+	b->subtrees = malloc(sizeof(int)*max);
+	b->subtrees[0] = 0;
+
+	for (i=0; i<n && n < wanted; )
+		{
+		int node = b->subtrees[i];
+
+		if (node < 0)
+			{
+			i++;
+			continue;
+			}
+		b->subtrees[i] = nodes[node].children[0];
+		b->subtrees[n++] = nodes[node].children[1];
+		}
+
+	b->n_subtrees = n;
+	}
+
+/* The six axial sides every compiled brush starts with give its bounds */
+static void
+brush_bounds(struct nav_build *b, struct bsp_brush *brush, float mins[3], float maxs[3])
+	{
+	struct bsp_brushside *sides = b->bsp->directory[BRUSHSIDES].data;
+	struct bsp_plane *planes = b->bsp->directory[PLANES].data;
+	struct bsp_node *root = b->bsp->directory[NODES].data;
+	int i, k;
+
+	for (k=0; k<3; k++)
+		{
+		mins[k] = root->mins[k];
+		maxs[k] = root->maxs[k];
+		}
+
+	for (i=0; i<brush->n_brushsides; i++)
+		{
+		struct bsp_plane *p = &planes[sides[brush->brushside + i].plane];
+
+		for (k=0; k<3; k++)
+			{
+			if (p->normal[k] == 1 && p->normal[(k+1)%3] == 0 && p->normal[(k+2)%3] == 0)
+				{
+				if (p->dist < maxs[k]) maxs[k] = p->dist;
+				}
+			else if (p->normal[k] == -1 && p->normal[(k+1)%3] == 0 && p->normal[(k+2)%3] == 0)
+				{
+				if (-p->dist > mins[k]) mins[k] = -p->dist;
+				}
+			}
+		}
+	}
+
+/***
+Solid spans of one brush in the columns of a box: where the line
+up the middle of each column is behind every side. The side that
+bounds it from above says whether the top can be stood on.
+***/
+static void
+voxelize_brush(struct nav_build *b, struct span_list *l, struct bsp_brush *brush, int box_mins[3], int box_maxs[3])
+	{
+	struct bsp_brushside *sides = b->bsp->directory[BRUSHSIDES].data;
+	struct bsp_plane *planes = b->bsp->directory[PLANES].data;
+	float mins[3], maxs[3];
+	int x0, x1, y0, y1, x, y, i;
+
+	brush_bounds(b, brush, mins, maxs);
+	if (mins[0] < box_mins[0]) mins[0] = box_mins[0];
+	if (mins[1] < box_mins[1]) mins[1] = box_mins[1];
+	if (maxs[0] > box_maxs[0]) maxs[0] = box_maxs[0];
+	if (maxs[1] > box_maxs[1]) maxs[1] = box_maxs[1];
+
+	/* Columns whose middle is inside */
+	x0 = (int)ceilf((mins[0] - b->origin[0])/NAV_CELL_SIZE - 0.5f);
+	x1 = (int)floorf((maxs[0] - b->origin[0])/NAV_CELL_SIZE - 0.5f);
+	y0 = (int)ceilf((mins[1] - b->origin[1])/NAV_CELL_SIZE - 0.5f);
+	y1 = (int)floorf((maxs[1] - b->origin[1])/NAV_CELL_SIZE - 0.5f);
+	if (x0 < 0) x0 = 0;
+	if (y0 < 0) y0 = 0;
+	if (x1 >= b->width) x1 = b->width-1;
+	if (y1 >= b->height) y1 = b->height-1;
+
+	for (y=y0; y<=y1; y++)
+		for (x=x0; x<=x1; x++)
+			{
+			float px = b->origin[0] + (x + 0.5f)*NAV_CELL_SIZE;
+			float py = b->origin[1] + (y + 0.5f)*NAV_CELL_SIZE;
+			float zlo = -1e30f, zhi = 1e30f, top_normal = 0;
+			int zl, zh;
+
+			for (i=0; i<brush->n_brushsides; i++)
+				{
+				struct bsp_plane *p = &planes[sides[brush->brushside + i].plane];
+				float a = p->dist - p->normal[0]*px - p->normal[1]*py;
+
+				if (fabsf(p->normal[2]) < 1e-6f)
+					{
+					if (a < 0) break;
+					}
+				else if (p->normal[2] > 0)
+					{
+					if (a/p->normal[2] < zhi)
+						{
+						zhi = a/p->normal[2];
+						top_normal = p->normal[2];
+						}
+					}
+				else if (a/p->normal[2] > zlo) zlo = a/p->normal[2];
+				}
+			if (i < brush->n_brushsides || zlo >= zhi) continue;
+
+			zl = (int)floorf((zlo - b->origin[2])/NAV_CELL_HEIGHT + 0.5f);
+			zh = (int)floorf((zhi - b->origin[2])/NAV_CELL_HEIGHT + 0.5f);
+			if (zl < 0) zl = 0;
+			if (zh > b->top) zh = b->top;
+			if (zh <= zl) zh = zl+1;
+			add_span(l, y*b->width + x, zl, zh, top_normal >= NAV_WALK_NORMAL);
+			}
+	}
+
+static void
+voxelize_subtrees(void *ctx, int begin, int end, int thread)
+	{
+	struct nav_build *b = ctx;
+	struct bsp_node *nodes = b->bsp->directory[NODES].data;
+	struct bsp_leaf *leaves = b->bsp->directory[LEAVES].data;
+	int *leafbrushes = b->bsp->directory[LEAFBRUSHES].data;
+	struct bsp_brush *brushes = b->bsp->directory[BRUSHES].data;
+	struct texture *textures = b->bsp->directory[TEXTURES].data;
+	int n_textures = b->bsp->directory[TEXTURES].length/sizeof(struct texture);
+	int *stamps = b->brush_stamps[thread];
+	int stack[256];
+	int s, i;
+
+	for (s=begin; s<end; s++)
+		{
+		int root = b->subtrees[s];
+		int *box_mins = root < 0 ? leaves[-(root+1)].mins : nodes[root].mins;
+		int *box_maxs = root < 0 ? leaves[-(root+1)].maxs : nodes[root].maxs;
+		int sp = 0;
+
+		/* A brush once per subtree; neighbours overlap at the edges, the merge sorts that out */
+		b->stamp[thread]++;
+		stack[sp++] = root;
+		while (sp)
+			{
+			int node = stack[--sp];
+			struct bsp_leaf *leaf;
+
+			if (node >= 0)
+				{
+				if (sp+2 > 256) error(-1, "Navmesh: BSP tree too deep.");
+				stack[sp++] = nodes[node].children[0];
+				stack[sp++] = nodes[node].children[1];
+				continue;
+				}
+
+			leaf = &leaves[-(node+1)];
+			for (i=0; i<leaf->n_leafbrushes; i++)
+				{
+				int brush = leafbrushes[leaf->leafbrush + i];
+				struct bsp_brush *br = &brushes[brush];
+
+				if (stamps[brush] == b->stamp[thread]) continue;
+				stamps[brush] = b->stamp[thread];
+				if (br->texture < 0 || br->texture >= n_textures) continue;
+				if (!(textures[br->texture].contents & (CONTENTS_SOLID | CONTENTS_PLAYERCLIP))) continue;
+
+				voxelize_brush(b, &b->lists[thread], br, box_mins, box_maxs);
+				}
+			}
+		}
+	}
+
+static int
+compare_spans(const void *a, const void *b)
+	{
+	const struct nav_span *sa = a, *sb = b;
+
+	if (sa->column != sb->column) return sa->column - sb->column;
+	return sa->zlo - sb->zlo;
+	}
+
+/***
+All threads' spans sorted by column and height and joined where
+they touch; the top of a joined span is walkable if the highest of
+its parts is. The gaps between the spans with room for a player
+become the floors.
+***/
+static void
+merge_spans(struct nav_build *b, int n_threads)
+	{
+	struct bsp_leaf *leaves = b->bsp->directory[LEAVES].data;
+	int n_columns = b->width*b->height;
+	long n_spans = 0, n_all;
+	struct nav_span *all;
+	int i, j, t;
+
+	for (t=0; t<n_threads; t++) n_spans += b->lists[t].n_spans;
+	n_all = n_spans;
+	all = nav_alloc(b, sizeof(struct nav_span)*n_all);
+	for (t=0, n_spans=0; t<n_threads; t++)
+		{
+		memcpy(&all[n_spans], b->lists[t].spans, sizeof(struct nav_span)*b->lists[t].n_spans);
+		n_spans += b->lists[t].n_spans;
+		}
+	qsort(all, n_spans, sizeof(struct nav_span), compare_spans);
+
+	/* Join in place */
+	for (i=0, j=-1; i<n_spans; i++)
+		{
+		if (j >= 0 && all[j].column == all[i].column && all[i].zlo <= all[j].zhi)
+			{
+			if (all[i].zhi > all[j].zhi)
+				{
+				all[j].zhi = all[i].zhi;
+				all[j].walkable = all[i].walkable;
+				}
+			else if (all[i].zhi == all[j].zhi) all[j].walkable |= all[i].walkable;
+			continue;
+			}
+		all[++j] = all[i];
+		}
+	n_spans = j+1;
+
+	b->floor_first = nav_alloc(b, sizeof(int)*(n_columns+1));
+	b->floors = nav_alloc(b, sizeof(struct nav_floor)*(n_spans+1));
+	b->n_floors = 0;
+	for (i=0, j=0; i<n_columns; i++)
+		{
+		b->floor_first[i] = b->n_floors;
+		for (; j<n_spans && all[j].column == i; j++)
+			{
+			int ceiling = j+1 < n_spans && all[j+1].column == i ? all[j+1].zlo : NAV_OPEN;
+			struct nav_floor *f;
+
+			if (!all[j].walkable) continue;
+			if ((ceiling - all[j].zhi)*NAV_CELL_HEIGHT < NAV_AGENT_HEIGHT) continue;
+			/* The tops of the sky and outer walls are outside the world */
+			if (leaves[findLeaf(b->bsp, b->origin[0] + (i%b->width + 0.5f)*NAV_CELL_SIZE,
+					b->origin[1] + (i/b->width + 0.5f)*NAV_CELL_SIZE,
+					b->origin[2] + all[j].zhi*NAV_CELL_HEIGHT + NAV_AGENT_CLIMB)].cluster < 0)
+				continue;
+
+			f = &b->floors[b->n_floors++];
+			f->z = all[j].zhi;
+			f->ceiling = ceiling;
+			f->region = 0;
+			f->dist = 0;
+			f->poly = -1;
+			f->x = i%b->width;
+			f->y = i/b->width;
+			}
+		}
+	b->floor_first[n_columns] = b->n_floors;
+
+	nav_free(b, all, sizeof(struct nav_span)*n_all);
+	}
+
+static const int g_dx[4] = {1, 0, -1, 0};
+static const int g_dy[4] = {0, 1, 0, -1};
+
+/* A player can step from a floor to one beside it if it's near the same height with room above both */
+static void
+link_rows(void *ctx, int begin, int end, int thread)
+	{
+	struct nav_build *b = ctx;
+	int x, y, d, i, j;
+
+	for (y=begin; y<end; y++)
+		for (x=0; x<b->width; x++)
+			{
+			int c = y*b->width + x;
+
+			for (i=b->floor_first[c]; i<b->floor_first[c+1]; i++)
+				{
+				struct nav_floor *f = &b->floors[i];
+
+				for (d=0; d<4; d++)
+					{
+					int nx = x + g_dx[d], ny = y + g_dy[d], n;
+
+					f->neighbours[d] = -1;
+					if (nx < 0 || ny < 0 || nx >= b->width || ny >= b->height) continue;
+					n = ny*b->width + nx;
+
+					for (j=b->floor_first[n]; j<b->floor_first[n+1]; j++)
+						{
+						struct nav_floor *g = &b->floors[j];
+						int low = f->z > g->z ? f->z : g->z;
+						int high = f->ceiling < g->ceiling ? f->ceiling : g->ceiling;
+
+						if (abs(g->z - f->z)*NAV_CELL_HEIGHT > NAV_AGENT_CLIMB) continue;
+						if ((high - low)*NAV_CELL_HEIGHT < NAV_AGENT_HEIGHT) continue;
+						f->neighbours[d] = j;
+						break;
+						}
+					}
+				}
+			}
+	}
+
+/***
+Keep the player's radius off the edges: a floor missing a neighbour
+is 0 from the edge, the floors next to those 1 and so on. Floors
+closer than the radius are dropped and unlinked.
+***/
+static void
+erode(struct nav_build *b)
+	{
+	int radius = (int)ceilf(NAV_AGENT_RADIUS/NAV_CELL_SIZE);
+	int pass, i, d;
+
+	for (i=0; i<b->n_floors; i++)
+		{
+		struct nav_floor *f = &b->floors[i];
+
+		f->dist = radius;
+		for (d=0; d<4; d++)
+			if (f->neighbours[d] < 0) f->dist = 0;
+		}
+
+	for (pass=0; pass<radius-1; pass++)
+		for (i=0; i<b->n_floors; i++)
+			{
+			struct nav_floor *f = &b->floors[i];
+
+			if (f->dist < radius) continue;
+			for (d=0; d<4; d++)
+				if (b->floors[f->neighbours[d]].dist == pass) f->dist = pass+1;
+			}
+
+	for (i=0; i<b->n_floors; i++)
+		if (b->floors[i].dist < radius) b->floors[i].region = -1;
+
+	for (i=0; i<b->n_floors; i++)
+		for (d=0; d<4; d++)
+			{
+			int n = b->floors[i].neighbours[d];
+			if (n >= 0 && b->floors[n].region < 0) b->floors[i].neighbours[d] = -1;
+			}
+	}
+
+/* Flood fill the linked floors into regions, too small ones are dropped */
+static int
+find_regions(struct nav_build *b)
+	{
+	int *queue = nav_alloc(b, sizeof(int)*(b->n_floors+1));
+	int n_regions = 0;
+	int i, d;
+
+	for (i=0; i<b->n_floors; i++)
+		{
+		int head = 0, tail = 0, k;
+
+		if (b->floors[i].region != 0) continue;
+
+		b->floors[i].region = n_regions+1;
+		queue[tail++] = i;
+		while (head < tail)
+			{
+			struct nav_floor *f = &b->floors[queue[head++]];
+
+			for (d=0; d<4; d++)
+				{
+				int n = f->neighbours[d];
+
+				if (n < 0 || b->floors[n].region != 0) continue;
+				b->floors[n].region = n_regions+1;
+				queue[tail++] = n;
+				}
+			}
+
+		if (tail < NAV_MIN_REGION)
+			{
+			for (k=0; k<tail; k++) b->floors[queue[k]].region = -1;
+			continue;
+			}
+		n_regions++;
+		}
+
+	nav_free(b, queue, sizeof(int)*(b->n_floors+1));
+	return n_regions;
+	}
+
+/* The floor beside f in direction d if it can take part in the quad */
+static int
+free_neighbour(struct nav_build *b, int f, int d, int region)
+	{
+	int n = b->floors[f].neighbours[d];
+
+	if (n < 0 || b->floors[n].poly >= 0 || b->floors[n].region != region) return -1;
+	return n;
+	}
+
+struct vertex_hash {
+	int *keys; /*index into vertices, -1 empty*/
+	int size;
+};
+
+static unsigned int
+add_vertex(struct navmesh *nav, struct vertex_hash *h, int x, int y, int z)
+	{
+	unsigned int slot;
+
+	/* Clamped before hashing, it's the stored value that is compared */
+	if (z < 0) z = 0;
+	if (z > 65535) z = 65535;
+	slot = ((unsigned int)x*73856093u ^ (unsigned int)y*19349663u ^ (unsigned int)z*83492791u) & (h->size-1);
+	while (h->keys[slot] >= 0)
+		{
+		unsigned short *v = nav->vertices[h->keys[slot]];
+		if (v[0] == x && v[1] == y && v[2] == z) return h->keys[slot];
+		slot = (slot+1) & (h->size-1);
+		}
+
+	h->keys[slot] = nav->n_vertices;
+	nav->vertices[nav->n_vertices][0] = x;
+	nav->vertices[nav->n_vertices][1] = y;
+	nav->vertices[nav->n_vertices][2] = z;
+	return nav->n_vertices++;
+	}
+
+static int
+compare_links(const void *a, const void *b)
+	{
+	const unsigned int *la = a, *lb = b;
+
+	if (la[0] != lb[0]) return la[0] < lb[0] ? -1 : 1;
+	if (la[1] != lb[1]) return la[1] < lb[1] ? -1 : 1;
+	return 0;
+	}
+
+/***
+Cover each region with quads, greedily: from the first free floor
+grow along x while the height keeps changing by the same step, then
+add rows along y while every floor in the row fits the same plane.
+Flat floors and even ramps come out as one quad each.
+***/
+static void
+build_polys(struct nav_build *b, struct navmesh *nav)
+	{
+	int *row = nav_alloc(b, sizeof(int)*(b->width+1));
+	int *next = nav_alloc(b, sizeof(int)*(b->width+1));
+	int max_polys = b->n_floors+1;
+	struct vertex_hash h;
+	unsigned int (*pairs)[2];
+	int n_pairs = 0, max_pairs;
+	int i, j, k, d;
+
+	nav->polys = malloc(sizeof(unsigned int)*4*max_polys);
+	nav->regions = malloc(sizeof(unsigned short)*max_polys);
+	nav->vertices = malloc(sizeof(unsigned short)*3*4*max_polys);
+	nav_account(b, (sizeof(unsigned int)*4 + sizeof(unsigned short)*13)*max_polys);
+	for (h.size=64; h.size < 8*max_polys; h.size *= 2);
+	h.keys = nav_alloc(b, sizeof(int)*h.size);
+	memset(h.keys, 0xff, sizeof(int)*h.size);
+
+	for (i=0; i<b->n_floors; i++)
+		{
+		struct nav_floor *f = &b->floors[i];
+		int region = f->region;
+		int w = 1, rows = 1, dzx = 0, dzy = 0, z2, x0, y0, n;
+
+		if (region <= 0 || f->poly >= 0) continue;
+
+		row[0] = i;
+		while ((n = free_neighbour(b, row[w-1], 0, region)) >= 0)
+			{
+			int dz = b->floors[n].z - b->floors[row[w-1]].z;
+
+			if (w == 1) dzx = dz;
+			else if (dz != dzx) break;
+			row[w++] = n;
+			}
+		for (k=0; k<w; k++) b->floors[row[k]].poly = nav->n_polys;
+
+		while (1)
+			{
+			for (k=0; k<w; k++)
+				{
+				next[k] = free_neighbour(b, row[k], 1, region);
+				if (next[k] < 0) break;
+				if (rows == 1 && k == 0) dzy = b->floors[next[0]].z - b->floors[row[0]].z;
+				if (b->floors[next[k]].z != b->floors[i].z + k*dzx + rows*dzy) break;
+				if (k > 0 && b->floors[next[k-1]].neighbours[0] != next[k]) break;
+				}
+			if (k < w) break;
+
+			for (k=0; k<w; k++)
+				{
+				b->floors[next[k]].poly = nav->n_polys;
+				row[k] = next[k];
+				}
+			rows++;
+			}
+		if (rows == 1) dzy = 0;
+
+		/* Corners in half cell heights, on the plane through the middles of the floors */
+		x0 = f->x;
+		y0 = f->y;
+		z2 = 2*f->z;
+		nav->polys[nav->n_polys][0] = add_vertex(nav, &h, x0, y0, z2 - dzx - dzy);
+		nav->polys[nav->n_polys][1] = add_vertex(nav, &h, x0+w, y0, z2 + (2*w-1)*dzx - dzy);
+		nav->polys[nav->n_polys][2] = add_vertex(nav, &h, x0+w, y0+rows, z2 + (2*w-1)*dzx + (2*rows-1)*dzy);
+		nav->polys[nav->n_polys][3] = add_vertex(nav, &h, x0, y0+rows, z2 - dzx + (2*rows-1)*dzy);
+		nav->regions[nav->n_polys] = region-1;
+		nav->n_polys++;
+		}
+
+	/* Quads are linked where a player can step from a floor of one to a floor of the other */
+	max_pairs = 1024;
+	pairs = malloc(sizeof(unsigned int)*2*max_pairs);
+	for (i=0; i<b->n_floors; i++)
+		{
+		int p = b->floors[i].poly;
+
+		if (p < 0) continue;
+		for (d=0; d<4; d++)
+			{
+			int n = b->floors[i].neighbours[d];
+			int q = n >= 0 ? b->floors[n].poly : -1;
+
+			if (q < 0 || q == p) continue;
+			if (n_pairs == max_pairs)
+				{
+				max_pairs *= 2;
+				pairs = realloc(pairs, sizeof(unsigned int)*2*max_pairs);
+				}
+			pairs[n_pairs][0] = p;
+			pairs[n_pairs][1] = q;
+			n_pairs++;
+			}
+		}
+	nav_account(b, sizeof(unsigned int)*2*max_pairs);
+	qsort(pairs, n_pairs, sizeof(unsigned int)*2, compare_links);
+
+	nav->link_first = malloc(sizeof(unsigned int)*(nav->n_polys+1));
+	nav->links = malloc(sizeof(unsigned int)*(n_pairs+1));
+	nav->n_links = 0;
+	for (i=0, j=0; i<nav->n_polys; i++)
+		{
+		nav->link_first[i] = nav->n_links;
+		for (; j<n_pairs && pairs[j][0] == (unsigned int)i; j++)
+			if (nav->n_links == (int)nav->link_first[i] || nav->links[nav->n_links-1] != pairs[j][1])
+				nav->links[nav->n_links++] = pairs[j][1];
+		}
+	nav->link_first[nav->n_polys] = nav->n_links;
+
+	nav_free(b, pairs, sizeof(unsigned int)*2*max_pairs);
+	nav_free(b, h.keys, sizeof(int)*h.size);
+	nav_free(b, row, sizeof(int)*(b->width+1));
+	nav_free(b, next, sizeof(int)*(b->width+1));
+	}
+
+struct navmesh *
+navmeshBuild(struct bsp *bsp, struct jobs *jobs)
+	{
+	struct bsp_node *root = bsp->directory[NODES].data;
+	int n_threads = jobs ? jobsThreadCount(jobs) : 1;
+	struct nav_build b = {0};
+	struct navmesh *nav;
+	double t0 = jobsTime(), t;
+	long n_spans = 0;
+	int i, k;
+
+	nav = calloc(1, sizeof(struct navmesh));
+	nav->cell_size = NAV_CELL_SIZE;
+	nav->cell_height = NAV_CELL_HEIGHT;
+	if (bsp->directory[NODES].length < (int)sizeof(struct bsp_node)) return nav;
+
+	b.bsp = bsp;
+	for (k=0; k<3; k++) b.origin[k] = nav->origin[k] = root->mins[k];
+	b.width = (int)ceilf((root->maxs[0] - root->mins[0])/NAV_CELL_SIZE);
+	b.height = (int)ceilf((root->maxs[1] - root->mins[1])/NAV_CELL_SIZE);
+	b.top = (int)ceilf((root->maxs[2] - root->mins[2])/NAV_CELL_HEIGHT);
+	if (b.width > 65535 || b.height > 65535 || b.top > 32767) error(-1, "Navmesh: map too big for the grid.");
+
+	/* Solid spans, a subtree at a time */
+	b.n_brushes = bsp->directory[BRUSHES].length/sizeof(struct bsp_brush);
+	find_subtrees(&b, n_threads*SUBTREES_PER_THREAD);
+	b.lists = calloc(n_threads, sizeof(struct span_list));
+	b.brush_stamps = malloc(sizeof(int *)*n_threads);
+	b.stamp = calloc(n_threads, sizeof(int));
+	for (i=0; i<n_threads; i++) b.brush_stamps[i] = nav_alloc(&b, sizeof(int)*(b.n_brushes+1));
+	for (i=0; i<n_threads; i++) memset(b.brush_stamps[i], 0, sizeof(int)*(b.n_brushes+1));
+
+	t = jobsTime();
+	jobsParallelFor(jobs, b.n_subtrees, 1, voxelize_subtrees, &b);
+	for (i=0; i<n_threads; i++)
+		{
+		n_spans += b.lists[i].n_spans;
+		nav_account(&b, sizeof(struct nav_span)*b.lists[i].max_spans);
+		}
+	printf("Navmesh: %ix%i columns, %li spans from %i subtrees in %.2f ms on %i threads\n",
+		b.width, b.height, n_spans, b.n_subtrees, (jobsTime() - t)*1000, n_threads);
+
+	t = jobsTime();
+	merge_spans(&b, n_threads);
+	for (i=0; i<n_threads; i++)
+		{
+		nav_free(&b, b.lists[i].spans, sizeof(struct nav_span)*b.lists[i].max_spans);
+		nav_free(&b, b.brush_stamps[i], sizeof(int)*(b.n_brushes+1));
+		}
+	jobsParallelFor(jobs, b.height, 16, link_rows, &b);
+	printf("Navmesh: %i floors, merged and linked in %.2f ms\n", b.n_floors, (jobsTime() - t)*1000);
+
+	t = jobsTime();
+	erode(&b);
+	nav->n_regions = find_regions(&b);
+	build_polys(&b, nav);
+	printf("Navmesh: %i regions, %i quads, %i vertices, %i links in %.2f ms\n",
+		nav->n_regions, nav->n_polys, nav->n_vertices, nav->n_links, (jobsTime() - t)*1000);
+
+	nav_free(&b, b.floors, sizeof(struct nav_floor)*(b.n_floors+1));
+	nav_free(&b, b.floor_first, sizeof(int)*(b.width*b.height+1));
+	free(b.subtrees);
+	free(b.lists);
+	free(b.brush_stamps);
+	free(b.stamp);
+
+	nav->peak_bytes = b.peak_bytes;
+	nav->build_time = jobsTime() - t0;
+	return nav;
+	}
+
+void
+navmeshFree(struct navmesh *nav)
+	{
+	if (!nav) return;
+	free(nav->vertices);
+	free(nav->polys);
+	free(nav->regions);
+	free(nav->link_first);
+	free(nav->links);
+	free(nav);
+	}
+
+int
+navmeshWrite(struct navmesh *nav, char *path)
+	{
+	FILE *fp = fopen(path, "wb");
+	int version = NAV_VERSION;
+
+	if (!fp) return -1;
+
+	fwrite(NAV_MAGIC, 4, 1, fp);
+	fwrite(&version, sizeof(int), 1, fp);
+	fwrite(nav->origin, sizeof(float), 3, fp);
+	fwrite(&nav->cell_size, sizeof(float), 1, fp);
+	fwrite(&nav->cell_height, sizeof(float), 1, fp);
+	fwrite(&nav->n_vertices, sizeof(int), 1, fp);
+	fwrite(&nav->n_polys, sizeof(int), 1, fp);
+	fwrite(&nav->n_links, sizeof(int), 1, fp);
+	fwrite(nav->vertices, sizeof(unsigned short)*3, nav->n_vertices, fp);
+	fwrite(nav->polys, sizeof(unsigned int)*4, nav->n_polys, fp);
+	fwrite(nav->regions, sizeof(unsigned short), nav->n_polys, fp);
+	fwrite(nav->link_first, sizeof(unsigned int), nav->n_polys+1, fp);
+	fwrite(nav->links, sizeof(unsigned int), nav->n_links, fp);
+
+	return fclose(fp) ? -1 : 0;
+	}
+
+int
+navmeshGenerate(struct bsp *bsp, char *out_file, int n_threads)
+	{
+	struct jobs *jobs = jobsCreate(n_threads);
+	struct navmesh *nav = navmeshBuild(bsp, jobs);
+	/* Magic, version, origin, the cell sizes and the three counts */
+	long size = 4 + 4*9 + 6L*nav->n_vertices + 18L*nav->n_polys + 4L*(nav->n_polys+1) + 4L*nav->n_links;
+
+	printf("Navmesh: built in %.2f ms on %i threads, %.2f MB peak working memory\n",
+		nav->build_time*1000, jobsThreadCount(jobs), nav->peak_bytes/(1024.0*1024.0));
+
+	if (navmeshWrite(nav, out_file) != 0) error(-1, "Failed to write navigation mesh.");
+	printf("Navmesh: wrote %s, %li bytes\n", out_file, size);
+
+	navmeshFree(nav);
+	jobsDestroy(jobs);
+	return 0;
+	}
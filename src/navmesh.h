@@ -0,0 +1,64 @@
+#ifndef NAVMESH_H
+#define NAVMESH_H
+
+#include "bsp.h"
+#include "jobs.h"
+
+/***
+Walkable surface extraction for bots, after Recast.
+The solid and player clip brushes are voxelized into columns of
+solid spans, each BSP subtree on its own worker; the tops of spans
+with room for a player above them are the floors. Floors link to
+the floors beside them that a player can step to, the edges are
+eroded by the player's radius, connected floors are grouped into
+regions and each region is covered with planar quads. Quads that
+share an edge are linked.
+***/
+
+/* Grid and player, in world units */
+#define NAV_CELL_SIZE (8.0f)
+#define NAV_CELL_HEIGHT (4.0f)
+#define NAV_AGENT_HEIGHT (56.0f)
+#define NAV_AGENT_CLIMB (18.0f)
+#define NAV_AGENT_RADIUS (16.0f)
+/* Steepest walkable floor, normal z, as MIN_WALK_NORMAL in Quake 3 */
+#define NAV_WALK_NORMAL (0.7f)
+/* Smaller regions are dropped, in cells */
+#define NAV_MIN_REGION (8)
+
+/***
+File layout, little endian:
+	"NAVM", int version, float origin[3], float cell_size, cell_height,
+	int n_vertices, n_polys, n_links,
+	unsigned short vertices[n_vertices][3] (cells, cells, half cell heights),
+	unsigned int polys[n_polys][4] (vertices, counter clockwise from above),
+	unsigned short regions[n_polys],
+	unsigned int link_first[n_polys+1], unsigned int links[n_links]
+***/
+#define NAV_MAGIC "NAVM"
+#define NAV_VERSION (1)
+
+struct navmesh {
+	float origin[3];
+	float cell_size, cell_height;
+	int n_vertices;
+	unsigned short (*vertices)[3];
+	int n_polys;
+	unsigned int (*polys)[4];
+	unsigned short *regions;
+	unsigned int *link_first; /*links of poly p are links[link_first[p]..link_first[p+1]-1]*/
+	int n_links;
+	unsigned int *links;
+	int n_regions;
+
+	double build_time;
+	long peak_bytes; /*working memory while building*/
+};
+
+struct navmesh *navmeshBuild(struct bsp *bsp, struct jobs *jobs);
+void navmeshFree(struct navmesh *nav);
+int navmeshWrite(struct navmesh *nav, char *path);
+/* The --navmesh tool, n_threads <= 0 uses every core */
+int navmeshGenerate(struct bsp *bsp, char *out_file, int n_threads);
+
+#endif /* NAVMESH_H */
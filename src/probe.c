@@ -0,0 +1,767 @@
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "error.h"
+#include "jobs.h"
+#include "frustum.h"
+#include "probe.h"
+
+/* Surface flags of the texture */
+#define SURF_SKY (0x4)
+#define SURF_NODRAW (0x80)
+/* Player's eyes above the spawn's origin, as spawnPlayer */
+#define EYE_HEIGHT (26.0f)
+#define PROBE_NEAR (1.0f)
+#define LM_SIZE (128)
+
+enum {FACE_SKIP = 1, FACE_SKY = 2, FACE_PLANAR = 4};
+
+extern int g_bezier_steps;
+
+static char *view_names[PROBE_VIEWS] = {"px", "nx", "py", "ny", "pz", "nz", "thumb"};
+
+/* Forward and up of the cube faces, right is forward x up */
+static float cube_axes[6][2][3] = {
+	{{1, 0, 0}, {0, 0, 1}},
+	{{-1, 0, 0}, {0, 0, 1}},
+	{{0, 1, 0}, {0, 0, 1}},
+	{{0, -1, 0}, {0, 0, 1}},
+	{{0, 0, 1}, {-1, 0, 0}},
+	{{0, 0, -1}, {1, 0, 0}}
+};
+
+static unsigned char sky_color[3] = {96, 112, 160};
+
+struct probe_vertex {
+	float position[3];
+	float uv[2]; /*lightmap*/
+	float color[3]; /*0..255, for faces without a lightmap*/
+};
+
+/* Every face as triangles, patches tessellated as drawPatch does */
+struct probe_scene {
+	struct probe_vertex *vertices;
+	int n_vertices, max_vertices;
+	int *indices;
+	int n_indices, max_indices;
+	int *face_first; /*n_faces+1 offsets into indices*/
+	float (*bounds)[2][3];
+	unsigned char *flags;
+	float (*normals)[3];
+	unsigned char *lightmaps; /*lightened, as the viewer shows them*/
+	int n_lightmaps;
+};
+
+struct probe_face {
+	int face;
+	int model; /*placed brush model, -1 for the world*/
+};
+
+struct probe {
+	float origin[3];
+	float yaw;
+	struct probe_face *faces; /*what the PVS lets it see*/
+	int n_faces;
+	float ambient[6][3];
+};
+
+struct probe_target {
+	unsigned char *color;
+	float *depth; /*1/z, 0 is nothing*/
+	long n_triangles;
+	double render_time;
+};
+
+struct probe_job {
+	struct bsp *bsp;
+	struct map *map;
+	struct probe_scene *scene;
+	struct probe *probes;
+	int n_probes;
+	struct probe_target *targets;
+	int size;
+	char *out_dir;
+	int n_failed;
+};
+
+/* A vertex being clipped: view space position, then uv and colour */
+struct clip_vertex {
+	float p[3];
+	float a[5];
+};
+
+static void
+cross(float a[3], float b[3], float out[3])
+	{
+	out[0] = a[1]*b[2] - a[2]*b[1];
+	out[1] = a[2]*b[0] - a[0]*b[2];
+	out[2] = a[0]*b[1] - a[1]*b[0];
+	}
+
+static float
+dot(float a[3], float b[3])
+	{
+	return a[0]*b[0] + a[1]*b[1] + a[2]*b[2];
+	}
+
+static int
+add_vertex(struct probe_scene *s, float position[3], float uv[2], unsigned char *color)
+	{
+	struct probe_vertex *v;
+
+	if (s->n_vertices == s->max_vertices)
+		{
+		s->max_vertices = s->max_vertices ? s->max_vertices*2 : 4096;
+		s->vertices = realloc(s->vertices, sizeof(struct probe_vertex)*s->max_vertices);
+		}
+	v = &s->vertices[s->n_vertices];
+	memcpy(v->position, position, sizeof(float)*3);
+	memcpy(v->uv, uv, sizeof(float)*2);
+	v->color[0] = color ? color[0] : 255;
+	v->color[1] = color ? color[1] : 255;
+	v->color[2] = color ? color[2] : 255;
+
+	return s->n_vertices++;
+	}
+
+static void
+add_index(struct probe_scene *s, int index)
+	{
+	if (s->n_indices == s->max_indices)
+		{
+		s->max_indices = s->max_indices ? s->max_indices*2 : 16384;
+		s->indices = realloc(s->indices, sizeof(int)*s->max_indices);
+		}
+	s->indices[s->n_indices++] = index;
+	}
+
+static void
+tessellate_patch(struct probe_scene *s, struct bsp_face *face, struct bsp_vertex *verts)
+	{
+	int w = face->size[0];
+	int pw = (w-1)/2;
+	int ph = (face->size[1]-1)/2;
+	int steps = g_bezier_steps;
+	float patch[3][3][5];
+	int i, x, y;
+
+	for (i=0; i<pw*ph; i++)
+		{
+		int first = s->n_vertices;
+
+		bspPatchControlPoints(face, &verts[face->vertex], i, patch);
+
+		for (y=0; y<=steps; y++)
+			for (x=0; x<=steps; x++)
+				{
+				float p[5] = {0};
+				get_point_on_patch(patch, (float)x/steps, (float)y/steps, p);
+				add_vertex(s, p, p+3, 0);
+				}
+
+		for (y=0; y<steps; y++)
+			for (x=0; x<steps; x++)
+				{
+				int v00 = first + y*(steps+1) + x;
+				int v10 = v00 + 1, v01 = v00 + steps+1, v11 = v01 + 1;
+
+				add_index(s, v00); add_index(s, v01); add_index(s, v10);
+				add_index(s, v10); add_index(s, v01); add_index(s, v11);
+				}
+		}
+	}
+
+static struct probe_scene *
+build_scene(struct bsp *bsp)
+	{
+	struct bsp_face *faces = bsp->directory[FACES].data;
+	int n_faces = bsp->directory[FACES].length/sizeof(struct bsp_face);
+	struct bsp_vertex *verts = bsp->directory[VERTEXES].data;
+	int n_verts = bsp->directory[VERTEXES].length/sizeof(struct bsp_vertex);
+	int *meshverts = bsp->directory[MESHVERTS].data;
+	struct texture *textures = bsp->directory[TEXTURES].data;
+	int n_textures = bsp->directory[TEXTURES].length/sizeof(struct texture);
+	struct probe_scene *s = calloc(1, sizeof(struct probe_scene));
+	unsigned char *lump = bsp->directory[LIGHTMAPS].data;
+	int i, j, k;
+
+	s->face_first = malloc(sizeof(int)*(n_faces+1));
+	s->bounds = malloc(sizeof(float)*6*(n_faces+1));
+	s->normals = malloc(sizeof(float)*3*(n_faces+1));
+	s->flags = calloc(n_faces+1, 1);
+
+	/* The BSP's own vertices first, faces of type 1 and 3 index them */
+	for (i=0; i<n_verts; i++) add_vertex(s, verts[i].position, verts[i].texcoord[1], verts[i].color);
+
+	for (i=0; i<n_faces; i++)
+		{
+		struct bsp_face *face = &faces[i];
+		int first = s->n_indices;
+
+		s->face_first[i] = first;
+		memcpy(s->normals[i], face->normal, sizeof(float)*3);
+		if (face->texture >= 0 && face->texture < n_textures)
+			{
+			if (textures[face->texture].flags & SURF_NODRAW) s->flags[i] |= FACE_SKIP;
+			if (textures[face->texture].flags & SURF_SKY) s->flags[i] |= FACE_SKY;
+			}
+
+		switch (face->type)
+			{
+			case 1:
+				s->flags[i] |= FACE_PLANAR;
+				/* fall through */
+			case 3:
+				for (j=0; j<face->n_meshverts; j++)
+					add_index(s, face->vertex + meshverts[face->meshvert + j]);
+				break;
+			case 2:
+				tessellate_patch(s, face, verts);
+				break;
+			default:
+				s->flags[i] |= FACE_SKIP;
+			}
+
+		for (k=0; k<3; k++)
+			{
+			s->bounds[i][0][k] = 1e30f;
+			s->bounds[i][1][k] = -1e30f;
+			}
+		for (j=first; j<s->n_indices; j++)
+			{
+			float *p = s->vertices[s->indices[j]].position;
+			for (k=0; k<3; k++)
+				{
+				if (p[k] < s->bounds[i][0][k]) s->bounds[i][0][k] = p[k];
+				if (p[k] > s->bounds[i][1][k]) s->bounds[i][1][k] = p[k];
+				}
+			}
+		}
+	s->face_first[n_faces] = s->n_indices;
+
+	s->n_lightmaps = bsp->directory[LIGHTMAPS].length/(LM_SIZE*LM_SIZE*3);
+	s->lightmaps = malloc((long)LM_SIZE*LM_SIZE*3*s->n_lightmaps + 1);
+	for (i=0; i<LM_SIZE*LM_SIZE*3*s->n_lightmaps; i++)
+		{
+		float c = lump[i]*LIGHTEN;
+		s->lightmaps[i] = c > 255 ? 255 : c;
+		}
+
+	return s;
+	}
+
+static void
+free_scene(struct probe_scene *s)
+	{
+	free(s->vertices);
+	free(s->indices);
+	free(s->face_first);
+	free(s->bounds);
+	free(s->normals);
+	free(s->flags);
+	free(s->lightmaps);
+	free(s);
+	}
+
+/* Every info_player_deathmatch, in entity order as spawnPlayer counts them */
+static int
+find_probes(struct map *map, struct probe **probes)
+	{
+	int n = 0;
+	int i;
+
+	*probes = calloc(map->n_entities+1, sizeof(struct probe));
+	for (i=0; i<map->n_entities; i++)
+		{
+		struct entity_property *prop = entityGetPropertyByName(&map->entities[i], "classname");
+		struct probe *p = &(*probes)[n];
+
+		if (!prop || strcmp(prop->value, "info_player_deathmatch")) continue;
+
+		prop = entityGetPropertyByName(&map->entities[i], "origin");
+		if (prop) sscanf(prop->value, "%f %f %f", &p->origin[0], &p->origin[1], &p->origin[2]);
+		p->origin[2] += EYE_HEIGHT;
+		prop = entityGetPropertyByName(&map->entities[i], "angle");
+		if (prop) sscanf(prop->value, "%f", &p->yaw);
+		n++;
+		}
+
+	return n;
+	}
+
+/***
+The faces of every leaf in a cluster the probe's PVS lets through,
+each once, and the placed brush models in those clusters. Outside
+the world (no cluster) everything is taken.
+***/
+static void
+gather_faces(struct bsp *bsp, struct map *map, struct probe *p, unsigned char *stamps)
+	{
+	struct bsp_leaf *leaves = bsp->directory[LEAVES].data;
+	int n_leaves = bsp->directory[LEAVES].length/sizeof(struct bsp_leaf);
+	int *leaffaces = bsp->directory[LEAFFACES].data;
+	struct bsp_model *models = bsp->directory[MODELS].data;
+	int n_faces = bsp->directory[FACES].length/sizeof(struct bsp_face);
+	void *visdata = bsp->directory[VISDATA].data;
+	int have_vis = bsp->directory[VISDATA].length > 8;
+	int cluster = findCluster(bsp, p->origin[0], p->origin[1], p->origin[2]);
+	int max_faces = 1024;
+	int i, j;
+
+	memset(stamps, 0, n_faces);
+	p->faces = malloc(sizeof(struct probe_face)*max_faces);
+	p->n_faces = 0;
+
+	for (i=0; i<n_leaves; i++)
+		{
+		struct bsp_leaf *leaf = &leaves[i];
+
+		if (leaf->cluster < 0) continue;
+		if (cluster >= 0 && have_vis && !clusterIsVisible(cluster, leaf->cluster, visdata)) continue;
+
+		for (j=0; j<leaf->n_leaffaces; j++)
+			{
+			int f = leaffaces[leaf->leafface + j];
+
+			if (f < 0 || f >= n_faces || stamps[f]) continue;
+			stamps[f] = 1;
+			if (p->n_faces == max_faces)
+				{
+				max_faces *= 2;
+				p->faces = realloc(p->faces, sizeof(struct probe_face)*max_faces);
+				}
+			p->faces[p->n_faces].face = f;
+			p->faces[p->n_faces].model = -1;
+			p->n_faces++;
+			}
+		}
+
+	for (i=0; i<map->n_models; i++)
+		{
+		struct model_instance *inst = &map->models[i];
+		struct bsp_model *model = &models[inst->model];
+		int visible = cluster < 0 || !have_vis || !inst->n_clusters;
+
+		for (j=0; j<inst->n_clusters && !visible; j++)
+			visible = clusterIsVisible(cluster, inst->clusters[j], visdata);
+		if (!visible) continue;
+
+		for (j=0; j<model->n_faces; j++)
+			{
+			if (p->n_faces == max_faces)
+				{
+				max_faces *= 2;
+				p->faces = realloc(p->faces, sizeof(struct probe_face)*max_faces);
+				}
+			p->faces[p->n_faces].face = model->face + j;
+			p->faces[p->n_faces].model = i;
+			p->n_faces++;
+			}
+		}
+	}
+
+static void
+gather_range(void *ctx, int begin, int end, int thread)
+	{
+	struct probe_job *job = ctx;
+	unsigned char *stamps = malloc(job->bsp->directory[FACES].length/sizeof(struct bsp_face) + 1);
+	int i;
+
+	for (i=begin; i<end; i++) gather_faces(job->bsp, job->map, &job->probes[i], stamps);
+	free(stamps);
+	}
+
+static void
+sample_lightmap(struct probe_scene *s, int lm, float u, float v, unsigned char *out)
+	{
+	unsigned char *texels = s->lightmaps + (long)LM_SIZE*LM_SIZE*3*lm;
+	float x = u*LM_SIZE - 0.5f, y = v*LM_SIZE - 0.5f;
+	int x0, y0, x1, y1, k;
+	float fx, fy;
+
+	if (x < 0) x = 0;
+	if (y < 0) y = 0;
+	if (x > LM_SIZE-1) x = LM_SIZE-1;
+	if (y > LM_SIZE-1) y = LM_SIZE-1;
+	x0 = (int)x;
+	y0 = (int)y;
+	x1 = x0 < LM_SIZE-1 ? x0+1 : x0;
+	y1 = y0 < LM_SIZE-1 ? y0+1 : y0;
+	fx = x - x0;
+	fy = y - y0;
+
+	for (k=0; k<3; k++)
+		{
+		float top = texels[(y0*LM_SIZE + x0)*3 + k]*(1-fx) + texels[(y0*LM_SIZE + x1)*3 + k]*fx;
+		float bottom = texels[(y1*LM_SIZE + x0)*3 + k]*(1-fx) + texels[(y1*LM_SIZE + x1)*3 + k]*fx;
+		out[k] = top*(1-fy) + bottom*fy + 0.5f;
+		}
+	}
+
+/***
+One screen space triangle: x, y in pixels, then 1/z and the
+attributes divided by z, for perspective correct interpolation.
+Either winding, back faces were dropped before.
+***/
+static void
+raster_triangle(struct probe_scene *s, struct probe_target *t, int size, float v[3][8], int lm, int sky)
+	{
+	float area = (v[1][0]-v[0][0])*(v[2][1]-v[0][1]) - (v[2][0]-v[0][0])*(v[1][1]-v[0][1]);
+	float min_x, max_x, min_y, max_y;
+	int x0, x1, y0, y1, x, y, k;
+
+	if (fabsf(area) < 1e-8f) return;
+
+	min_x = fminf(v[0][0], fminf(v[1][0], v[2][0]));
+	max_x = fmaxf(v[0][0], fmaxf(v[1][0], v[2][0]));
+	min_y = fminf(v[0][1], fminf(v[1][1], v[2][1]));
+	max_y = fmaxf(v[0][1], fmaxf(v[1][1], v[2][1]));
+	x0 = min_x < 0 ? 0 : (int)min_x;
+	y0 = min_y < 0 ? 0 : (int)min_y;
+	x1 = max_x > size-1 ? size-1 : (int)max_x;
+	y1 = max_y > size-1 ? size-1 : (int)max_y;
+
+	for (y=y0; y<=y1; y++)
+		{
+		float py = y + 0.5f;
+
+		for (x=x0; x<=x1; x++)
+			{
+			float px = x + 0.5f;
+			float b0 = ((v[2][0]-v[1][0])*(py-v[1][1]) - (v[2][1]-v[1][1])*(px-v[1][0]))/area;
+			float b1 = ((v[0][0]-v[2][0])*(py-v[2][1]) - (v[0][1]-v[2][1])*(px-v[2][0]))/area;
+			float b2 = 1 - b0 - b1;
+			float iz, a[5];
+			unsigned char *out;
+			long pixel;
+
+			if (b0 < 0 || b1 < 0 || b2 < 0) continue;
+
+			pixel = (long)y*size + x;
+			iz = b0*v[0][2] + b1*v[1][2] + b2*v[2][2];
+			if (iz <= t->depth[pixel]) continue;
+			t->depth[pixel] = iz;
+
+			out = &t->color[pixel*3];
+			if (sky)
+				{
+				memcpy(out, sky_color, 3);
+				continue;
+				}
+			for (k=0; k<5; k++) a[k] = (b0*v[0][3+k] + b1*v[1][3+k] + b2*v[2][3+k])/iz;
+			if (lm >= 0) sample_lightmap(s, lm, a[0], a[1], out);
+			else for (k=0; k<3; k++) out[k] = a[2+k] < 0 ? 0 : a[2+k] > 255 ? 255 : a[2+k];
+			}
+		}
+	}
+
+/* Keep the part in front of the near plane, at most 4 vertices */
+static int
+clip_near(struct clip_vertex in[3], struct clip_vertex out[4])
+	{
+	int n = 0;
+	int i, k;
+
+	for (i=0; i<3; i++)
+		{
+		struct clip_vertex *a = &in[i], *b = &in[(i+1)%3];
+		int a_in = a->p[2] >= PROBE_NEAR, b_in = b->p[2] >= PROBE_NEAR;
+
+		if (a_in) out[n++] = *a;
+		if (a_in != b_in)
+			{
+			float f = (PROBE_NEAR - a->p[2])/(b->p[2] - a->p[2]);
+			for (k=0; k<3; k++) out[n].p[k] = a->p[k] + (b->p[k] - a->p[k])*f;
+			for (k=0; k<5; k++) out[n].a[k] = a->a[k] + (b->a[k] - a->a[k])*f;
+			n++;
+			}
+		}
+
+	return n;
+	}
+
+static void
+render_view(struct probe_job *job, struct probe *p, int view, struct probe_target *t)
+	{
+	struct probe_scene *s = job->scene;
+	struct bsp_face *faces = job->bsp->directory[FACES].data;
+	int size = job->size;
+	float forward[3], up[3], right[3];
+	struct frustum frustum;
+	int i, j, k;
+
+	if (view < 6)
+		{
+		memcpy(forward, cube_axes[view][0], sizeof(forward));
+		memcpy(up, cube_axes[view][1], sizeof(up));
+		}
+	else
+		{
+		forward[0] = cosf(p->yaw*M_PI/180);
+		forward[1] = sinf(p->yaw*M_PI/180);
+		forward[2] = 0;
+		up[0] = up[1] = 0;
+		up[2] = 1;
+		}
+	cross(forward, up, right);
+
+	/* 90 degrees each way, planes point in */
+	for (k=0; k<3; k++)
+		{
+		frustum.planes[0][k] = forward[k] + right[k];
+		frustum.planes[1][k] = forward[k] - right[k];
+		frustum.planes[2][k] = forward[k] + up[k];
+		frustum.planes[3][k] = forward[k] - up[k];
+		frustum.planes[4][k] = forward[k];
+		frustum.planes[5][k] = 0;
+		}
+	for (i=0; i<4; i++) frustum.planes[i][3] = -dot(frustum.planes[i], p->origin);
+	frustum.planes[4][3] = -dot(forward, p->origin) - PROBE_NEAR;
+	frustum.planes[5][3] = 1;
+
+	memset(t->color, 0, (long)size*size*3);
+	memset(t->depth, 0, sizeof(float)*size*size);
+
+	for (i=0; i<p->n_faces; i++)
+		{
+		int f = p->faces[i].face;
+		float offset[3] = {0, 0, 0};
+		float mins[3], maxs[3], eye[3];
+
+		if (s->flags[f] & FACE_SKIP) continue;
+		if (p->faces[i].model >= 0) memcpy(offset, job->map->models[p->faces[i].model].origin, sizeof(offset));
+
+		for (k=0; k<3; k++)
+			{
+			mins[k] = s->bounds[f][0][k] + offset[k];
+			maxs[k] = s->bounds[f][1][k] + offset[k];
+			eye[k] = p->origin[k] - offset[k];
+			}
+		if (frustumCullBox(&frustum, mins, maxs)) continue;
+
+		/* Planar faces seen from behind */
+		if ((s->flags[f] & FACE_PLANAR) && s->face_first[f+1] > s->face_first[f])
+			{
+			float *v = s->vertices[s->indices[s->face_first[f]]].position;
+			float d[3] = {eye[0]-v[0], eye[1]-v[1], eye[2]-v[2]};
+			if (dot(d, s->normals[f]) <= 0) continue;
+			}
+
+		for (j=s->face_first[f]; j+2<s->face_first[f+1]; j+=3)
+			{
+			struct clip_vertex in[3], clipped[4];
+			float screen[4][8];
+			int n;
+
+			for (k=0; k<3; k++)
+				{
+				struct probe_vertex *pv = &s->vertices[s->indices[j+k]];
+				float d[3] = {pv->position[0] - eye[0], pv->position[1] - eye[1], pv->position[2] - eye[2]};
+
+				in[k].p[0] = dot(d, right);
+				in[k].p[1] = dot(d, up);
+				in[k].p[2] = dot(d, forward);
+				in[k].a[0] = pv->uv[0];
+				in[k].a[1] = pv->uv[1];
+				in[k].a[2] = pv->color[0];
+				in[k].a[3] = pv->color[1];
+				in[k].a[4] = pv->color[2];
+				}
+
+			n = clip_near(in, clipped);
+			if (n < 3) continue;
+
+			for (k=0; k<n; k++)
+				{
+				float iz = 1/clipped[k].p[2];
+				int a;
+
+				screen[k][0] = (clipped[k].p[0]*iz*0.5f + 0.5f)*size;
+				screen[k][1] = (0.5f - clipped[k].p[1]*iz*0.5f)*size;
+				screen[k][2] = iz;
+				for (a=0; a<5; a++) screen[k][3+a] = clipped[k].a[a]*iz;
+				}
+
+			for (k=1; k+1<n; k++)
+				{
+				float tri[3][8];
+
+				memcpy(tri[0], screen[0], sizeof(tri[0]));
+				memcpy(tri[1], screen[k], sizeof(tri[1]));
+				memcpy(tri[2], screen[k+1], sizeof(tri[2]));
+				raster_triangle(s, t, size,  tri,
+					faces[f].lm_index < s->n_lightmaps ? faces[f].lm_index : -1, s->flags[f] & FACE_SKY);
+				t->n_triangles++;
+				}
+			}
+		}
+	}
+
+/* Top down, so the header says so */
+static int
+write_tga(char *name, unsigned char *pixels, int w, int h)
+	{
+	unsigned char header[18] = {0};
+	FILE *fp = fopen(name, "wb");
+	long i;
+
+	if (!fp) return -1;
+
+	header[2] = 2;
+	header[12] = w & 0xff;
+	header[13] = w >> 8;
+	header[14] = h & 0xff;
+	header[15] = h >> 8;
+	header[16] = 24;
+	header[17] = 0x20;
+	fwrite(header, 1, sizeof(header), fp);
+	/* BGR */
+	for (i=0; i<(long)w*h; i++)
+		{
+		unsigned char bgr[3] = {pixels[i*3+2], pixels[i*3+1], pixels[i*3]};
+		fwrite(bgr, 1, 3, fp);
+		}
+
+	return fclose(fp) == 0 ? 0 : -1;
+	}
+
+static void
+view_range(void *ctx, int begin, int end, int thread)
+	{
+	struct probe_job *job = ctx;
+	struct probe_target *t = &job->targets[thread];
+	int i, k;
+
+	for (i=begin; i<end; i++)
+		{
+		struct probe *p = &job->probes[i/PROBE_VIEWS];
+		int view = i%PROBE_VIEWS;
+		long n_pixels = (long)job->size*job->size;
+		double start = jobsTime();
+		char name[1024];
+
+		render_view(job, p, view, t);
+		t->render_time += jobsTime() - start;
+
+		if (view < 6)
+			{
+			double sum[3] = {0, 0, 0};
+			long j;
+
+			for (j=0; j<n_pixels; j++)
+				for (k=0; k<3; k++) sum[k] += t->color[j*3+k];
+			for (k=0; k<3; k++) p->ambient[view][k] = sum[k]/n_pixels;
+			}
+
+		snprintf(name, sizeof(name), "%s/probe%03d_%s.tga", job->out_dir, i/PROBE_VIEWS, view_names[view]);
+		if (write_tga(name, t->color, job->size, job->size) != 0)
+			{
+			printf("Probes: couldn't write %s\n", name);
+			job->n_failed = 1;
+			}
+		}
+	}
+
+static int
+write_probes(struct probe_job *job)
+	{
+	char name[1024];
+	FILE *fp;
+	int i, k;
+
+	snprintf(name, sizeof(name), "%s/probes.txt", job->out_dir);
+	fp = fopen(name, "w");
+	if (!fp) return -1;
+
+	fprintf(fp, "# probe x y z, then r g b (0..255) of the mean of each cube face: +x -x +y -y +z -z\n");
+	for (i=0; i<job->n_probes; i++)
+		{
+		struct probe *p = &job->probes[i];
+
+		fprintf(fp, "%i %.1f %.1f %.1f", i, p->origin[0], p->origin[1], p->origin[2]);
+		for (k=0; k<6; k++) fprintf(fp, "  %.1f %.1f %.1f", p->ambient[k][0], p->ambient[k][1], p->ambient[k][2]);
+		fprintf(fp, "\n");
+		}
+
+	return fclose(fp) == 0 ? 0 : -1;
+	}
+
+int
+probeCapture(struct bsp *bsp, char *out_dir, int size, int n_threads)
+	{
+	struct map map = {0};
+	struct probe_job job = {0};
+	struct jobs *jobs;
+	double t_start, t_gather, t_views, render_time = 0;
+	long n_triangles = 0, n_faces = 0;
+	int n_views, i;
+
+	if (size <= 0) size = PROBE_DEFAULT_SIZE;
+	if (mkdir(out_dir, 0755) != 0 && errno != EEXIST) error(-1, "Failed to create the probe directory.");
+
+	bspLoadEntities(bsp, &map);
+	bspLoadModels(bsp, &map);
+
+	job.bsp = bsp;
+	job.map = &map;
+	job.size = size;
+	job.out_dir = out_dir;
+	job.n_probes = find_probes(&map, &job.probes);
+	if (!job.n_probes)
+		{
+		printf("Probes: no info_player_deathmatch in the map\n");
+		free(job.probes);
+		mapFree(&map);
+		return 1;
+		}
+
+	jobs = jobsCreate(n_threads);
+	t_start = jobsTime();
+	job.scene = build_scene(bsp);
+	jobsParallelFor(jobs, job.n_probes, 1, gather_range, &job);
+	t_gather = jobsTime();
+
+	job.targets = calloc(jobsThreadCount(jobs), sizeof(struct probe_target));
+	for (i=0; i<jobsThreadCount(jobs); i++)
+		{
+		job.targets[i].color = malloc((long)size*size*3);
+		job.targets[i].depth = malloc(sizeof(float)*size*size);
+		}
+
+	n_views = job.n_probes*PROBE_VIEWS;
+	jobsParallelFor(jobs, n_views, 1, view_range, &job);
+	t_views = jobsTime();
+
+	for (i=0; i<jobsThreadCount(jobs); i++)
+		{
+		n_triangles += job.targets[i].n_triangles;
+		render_time += job.targets[i].render_time;
+		free(job.targets[i].color);
+		free(job.targets[i].depth);
+		}
+	for (i=0; i<job.n_probes; i++) n_faces += job.probes[i].n_faces;
+
+	if (write_probes(&job) != 0) job.n_failed = 1;
+
+	printf("Probes: %i probes, %.0f faces in the PVS each, gathered with the scene in %.1f ms\n",
+		job.n_probes, (double)n_faces/job.n_probes, (t_gather - t_start)*1000);
+	printf("Probes: %i views of %ix%i in %.3fs on %i threads, %.1f views/s (%.1f rendering only), %.0f triangles a view\n",
+		n_views, size, size, t_views - t_gather, jobsThreadCount(jobs), n_views/(t_views - t_gather),
+		render_time > 0 ? n_views*jobsThreadCount(jobs)/render_time : 0, (double)n_triangles/n_views);
+	printf("Probes: wrote %s/probe*.tga and %s/probes.txt\n", out_dir, out_dir);
+
+	for (i=0; i<job.n_probes; i++) free(job.probes[i].faces);
+	free(job.probes);
+	free(job.targets);
+	free_scene(job.scene);
+	jobsDestroy(jobs);
+	mapFree(&map);
+
+	return job.n_failed;
+	}
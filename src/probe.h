@@ -0,0 +1,24 @@
+#ifndef PROBE_H
+#define PROBE_H
+
+#include "bsp.h"
+
+/***
+Headless capture at every info_player_deathmatch: the six faces of
+a cube map, for reflection and ambient probes, and a thumbnail
+along the spawn's angle. A small CPU rasterizer draws the
+lightmapped world and the placed brush models; the faces a probe
+can see are gathered from its cluster's PVS once and shared by its
+views, which are spread across the workers one view at a time.
+Images are TGAs, probes.txt holds each probe's origin and the mean
+colour of every cube face (an ambient cube).
+***/
+
+#define PROBE_DEFAULT_SIZE (128)
+/* Cube faces are +x -x +y -y +z -z, then the thumbnail */
+#define PROBE_VIEWS (7)
+
+/* The --probes tool, n_threads <= 0 uses every core */
+int probeCapture(struct bsp *bsp, char *out_dir, int size, int n_threads);
+
+#endif /* PROBE_H */
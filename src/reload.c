@@ -0,0 +1,263 @@
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <poll.h>
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#endif
+
+#include "error.h"
+#include "jobs.h"
+#include "reload.h"
+
+/* Compilers write in bursts, wait for this long a quiet spell */
+#define SETTLE_MS (100)
+
+struct reload {
+	char directory[1024];
+	char name[256];
+	char path[1024];
+	int fd;
+	int quit_pipe[2];
+	pthread_t thread;
+
+	pthread_mutex_t lock;
+	struct bsp pending;
+	int ready;
+	double detected; /*first write of the burst*/
+};
+
+/* FNV-1a, only compared against itself */
+static unsigned int
+hash_bytes(unsigned char *data, int length)
+	{
+	unsigned int h = 2166136261u;
+	int i;
+
+	for (i=0; i<length; i++)
+		{
+		h ^= data[i];
+		h *= 16777619u;
+		}
+
+	return h ^ (unsigned int)length;
+	}
+
+/***
+Hash every lump as it came out of the file. Take these straight
+after loading: the viewer changes some lumps in place.
+***/
+void
+reloadHashLumps(struct bsp *bsp, unsigned int hashes[17])
+	{
+	int i;
+
+	for (i=0; i<17; i++)
+		hashes[i] = hash_bytes(bsp->directory[i].data, bsp->directory[i].length);
+	}
+
+/* Bit per lump that changed */
+unsigned int
+reloadDiff(unsigned int old_hashes[17], unsigned int new_hashes[17])
+	{
+	unsigned int changed = 0;
+	int i;
+
+	for (i=0; i<17; i++)
+		if (old_hashes[i] != new_hashes[i]) changed |= 1 << i;
+
+	return changed;
+	}
+
+#ifdef HAVE_SYS_INOTIFY_H
+static int
+load_file(char *path, struct bsp *bsp)
+	{
+	FILE *fp = fopen(path, "rb");
+	void *data;
+	long length;
+	int result;
+
+	if (!fp) return -1;
+	fseek(fp, 0, SEEK_END);
+	length = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+
+	data = malloc(length+1);
+	if (fread(data, 1, length, fp) != (size_t)length)
+		{
+		fclose(fp);
+		free(data);
+		return -1;
+		}
+	fclose(fp);
+
+	memset(bsp, 0, sizeof(struct bsp));
+	result = bspLoadFromMemory(bsp, data, length);
+	free(data);
+
+	return result;
+	}
+
+/* True if any of the events is about our file */
+static int
+read_events(struct reload *r)
+	{
+	char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	int ours = 0;
+	int n, pos;
+
+	n = read(r->fd, buffer, sizeof(buffer));
+	for (pos=0; pos<n; )
+		{
+		struct inotify_event *e = (struct inotify_event *)(buffer + pos);
+		if (e->len && !strcmp(e->name, r->name)) ours = 1;
+		pos += sizeof(struct inotify_event) + e->len;
+		}
+
+	return ours;
+	}
+
+static void *
+watch_thread(void *arg)
+	{
+	struct reload *r = arg;
+	struct pollfd fds[2];
+	double detected = 0;
+	int waiting = 0;
+
+	fds[0].fd = r->fd;
+	fds[0].events = POLLIN;
+	fds[1].fd = r->quit_pipe[0];
+	fds[1].events = POLLIN;
+
+	for (;;)
+		{
+		int n = poll(fds, 2, waiting ? SETTLE_MS : -1);
+		struct bsp bsp;
+
+		if (n < 0) continue;
+		if (fds[1].revents) break;
+
+		if (n > 0 && (fds[0].revents & POLLIN))
+			{
+			if (read_events(r))
+				{
+				if (!waiting) detected = jobsTime();
+				waiting = 1;
+				}
+			continue;
+			}
+
+		/* Quiet for SETTLE_MS since the last write */
+		if (!waiting) continue;
+		waiting = 0;
+
+		if (load_file(r->path, &bsp) < 0)
+			{
+			printf("Reload: %s isn't a complete BSP yet\n", r->path);
+			continue;
+			}
+
+		pthread_mutex_lock(&r->lock);
+		if (r->ready) bspFree(&r->pending);
+		r->pending = bsp;
+		r->ready = 1;
+		r->detected = detected;
+		pthread_mutex_unlock(&r->lock);
+		}
+
+	return 0;
+	}
+#endif
+
+/***
+Watch the file at path. The directory is watched rather than the
+file so saves that replace the file by renaming are seen too.
+Returns 0 if inotify isn't available.
+***/
+struct reload *
+reloadCreate(char *path)
+	{
+#ifdef HAVE_SYS_INOTIFY_H
+	struct reload *r = calloc(1, sizeof(struct reload));
+	char *slash = strrchr(path, '/');
+
+	snprintf(r->path, sizeof(r->path), "%s", path);
+	if (slash)
+		{
+		snprintf(r->directory, sizeof(r->directory), "%.*s", (int)(slash - path), path);
+		snprintf(r->name, sizeof(r->name), "%s", slash+1);
+		}
+	else
+		{
+		snprintf(r->directory, sizeof(r->directory), ".");
+		snprintf(r->name, sizeof(r->name), "%s", path);
+		}
+	if (!r->directory[0]) snprintf(r->directory, sizeof(r->directory), "/");
+
+	r->fd = inotify_init();
+	if (r->fd < 0 || inotify_add_watch(r->fd, r->directory, IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+		{
+		if (r->fd >= 0) close(r->fd);
+		free(r);
+		return 0;
+		}
+
+	if (pipe(r->quit_pipe)) error(-1, "Failed to create pipe.");
+	pthread_mutex_init(&r->lock, 0);
+	if (pthread_create(&r->thread, 0, watch_thread, r)) error(-1, "Failed to start reload thread.");
+
+	printf("Reload: watching %s\n", r->path);
+
+	return r;
+#else
+	return 0;
+#endif
+	}
+
+void
+reloadDestroy(struct reload *r)
+	{
+#ifdef HAVE_SYS_INOTIFY_H
+	if (!r) return;
+
+	if (write(r->quit_pipe[1], "q", 1) != 1) error(-1, "Failed to stop reload thread.");
+	pthread_join(r->thread, 0);
+
+	close(r->quit_pipe[0]);
+	close(r->quit_pipe[1]);
+	close(r->fd);
+	if (r->ready) bspFree(&r->pending);
+	pthread_mutex_destroy(&r->lock);
+	free(r);
+#endif
+	}
+
+/***
+If a new version of the map has been loaded, move it into bsp
+and return 1. detected is when the file change was first seen.
+***/
+int
+reloadPoll(struct reload *r, struct bsp *bsp, double *detected)
+	{
+	int ready = 0;
+
+	if (!r) return 0;
+
+	pthread_mutex_lock(&r->lock);
+	if (r->ready)
+		{
+		*bsp = r->pending;
+		*detected = r->detected;
+		r->ready = 0;
+		ready = 1;
+		}
+	pthread_mutex_unlock(&r->lock);
+
+	return ready;
+	}
@@ -0,0 +1,25 @@
+#ifndef RELOAD_H
+#define RELOAD_H
+
+#include "bsp.h"
+
+/***
+Hot reload of the map being viewed.
+A thread waits on inotify for the file to be rewritten, lets the
+writes settle, then loads it in the background. The render thread
+picks the new map up with reloadPoll and only rebuilds what
+depends on lumps whose contents changed, see reloadDiff.
+***/
+
+/* Lumps that are only valid together, vcache reorders them as one */
+#define RELOAD_GEOMETRY ((1 << VERTEXES) | (1 << MESHVERTS) | (1 << FACES))
+
+struct reload;
+
+struct reload *reloadCreate(char *path);
+void reloadDestroy(struct reload *r);
+int reloadPoll(struct reload *r, struct bsp *bsp, double *detected);
+void reloadHashLumps(struct bsp *bsp, unsigned int hashes[17]);
+unsigned int reloadDiff(unsigned int old_hashes[17], unsigned int new_hashes[17]);
+
+#endif /* RELOAD_H */
@@ -0,0 +1,346 @@
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "error.h"
+#include "bsp.h"
+#include "bvh.h"
+#include "jobs.h"
+#include "trace.h"
+#include "revis.h"
+
+/* Sample points stay this far inside the leaf bounds */
+#define SAMPLE_INSET (1.0f)
+/* Clusters whose leaf bounds are this close touch, and always see each other */
+#define TOUCH_DISTANCE (1.0f)
+
+struct revis {
+	struct bsp *bsp;
+	struct bvh *bvh;
+	int n_clusters;
+	int *cluster_first; /*leaves of cluster c are cluster_leaves[cluster_first[c]..cluster_first[c+1]-1]*/
+	int *cluster_leaves;
+	float (*points)[3]; /*samples per cluster, n_points of them used*/
+	int *n_points;
+	int samples;
+	unsigned char *old_rows; /*n_clusters rows of sz_vecs*/
+	int sz_vecs;
+	unsigned char *visible; /*n_clusters squared, only b > a is written*/
+	unsigned long *rays; /*per thread*/
+	unsigned long *tested; /*pairs, per thread*/
+};
+
+static float
+revis_random(unsigned int *seed)
+	{
+	*seed = *seed*1664525u + 1013904223u;
+	return (*seed >> 8)*(1.0f/16777216.0f);
+	}
+
+static int
+old_visible(struct revis *r, int a, int b)
+	{
+	return r->old_rows[(long)a*r->sz_vecs + (b >> 3)] & (1 << (b & 7));
+	}
+
+/***
+Points inside the cluster: every leaf's centre first, then random
+points in the leaf bounds, every other one pushed out onto a side
+of the bounds since that's where the openings to the neighbours
+are. The bounds are loose, so a point only counts if the tree
+puts it back in the same leaf.
+***/
+static void
+place_samples(struct revis *r, int cluster)
+	{
+	struct bsp_leaf *leaves = r->bsp->directory[LEAVES].data;
+	int first = r->cluster_first[cluster];
+	int n_leaves = r->cluster_first[cluster+1] - first;
+	float (*points)[3] = &r->points[cluster*r->samples];
+	unsigned int seed = cluster*2654435761u + 1;
+	int n = 0, attempt, k;
+
+	for (attempt=0; n < r->samples && n_leaves && attempt < r->samples*16; attempt++)
+		{
+		int leaf_index = r->cluster_leaves[first + attempt%n_leaves];
+		struct bsp_leaf *leaf = &leaves[leaf_index];
+		float p[3];
+
+		int side = attempt >= n_leaves && (attempt & 1) ? (int)(revis_random(&seed)*6) : -1;
+
+		for (k=0; k<3; k++)
+			{
+			float lo = leaf->mins[k] + SAMPLE_INSET, hi = leaf->maxs[k] - SAMPLE_INSET;
+			float f = attempt < n_leaves ? 0.5f : revis_random(&seed);
+
+			if (side/2 == k) f = side & 1;
+			if (hi < lo) lo = hi = (leaf->mins[k] + leaf->maxs[k])*0.5f;
+			p[k] = lo + (hi - lo)*f;
+			}
+
+		if (findLeaf(r->bsp, p[0], p[1], p[2]) != leaf_index) continue;
+		memcpy(points[n++], p, sizeof(p));
+		}
+
+	r->n_points[cluster] = n;
+	}
+
+static int
+clusters_touch(struct revis *r, int a, int b)
+	{
+	struct bsp_leaf *leaves = r->bsp->directory[LEAVES].data;
+	int i, j, k;
+
+	for (i=r->cluster_first[a]; i<r->cluster_first[a+1]; i++)
+		for (j=r->cluster_first[b]; j<r->cluster_first[b+1]; j++)
+			{
+			struct bsp_leaf *la = &leaves[r->cluster_leaves[i]];
+			struct bsp_leaf *lb = &leaves[r->cluster_leaves[j]];
+
+			for (k=0; k<3; k++)
+				if (la->mins[k] > lb->maxs[k] + TOUCH_DISTANCE || lb->mins[k] > la->maxs[k] + TOUCH_DISTANCE)
+					break;
+			if (k == 3) return 1;
+			}
+	return 0;
+	}
+
+/***
+Every pair (a, b), b > a, of a range of rows. Ray k joins sample
+k of a to sample k/n_a + k of b, so the first few rays already
+spread over both clusters and a visible pair usually stops early.
+Rows get shorter as a grows, the stealing evens it out. The
+counts are kept locally and added once a row, the per thread
+slots share a cache line.
+***/
+static void
+revis_rows(void *ctx, int begin, int end, int thread)
+	{
+	struct revis *r = ctx;
+	int a, b, k;
+
+	for (a=begin; a<end; a++)
+		{
+		unsigned char *row = &r->visible[(long)a*r->n_clusters];
+		int n_a = r->n_points[a];
+		unsigned long rays = 0, tested = 0;
+
+		for (b=a+1; b<r->n_clusters; b++)
+			{
+			int n_b = r->n_points[b];
+			int n_rays = n_a*n_b;
+
+			if (!old_visible(r, a, b) && !old_visible(r, b, a)) continue;
+			tested++;
+
+			/* Nothing to sample in, or no way to tell: keep it */
+			if (!n_a || !n_b || clusters_touch(r, a, b))
+				{
+				row[b] = 1;
+				continue;
+				}
+
+			for (k=0; k<n_rays; k++)
+				{
+				float *from = r->points[a*r->samples + k%n_a];
+				float *to = r->points[b*r->samples + (k/n_a + k)%n_b];
+
+				rays++;
+				if (bvhVisible(r->bvh, from, to))
+					{
+					row[b] = 1;
+					break;
+					}
+				}
+			}
+		r->rays[thread] += rays;
+		r->tested[thread] += tested;
+		}
+	}
+
+/* Mean faces in the PVS of a cluster, each face counted once */
+static double
+mean_visible_faces(struct revis *r, unsigned char *rows)
+	{
+	struct bsp_leaf *leaves = r->bsp->directory[LEAVES].data;
+	int *leaffaces = r->bsp->directory[LEAFFACES].data;
+	int n_faces = r->bsp->directory[FACES].length/sizeof(struct bsp_face);
+	int *stamps = calloc(n_faces+1, sizeof(int));
+	double total = 0;
+	int a, b, i, j;
+
+	for (a=0; a<r->n_clusters; a++)
+		for (b=0; b<r->n_clusters; b++)
+			{
+			if (!(rows[(long)a*r->sz_vecs + (b >> 3)] & (1 << (b & 7)))) continue;
+
+			for (i=r->cluster_first[b]; i<r->cluster_first[b+1]; i++)
+				{
+				struct bsp_leaf *leaf = &leaves[r->cluster_leaves[i]];
+
+				for (j=0; j<leaf->n_leaffaces; j++)
+					{
+					int face = leaffaces[leaf->leafface + j];
+
+					if (face < 0 || face >= n_faces || stamps[face] == a+1) continue;
+					stamps[face] = a+1;
+					total++;
+					}
+				}
+			}
+
+	free(stamps);
+	return r->n_clusters ? total/r->n_clusters : 0;
+	}
+
+int
+revisMap(struct bsp *bsp, char *out_file, int samples, int n_threads)
+	{
+	struct bsp_leaf *leaves = bsp->directory[LEAVES].data;
+	int n_leaves = bsp->directory[LEAVES].length/sizeof(struct bsp_leaf);
+	struct bsp_face *faces = bsp->directory[FACES].data;
+	int n_faces = bsp->directory[FACES].length/sizeof(struct bsp_face);
+	struct bsp_model *models = bsp->directory[MODELS].data;
+	int n_models = bsp->directory[MODELS].length/sizeof(struct bsp_model);
+	struct texture *textures = bsp->directory[TEXTURES].data;
+	int n_textures = bsp->directory[TEXTURES].length/sizeof(struct texture);
+	struct revis r = {0};
+	struct jobs *jobs;
+	unsigned char *use_face, *visdata;
+	unsigned long n_rays = 0, n_tested = 0;
+	long old_bits = 0, new_bits = 0;
+	double before, after, t_start, t_rays;
+	int n_vecs = 0;
+	int *fill;
+	int i, a, b;
+
+	if (samples <= 0) samples = REVIS_DEFAULT_SAMPLES;
+
+	r.bsp = bsp;
+	r.samples = samples;
+	for (i=0; i<n_leaves; i++)
+		if (leaves[i].cluster+1 > r.n_clusters) r.n_clusters = leaves[i].cluster+1;
+	if (!r.n_clusters) error(-1, "Map has no clusters to vis.");
+
+	/* Start from the old visdata, or from everything visible if there's none */
+	if (bsp->directory[VISDATA].length >= 8)
+		{
+		memcpy(&n_vecs, bsp->directory[VISDATA].data, 4);
+		memcpy(&r.sz_vecs, (char *)bsp->directory[VISDATA].data + 4, 4);
+		if (n_vecs < r.n_clusters || r.sz_vecs*8 < r.n_clusters
+				|| (long)n_vecs*r.sz_vecs + 8 > bsp->directory[VISDATA].length)
+			n_vecs = 0;
+		}
+	if (n_vecs)
+		{
+		r.old_rows = malloc((long)n_vecs*r.sz_vecs);
+		memcpy(r.old_rows, (char *)bsp->directory[VISDATA].data + 8, (long)n_vecs*r.sz_vecs);
+		}
+	else
+		{
+		n_vecs = r.n_clusters;
+		r.sz_vecs = (r.n_clusters + 7)/8;
+		r.old_rows = malloc((long)n_vecs*r.sz_vecs);
+		memset(r.old_rows, 0xff, (long)n_vecs*r.sz_vecs);
+		}
+
+	/* Leaves grouped by cluster */
+	r.cluster_first = calloc(r.n_clusters+1, sizeof(int));
+	r.cluster_leaves = malloc(sizeof(int)*(n_leaves+1));
+	fill = calloc(r.n_clusters, sizeof(int));
+	for (i=0; i<n_leaves; i++)
+		if (leaves[i].cluster >= 0) r.cluster_first[leaves[i].cluster+1]++;
+	for (a=0; a<r.n_clusters; a++) r.cluster_first[a+1] += r.cluster_first[a];
+	for (i=0; i<n_leaves; i++)
+		if (leaves[i].cluster >= 0)
+			r.cluster_leaves[r.cluster_first[leaves[i].cluster] + fill[leaves[i].cluster]++] = i;
+	free(fill);
+
+	/* Only what never moves and can't be seen through blocks the view */
+	use_face = calloc(n_faces+1, 1);
+	for (i=0; i<n_faces; i++)
+		{
+		int contents = faces[i].texture >= 0 && faces[i].texture < n_textures
+			? textures[faces[i].texture].contents : 0;
+
+		if (n_models && (i < models[0].face || i >= models[0].face + models[0].n_faces)) continue;
+		if (!(contents & CONTENTS_SOLID) || (contents & CONTENTS_TRANSLUCENT)) continue;
+		use_face[i] = 1;
+		}
+
+	t_start = jobsTime();
+	jobs = jobsCreate(n_threads);
+	r.bvh = bvhCreateFaces(bsp, jobs, use_face);
+	printf("Revis: %i clusters, %i occluding triangles, %i samples per cluster\n",
+		r.n_clusters, r.bvh->n_triangles, samples);
+
+	r.points = malloc(sizeof(float)*3*samples*r.n_clusters);
+	r.n_points = malloc(sizeof(int)*r.n_clusters);
+	for (a=0; a<r.n_clusters; a++) place_samples(&r, a);
+
+	r.visible = calloc((long)r.n_clusters*r.n_clusters, 1);
+	r.rays = calloc(jobsThreadCount(jobs), sizeof(unsigned long));
+	r.tested = calloc(jobsThreadCount(jobs), sizeof(unsigned long));
+
+	t_rays = jobsTime();
+	jobsParallelFor(jobs, r.n_clusters, 1, revis_rows, &r);
+	t_rays = jobsTime() - t_rays;
+
+	for (i=0; i<jobsThreadCount(jobs); i++)
+		{
+		n_rays += r.rays[i];
+		n_tested += r.tested[i];
+		}
+
+	/* New rows: a cluster sees itself, and pairs either way round */
+	visdata = calloc(8 + (long)n_vecs*r.sz_vecs, 1);
+	memcpy(visdata, &n_vecs, 4);
+	memcpy(visdata+4, &r.sz_vecs, 4);
+	for (a=0; a<r.n_clusters; a++)
+		{
+		unsigned char *row = visdata + 8 + (long)a*r.sz_vecs;
+
+		for (b=0; b<r.n_clusters; b++)
+			{
+			int keep = a == b || r.visible[(long)(a < b ? a : b)*r.n_clusters + (a < b ? b : a)];
+
+			if (!old_visible(&r, a, b)) continue;
+			old_bits++;
+			if (!keep) continue;
+			row[b >> 3] |= 1 << (b & 7);
+			new_bits++;
+			}
+		}
+
+	before = mean_visible_faces(&r, r.old_rows);
+	after = mean_visible_faces(&r, visdata + 8);
+
+	printf("Revis: %lu pairs, %lu rays in %.3fs on %i threads, %.0f rays/s\n",
+		n_tested, n_rays, t_rays, jobsThreadCount(jobs), t_rays > 0 ? n_rays/t_rays : 0);
+	printf("Revis: %li of %li visible bits cleared, PVS %.1f%% -> %.1f%% of clusters\n",
+		old_bits - new_bits, old_bits,
+		100.0*old_bits/((double)r.n_clusters*r.n_clusters), 100.0*new_bits/((double)r.n_clusters*r.n_clusters));
+	printf("Revis: %.1f -> %.1f visible faces per cluster, %.3fs in all\n",
+		before, after, jobsTime() - t_start);
+
+	bspReplaceLump(bsp, VISDATA, visdata, 8 + n_vecs*r.sz_vecs);
+
+	if (bspWrite(bsp, out_file) != 0) error(-1, "Failed to write revised bsp file.");
+	printf("Revis: wrote %s\n", out_file);
+
+	free(use_face);
+	free(r.cluster_first);
+	free(r.cluster_leaves);
+	free(r.points);
+	free(r.n_points);
+	free(r.old_rows);
+	free(r.visible);
+	free(r.rays);
+	free(r.tested);
+	bvhFree(r.bvh);
+	jobsDestroy(jobs);
+
+	return 0;
+	}
@@ -0,0 +1,22 @@
+#ifndef REVIS_H
+#define REVIS_H
+
+/***
+Offline PVS tightening.
+Maps built with a fast vis, or none, mark almost every cluster
+as visible from every other. This samples points inside the
+leaves of each cluster and casts rays between every pair of
+clusters the old visdata marks visible; a pair keeps its bit if
+any ray gets through the static opaque world, or if the clusters
+touch. Bits are only ever cleared, never set. The result goes to
+a new BSP file.
+samples is the points per cluster, a pair costs up to samples
+squared rays. n_threads <= 0 uses every core.
+***/
+struct bsp;
+
+#define REVIS_DEFAULT_SAMPLES (32)
+
+int revisMap(struct bsp *bsp, char *out_file, int samples, int n_threads);
+
+#endif /* REVIS_H */
@@ -0,0 +1,1218 @@
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <math.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "error.h"
+#include "shader.h"
+#include "drawlist.h"
+#include "vfs/vfs.h"
+
+#define TWO_PI (6.28318530718f)
+
+/* Shaders, stages... parsed from one script before the merge */
+struct parsed {
+	struct shader *shaders;
+	int n_shaders, max_shaders;
+	struct shader_stage *stages;
+	int n_stages, max_stages;
+	struct shader_tcmod *tcmods;
+	int n_tcmods, max_tcmods;
+	struct shader_deform *deforms;
+	int n_deforms, max_deforms;
+	int n_errors;
+};
+
+/* Mapped pk3 data isn't null terminated, so always up to end */
+struct lexer {
+	char *p, *end;
+	int line;
+	char token[256];
+};
+
+struct parse_job {
+	struct vfs_file *files;
+	struct parsed *parsed;
+};
+
+struct name_value {
+	char *name;
+	int value;
+};
+
+static struct name_value blend_factors[] = {
+	{"GL_ONE", GL_ONE},
+	{"GL_ZERO", GL_ZERO},
+	{"GL_DST_COLOR", GL_DST_COLOR},
+	{"GL_ONE_MINUS_DST_COLOR", GL_ONE_MINUS_DST_COLOR},
+	{"GL_SRC_COLOR", GL_SRC_COLOR},
+	{"GL_ONE_MINUS_SRC_COLOR", GL_ONE_MINUS_SRC_COLOR},
+	{"GL_SRC_ALPHA", GL_SRC_ALPHA},
+	{"GL_ONE_MINUS_SRC_ALPHA", GL_ONE_MINUS_SRC_ALPHA},
+	{"GL_DST_ALPHA", GL_DST_ALPHA},
+	{"GL_ONE_MINUS_DST_ALPHA", GL_ONE_MINUS_DST_ALPHA},
+	{"GL_SRC_ALPHA_SATURATE", GL_SRC_ALPHA_SATURATE},
+	{0, 0}
+};
+
+static struct name_value wave_funcs[] = {
+	{"sin", WAVE_SIN},
+	{"triangle", WAVE_TRIANGLE},
+	{"square", WAVE_SQUARE},
+	{"sawtooth", WAVE_SAWTOOTH},
+	{"inversesawtooth", WAVE_INVERSE_SAWTOOTH},
+	{"noise", WAVE_NOISE},
+	{0, 0}
+};
+
+static struct name_value sorts[] = {
+	{"portal", SORT_PORTAL},
+	{"sky", SORT_SKY},
+	{"opaque", SORT_OPAQUE},
+	{"decal", SORT_DECAL},
+	{"seethrough", SORT_SEE_THROUGH},
+	{"banner", SORT_BANNER},
+	{"underwater", SORT_UNDERWATER},
+	{"additive", SORT_ADDITIVE},
+	{"nearest", SORT_NEAREST},
+	{0, 0}
+};
+
+/* -1 if the name isn't in the table */
+static int
+lookup(struct name_value *table, char *name)
+	{
+	int i;
+
+	for (i=0; table[i].name; i++)
+		if (!strcasecmp(table[i].name, name)) return table[i].value;
+
+	return -1;
+	}
+
+static void *
+grow(void *array, int n, int *max, int size)
+	{
+	if (n < *max) return array;
+	*max = *max ? *max*2 : 64;
+	array = realloc(array, (long)*max*size);
+	if (!array) error(-1, "Out of memory for shaders.");
+
+	return array;
+	}
+
+/* Whatever is left of the line, the newline stays for next_token */
+static void
+skip_line(struct lexer *lx)
+	{
+	char *newline = memchr(lx->p, '\n', lx->end - lx->p);
+
+	lx->p = newline ? newline : lx->end;
+	}
+
+/***
+The next token. Without cross_lines it stops at the end of the
+line and returns an empty string, the way shader keywords take
+the rest of their line as arguments.
+***/
+static char *
+next_token(struct lexer *lx, int cross_lines)
+	{
+	int n = 0;
+
+	for (;;)
+		{
+		while (lx->p < lx->end && (unsigned char)*lx->p <= ' ')
+			{
+			if (*lx->p == '\n')
+				{
+				if (!cross_lines)
+					{
+					lx->token[0] = 0;
+					return lx->token;
+					}
+				lx->line++;
+				}
+			lx->p++;
+			}
+
+		if (lx->p+1 < lx->end && lx->p[0] == '/' && lx->p[1] == '/')
+			{
+			skip_line(lx);
+			continue;
+			}
+		if (lx->p+1 < lx->end && lx->p[0] == '/' && lx->p[1] == '*')
+			{
+			lx->p += 2;
+			while (lx->p+1 < lx->end && !(lx->p[0] == '*' && lx->p[1] == '/'))
+				{
+				if (*lx->p == '\n') lx->line++;
+				lx->p++;
+				}
+			lx->p += 2;
+			if (lx->p > lx->end) lx->p = lx->end;
+			continue;
+			}
+		break;
+		}
+
+	if (lx->p < lx->end && (*lx->p == '{' || *lx->p == '}'))
+		{
+		lx->token[n++] = *lx->p++;
+		}
+	else if (lx->p < lx->end && *lx->p == '"')
+		{
+		lx->p++;
+		while (lx->p < lx->end && *lx->p != '"' && *lx->p != '\n')
+			{
+			if (n < sizeof(lx->token)-1) lx->token[n++] = *lx->p;
+			lx->p++;
+			}
+		if (lx->p < lx->end && *lx->p == '"') lx->p++;
+		}
+	else
+		{
+		while (lx->p < lx->end && (unsigned char)*lx->p > ' ' && *lx->p != '{' && *lx->p != '}')
+			{
+			if (n < sizeof(lx->token)-1) lx->token[n++] = *lx->p;
+			lx->p++;
+			}
+		}
+
+	lx->token[n] = 0;
+	return lx->token;
+	}
+
+static float
+next_float(struct lexer *lx)
+	{
+	return atof(next_token(lx, 0));
+	}
+
+/* Skip a { } block, the opening brace already read */
+static void
+skip_block(struct lexer *lx)
+	{
+	int depth = 1;
+
+	while (depth)
+		{
+		char *token = next_token(lx, 1);
+
+		if (!*token) return;
+		if (token[0] == '{') depth++;
+		else if (token[0] == '}') depth--;
+		}
+	}
+
+/* func base amplitude phase frequency */
+static void
+parse_wave(struct lexer *lx, struct shader_wave *wave)
+	{
+	wave->func = lookup(wave_funcs, next_token(lx, 0));
+	if (wave->func < 0) wave->func = WAVE_SIN;
+	wave->base = next_float(lx);
+	wave->amplitude = next_float(lx);
+	wave->phase = next_float(lx);
+	wave->frequency = next_float(lx);
+	wave->slot = -1;
+	}
+
+static void
+parse_gen(struct lexer *lx, int *gen, struct shader_wave *wave, float *values, int n_values)
+	{
+	char *token = next_token(lx, 0);
+	int i;
+
+	if (!strcasecmp(token, "wave"))
+		{
+		*gen = GEN_WAVE;
+		parse_wave(lx, wave);
+		}
+	else if (!strcasecmp(token, "const") || !strcasecmp(token, "constant"))
+		{
+		*gen = GEN_CONST;
+		for (i=0; i<n_values; i++)
+			{
+			token = next_token(lx, 0);
+			if (token[0] == '(') token = token[1] ? token+1 : next_token(lx, 0);
+			values[i] = atof(token);
+			}
+		}
+	else if (!strcasecmp(token, "entity") || !strcasecmp(token, "oneMinusEntity"))
+		*gen = GEN_ENTITY;
+	else if (!strcasecmp(token, "identity") || !strcasecmp(token, "identityLighting"))
+		*gen = GEN_IDENTITY;
+	else
+		*gen = GEN_VERTEX;
+	}
+
+static void
+parse_tcmod(struct lexer *lx, struct parsed *r, struct shader_stage *stage)
+	{
+	char *token = next_token(lx, 0);
+	struct shader_tcmod *t;
+	int i;
+
+	if (stage->n_tcmods == SHADER_MAX_TCMODS) return;
+
+	r->tcmods = grow(r->tcmods, r->n_tcmods, &r->max_tcmods, sizeof(struct shader_tcmod));
+	t = &r->tcmods[r->n_tcmods];
+	memset(t, 0, sizeof(struct shader_tcmod));
+	t->wave.slot = -1;
+
+	if (!strcasecmp(token, "scroll"))
+		{
+		t->type = TCMOD_SCROLL;
+		t->args[0] = next_float(lx);
+		t->args[1] = next_float(lx);
+		}
+	else if (!strcasecmp(token, "rotate"))
+		{
+		t->type = TCMOD_ROTATE;
+		t->args[0] = next_float(lx);
+		}
+	else if (!strcasecmp(token, "scale"))
+		{
+		t->type = TCMOD_SCALE;
+		t->args[0] = next_float(lx);
+		t->args[1] = next_float(lx);
+		}
+	else if (!strcasecmp(token, "stretch"))
+		{
+		t->type = TCMOD_STRETCH;
+		parse_wave(lx, &t->wave);
+		}
+	else if (!strcasecmp(token, "turb"))
+		{
+		/* base amplitude phase frequency, always a sine */
+		t->type = TCMOD_TURB;
+		t->wave.func = WAVE_SIN;
+		t->wave.base = next_float(lx);
+		t->wave.amplitude = next_float(lx);
+		t->wave.phase = next_float(lx);
+		t->wave.frequency = next_float(lx);
+		}
+	else if (!strcasecmp(token, "transform"))
+		{
+		t->type = TCMOD_TRANSFORM;
+		for (i=0; i<6; i++) t->args[i] = next_float(lx);
+		}
+	else return; /*entityTranslate and anything unknown*/
+
+	if (!stage->n_tcmods) stage->tcmod = r->n_tcmods;
+	stage->n_tcmods++;
+	r->n_tcmods++;
+	}
+
+static void
+parse_deform(struct lexer *lx, struct parsed *r, struct shader *shader)
+	{
+	char *token = next_token(lx, 0);
+	struct shader_deform *d;
+
+	if (shader->n_deforms == SHADER_MAX_DEFORMS) return;
+
+	r->deforms = grow(r->deforms, r->n_deforms, &r->max_deforms, sizeof(struct shader_deform));
+	d = &r->deforms[r->n_deforms];
+	memset(d, 0, sizeof(struct shader_deform));
+	d->wave.slot = -1;
+
+	if (!strcasecmp(token, "wave"))
+		{
+		d->type = DEFORM_WAVE;
+		d->args[0] = next_float(lx);
+		parse_wave(lx, &d->wave);
+		}
+	else if (!strcasecmp(token, "move"))
+		{
+		d->type = DEFORM_MOVE;
+		d->args[0] = next_float(lx);
+		d->args[1] = next_float(lx);
+		d->args[2] = next_float(lx);
+		parse_wave(lx, &d->wave);
+		}
+	else if (!strcasecmp(token, "bulge"))
+		{
+		d->type = DEFORM_BULGE;
+		d->args[0] = next_float(lx);
+		d->args[1] = next_float(lx);
+		d->args[2] = next_float(lx);
+		}
+	else if (!strcasecmp(token, "normal"))
+		{
+		/* amplitude frequency */
+		d->type = DEFORM_NORMAL;
+		d->wave.func = WAVE_SIN;
+		d->wave.amplitude = next_float(lx);
+		d->wave.frequency = next_float(lx);
+		}
+	else if (!strcasecmp(token, "autosprite")) d->type = DEFORM_AUTOSPRITE;
+	else if (!strcasecmp(token, "autosprite2")) d->type = DEFORM_AUTOSPRITE2;
+	else d->type = DEFORM_OTHER;
+
+	if (!shader->n_deforms) shader->deform = r->n_deforms;
+	shader->n_deforms++;
+	r->n_deforms++;
+	}
+
+static void
+parse_blend(struct lexer *lx, struct shader_stage *stage)
+	{
+	char *token = next_token(lx, 0);
+	int src, dst;
+
+	if (!strcasecmp(token, "add"))
+		{
+		src = GL_ONE;
+		dst = GL_ONE;
+		}
+	else if (!strcasecmp(token, "filter"))
+		{
+		src = GL_DST_COLOR;
+		dst = GL_ZERO;
+		}
+	else if (!strcasecmp(token, "blend"))
+		{
+		src = GL_SRC_ALPHA;
+		dst = GL_ONE_MINUS_SRC_ALPHA;
+		}
+	else
+		{
+		src = lookup(blend_factors, token);
+		dst = lookup(blend_factors, next_token(lx, 0));
+		if (src < 0) src = GL_ONE;
+		if (dst < 0) dst = GL_ONE;
+		}
+
+	stage->blend_src = src;
+	stage->blend_dst = dst;
+	}
+
+/* The opening brace already read, stops after the closing one */
+static int
+parse_stage(struct lexer *lx, struct parsed *r, struct shader *shader)
+	{
+	struct shader_stage *stage;
+	int depth_write = -1;
+
+	r->stages = grow(r->stages, r->n_stages, &r->max_stages, sizeof(struct shader_stage));
+	stage = &r->stages[r->n_stages];
+	memset(stage, 0, sizeof(struct shader_stage));
+	stage->blend_src = GL_ONE;
+	stage->blend_dst = GL_ZERO;
+	stage->rgb_gen = GEN_IDENTITY;
+	stage->alpha_gen = GEN_IDENTITY;
+	stage->rgb_const[0] = stage->rgb_const[1] = stage->rgb_const[2] = 1;
+	stage->alpha_const = 1;
+	stage->rgb_wave.slot = stage->alpha_wave.slot = -1;
+	stage->slot = -1;
+
+	for (;;)
+		{
+		char *token = next_token(lx, 1);
+
+		if (!*token) return -1;
+		if (token[0] == '}') break;
+		if (token[0] == '{')
+			{
+			skip_block(lx);
+			continue;
+			}
+
+		if (!strcasecmp(token, "map") || !strcasecmp(token, "clampMap") || !strcasecmp(token, "videoMap"))
+			{
+			if (!strcasecmp(token, "clampMap")) stage->flags |= STAGE_CLAMP;
+			token = next_token(lx, 0);
+			if (!strcasecmp(token, "$lightmap")) stage->flags |= STAGE_LIGHTMAP;
+			strncpy(stage->map, token, sizeof(stage->map)-1);
+			}
+		else if (!strcasecmp(token, "animMap"))
+			{
+			/* Frequency then the frames, keep the first */
+			stage->flags |= STAGE_ANIMMAP;
+			next_token(lx, 0);
+			strncpy(stage->map, next_token(lx, 0), sizeof(stage->map)-1);
+			}
+		else if (!strcasecmp(token, "blendFunc")) parse_blend(lx, stage);
+		else if (!strcasecmp(token, "rgbGen")) parse_gen(lx, &stage->rgb_gen, &stage->rgb_wave, stage->rgb_const, 3);
+		else if (!strcasecmp(token, "alphaGen")) parse_gen(lx, &stage->alpha_gen, &stage->alpha_wave, &stage->alpha_const, 1);
+		else if (!strcasecmp(token, "tcMod")) parse_tcmod(lx, r, stage);
+		else if (!strcasecmp(token, "tcGen") || !strcasecmp(token, "texGen"))
+			{
+			if (!strcasecmp(next_token(lx, 0), "environment")) stage->flags |= STAGE_ENVIRONMENT;
+			}
+		else if (!strcasecmp(token, "depthWrite")) depth_write = 1;
+		else if (!strcasecmp(token, "alphaFunc"))
+			{
+			token = next_token(lx, 0);
+			if (!strcasecmp(token, "GT0")) stage->alpha_func = ALPHA_FUNC_GT0;
+			else if (!strcasecmp(token, "LT128")) stage->alpha_func = ALPHA_FUNC_LT128;
+			else if (!strcasecmp(token, "GE128")) stage->alpha_func = ALPHA_FUNC_GE128;
+			}
+		skip_line(lx);
+		}
+
+	/* Blended stages don't write depth unless they ask to */
+	if (depth_write == 1 || (stage->blend_src == GL_ONE && stage->blend_dst == GL_ZERO))
+		stage->flags |= STAGE_DEPTH_WRITE;
+
+	if (shader->n_stages == SHADER_MAX_STAGES) return 0;
+	if (!shader->n_stages) shader->stage = r->n_stages;
+	shader->n_stages++;
+	r->n_stages++;
+
+	return 0;
+	}
+
+static int
+stage_blends(struct shader_stage *stage)
+	{
+	return stage->blend_src != GL_ONE || stage->blend_dst != GL_ZERO;
+	}
+
+/* Body of a shader, the name already read */
+static int
+parse_shader(struct lexer *lx, struct parsed *r, struct shader *shader)
+	{
+	int i;
+
+	if (strcmp(next_token(lx, 1), "{")) return -1;
+
+	for (;;)
+		{
+		char *token = next_token(lx, 1);
+
+		if (!*token) return -1;
+		if (token[0] == '}') break;
+		if (token[0] == '{')
+			{
+			if (parse_stage(lx, r, shader) < 0) return -1;
+			continue;
+			}
+
+		if (!strcasecmp(token, "surfaceparm"))
+			{
+			token = next_token(lx, 0);
+			if (!strcasecmp(token, "sky")) shader->flags |= SHADER_SKY;
+			else if (!strcasecmp(token, "nodraw")) shader->flags |= SHADER_NODRAW;
+			else if (!strcasecmp(token, "nolightmap")) shader->flags |= SHADER_NOLIGHTMAP;
+			}
+		else if (!strcasecmp(token, "skyParms")) shader->flags |= SHADER_SKY;
+		else if (!strcasecmp(token, "cull"))
+			{
+			token = next_token(lx, 0);
+			if (!strcasecmp(token, "none") || !strcasecmp(token, "disable") || !strcasecmp(token, "twosided"))
+				shader->cull = 0;
+			else if (!strncasecmp(token, "back", 4))
+				shader->cull = 2;
+			else
+				shader->cull = 1;
+			}
+		else if (!strcasecmp(token, "sort"))
+			{
+			token = next_token(lx, 0);
+			shader->sort = lookup(sorts, token);
+			if (shader->sort < 0) shader->sort = atoi(token);
+			}
+		else if (!strcasecmp(token, "deformVertexes")) parse_deform(lx, r, shader);
+		else if (!strcasecmp(token, "polygonOffset")) shader->flags |= SHADER_POLYGON_OFFSET;
+		skip_line(lx);
+		}
+
+	/* Quake 3's defaults when there is no sort keyword */
+	if (shader->sort <= 0)
+		{
+		if (shader->flags & SHADER_SKY) shader->sort = SORT_SKY;
+		else if (shader->n_stages && stage_blends(&r->stages[shader->stage])) shader->sort = SORT_ADDITIVE;
+		else if (shader->flags & SHADER_POLYGON_OFFSET) shader->sort = SORT_DECAL;
+		else shader->sort = SORT_OPAQUE;
+		}
+
+	for (i=0; i<shader->n_stages; i++)
+		{
+		struct shader_stage *stage = &r->stages[shader->stage+i];
+
+		if (stage->rgb_gen == GEN_WAVE || stage->alpha_gen == GEN_WAVE || stage->n_tcmods)
+			shader->flags |= SHADER_ANIMATED;
+		}
+	if (shader->n_deforms) shader->flags |= SHADER_ANIMATED;
+
+	return 0;
+	}
+
+static void
+parse_script(struct lexer *lx, struct parsed *r)
+	{
+	for (;;)
+		{
+		char *token = next_token(lx, 1);
+		struct shader *shader;
+		int i;
+
+		if (!*token) return;
+		if (token[0] == '{' || token[0] == '}')
+			{
+			r->n_errors++;
+			if (token[0] == '{') skip_block(lx);
+			continue;
+			}
+
+		r->shaders = grow(r->shaders, r->n_shaders, &r->max_shaders, sizeof(struct shader));
+		shader = &r->shaders[r->n_shaders];
+		memset(shader, 0, sizeof(struct shader));
+		for (i=0; token[i] && i<sizeof(shader->name)-1; i++) shader->name[i] = tolower(token[i]);
+		shader->cull = 1;
+
+		/* A broken shader spoils the rest of its file */
+		if (parse_shader(lx, r, shader) < 0)
+			{
+			r->n_errors++;
+			return;
+			}
+		r->n_shaders++;
+		}
+	}
+
+/* Runs on the workers, one script each */
+static void
+parse_files(void *ctx, int begin, int end, int thread)
+	{
+	struct parse_job *job = ctx;
+	int i;
+
+	for (i=begin; i<end; i++)
+		{
+		struct lexer lx;
+
+		if (!job->files[i].data) continue;
+		lx.p = job->files[i].data;
+		lx.end = lx.p + job->files[i].length;
+		lx.line = 1;
+		parse_script(&lx, &job->parsed[i]);
+		}
+	}
+
+static unsigned int
+hash_name(char *name)
+	{
+	unsigned int h = 2166136261u;
+
+	for (; *name; name++)
+		{
+		h ^= (unsigned char)tolower(*name);
+		h *= 16777619u;
+		}
+
+	return h;
+	}
+
+/* Later definitions replace earlier ones, as later pk3s do */
+static void
+insert(struct shaders *s, int index)
+	{
+	unsigned int h = hash_name(s->shaders[index].name) & (s->hash_size-1);
+
+	while (s->hash[h] >= 0)
+		{
+		if (!strcmp(s->shaders[s->hash[h]].name, s->shaders[index].name))
+			break;
+		h = (h+1) & (s->hash_size-1);
+		}
+	s->hash[h] = index;
+	}
+
+/* Append one script's results, fixing up the indices. The arrays
+   are already big enough for every script */
+static void
+merge(struct shaders *s, struct parsed *r)
+	{
+	int i;
+
+	for (i=0; i<r->n_stages; i++) r->stages[i].tcmod += s->n_tcmods;
+	for (i=0; i<r->n_shaders; i++)
+		{
+		r->shaders[i].stage += s->n_stages;
+		r->shaders[i].deform += s->n_deforms;
+		}
+
+	memcpy(s->shaders + s->n_shaders, r->shaders, sizeof(struct shader)*r->n_shaders);
+	s->n_shaders += r->n_shaders;
+	memcpy(s->stages + s->n_stages, r->stages, sizeof(struct shader_stage)*r->n_stages);
+	s->n_stages += r->n_stages;
+	memcpy(s->tcmods + s->n_tcmods, r->tcmods, sizeof(struct shader_tcmod)*r->n_tcmods);
+	s->n_tcmods += r->n_tcmods;
+	memcpy(s->deforms + s->n_deforms, r->deforms, sizeof(struct shader_deform)*r->n_deforms);
+	s->n_deforms += r->n_deforms;
+	s->n_errors += r->n_errors;
+
+	free(r->shaders);
+	free(r->stages);
+	free(r->tcmods);
+	free(r->deforms);
+	}
+
+static int
+compare_paths(const void *a, const void *b)
+	{
+	return strcasecmp(*(char **)a, *(char **)b);
+	}
+
+/***
+Read and compile every script in scripts/. The files are read and
+parsed on the workers and merged in name order afterwards.
+***/
+struct shaders *
+shadersLoad(struct vfs *vfs, struct jobs *jobs)
+	{
+	struct shaders *s = calloc(1, sizeof(struct shaders));
+	struct parse_job job;
+	struct vfs_file *files;
+	char **paths;
+	double t = jobsTime();
+	int n_shaders = 0, n_stages = 0, n_tcmods = 0, n_deforms = 0;
+	int n, i;
+
+	n = vfsList(vfs, "scripts/", ".shader", &paths);
+	qsort(paths, n, sizeof(char *), compare_paths);
+	files = calloc(n ? n : 1, sizeof(struct vfs_file));
+	job.files = files;
+	job.parsed = calloc(n ? n : 1, sizeof(struct parsed));
+
+	if (n)
+		{
+		vfsReadMany(vfs, paths, n, files, jobs);
+		jobsParallelFor(jobs, n, 1, parse_files, &job);
+		}
+
+	for (i=0; i<n; i++)
+		{
+		n_shaders += job.parsed[i].n_shaders;
+		n_stages += job.parsed[i].n_stages;
+		n_tcmods += job.parsed[i].n_tcmods;
+		n_deforms += job.parsed[i].n_deforms;
+		}
+	s->shaders = malloc(sizeof(struct shader)*(n_shaders+1));
+	s->stages = malloc(sizeof(struct shader_stage)*(n_stages+1));
+	s->tcmods = malloc(sizeof(struct shader_tcmod)*(n_tcmods+1));
+	s->deforms = malloc(sizeof(struct shader_deform)*(n_deforms+1));
+
+	for (i=0; i<n; i++)
+		{
+		merge(s, &job.parsed[i]);
+		if (files[i].data) vfsClose(&files[i]);
+		}
+	s->n_files = n;
+
+	for (s->hash_size=64; s->hash_size < s->n_shaders*2; s->hash_size*=2);
+	s->hash = malloc(sizeof(int)*s->hash_size);
+	for (i=0; i<s->hash_size; i++) s->hash[i] = -1;
+	for (i=0; i<s->n_shaders; i++) insert(s, i);
+
+	s->parse_time = jobsTime() - t;
+	printf("Shaders: %i scripts, %i shaders, %i stages in %.2f ms",
+		n, s->n_shaders, s->n_stages, s->parse_time*1000);
+	if (s->n_errors) printf(", %i errors", s->n_errors);
+	printf("\n");
+
+	free(job.parsed);
+	free(files);
+	vfsFreeList(paths, n);
+
+	return s;
+	}
+
+static void
+free_binding(struct shaders *s)
+	{
+	struct shader_batch *b = &s->batch;
+
+	free(s->texture_shader);
+	free(s->face_bucket);
+	free(s->bucket_shader);
+	free(s->face_test);
+	free(b->base);
+	free(b->amplitude);
+	free(b->phase);
+	free(b->frequency);
+	free(b->func);
+	free(b->value);
+	free(b->stages);
+	free(b->colors);
+	free(b->matrices);
+	s->texture_shader = s->face_bucket = s->bucket_shader = s->face_test = 0;
+	memset(b, 0, sizeof(struct shader_batch));
+	}
+
+void
+shadersFree(struct shaders *s)
+	{
+	if (!s) return;
+	free_binding(s);
+	free(s->shaders);
+	free(s->stages);
+	free(s->tcmods);
+	free(s->deforms);
+	free(s->hash);
+	free(s);
+	}
+
+/* Index of the shader, -1 if there isn't one. The extension is ignored */
+int
+shadersFind(struct shaders *s, char *name)
+	{
+	char key[64];
+	char *dot;
+	unsigned int h;
+	int i;
+
+	for (i=0; name[i] && i<sizeof(key)-1; i++) key[i] = tolower(name[i]);
+	key[i] = 0;
+	dot = strrchr(key, '.');
+	if (dot && (!strcmp(dot, ".tga") || !strcmp(dot, ".jpg"))) *dot = 0;
+
+	if (!s->hash_size) return -1;
+	h = hash_name(key) & (s->hash_size-1);
+	while (s->hash[h] >= 0)
+		{
+		if (!strcmp(s->shaders[s->hash[h]].name, key)) return s->hash[h];
+		h = (h+1) & (s->hash_size-1);
+		}
+
+	return -1;
+	}
+
+/* A slot in the frame batch for the wave */
+static void
+add_wave(struct shader_batch *b, struct shader_wave *wave)
+	{
+	if (b->n_waves == b->max_waves)
+		{
+		b->max_waves = b->max_waves ? b->max_waves*2 : 64;
+		b->base = realloc(b->base, sizeof(float)*b->max_waves);
+		b->amplitude = realloc(b->amplitude, sizeof(float)*b->max_waves);
+		b->phase = realloc(b->phase, sizeof(float)*b->max_waves);
+		b->frequency = realloc(b->frequency, sizeof(float)*b->max_waves);
+		b->func = realloc(b->func, sizeof(int)*b->max_waves);
+		b->value = realloc(b->value, sizeof(float)*b->max_waves);
+		}
+
+	wave->slot = b->n_waves;
+	b->base[b->n_waves] = wave->base;
+	b->amplitude[b->n_waves] = wave->amplitude;
+	b->phase[b->n_waves] = wave->phase;
+	b->frequency[b->n_waves] = wave->frequency;
+	b->func[b->n_waves] = wave->func;
+	b->n_waves++;
+	}
+
+static void
+add_stage(struct shader_batch *b, struct shader_stage *stage, int index)
+	{
+	if (b->n_stages == b->max_stages)
+		{
+		b->max_stages = b->max_stages ? b->max_stages*2 : 64;
+		b->stages = realloc(b->stages, sizeof(int)*b->max_stages);
+		b->colors = realloc(b->colors, sizeof(float)*4*b->max_stages);
+		b->matrices = realloc(b->matrices, sizeof(float)*6*b->max_stages);
+		}
+
+	stage->slot = b->n_stages;
+	b->stages[b->n_stages++] = index;
+	}
+
+/* Gather the waves and animated stages of one shader */
+static void
+batch_shader(struct shaders *s, struct shader *shader)
+	{
+	struct shader_batch *b = &s->batch;
+	int i, j;
+
+	for (i=0; i<shader->n_deforms; i++)
+		{
+		struct shader_deform *d = &s->deforms[shader->deform+i];
+
+		if (d->type == DEFORM_WAVE || d->type == DEFORM_MOVE || d->type == DEFORM_NORMAL)
+			add_wave(b, &d->wave);
+		}
+
+	for (i=0; i<shader->n_stages; i++)
+		{
+		struct shader_stage *stage = &s->stages[shader->stage+i];
+
+		if (stage->rgb_gen != GEN_WAVE && stage->alpha_gen != GEN_WAVE && !stage->n_tcmods) continue;
+
+		if (stage->rgb_gen == GEN_WAVE) add_wave(b, &stage->rgb_wave);
+		if (stage->alpha_gen == GEN_WAVE) add_wave(b, &stage->alpha_wave);
+		for (j=0; j<stage->n_tcmods; j++)
+			{
+			struct shader_tcmod *t = &s->tcmods[stage->tcmod+j];
+
+			if (t->type == TCMOD_STRETCH || t->type == TCMOD_TURB) add_wave(b, &t->wave);
+			}
+		add_stage(b, stage, shader->stage+i);
+		}
+	}
+
+struct face_key {
+	unsigned long long key;
+	int face;
+};
+
+static int
+compare_keys(const void *a, const void *b)
+	{
+	unsigned long long ka = ((struct face_key *)a)->key;
+	unsigned long long kb = ((struct face_key *)b)->key;
+
+	return ka < kb ? -1 : ka > kb;
+	}
+
+/***
+Look up the shader of every texture of the map, gather the
+animated values of those shaders into the batch and give every
+face a bucket: faces are drawn by sort, then shader, then lightmap.
+Every face also gets the face tests its shader allows: none when
+a deform moves it, only the frustum when it is two sided.
+***/
+void
+shadersBindMap(struct shaders *s, struct bsp *bsp)
+	{
+	struct texture *textures = bsp->directory[TEXTURES].data;
+	struct bsp_face *faces = bsp->directory[FACES].data;
+	struct face_key *keys;
+	char *bound;
+	int i;
+
+	free_binding(s);
+	for (i=0; i<s->n_stages; i++)
+		s->stages[i].slot = s->stages[i].rgb_wave.slot = s->stages[i].alpha_wave.slot = -1;
+	for (i=0; i<s->n_tcmods; i++) s->tcmods[i].wave.slot = -1;
+	for (i=0; i<s->n_deforms; i++) s->deforms[i].wave.slot = -1;
+
+	s->n_textures = bsp->directory[TEXTURES].length/sizeof(struct texture);
+	s->texture_shader = malloc(sizeof(int)*(s->n_textures+1));
+	bound = calloc(s->n_shaders+1, 1);
+	s->n_active = 0;
+	for (i=0; i<s->n_textures; i++)
+		{
+		int shader = shadersFind(s, textures[i].name);
+
+		s->texture_shader[i] = shader;
+		if (shader < 0 || bound[shader]) continue;
+		bound[shader] = 1;
+		s->n_active++;
+		batch_shader(s, &s->shaders[shader]);
+		}
+	free(bound);
+
+	/* Whole registers, the padding evaluates to nothing */
+	if (s->batch.n_waves % 4)
+		{
+		struct shader_wave pad = {WAVE_SIN, 0, 0, 0, 0, -1};
+
+		while (s->batch.n_waves % 4) add_wave(&s->batch, &pad);
+		}
+
+	/* Sort, shader then lightmap; faces without a script are opaque */
+	s->n_faces = bsp->directory[FACES].length/sizeof(struct bsp_face);
+	keys = malloc(sizeof(struct face_key)*(s->n_faces+1));
+	for (i=0; i<s->n_faces; i++)
+		{
+		int texture = faces[i].texture;
+		int shader = texture >= 0 && texture < s->n_textures ? s->texture_shader[texture] : -1;
+		unsigned long long sort = shader >= 0 ? s->shaders[shader].sort : SORT_OPAQUE;
+		int lightmap = faces[i].lm_index < 0 ? 0 : (faces[i].lm_index+1) & 0xffffff;
+
+		keys[i].key = (sort << 56) | ((unsigned long long)(shader+1) << 24) | lightmap;
+		keys[i].face = i;
+		}
+	qsort(keys, s->n_faces, sizeof(struct face_key), compare_keys);
+
+	s->face_bucket = malloc(sizeof(int)*(s->n_faces+1));
+	s->bucket_shader = malloc(sizeof(int)*(s->n_faces+1));
+	s->n_buckets = 0;
+	s->first_blend_bucket = -1;
+	for (i=0; i<s->n_faces; i++)
+		{
+		if (!i || keys[i].key != keys[i-1].key)
+			{
+			int sort = keys[i].key >> 56;
+
+			s->bucket_shader[s->n_buckets] = (int)((keys[i].key >> 24) & 0xffffffff) - 1;
+			if (sort > SORT_OPAQUE && s->first_blend_bucket < 0) s->first_blend_bucket = s->n_buckets;
+			s->n_buckets++;
+			}
+		s->face_bucket[keys[i].face] = s->n_buckets-1;
+		}
+	if (s->first_blend_bucket < 0) s->first_blend_bucket = s->n_buckets;
+	free(keys);
+
+	s->face_test = malloc(sizeof(int)*(s->n_faces+1));
+	for (i=0; i<s->n_faces; i++)
+		{
+		int texture = faces[i].texture;
+		int shader = texture >= 0 && texture < s->n_textures ? s->texture_shader[texture] : -1;
+		struct shader *sh = shader >= 0 ? &s->shaders[shader] : 0;
+
+		if (!sh) s->face_test[i] = FACE_TEST_FRONT;
+		else if (sh->n_deforms) s->face_test[i] = FACE_TEST_NONE;
+		else if (!sh->cull) s->face_test[i] = FACE_TEST_BOUNDS;
+		else s->face_test[i] = sh->cull == 2 ? FACE_TEST_BACK : FACE_TEST_FRONT;
+		}
+
+	printf("Shaders: %i of %i textures have scripts, %i animated stages, %i waves, %i draw buckets\n",
+		s->n_active, s->n_textures, s->batch.n_stages, s->batch.n_waves, s->n_buckets);
+	}
+
+/* Smooth noise in -1..1, one random value per whole x */
+static float
+noise(float x)
+	{
+	float f = floorf(x);
+	unsigned int a = (unsigned int)(int)f * 2654435761u;
+	unsigned int b = (unsigned int)((int)f+1) * 2654435761u;
+	float t = x - f;
+
+	t = t*t*(3 - 2*t);
+	return ((a >> 8) / 8388608.0f - 1)*(1 - t) + ((b >> 8) / 8388608.0f - 1)*t;
+	}
+
+/***
+All the waves of the bound map in one pass, four at a time.
+Sine is a polynomial over a quarter period, which also gives the
+triangle; noise waves are done one by one afterwards.
+***/
+static void
+evaluate_waves(struct shader_batch *b, float time)
+	{
+	int i;
+
+#ifdef __SSE2__
+	__m128 t = _mm_set1_ps(time);
+	__m128 one = _mm_set1_ps(1);
+	__m128 half = _mm_set1_ps(0.5f);
+
+	for (i=0; i<b->n_waves; i+=4)
+		{
+		__m128 x = _mm_add_ps(_mm_loadu_ps(&b->phase[i]), _mm_mul_ps(t, _mm_loadu_ps(&b->frequency[i])));
+		__m128 floor_x = _mm_cvtepi32_ps(_mm_cvttps_epi32(x));
+		__m128 frac, second_half, sign, u, a, y, y2, sine, value;
+		__m128i func = _mm_loadu_si128((__m128i *)&b->func[i]);
+
+		floor_x = _mm_sub_ps(floor_x, _mm_and_ps(_mm_cmpgt_ps(floor_x, x), one));
+		frac = _mm_sub_ps(x, floor_x);
+
+		/* Fold to a quarter period, the second half negated */
+		second_half = _mm_cmpge_ps(frac, half);
+		sign = _mm_sub_ps(one, _mm_and_ps(second_half, _mm_set1_ps(2)));
+		u = _mm_sub_ps(frac, _mm_and_ps(second_half, half));
+		a = _mm_min_ps(u, _mm_sub_ps(half, u));
+
+		y = _mm_mul_ps(a, _mm_set1_ps(TWO_PI));
+		y2 = _mm_mul_ps(y, y);
+		sine = _mm_add_ps(_mm_set1_ps(-1/5040.0f), _mm_mul_ps(y2, _mm_set1_ps(1/362880.0f)));
+		sine = _mm_add_ps(_mm_set1_ps(1/120.0f), _mm_mul_ps(y2, sine));
+		sine = _mm_add_ps(_mm_set1_ps(-1/6.0f), _mm_mul_ps(y2, sine));
+		sine = _mm_mul_ps(y, _mm_add_ps(one, _mm_mul_ps(y2, sine)));
+
+		value = _mm_and_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(func, _mm_set1_epi32(WAVE_SIN))), _mm_mul_ps(sign, sine));
+		value = _mm_or_ps(value, _mm_and_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(func, _mm_set1_epi32(WAVE_TRIANGLE))),
+			_mm_mul_ps(sign, _mm_mul_ps(a, _mm_set1_ps(4)))));
+		value = _mm_or_ps(value, _mm_and_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(func, _mm_set1_epi32(WAVE_SQUARE))), sign));
+		value = _mm_or_ps(value, _mm_and_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(func, _mm_set1_epi32(WAVE_SAWTOOTH))), frac));
+		value = _mm_or_ps(value, _mm_and_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(func, _mm_set1_epi32(WAVE_INVERSE_SAWTOOTH))),
+			_mm_sub_ps(one, frac)));
+
+		value = _mm_add_ps(_mm_loadu_ps(&b->base[i]), _mm_mul_ps(_mm_loadu_ps(&b->amplitude[i]), value));
+		_mm_storeu_ps(&b->value[i], value);
+		}
+
+	for (i=0; i<b->n_waves; i++)
+		if (b->func[i] == WAVE_NOISE)
+			b->value[i] = b->base[i] + b->amplitude[i]*noise(b->phase[i] + time*b->frequency[i]);
+#else
+	for (i=0; i<b->n_waves; i++)
+		{
+		float x = b->phase[i] + time*b->frequency[i];
+		float frac = x - floorf(x);
+		float v;
+
+		switch (b->func[i])
+			{
+			case WAVE_SIN: v = sinf(frac*TWO_PI); break;
+			case WAVE_TRIANGLE: v = frac < 0.25f ? 4*frac : frac < 0.75f ? 2 - 4*frac : 4*frac - 4; break;
+			case WAVE_SQUARE: v = frac < 0.5f ? 1 : -1; break;
+			case WAVE_SAWTOOTH: v = frac; break;
+			case WAVE_INVERSE_SAWTOOTH: v = 1 - frac; break;
+			default: v = noise(x); break;
+			}
+		b->value[i] = b->base[i] + b->amplitude[i]*v;
+		}
+#endif
+	}
+
+static float
+clamp01(float x)
+	{
+	if (x < 0) return 0;
+	if (x > 1) return 1;
+	return x;
+	}
+
+/* m = n applied after m */
+static void
+compose(float m[6], float n[6])
+	{
+	float r[6];
+
+	r[0] = n[0]*m[0] + n[1]*m[3];
+	r[1] = n[0]*m[1] + n[1]*m[4];
+	r[2] = n[0]*m[2] + n[1]*m[5] + n[2];
+	r[3] = n[3]*m[0] + n[4]*m[3];
+	r[4] = n[3]*m[1] + n[4]*m[4];
+	r[5] = n[3]*m[2] + n[4]*m[5] + n[5];
+	memcpy(m, r, sizeof(r));
+	}
+
+static void
+stage_matrix(struct shaders *s, struct shader_stage *stage, float time, float m[6])
+	{
+	float *values = s->batch.value;
+	int i;
+
+	m[0] = 1; m[1] = 0; m[2] = 0;
+	m[3] = 0; m[4] = 1; m[5] = 0;
+
+	for (i=0; i<stage->n_tcmods; i++)
+		{
+		struct shader_tcmod *t = &s->tcmods[stage->tcmod+i];
+		float n[6] = {1, 0, 0, 0, 1, 0};
+		float p, c, sn;
+
+		switch (t->type)
+			{
+			case TCMOD_SCROLL:
+				n[2] = t->args[0]*time - floorf(t->args[0]*time);
+				n[5] = t->args[1]*time - floorf(t->args[1]*time);
+				break;
+			case TCMOD_ROTATE:
+				p = -t->args[0]*time*(TWO_PI/360);
+				c = cosf(p);
+				sn = sinf(p);
+				n[0] = c; n[1] = -sn; n[2] = 0.5f - 0.5f*c + 0.5f*sn;
+				n[3] = sn; n[4] = c; n[5] = 0.5f - 0.5f*sn - 0.5f*c;
+				break;
+			case TCMOD_SCALE:
+				n[0] = t->args[0];
+				n[4] = t->args[1];
+				break;
+			case TCMOD_STRETCH:
+				p = values[t->wave.slot];
+				p = p ? 1/p : 1;
+				n[0] = n[4] = p;
+				n[2] = n[5] = 0.5f - 0.5f*p;
+				break;
+			case TCMOD_TURB:
+				/* Quake 3 varies it across the surface, a shift will do */
+				n[2] = n[5] = values[t->wave.slot] - t->wave.base;
+				break;
+			case TCMOD_TRANSFORM:
+				n[0] = t->args[0]; n[1] = t->args[2]; n[2] = t->args[4];
+				n[3] = t->args[1]; n[4] = t->args[3]; n[5] = t->args[5];
+				break;
+			}
+		compose(m, n);
+		}
+	}
+
+/* Waves, then colours and texture matrices of the animated stages */
+void
+shadersUpdate(struct shaders *s, float time)
+	{
+	struct shader_batch *b = &s->batch;
+	int i;
+
+	evaluate_waves(b, time);
+
+	for (i=0; i<b->n_stages; i++)
+		{
+		struct shader_stage *stage = &s->stages[b->stages[i]];
+		float *color = b->colors[i];
+
+		if (stage->rgb_gen == GEN_WAVE)
+			color[0] = color[1] = color[2] = clamp01(b->value[stage->rgb_wave.slot]);
+		else if (stage->rgb_gen == GEN_CONST)
+			memcpy(color, stage->rgb_const, sizeof(float)*3);
+		else
+			color[0] = color[1] = color[2] = 1;
+
+		if (stage->alpha_gen == GEN_WAVE) color[3] = clamp01(b->value[stage->alpha_wave.slot]);
+		else if (stage->alpha_gen == GEN_CONST) color[3] = stage->alpha_const;
+		else color[3] = 1;
+
+		stage_matrix(s, stage, time, b->matrices[i]);
+		}
+	}
+
+/***
+GL state for the faces of a shader, drawn with their lightmap; the
+first stage gives the blend and colour. -1 puts the defaults back.
+Returns 0 if the faces shouldn't be drawn at all.
+***/
+int
+shadersApply(struct shaders *s, int shader)
+	{
+	struct shader *sh;
+	struct shader_stage *stage;
+
+	if (shader < 0)
+		{
+		glEnable(GL_CULL_FACE);
+		glCullFace(GL_FRONT);
+		glDisable(GL_BLEND);
+		glDepthMask(GL_TRUE);
+		glColor4f(1, 1, 1, 1);
+		return 1;
+		}
+
+	sh = &s->shaders[shader];
+	if (sh->flags & SHADER_NODRAW) return 0;
+
+	if (!sh->cull) glDisable(GL_CULL_FACE);
+	else
+		{
+		glEnable(GL_CULL_FACE);
+		glCullFace(sh->cull == 2 ? GL_BACK : GL_FRONT);
+		}
+
+	if (!sh->n_stages)
+		{
+		glDisable(GL_BLEND);
+		glDepthMask(GL_TRUE);
+		glColor4f(1, 1, 1, 1);
+		return 1;
+		}
+
+	stage = &s->stages[sh->stage];
+	if (stage_blends(stage))
+		{
+		glEnable(GL_BLEND);
+		glBlendFunc(stage->blend_src, stage->blend_dst);
+		}
+	else glDisable(GL_BLEND);
+	glDepthMask(stage->flags & STAGE_DEPTH_WRITE ? GL_TRUE : GL_FALSE);
+
+	if (stage->slot >= 0) glColor4fv(s->batch.colors[stage->slot]);
+	else if (stage->rgb_gen == GEN_CONST) glColor4f(stage->rgb_const[0], stage->rgb_const[1], stage->rgb_const[2], 1);
+	else glColor4f(1, 1, 1, 1);
+
+	return 1;
+	}
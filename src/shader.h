@@ -0,0 +1,147 @@
+#ifndef SHADER_H
+#define SHADER_H
+
+#include "bsp.h"
+#include "jobs.h"
+
+struct vfs;
+
+/***
+Quake 3 shader scripts, the .shader files in scripts/.
+Every script is parsed once, on the workers, into flat arrays of
+shaders, stages, tcMods and deforms that refer to each other by
+index. Binding a map picks out the shaders its textures use and
+gathers their waves into one structure of arrays; shadersUpdate
+evaluates those four at a time each frame and then builds the
+stage colours and texture matrices from the results.
+***/
+
+#define SHADER_MAX_STAGES (8)
+#define SHADER_MAX_TCMODS (4)
+#define SHADER_MAX_DEFORMS (3)
+
+/* Quake 3's sort values, lower draws first */
+enum {
+	SORT_PORTAL = 1,
+	SORT_SKY = 2,
+	SORT_OPAQUE = 3,
+	SORT_DECAL = 4,
+	SORT_SEE_THROUGH = 5,
+	SORT_BANNER = 6,
+	SORT_UNDERWATER = 8,
+	SORT_ADDITIVE = 9,
+	SORT_NEAREST = 16
+};
+
+enum {WAVE_SIN, WAVE_TRIANGLE, WAVE_SQUARE, WAVE_SAWTOOTH, WAVE_INVERSE_SAWTOOTH, WAVE_NOISE};
+/* rgbGen and alphaGen, vertex and entity colours count as white */
+enum {GEN_IDENTITY, GEN_CONST, GEN_WAVE, GEN_VERTEX, GEN_ENTITY};
+enum {TCMOD_SCROLL, TCMOD_ROTATE, TCMOD_SCALE, TCMOD_STRETCH, TCMOD_TURB, TCMOD_TRANSFORM};
+enum {DEFORM_WAVE, DEFORM_MOVE, DEFORM_BULGE, DEFORM_NORMAL, DEFORM_AUTOSPRITE, DEFORM_AUTOSPRITE2, DEFORM_OTHER};
+enum {ALPHA_FUNC_NONE, ALPHA_FUNC_GT0, ALPHA_FUNC_LT128, ALPHA_FUNC_GE128};
+
+/* struct shader flags */
+#define SHADER_SKY (1 << 0)
+#define SHADER_NODRAW (1 << 1)
+#define SHADER_NOLIGHTMAP (1 << 2)
+#define SHADER_POLYGON_OFFSET (1 << 3)
+#define SHADER_ANIMATED (1 << 4)
+
+/* struct shader_stage flags */
+#define STAGE_LIGHTMAP (1 << 0)
+#define STAGE_CLAMP (1 << 1)
+#define STAGE_DEPTH_WRITE (1 << 2)
+#define STAGE_ENVIRONMENT (1 << 3)
+#define STAGE_ANIMMAP (1 << 4)
+
+struct shader_wave {
+	int func;
+	float base, amplitude, phase, frequency;
+	int slot; /*value in the frame batch, -1 when not bound*/
+};
+
+struct shader_tcmod {
+	int type;
+	float args[6];
+	struct shader_wave wave; /*stretch and turb*/
+};
+
+struct shader_deform {
+	int type;
+	float args[3]; /*wave's spread, move's direction, bulge's width, height, speed*/
+	struct shader_wave wave;
+};
+
+struct shader_stage {
+	char map[64];
+	int flags;
+	unsigned int blend_src, blend_dst; /*GL_ONE, GL_ZERO for no blending*/
+	int alpha_func;
+	int rgb_gen, alpha_gen;
+	float rgb_const[3], alpha_const;
+	struct shader_wave rgb_wave, alpha_wave;
+	int tcmod, n_tcmods; /*into shaders->tcmods*/
+	int slot; /*colour and matrix in the frame batch, -1 when static*/
+};
+
+struct shader {
+	char name[64];
+	int sort;
+	int flags;
+	int cull; /*0 none, 1 front (the default), 2 back*/
+	int stage, n_stages; /*into shaders->stages*/
+	int deform, n_deforms;
+};
+
+/* Animated values of the bound map, a structure of arrays */
+struct shader_batch {
+	int n_waves;
+	int max_waves; /*allocated, a multiple of 4*/
+	float *base, *amplitude, *phase, *frequency;
+	int *func;
+	float *value;
+
+	int n_stages; /*animated stages*/
+	int max_stages;
+	int *stages;
+	float (*colors)[4];
+	float (*matrices)[6]; /*s' = m[0]s + m[1]t + m[2], t' = m[3]s + m[4]t + m[5]*/
+};
+
+struct shaders {
+	struct shader *shaders;
+	int n_shaders;
+	struct shader_stage *stages;
+	int n_stages;
+	struct shader_tcmod *tcmods;
+	int n_tcmods;
+	struct shader_deform *deforms;
+	int n_deforms;
+
+	int *hash; /*open addressing, shader index or -1*/
+	int hash_size;
+	int n_files;
+	int n_errors;
+	double parse_time;
+
+	/* The map being drawn */
+	int n_textures;
+	int *texture_shader; /*-1 for a texture without a script*/
+	int n_active;
+	int n_faces;
+	int *face_bucket; /*for drawlistSetBuckets*/
+	int *face_test; /*FACE_TEST_ of every face, for drawlistSetFaceTests*/
+	int n_buckets;
+	int *bucket_shader;
+	int first_blend_bucket; /*buckets from here on are drawn after everything opaque*/
+	struct shader_batch batch;
+};
+
+struct shaders *shadersLoad(struct vfs *vfs, struct jobs *jobs);
+void shadersFree(struct shaders *s);
+int shadersFind(struct shaders *s, char *name);
+void shadersBindMap(struct shaders *s, struct bsp *bsp);
+void shadersUpdate(struct shaders *s, float time);
+int shadersApply(struct shaders *s, int shader);
+
+#endif /* SHADER_H */
@@ -0,0 +1,691 @@
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <SDL.h>
+#include <SDL_opengl.h>
+
+#include "error.h"
+#include "stream.h"
+#include "mipmap.h"
+
+#ifndef GL_ARRAY_BUFFER
+#define GL_ARRAY_BUFFER (0x8892)
+#endif
+#ifndef GL_ELEMENT_ARRAY_BUFFER
+#define GL_ELEMENT_ARRAY_BUFFER (0x8893)
+#endif
+#ifndef GL_STATIC_DRAW
+#define GL_STATIC_DRAW (0x88E4)
+#endif
+
+#define LM_SIZE (128)
+#define LM_BYTES (LM_SIZE*LM_SIZE*3)
+/* Side of the always resident stand in for a lightmap */
+#define FALLBACK_SIZE (8)
+/* Position, lightmap texcoord, normal */
+#define VERTEX_FLOATS (8)
+
+extern unsigned int *g_lm_texture_ids;
+
+enum {ITEM_OUT, ITEM_QUEUED, ITEM_PREPARING, ITEM_READY, ITEM_IN};
+enum {KIND_LIGHTMAP, KIND_GEOMETRY};
+
+struct stream_item {
+	int kind;
+	int index; /*lightmap or cluster*/
+	int state;
+	int pinned; /*used outside the leaves, by brush models, never evicted*/
+	long bytes;
+	long vertex_bytes; /*geometry, the indices follow*/
+	unsigned int name; /*texture or vertex buffer*/
+	unsigned int indices;
+	unsigned int last_drawn; /*frame*/
+	unsigned char *staging;
+	struct stream_item *next_ready;
+};
+
+struct stream {
+	struct bsp *bsp;
+	long budget;
+	long resident, peak_resident;
+	unsigned int frame;
+	int current_cluster;
+
+	int n_lightmaps;
+	int mip_filter; /*lightmaps get their mip chain on the thread*/
+	int n_clusters;
+	int n_items; /*lightmaps, then a geometry item per cluster*/
+	struct stream_item *items;
+	unsigned int *fallbacks;
+
+	int *lm_first, *lms; /*lightmaps the faces of each cluster use*/
+	int *face_first, *faces; /*faces each cluster's buffers hold*/
+	int *neighbour_first, *neighbours;
+	int *face_owner; /*cluster whose buffers hold the face, -1 for none*/
+	long *face_vertex; /*offsets into the owner's buffers*/
+	long *face_index;
+	int *wanted; /*per cluster, the request it was last asked for in*/
+	int request;
+
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	int *queue; /*ring of n_items+1, an item is only ever in it once*/
+	int queue_head, queue_tail;
+	struct stream_item *ready;
+	int quit;
+
+	int have_buffers;
+	PFNGLGENBUFFERSPROC gen_buffers;
+	PFNGLDELETEBUFFERSPROC delete_buffers;
+	PFNGLBINDBUFFERPROC bind_buffer;
+	PFNGLBUFFERDATAPROC buffer_data;
+
+	unsigned long lm_hits, lm_misses;
+	unsigned long geometry_hits, geometry_misses;
+	unsigned long streamed_bytes, n_uploads, n_evictions;
+	unsigned long upload_frames; /*frames that hit STREAM_UPLOAD_BYTES*/
+};
+
+/* Off the GL thread: copy what an item needs out of the lumps */
+static unsigned char *
+prepare_item(struct stream *s, struct stream_item *item)
+	{
+	struct bsp *bsp = s->bsp;
+	unsigned char *data = malloc(item->bytes);
+
+	if (item->kind == KIND_LIGHTMAP)
+		{
+		unsigned char *chain = data + LM_BYTES;
+
+		memcpy(data, (unsigned char *)bsp->directory[LIGHTMAPS].data + (long)LM_BYTES*item->index, LM_BYTES);
+		if (s->mip_filter != MIPMAP_NONE) mipmapGenerate(0, &data, 1, LM_SIZE, LM_SIZE, 3, s->mip_filter, &chain);
+		}
+	else
+		{
+		struct bsp_face *faces = bsp->directory[FACES].data;
+		struct bsp_vertex *vertices = bsp->directory[VERTEXES].data;
+		int *meshverts = bsp->directory[MESHVERTS].data;
+		float *v = (float *)data;
+		unsigned int *indices = (unsigned int *)(data + item->vertex_bytes);
+		int i, j;
+
+		for (i=s->face_first[item->index]; i<s->face_first[item->index+1]; i++)
+			{
+			struct bsp_face *f = &faces[s->faces[i]];
+
+			for (j=0; j<f->n_vertexes; j++)
+				{
+				struct bsp_vertex *bv = &vertices[f->vertex + j];
+				memcpy(v, bv->position, sizeof(float)*3);
+				memcpy(v+3, bv->texcoord[1], sizeof(float)*2);
+				memcpy(v+5, bv->normal, sizeof(float)*3);
+				v += VERTEX_FLOATS;
+				}
+			for (j=0; j<f->n_meshverts; j++) *indices++ = meshverts[f->meshvert + j];
+			}
+		}
+
+	return data;
+	}
+
+static void *
+stream_thread(void *arg)
+	{
+	struct stream *s = arg;
+
+	pthread_mutex_lock(&s->lock);
+	for (;;)
+		{
+		struct stream_item *item;
+		unsigned char *data;
+
+		if (s->quit) break;
+		if (s->queue_head == s->queue_tail)
+			{
+			pthread_cond_wait(&s->wake, &s->lock);
+			continue;
+			}
+
+		item = &s->items[s->queue[s->queue_head]];
+		s->queue_head = (s->queue_head + 1) % (s->n_items+1);
+		if (item->state != ITEM_QUEUED) continue;
+		item->state = ITEM_PREPARING;
+		pthread_mutex_unlock(&s->lock);
+
+		data = prepare_item(s, item);
+
+		pthread_mutex_lock(&s->lock);
+		item->staging = data;
+		item->state = ITEM_READY;
+		item->next_ready = s->ready;
+		s->ready = item;
+		}
+	pthread_mutex_unlock(&s->lock);
+
+	return 0;
+	}
+
+/* Called with the lock held */
+static void
+request_item(struct stream *s, struct stream_item *item)
+	{
+	if (item->state != ITEM_OUT) return;
+	item->state = ITEM_QUEUED;
+	s->queue[s->queue_tail] = item - s->items;
+	s->queue_tail = (s->queue_tail + 1) % (s->n_items+1);
+	}
+
+static void
+request_cluster(struct stream *s, int cluster)
+	{
+	int i;
+
+	if (s->wanted[cluster] == s->request) return;
+	s->wanted[cluster] = s->request;
+
+	for (i=s->lm_first[cluster]; i<s->lm_first[cluster+1]; i++) request_item(s, &s->items[s->lms[i]]);
+	if (s->have_buffers && s->face_first[cluster+1] > s->face_first[cluster])
+		request_item(s, &s->items[s->n_lightmaps + cluster]);
+	}
+
+static void
+request_pvs(struct stream *s, int cluster)
+	{
+	void *visdata = s->bsp->directory[VISDATA].data;
+	int c;
+
+	request_cluster(s, cluster);
+	for (c=0; c<s->n_clusters; c++)
+		if (!s->bsp->directory[VISDATA].length || clusterIsVisible(cluster, c, visdata))
+			request_cluster(s, c);
+	}
+
+/***
+The camera moved to another cluster: drop what is still queued and
+ask again, its own cluster first, then what it can see, then what
+the clusters next to it can see.
+***/
+static void
+requeue(struct stream *s, int cluster)
+	{
+	int i;
+
+	pthread_mutex_lock(&s->lock);
+	for (i=s->queue_head; i!=s->queue_tail; i=(i+1) % (s->n_items+1))
+		if (s->items[s->queue[i]].state == ITEM_QUEUED) s->items[s->queue[i]].state = ITEM_OUT;
+	s->queue_head = s->queue_tail = 0;
+	s->request++;
+
+	for (i=0; i<s->n_items; i++)
+		if (s->items[i].pinned) request_item(s, &s->items[i]);
+
+	if (cluster >= 0 && cluster < s->n_clusters)
+		{
+		request_pvs(s, cluster);
+		for (i=s->neighbour_first[cluster]; i<s->neighbour_first[cluster+1]; i++)
+			request_pvs(s, s->neighbours[i]);
+		}
+
+	pthread_cond_signal(&s->wake);
+	pthread_mutex_unlock(&s->lock);
+	}
+
+static void
+upload_item(struct stream *s, struct stream_item *item)
+	{
+	if (item->kind == KIND_LIGHTMAP)
+		{
+		glGenTextures(1, &item->name);
+		glBindTexture(GL_TEXTURE_2D, item->name);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, LM_SIZE, LM_SIZE, 0, GL_RGB, GL_UNSIGNED_BYTE, item->staging);
+		if (s->mip_filter != MIPMAP_NONE)
+			{
+			int n_levels = mipmapLevels(LM_SIZE, LM_SIZE);
+			int level, w, h;
+
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+			glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+			for (level=1; level<n_levels; level++)
+				{
+				mipmapLevelSize(LM_SIZE, LM_SIZE, level, &w, &h);
+				glTexImage2D(GL_TEXTURE_2D, level, GL_RGB, w, h, 0, GL_RGB, GL_UNSIGNED_BYTE,
+					mipmapLevel(item->staging + LM_BYTES, LM_SIZE, LM_SIZE, 3, level));
+				}
+			glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+			}
+		else glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		g_lm_texture_ids[item->index] = item->name;
+		}
+	else
+		{
+		s->gen_buffers(1, &item->name);
+		s->gen_buffers(1, &item->indices);
+		s->bind_buffer(GL_ARRAY_BUFFER, item->name);
+		s->buffer_data(GL_ARRAY_BUFFER, item->vertex_bytes, item->staging, GL_STATIC_DRAW);
+		s->bind_buffer(GL_ELEMENT_ARRAY_BUFFER, item->indices);
+		s->buffer_data(GL_ELEMENT_ARRAY_BUFFER, item->bytes - item->vertex_bytes,
+			item->staging + item->vertex_bytes, GL_STATIC_DRAW);
+		s->bind_buffer(GL_ARRAY_BUFFER, 0);
+		s->bind_buffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+		}
+
+	free(item->staging);
+	item->staging = 0;
+	item->state = ITEM_IN;
+	item->last_drawn = s->frame;
+	s->resident += item->bytes;
+	if (s->resident > s->peak_resident) s->peak_resident = s->resident;
+	s->streamed_bytes += item->bytes;
+	s->n_uploads++;
+	}
+
+static void
+evict_item(struct stream *s, struct stream_item *item)
+	{
+	if (item->kind == KIND_LIGHTMAP)
+		{
+		glDeleteTextures(1, &item->name);
+		g_lm_texture_ids[item->index] = s->fallbacks[item->index];
+		}
+	else
+		{
+		s->delete_buffers(1, &item->name);
+		s->delete_buffers(1, &item->indices);
+		}
+
+	item->state = ITEM_OUT;
+	s->resident -= item->bytes;
+	s->n_evictions++;
+	}
+
+/***
+Upload what the thread has ready, up to STREAM_UPLOAD_BYTES, then
+evict the least recently drawn until back under the budget. What
+was drawn last frame stays even over it; the budget is for what
+is kept around, not what is in view.
+***/
+void
+streamUpdate(struct stream *s, int cluster)
+	{
+	long uploaded = 0;
+	int i;
+
+	s->frame++;
+	if (cluster != s->current_cluster)
+		{
+		s->current_cluster = cluster;
+		requeue(s, cluster);
+		}
+
+	for (;;)
+		{
+		struct stream_item *item;
+
+		pthread_mutex_lock(&s->lock);
+		item = s->ready;
+		if (item && uploaded < STREAM_UPLOAD_BYTES) s->ready = item->next_ready;
+		else item = 0;
+		pthread_mutex_unlock(&s->lock);
+
+		if (!item)
+			{
+			if (uploaded >= STREAM_UPLOAD_BYTES) s->upload_frames++;
+			break;
+			}
+		upload_item(s, item);
+		uploaded += item->bytes;
+		}
+
+	while (s->resident > s->budget)
+		{
+		struct stream_item *oldest = 0;
+
+		for (i=0; i<s->n_items; i++)
+			{
+			struct stream_item *item = &s->items[i];
+
+			if (item->state != ITEM_IN || item->pinned || item->last_drawn + 1 >= s->frame) continue;
+			if (!oldest || item->last_drawn < oldest->last_drawn) oldest = item;
+			}
+		if (!oldest) break;
+		evict_item(s, oldest);
+		}
+	}
+
+/* Anything drawn that was evicted since the cluster changed is asked for again */
+void
+streamDrawn(struct stream *s, int *faces, int n_faces)
+	{
+	struct bsp_face *bsp_faces = s->bsp->directory[FACES].data;
+	int i;
+
+	pthread_mutex_lock(&s->lock);
+	for (i=0; i<n_faces; i++)
+		{
+		int lm = bsp_faces[faces[i]].lm_index;
+		int owner = s->face_owner[faces[i]];
+
+		if (lm >= 0 && lm < s->n_lightmaps)
+			{
+			struct stream_item *item = &s->items[lm];
+
+			item->last_drawn = s->frame;
+			if (item->state == ITEM_IN) s->lm_hits++;
+			else s->lm_misses++;
+			request_item(s, item);
+			}
+
+		if (owner >= 0 && s->have_buffers)
+			{
+			struct stream_item *item = &s->items[s->n_lightmaps + owner];
+
+			item->last_drawn = s->frame;
+			if (item->state == ITEM_IN) s->geometry_hits++;
+			else s->geometry_misses++;
+			request_item(s, item);
+			}
+		}
+	pthread_cond_signal(&s->wake);
+	pthread_mutex_unlock(&s->lock);
+	}
+
+int
+streamDrawFace(struct stream *s, int face_index)
+	{
+	struct bsp_face *face = &((struct bsp_face *)s->bsp->directory[FACES].data)[face_index];
+	int owner = s->face_owner[face_index];
+	struct stream_item *item;
+	long stride = sizeof(float)*VERTEX_FLOATS;
+	char *base;
+
+	if (owner < 0 || !s->have_buffers) return 0;
+	item = &s->items[s->n_lightmaps + owner];
+	if (item->state != ITEM_IN) return 0;
+
+	base = (char *)0 + s->face_vertex[face_index];
+	if (face->lm_index >= 0) glBindTexture(GL_TEXTURE_2D, g_lm_texture_ids[face->lm_index]);
+	else glBindTexture(GL_TEXTURE_2D, 0);
+
+	s->bind_buffer(GL_ARRAY_BUFFER, item->name);
+	s->bind_buffer(GL_ELEMENT_ARRAY_BUFFER, item->indices);
+	glEnableClientState(GL_VERTEX_ARRAY);
+	glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+	glVertexPointer(3, GL_FLOAT, stride, base);
+	glTexCoordPointer(2, GL_FLOAT, stride, base + sizeof(float)*3);
+	if (face->type == 3)
+		{
+		glEnable(GL_LIGHTING);
+		glEnable(GL_LIGHT0);
+		glEnableClientState(GL_NORMAL_ARRAY);
+		glNormalPointer(GL_FLOAT, stride, base + sizeof(float)*5);
+		}
+	glDrawElements(GL_TRIANGLES, face->n_meshverts, GL_UNSIGNED_INT, (char *)0 + s->face_index[face_index]);
+	if (face->type == 3)
+		{
+		glDisableClientState(GL_NORMAL_ARRAY);
+		glDisable(GL_LIGHTING);
+		}
+	glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+	glDisableClientState(GL_VERTEX_ARRAY);
+	s->bind_buffer(GL_ARRAY_BUFFER, 0);
+	s->bind_buffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+
+	return 1;
+	}
+
+/* Leaves in the same cluster list the same faces, each is taken once */
+static void
+build_cluster_lists(struct stream *s)
+	{
+	struct bsp *bsp = s->bsp;
+	struct bsp_leaf *leaves = bsp->directory[LEAVES].data;
+	int n_leaves = bsp->directory[LEAVES].length/sizeof(struct bsp_leaf);
+	int *leaffaces = bsp->directory[LEAFFACES].data;
+	struct bsp_face *faces = bsp->directory[FACES].data;
+	int n_faces = bsp->directory[FACES].length/sizeof(struct bsp_face);
+	int *face_stamp = calloc(n_faces+1, sizeof(int));
+	int *lm_stamp = calloc(s->n_lightmaps+1, sizeof(int));
+	int *cluster_stamp = calloc(s->n_clusters+1, sizeof(int));
+	int n_lms = 0, n_owned = 0, n_neighbours = 0, max_neighbours = 256;
+	int c, i, j, k;
+
+	s->lm_first = calloc(s->n_clusters+1, sizeof(int));
+	s->face_first = calloc(s->n_clusters+1, sizeof(int));
+	s->neighbour_first = calloc(s->n_clusters+1, sizeof(int));
+	/* A lightmap at most once per leafface */
+	s->lms = malloc(sizeof(int)*(bsp->directory[LEAFFACES].length/sizeof(int)+1));
+	s->faces = malloc(sizeof(int)*(n_faces+1));
+	s->neighbours = malloc(sizeof(int)*max_neighbours);
+	s->face_owner = malloc(sizeof(int)*(n_faces+1));
+	s->face_vertex = calloc(n_faces+1, sizeof(long));
+	s->face_index = calloc(n_faces+1, sizeof(long));
+	for (i=0; i<n_faces; i++) s->face_owner[i] = -1;
+
+	/* Clusters times leaves, a few million steps on the largest maps */
+	for (c=0; c<s->n_clusters; c++)
+		{
+		struct stream_item *geometry = &s->items[s->n_lightmaps + c];
+
+		s->lm_first[c] = n_lms;
+		s->face_first[c] = n_owned;
+		s->neighbour_first[c] = n_neighbours;
+		geometry->kind = KIND_GEOMETRY;
+		geometry->index = c;
+		cluster_stamp[c] = c+1;
+
+		for (i=0; i<n_leaves; i++)
+			{
+			struct bsp_leaf *leaf = &leaves[i];
+			float mins[3], maxs[3];
+			int touched[256], n_touched;
+
+			if (leaf->cluster != c) continue;
+
+			for (j=0; j<leaf->n_leaffaces; j++)
+				{
+				int f = leaffaces[leaf->leafface + j];
+				struct bsp_face *face = &faces[f];
+
+				if (face_stamp[f] == c+1) continue;
+				face_stamp[f] = c+1;
+
+				if (face->lm_index >= 0 && face->lm_index < s->n_lightmaps && lm_stamp[face->lm_index] != c+1)
+					{
+					lm_stamp[face->lm_index] = c+1;
+					s->lms[n_lms++] = face->lm_index;
+					}
+
+				/* Patches are tessellated as they are drawn, they stay as they are */
+				if (s->face_owner[f] >= 0 || (face->type != 1 && face->type != 3)) continue;
+				s->face_owner[f] = c;
+				s->face_vertex[f] = geometry->vertex_bytes;
+				geometry->vertex_bytes += sizeof(float)*VERTEX_FLOATS*face->n_vertexes;
+				s->faces[n_owned++] = f;
+				}
+
+			for (k=0; k<3; k++)
+				{
+				mins[k] = leaf->mins[k] - 1;
+				maxs[k] = leaf->maxs[k] + 1;
+				}
+			n_touched = bspBoxClusters(bsp, mins, maxs, touched, 256);
+			for (k=0; k<n_touched; k++)
+				{
+				if (cluster_stamp[touched[k]] == c+1) continue;
+				cluster_stamp[touched[k]] = c+1;
+				if (n_neighbours == max_neighbours)
+					{
+					max_neighbours *= 2;
+					s->neighbours = realloc(s->neighbours, sizeof(int)*max_neighbours);
+					}
+				s->neighbours[n_neighbours++] = touched[k];
+				}
+			}
+
+		/* Indices after the vertices */
+		geometry->bytes = geometry->vertex_bytes;
+		for (i=s->face_first[c]; i<n_owned; i++)
+			{
+			s->face_index[s->faces[i]] = geometry->bytes;
+			geometry->bytes += sizeof(unsigned int)*faces[s->faces[i]].n_meshverts;
+			}
+		}
+	s->lm_first[s->n_clusters] = n_lms;
+	s->face_first[s->n_clusters] = n_owned;
+	s->neighbour_first[s->n_clusters] = n_neighbours;
+
+	/* Lightmaps no leaf uses belong to brush models, keep those in */
+	for (i=0; i<n_faces; i++)
+		{
+		int lm = faces[i].lm_index;
+		if (lm >= 0 && lm < s->n_lightmaps && !lm_stamp[lm]) s->items[lm].pinned = 1;
+		}
+
+	free(face_stamp);
+	free(lm_stamp);
+	free(cluster_stamp);
+	}
+
+/* An 8x8 average of each lightmap, so nothing is ever drawn unlit */
+static void
+create_fallbacks(struct stream *s)
+	{
+	unsigned char *lightmaps = s->bsp->directory[LIGHTMAPS].data;
+	unsigned char small[FALLBACK_SIZE*FALLBACK_SIZE*3];
+	int block = LM_SIZE/FALLBACK_SIZE;
+	int i, x, y, k, u, v;
+
+	s->fallbacks = malloc(sizeof(unsigned int)*(s->n_lightmaps+1));
+	if (s->n_lightmaps) glGenTextures(s->n_lightmaps, s->fallbacks);
+
+	for (i=0; i<s->n_lightmaps; i++)
+		{
+		unsigned char *lm = lightmaps + (long)LM_BYTES*i;
+
+		for (y=0; y<FALLBACK_SIZE; y++)
+			for (x=0; x<FALLBACK_SIZE; x++)
+				for (k=0; k<3; k++)
+					{
+					int sum = 0;
+					for (v=0; v<block; v++)
+						for (u=0; u<block; u++)
+							sum += lm[((y*block + v)*LM_SIZE + x*block + u)*3 + k];
+					small[(y*FALLBACK_SIZE + x)*3 + k] = sum/(block*block);
+					}
+
+		glBindTexture(GL_TEXTURE_2D, s->fallbacks[i]);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, FALLBACK_SIZE, FALLBACK_SIZE, 0, GL_RGB, GL_UNSIGNED_BYTE, small);
+		g_lm_texture_ids[i] = s->fallbacks[i];
+		}
+	}
+
+struct stream *
+streamCreate(struct bsp *bsp, long budget, int mip_filter)
+	{
+	struct bsp_leaf *leaves = bsp->directory[LEAVES].data;
+	int n_leaves = bsp->directory[LEAVES].length/sizeof(struct bsp_leaf);
+	struct stream *s = calloc(1, sizeof(struct stream));
+	long geometry_bytes = 0;
+	long lm_bytes = LM_BYTES + (mip_filter != MIPMAP_NONE ? mipmapChainSize(LM_SIZE, LM_SIZE, 3) : 0);
+	int i;
+
+	s->bsp = bsp;
+	s->budget = budget;
+	s->mip_filter = mip_filter;
+	s->current_cluster = -2;
+	s->n_lightmaps = bsp->directory[LIGHTMAPS].length/LM_BYTES;
+	for (i=0; i<n_leaves; i++)
+		if (leaves[i].cluster+1 > s->n_clusters) s->n_clusters = leaves[i].cluster+1;
+
+	s->n_items = s->n_lightmaps + s->n_clusters;
+	s->items = calloc(s->n_items+1, sizeof(struct stream_item));
+	s->queue = malloc(sizeof(int)*(s->n_items+1));
+	s->wanted = calloc(s->n_clusters+1, sizeof(int));
+	for (i=0; i<s->n_lightmaps; i++)
+		{
+		s->items[i].kind = KIND_LIGHTMAP;
+		s->items[i].index = i;
+		s->items[i].bytes = lm_bytes;
+		}
+
+	/* Vertex buffers are GL 1.5, without them only lightmaps are streamed */
+	s->gen_buffers = SDL_GL_GetProcAddress("glGenBuffers");
+	s->delete_buffers = SDL_GL_GetProcAddress("glDeleteBuffers");
+	s->bind_buffer = SDL_GL_GetProcAddress("glBindBuffer");
+	s->buffer_data = SDL_GL_GetProcAddress("glBufferData");
+	s->have_buffers = s->gen_buffers && s->delete_buffers && s->bind_buffer && s->buffer_data;
+
+	build_cluster_lists(s);
+	for (i=0; i<s->n_clusters; i++) geometry_bytes += s->items[s->n_lightmaps + i].bytes;
+
+	create_fallbacks(s);
+
+	pthread_mutex_init(&s->lock, 0);
+	pthread_cond_init(&s->wake, 0);
+	if (pthread_create(&s->thread, 0, stream_thread, s)) error(-1, "Failed to start streaming thread.");
+
+	printf("Stream: %i clusters, %i lightmaps (%.1f MB, %s mipmaps), %s%.1f MB of geometry, budget %.1f MB\n",
+		s->n_clusters, s->n_lightmaps, (double)s->n_lightmaps*lm_bytes/(1024*1024),
+		mip_filter != MIPMAP_NONE ? mipmapFilterName(mip_filter) : "no",
+		s->have_buffers ? "" : "no vertex buffers for ", geometry_bytes/(1024.0*1024.0), budget/(1024.0*1024.0));
+
+	return s;
+	}
+
+void
+streamReport(struct stream *s)
+	{
+	unsigned long lm = s->lm_hits + s->lm_misses;
+	unsigned long geometry = s->geometry_hits + s->geometry_misses;
+
+	printf("Stream: lightmaps %.1f%% hits (of faces drawn)\n", lm ? 100.0*s->lm_hits/lm : 100.0);
+	if (s->have_buffers)
+		printf("Stream: geometry %.1f%% hits (of faces drawn)\n", geometry ? 100.0*s->geometry_hits/geometry : 100.0);
+	printf("Stream: %.1f MB streamed in %lu uploads, %lu evictions, %lu frames at the upload limit, peak %.1f MB resident\n",
+		s->streamed_bytes/(1024.0*1024.0), s->n_uploads, s->n_evictions, s->upload_frames,
+		s->peak_resident/(1024.0*1024.0));
+	}
+
+void
+streamDestroy(struct stream *s)
+	{
+	struct stream_item *item;
+	int i;
+
+	if (!s) return;
+
+	pthread_mutex_lock(&s->lock);
+	s->quit = 1;
+	pthread_cond_signal(&s->wake);
+	pthread_mutex_unlock(&s->lock);
+	pthread_join(s->thread, 0);
+
+	for (item=s->ready; item; item=item->next_ready) free(item->staging);
+	for (i=0; i<s->n_items; i++)
+		if (s->items[i].state == ITEM_IN) evict_item(s, &s->items[i]);
+	if (s->n_lightmaps) glDeleteTextures(s->n_lightmaps, s->fallbacks);
+
+	pthread_mutex_destroy(&s->lock);
+	pthread_cond_destroy(&s->wake);
+	free(s->items);
+	free(s->fallbacks);
+	free(s->queue);
+	free(s->wanted);
+	free(s->lm_first);
+	free(s->lms);
+	free(s->face_first);
+	free(s->faces);
+	free(s->neighbour_first);
+	free(s->neighbours);
+	free(s->face_owner);
+	free(s->face_vertex);
+	free(s->face_index);
+	free(s);
+	}
@@ -0,0 +1,36 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+#include "bsp.h"
+
+/***
+Lightmap textures and world geometry buffers kept on the GPU by
+cluster, under a budget, instead of all of them for the whole
+session. Each frame the PVS of the camera's cluster, then those
+of the clusters next to it, are asked for; a background thread
+gets the data ready and the GL thread uploads a little of it per
+frame. The least recently drawn go when the budget is exceeded.
+Lightmaps get their mip chain on the thread too and count into the
+budget with it. Until a lightmap is in, its face uses an 8x8 copy
+that is always resident; until a cluster's buffers are in, its
+faces are drawn from the lumps as before. Nothing ever waits.
+The lumps stay in memory as the backing store.
+***/
+
+/* Most uploaded per frame, so a new room doesn't cost a long frame */
+#define STREAM_UPLOAD_BYTES (1 << 20)
+
+struct stream;
+
+/* Needs the GL context and room in g_lm_texture_ids for every lightmap, budget in bytes, a MIPMAP_ filter */
+struct stream *streamCreate(struct bsp *bsp, long budget, int mip_filter);
+void streamDestroy(struct stream *s);
+/* Once a frame before drawing, keeps g_lm_texture_ids pointing at what is resident */
+void streamUpdate(struct stream *s, int cluster);
+/* The faces about to be drawn, for recency and the hit rate */
+void streamDrawn(struct stream *s, int *faces, int n_faces);
+/* Draws from the cluster's buffers if they are in, returns 0 if the caller has to */
+int streamDrawFace(struct stream *s, int face);
+void streamReport(struct stream *s);
+
+#endif /* STREAM_H */
@@ -0,0 +1,847 @@
+#include <config.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "error.h"
+#include "jobs.h"
+#include "trace.h"
+
+/* Keep hits this far in front of the surface */
+#define TRACE_EPSILON (0.125f)
+/* Patch facets are slabs this thick, half on each side of the surface */
+#define PATCH_THICKNESS (2.0f)
+/* A grid quad whose corners are this close to one plane stays a quad */
+#define PATCH_FLAT (0.1f)
+
+/* Facet planes while the patches are built, appended after the brushes */
+struct facet_planes {
+	float (*planes)[4];
+	int n_planes;
+	int max_planes;
+};
+
+static void
+add_plane(struct facet_planes *fp, float x, float y, float z, float dist)
+	{
+	if (fp->n_planes == fp->max_planes)
+		{
+		fp->max_planes = fp->max_planes ? fp->max_planes*2 : 1024;
+		fp->planes = realloc(fp->planes, sizeof(float)*4*fp->max_planes);
+		}
+	fp->planes[fp->n_planes][0] = x;
+	fp->planes[fp->n_planes][1] = y;
+	fp->planes[fp->n_planes][2] = z;
+	fp->planes[fp->n_planes][3] = dist;
+	fp->n_planes++;
+	}
+
+static void
+cross(float a[3], float b[3], float out[3])
+	{
+	out[0] = a[1]*b[2] - a[2]*b[1];
+	out[1] = a[2]*b[0] - a[0]*b[2];
+	out[2] = a[0]*b[1] - a[1]*b[0];
+	}
+
+static float
+dot(float a[3], float b[3])
+	{
+	return a[0]*b[0] + a[1]*b[1] + a[2]*b[2];
+	}
+
+static float
+normalize(float v[3])
+	{
+	float len = sqrtf(dot(v, v));
+
+	if (len > 0)
+		{
+		v[0] /= len;
+		v[1] /= len;
+		v[2] /= len;
+		}
+	return len;
+	}
+
+/* The normal and centre of a triangle or quad, 0 if it's degenerate */
+static int
+facet_plane(float (*points)[3], int n_points, float normal[3], float centre[3])
+	{
+	float a[3], b[3];
+	int i, k;
+
+	/* Quads take the diagonals, so the normal averages both halves */
+	for (k=0; k<3; k++)
+		{
+		a[k] = n_points == 4 ? points[2][k] - points[0][k] : points[1][k] - points[0][k];
+		b[k] = n_points == 4 ? points[3][k] - points[1][k] : points[2][k] - points[0][k];
+		centre[k] = 0;
+		for (i=0; i<n_points; i++) centre[k] += points[i][k];
+		centre[k] /= n_points;
+		}
+
+	cross(a, b, normal);
+	return normalize(normal) > 1e-4f;
+	}
+
+/***
+One convex facet: the surface pushed out half the thickness on
+both sides, then a plane out through each edge, padded to
+TRACE_FACET_PLANES. The edges face out by the winding, so a quad
+that folds over itself has an edge facing in and is refused.
+***/
+static int
+add_facet(struct facet_planes *fp, float (*points)[3], int n_points)
+	{
+	float normal[3], centre[3], edges[4][4], d;
+	int i, k;
+
+	if (!facet_plane(points, n_points, normal, centre)) return 0;
+
+	for (i=0; i<n_points; i++)
+		{
+		float *p = points[i], *q = points[(i+1)%n_points];
+		float e[3];
+
+		for (k=0; k<3; k++) e[k] = q[k] - p[k];
+		cross(e, normal, edges[i]);
+		if (normalize(edges[i]) < 1e-4f)
+			{
+			/* Two points the same, the other edges close it */
+			edges[i][0] = edges[i][1] = edges[i][2] = 0;
+			edges[i][3] = 1;
+			continue;
+			}
+		edges[i][3] = dot(edges[i], p);
+		if (dot(edges[i], centre) > edges[i][3]) return 0;
+		}
+
+	d = dot(normal, centre);
+	add_plane(fp, normal[0], normal[1], normal[2], d + PATCH_THICKNESS*0.5f);
+	add_plane(fp, -normal[0], -normal[1], -normal[2], -d + PATCH_THICKNESS*0.5f);
+	for (i=0; i<n_points; i++) add_plane(fp, edges[i][0], edges[i][1], edges[i][2], edges[i][3]);
+	for (i=2+n_points; i<TRACE_FACET_PLANES; i++) add_plane(fp, 0, 0, 0, 1);
+
+	return 1;
+	}
+
+static int
+quad_is_flat(float (*points)[3])
+	{
+	float normal[3], centre[3], d;
+	int i;
+
+	if (!facet_plane(points, 4, normal, centre)) return 0;
+	d = dot(normal, centre);
+	for (i=0; i<4; i++)
+		if (fabsf(dot(normal, points[i]) - d) > PATCH_FLAT) return 0;
+	return 1;
+	}
+
+static void
+expand_bounds(float mins[3], float maxs[3], float by)
+	{
+	int k;
+
+	for (k=0; k<3; k++)
+		{
+		mins[k] -= by;
+		maxs[k] += by;
+		}
+	}
+
+/***
+Evaluate each 3x3 section of the patch on a TRACE_PATCH_STEPS grid,
+the same way it's drawn but coarser, and make facets of it. Each
+section keeps its own bounds so a trace only clips the facets of
+the sections it passes through.
+Facet planes are numbered from 0 here; tracerCreate moves them.
+***/
+static void
+build_patch(struct tracer *t, struct trace_patch *patch, struct facet_planes *fp,
+		struct bsp_face *face, struct bsp_vertex *verts, int face_index)
+	{
+	int w = face->size[0];
+	int pw = (w-1)/2;
+	int ph = (face->size[1]-1)/2;
+	float step_size = 1.0f/TRACE_PATCH_STEPS;
+	float grid[TRACE_PATCH_STEPS+1][TRACE_PATCH_STEPS+1][3];
+	float control[3][3][5];
+	int i, k, x, y;
+
+	patch->face = face_index;
+	patch->first_section = t->n_sections;
+	patch->n_sections = pw*ph;
+	patch->n_facets = 0;
+	for (k=0; k<3; k++)
+		{
+		patch->mins[k] = 1e30f;
+		patch->maxs[k] = -1e30f;
+		}
+
+	t->sections = realloc(t->sections, sizeof(struct trace_section)*(t->n_sections + pw*ph));
+	t->n_sections += pw*ph;
+
+	for (i=0; i<pw*ph; i++)
+		{
+		struct trace_section *section = &t->sections[patch->first_section + i];
+
+		bspPatchControlPoints(face, verts, i, control);
+
+		section->first_plane = fp->n_planes;
+		section->n_facets = 0;
+		for (k=0; k<3; k++)
+			{
+			section->mins[k] = 1e30f;
+			section->maxs[k] = -1e30f;
+			}
+
+		for (y=0; y<=TRACE_PATCH_STEPS; y++)
+			for (x=0; x<=TRACE_PATCH_STEPS; x++)
+				{
+				float point[5] = {0};
+
+				get_point_on_patch(control, x*step_size, y*step_size, point);
+				for (k=0; k<3; k++)
+					{
+					grid[y][x][k] = point[k];
+					if (point[k] < section->mins[k]) section->mins[k] = point[k];
+					if (point[k] > section->maxs[k]) section->maxs[k] = point[k];
+					}
+				}
+
+		for (y=0; y<TRACE_PATCH_STEPS; y++)
+			for (x=0; x<TRACE_PATCH_STEPS; x++)
+				{
+				float quad[4][3], tri[3][3];
+
+				memcpy(quad[0], grid[y][x], sizeof(float)*3);
+				memcpy(quad[1], grid[y][x+1], sizeof(float)*3);
+				memcpy(quad[2], grid[y+1][x+1], sizeof(float)*3);
+				memcpy(quad[3], grid[y+1][x], sizeof(float)*3);
+
+				if (quad_is_flat(quad) && add_facet(fp, quad, 4))
+					{
+					section->n_facets++;
+					continue;
+					}
+
+				memcpy(tri[0], quad[0], sizeof(float)*3);
+				memcpy(tri[1], quad[1], sizeof(float)*3);
+				memcpy(tri[2], quad[3], sizeof(float)*3);
+				section->n_facets += add_facet(fp, tri, 3);
+				memcpy(tri[0], quad[1], sizeof(float)*3);
+				memcpy(tri[1], quad[2], sizeof(float)*3);
+				memcpy(tri[2], quad[3], sizeof(float)*3);
+				section->n_facets += add_facet(fp, tri, 3);
+				}
+
+		expand_bounds(section->mins, section->maxs, PATCH_THICKNESS + TRACE_EPSILON);
+		for (k=0; k<3; k++)
+			{
+			if (section->mins[k] < patch->mins[k]) patch->mins[k] = section->mins[k];
+			if (section->maxs[k] > patch->maxs[k]) patch->maxs[k] = section->maxs[k];
+			}
+		patch->n_facets += section->n_facets;
+		}
+	}
+
+struct tracer *
+tracerCreate(struct bsp *bsp)
+	{
+	struct bsp_brush *brushes = bsp->directory[BRUSHES].data;
+	struct bsp_brushside *sides = bsp->directory[BRUSHSIDES].data;
+	struct bsp_plane *planes = bsp->directory[PLANES].data;
+	struct texture *textures = bsp->directory[TEXTURES].data;
+	int n_textures = bsp->directory[TEXTURES].length/sizeof(struct texture);
+	struct bsp_face *faces = bsp->directory[FACES].data;
+	int n_faces = bsp->directory[FACES].length/sizeof(struct bsp_face);
+	struct bsp_vertex *verts = bsp->directory[VERTEXES].data;
+	struct facet_planes fp = {0};
+	struct tracer *t;
+	double time;
+	int n_planes = 0;
+	int i, j;
+
+	t = calloc(1, sizeof(struct tracer));
+	t->bsp = bsp;
+	t->n_brushes = bsp->directory[BRUSHES].length/sizeof(struct bsp_brush);
+	t->brush_plane = malloc(sizeof(int)*t->n_brushes);
+	t->brush_n_planes = malloc(sizeof(int)*t->n_brushes);
+
+	for (i=0; i<t->n_brushes; i++)
+		{
+		struct bsp_brush *b = &brushes[i];
+		int solid = b->texture >= 0 && b->texture < n_textures
+			&& (textures[b->texture].contents & CONTENTS_SOLID);
+
+		t->brush_plane[i] = n_planes;
+		t->brush_n_planes[i] = solid ? (b->n_brushsides + 3) & ~3 : 0;
+		n_planes += t->brush_n_planes[i];
+		}
+
+	/* Patches, only the solid ones; the rest can't be walked on anyway */
+	time = jobsTime();
+	t->face_patch = malloc(sizeof(int)*(n_faces+1));
+	for (i=0; i<n_faces; i++)
+		{
+		struct bsp_face *f = &faces[i];
+
+		t->face_patch[i] = -1;
+		if (f->type != 2 || f->size[0] < 3 || f->size[1] < 3) continue;
+		if (f->texture < 0 || f->texture >= n_textures) continue;
+		if (!(textures[f->texture].contents & CONTENTS_SOLID)) continue;
+		t->face_patch[i] = t->n_patches++;
+		}
+	t->patches = malloc(sizeof(struct trace_patch)*(t->n_patches+1));
+	for (i=0; i<n_faces; i++)
+		{
+		struct trace_patch *patch;
+
+		if (t->face_patch[i] < 0) continue;
+		patch = &t->patches[t->face_patch[i]];
+		build_patch(t, patch, &fp, &faces[i], &verts[faces[i].vertex], i);
+		t->n_facets += patch->n_facets;
+		}
+	for (i=0; i<t->n_sections; i++) t->sections[i].first_plane += n_planes;
+	t->patch_build_time = jobsTime() - time;
+	t->use_patches = 1;
+
+	t->nx = malloc(sizeof(float)*(n_planes+fp.n_planes+4));
+	t->ny = malloc(sizeof(float)*(n_planes+fp.n_planes+4));
+	t->nz = malloc(sizeof(float)*(n_planes+fp.n_planes+4));
+	t->dist = malloc(sizeof(float)*(n_planes+fp.n_planes+4));
+
+	for (i=0; i<fp.n_planes; i++)
+		{
+		t->nx[n_planes+i] = fp.planes[i][0];
+		t->ny[n_planes+i] = fp.planes[i][1];
+		t->nz[n_planes+i] = fp.planes[i][2];
+		t->dist[n_planes+i] = fp.planes[i][3];
+		}
+	free(fp.planes);
+
+	for (i=0; i<t->n_brushes; i++)
+		{
+		struct bsp_brush *b = &brushes[i];
+		int first = t->brush_plane[i];
+
+		for (j=0; j<t->brush_n_planes[i]; j++)
+			{
+			if (j < b->n_brushsides)
+				{
+				struct bsp_plane *p = &planes[sides[b->brushside + j].plane];
+				t->nx[first+j] = p->normal[0];
+				t->ny[first+j] = p->normal[1];
+				t->nz[first+j] = p->normal[2];
+				t->dist[first+j] = p->dist;
+				}
+			else
+				{
+				/* Padding: both ends always behind, never clips */
+				t->nx[first+j] = t->ny[first+j] = t->nz[first+j] = 0;
+				t->dist[first+j] = 1;
+				}
+			}
+		}
+
+	return t;
+	}
+
+void
+tracerFree(struct tracer *t)
+	{
+	if (!t) return;
+	free(t->brush_plane);
+	free(t->brush_n_planes);
+	free(t->nx);
+	free(t->ny);
+	free(t->nz);
+	free(t->dist);
+	free(t->patches);
+	free(t->sections);
+	free(t->face_patch);
+	free(t);
+	}
+
+void
+traceWorkInit(struct tracer *t, struct trace_work *w)
+	{
+	w->brush_stamp = calloc(t->n_brushes+1, sizeof(int));
+	w->patch_stamp = calloc(t->n_patches+1, sizeof(int));
+	w->stamp = 0;
+	w->n_traces = 0;
+	w->n_brush_tests = 0;
+	w->n_patch_tests = 0;
+	w->n_patch_culled = 0;
+	w->n_facet_tests = 0;
+	}
+
+void
+traceWorkFree(struct trace_work *w)
+	{
+	free(w->brush_stamp);
+	free(w->patch_stamp);
+	w->brush_stamp = 0;
+	w->patch_stamp = 0;
+	}
+
+struct trace_state {
+	struct tracer *t;
+	struct trace_work *w;
+	float start[3];
+	float end[3];
+	struct trace_result *result;
+};
+
+/***
+Clip the line against one convex set of planes, a brush or a
+patch facet, n a multiple of four. Returns 1 if it moved the hit.
+The same test as the Quake 3 CM_TraceThroughBrush, for a point.
+***/
+static int
+trace_planes(struct trace_state *s, int first, int n)
+	{
+	struct tracer *t = s->t;
+	float enter = -1, leave = 1;
+	int enter_plane = -1;
+	int start_out = 0;
+	int i;
+
+#ifdef __SSE2__
+	{
+	__m128 sx = _mm_set1_ps(s->start[0]), sy = _mm_set1_ps(s->start[1]), sz = _mm_set1_ps(s->start[2]);
+	__m128 ex = _mm_set1_ps(s->end[0]), ey = _mm_set1_ps(s->end[1]), ez = _mm_set1_ps(s->end[2]);
+	__m128 zero = _mm_setzero_ps();
+	__m128 eps = _mm_set1_ps(TRACE_EPSILON);
+
+	for (i=0; i<n; i+=4)
+		{
+		__m128 nx = _mm_loadu_ps(&t->nx[first+i]);
+		__m128 ny = _mm_loadu_ps(&t->ny[first+i]);
+		__m128 nz = _mm_loadu_ps(&t->nz[first+i]);
+		__m128 d = _mm_loadu_ps(&t->dist[first+i]);
+		__m128 d1 = _mm_sub_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, sx), _mm_mul_ps(ny, sy)), _mm_mul_ps(nz, sz)), d);
+		__m128 d2 = _mm_sub_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, ex), _mm_mul_ps(ny, ey)), _mm_mul_ps(nz, ez)), d);
+		__m128 front1 = _mm_cmpgt_ps(d1, zero);
+		__m128 front2 = _mm_cmpgt_ps(d2, zero);
+		float f1[4], f2[4], e[4], l[4];
+		int out_mask, entering, leaving, k;
+
+		/* Both in front and moving away: the line misses the brush */
+		if (_mm_movemask_ps(_mm_and_ps(front1, _mm_cmpge_ps(d2, d1)))) return 0;
+
+		start_out |= _mm_movemask_ps(front1);
+		out_mask = _mm_movemask_ps(_mm_or_ps(front1, front2));
+		if (!out_mask) continue;
+
+		entering = _mm_movemask_ps(_mm_cmpgt_ps(d1, d2)) & out_mask;
+		leaving = ~entering & out_mask;
+
+		_mm_storeu_ps(f1, d1);
+		_mm_storeu_ps(f2, d2);
+		/* Entering fractions pulled back, leaving ones pushed on */
+		_mm_storeu_ps(e, _mm_div_ps(_mm_sub_ps(d1, eps), _mm_sub_ps(d1, d2)));
+		_mm_storeu_ps(l, _mm_div_ps(_mm_add_ps(d1, eps), _mm_sub_ps(d1, d2)));
+
+		for (k=0; k<4; k++)
+			{
+			if (entering & (1<<k))
+				{
+				if (e[k] > enter)
+					{
+					enter = e[k];
+					enter_plane = first+i+k;
+					}
+				}
+			else if (leaving & (1<<k))
+				{
+				if (l[k] < leave) leave = l[k];
+				}
+			}
+		}
+	}
+#else
+	for (i=0; i<n; i++)
+		{
+		int p = first+i;
+		float d1 = t->nx[p]*s->start[0] + t->ny[p]*s->start[1] + t->nz[p]*s->start[2] - t->dist[p];
+		float d2 = t->nx[p]*s->end[0] + t->ny[p]*s->end[1] + t->nz[p]*s->end[2] - t->dist[p];
+
+		if (d1 > 0 && d2 >= d1) return 0;
+		if (d1 > 0) start_out = 1;
+		if (d1 <= 0 && d2 <= 0) continue;
+
+		if (d1 > d2)
+			{
+			float f = (d1 - TRACE_EPSILON)/(d1 - d2);
+			if (f > enter)
+				{
+				enter = f;
+				enter_plane = p;
+				}
+			}
+		else
+			{
+			float f = (d1 + TRACE_EPSILON)/(d1 - d2);
+			if (f < leave) leave = f;
+			}
+		}
+#endif
+
+	if (!start_out)
+		{
+		s->result->start_solid = 1;
+		s->result->fraction = 0;
+		return 1;
+		}
+
+	if (enter < leave && enter > -1 && enter < s->result->fraction)
+		{
+		if (enter < 0) enter = 0;
+		s->result->fraction = enter;
+		s->result->normal[0] = t->nx[enter_plane];
+		s->result->normal[1] = t->ny[enter_plane];
+		s->result->normal[2] = t->nz[enter_plane];
+		return 1;
+		}
+	return 0;
+	}
+
+/* Slab test of the line against a box, up to the nearest hit so far */
+static int
+line_hits_bounds(struct trace_state *s, float mins[3], float maxs[3])
+	{
+	float tmin = 0, tmax = s->result->fraction;
+	int k;
+
+	for (k=0; k<3; k++)
+		{
+		float d = s->end[k] - s->start[k];
+
+		if (d == 0)
+			{
+			if (s->start[k] < mins[k] || s->start[k] > maxs[k]) return 0;
+			}
+		else
+			{
+			float t1 = (mins[k] - s->start[k])/d;
+			float t2 = (maxs[k] - s->start[k])/d;
+			if (t1 > t2)
+				{
+				float swap = t1;
+				t1 = t2;
+				t2 = swap;
+				}
+			if (t1 > tmin) tmin = t1;
+			if (t2 < tmax) tmax = t2;
+			if (tmin > tmax) return 0;
+			}
+		}
+	return 1;
+	}
+
+static void
+trace_patch(struct trace_state *s, struct trace_patch *patch)
+	{
+	int i, j;
+
+	s->w->n_patch_tests++;
+	if (!line_hits_bounds(s, patch->mins, patch->maxs))
+		{
+		s->w->n_patch_culled++;
+		return;
+		}
+
+	for (i=0; i<patch->n_sections; i++)
+		{
+		struct trace_section *section = &s->t->sections[patch->first_section + i];
+
+		if (!line_hits_bounds(s, section->mins, section->maxs)) continue;
+
+		for (j=0; j<section->n_facets; j++)
+			{
+			s->w->n_facet_tests++;
+			if (trace_planes(s, section->first_plane + j*TRACE_FACET_PLANES, TRACE_FACET_PLANES))
+				{
+				s->result->patch = patch->face;
+				if (s->result->fraction == 0) return;
+				}
+			}
+		}
+	}
+
+static void
+trace_leaf(struct trace_state *s, int leaf_index)
+	{
+	struct bsp *bsp = s->t->bsp;
+	struct bsp_leaf *leaf = &((struct bsp_leaf *)bsp->directory[LEAVES].data)[leaf_index];
+	int *leafbrushes = bsp->directory[LEAFBRUSHES].data;
+	int *leaffaces = bsp->directory[LEAFFACES].data;
+	int i;
+
+	for (i=0; i<leaf->n_leafbrushes; i++)
+		{
+		int brush = leafbrushes[leaf->leafbrush + i];
+
+		if (s->w->brush_stamp[brush] == s->w->stamp) continue;
+		s->w->brush_stamp[brush] = s->w->stamp;
+		if (s->t->brush_n_planes[brush] == 0) continue;
+
+		s->w->n_brush_tests++;
+		if (trace_planes(s, s->t->brush_plane[brush], s->t->brush_n_planes[brush]))
+			s->result->patch = -1;
+		if (s->result->fraction == 0) return;
+		}
+
+	if (!s->t->use_patches || !s->t->n_patches) return;
+
+	for (i=0; i<leaf->n_leaffaces; i++)
+		{
+		int patch = s->t->face_patch[leaffaces[leaf->leafface + i]];
+
+		if (patch < 0) continue;
+		if (s->w->patch_stamp[patch] == s->w->stamp) continue;
+		s->w->patch_stamp[patch] = s->w->stamp;
+
+		trace_patch(s, &s->t->patches[patch]);
+		if (s->result->fraction == 0) return;
+		}
+	}
+
+/***
+Walk the part of the line between fractions f1 and f2 (points
+p1 and p2) down the tree, nearest side first, so the walk can
+stop as soon as a hit closer than the current segment is found.
+***/
+static void
+trace_node(struct trace_state *s, int node_index, float f1, float f2, float p1[3], float p2[3])
+	{
+	struct bsp *bsp = s->t->bsp;
+	struct bsp_node *node;
+	struct bsp_plane *plane;
+	float d1, d2, frac, frac2, mid_f, mid[3];
+	int side, k;
+
+	if (s->result->fraction <= f1) return;
+
+	if (node_index < 0)
+		{
+		trace_leaf(s, -(node_index+1));
+		return;
+		}
+
+	node = &((struct bsp_node *)bsp->directory[NODES].data)[node_index];
+	plane = &((struct bsp_plane *)bsp->directory[PLANES].data)[node->plane];
+
+	d1 = plane->normal[0]*p1[0] + plane->normal[1]*p1[1] + plane->normal[2]*p1[2] - plane->dist;
+	d2 = plane->normal[0]*p2[0] + plane->normal[1]*p2[1] + plane->normal[2]*p2[2] - plane->dist;
+
+	if (d1 >= 0 && d2 >= 0)
+		{
+		trace_node(s, node->children[0], f1, f2, p1, p2);
+		return;
+		}
+	if (d1 < 0 && d2 < 0)
+		{
+		trace_node(s, node->children[1], f1, f2, p1, p2);
+		return;
+		}
+
+	/* Split, with a little overlap so brushes on the plane aren't missed */
+	if (d1 < d2)
+		{
+		side = 1;
+		frac = (d1 - TRACE_EPSILON)/(d1 - d2);
+		frac2 = (d1 + TRACE_EPSILON)/(d1 - d2);
+		}
+	else
+		{
+		side = 0;
+		frac = (d1 + TRACE_EPSILON)/(d1 - d2);
+		frac2 = (d1 - TRACE_EPSILON)/(d1 - d2);
+		}
+	if (frac < 0) frac = 0;
+	if (frac > 1) frac = 1;
+	if (frac2 < 0) frac2 = 0;
+	if (frac2 > 1) frac2 = 1;
+
+	mid_f = f1 + (f2 - f1)*frac;
+	for (k=0; k<3; k++) mid[k] = p1[k] + frac*(p2[k] - p1[k]);
+	trace_node(s, node->children[side], f1, mid_f, p1, mid);
+
+	mid_f = f1 + (f2 - f1)*frac2;
+	for (k=0; k<3; k++) mid[k] = p1[k] + frac2*(p2[k] - p1[k]);
+	trace_node(s, node->children[side^1], mid_f, f2, mid, p2);
+	}
+
+/* Returns the fraction of the line before the first solid hit */
+float
+traceLine(struct tracer *t, struct trace_work *w, float start[3], float end[3],
+		struct trace_result *result)
+	{
+	struct trace_result local;
+	struct trace_state s;
+	int k;
+
+	if (!result) result = &local;
+	result->fraction = 1;
+	result->start_solid = 0;
+	result->patch = -1;
+	result->normal[0] = result->normal[1] = result->normal[2] = 0;
+
+	s.t = t;
+	s.w = w;
+	s.result = result;
+	for (k=0; k<3; k++)
+		{
+		s.start[k] = start[k];
+		s.end[k] = end[k];
+		}
+
+	w->stamp++;
+	w->n_traces++;
+
+	trace_node(&s, 0, 0, 1, s.start, s.end);
+
+	return result->fraction;
+	}
+
+#define BENCH_TRACES (1 << 17)
+#define BENCH_LENGTH (512.0f)
+
+struct bench_traces {
+	struct tracer *t;
+	struct trace_work *work;
+	float (*starts)[3];
+	float (*ends)[3];
+	float *fractions;
+};
+
+static float
+bench_random(unsigned int *seed)
+	{
+	*seed = *seed*1664525u + 1013904223u;
+	return (*seed >> 8)*(1.0f/16777216.0f)*2 - 1;
+	}
+
+static void
+bench_trace(void *ctx, int begin, int end, int thread)
+	{
+	struct bench_traces *b = ctx;
+	int i;
+
+	for (i=begin; i<end; i++)
+		b->fractions[i] = traceLine(b->t, &b->work[thread], b->starts[i], b->ends[i], 0);
+	}
+
+static double
+bench_run(struct bench_traces *b, struct jobs *jobs, int n_threads)
+	{
+	double time;
+	int i;
+
+	for (i=0; i<n_threads; i++)
+		{
+		b->work[i].n_traces = b->work[i].n_brush_tests = 0;
+		b->work[i].n_patch_tests = b->work[i].n_patch_culled = b->work[i].n_facet_tests = 0;
+		}
+
+	time = jobsTime();
+	if (jobs) jobsParallelFor(jobs, BENCH_TRACES, 1024, bench_trace, b);
+	else bench_trace(b, 0, BENCH_TRACES, 0);
+	return jobsTime() - time;
+	}
+
+/***
+Random segments from the middle of the leaves the player can be
+in, traced once without the patches and once with them, so the
+difference is what the patches cost.
+***/
+int
+traceBenchmark(struct bsp *bsp, int n_threads)
+	{
+	struct bsp_leaf *leaves = bsp->directory[LEAVES].data;
+	int n_leaves = bsp->directory[LEAVES].length/sizeof(struct bsp_leaf);
+	struct bench_traces b;
+	struct jobs *jobs;
+	float *brush_fractions;
+	unsigned int seed = 1;
+	double brush_time, patch_time, parallel_time;
+	int n_shortened = 0;
+	int i, k;
+
+	jobs = jobsCreate(n_threads);
+	b.t = tracerCreate(bsp);
+	b.work = malloc(sizeof(struct trace_work)*jobsThreadCount(jobs));
+	for (i=0; i<jobsThreadCount(jobs); i++) traceWorkInit(b.t, &b.work[i]);
+	b.starts = malloc(sizeof(float)*3*BENCH_TRACES);
+	b.ends = malloc(sizeof(float)*3*BENCH_TRACES);
+	b.fractions = malloc(sizeof(float)*BENCH_TRACES);
+	brush_fractions = malloc(sizeof(float)*BENCH_TRACES);
+
+	printf("Trace: %i brushes, %i patches in %i facets, built in %.2f ms\n",
+		b.t->n_brushes, b.t->n_patches, b.t->n_facets, b.t->patch_build_time*1000);
+
+	for (i=0; i<BENCH_TRACES; i++)
+		{
+		struct bsp_leaf *leaf;
+		float d[3], len;
+
+		do leaf = &leaves[(int)((bench_random(&seed)*0.5f + 0.5f)*(n_leaves-1))];
+		while (leaf->cluster < 0 && n_leaves > 1);
+
+		do
+			{
+			for (k=0; k<3; k++) d[k] = bench_random(&seed);
+			len = d[0]*d[0] + d[1]*d[1] + d[2]*d[2];
+			}
+		while (len > 1 || len < 0.01f);
+		len = BENCH_LENGTH/sqrtf(len);
+
+		for (k=0; k<3; k++)
+			{
+			b.starts[i][k] = (leaf->mins[k] + leaf->maxs[k])*0.5f;
+			b.ends[i][k] = b.starts[i][k] + d[k]*len;
+			}
+		}
+
+	b.t->use_patches = 0;
+	brush_time = bench_run(&b, 0, 1);
+	memcpy(brush_fractions, b.fractions, sizeof(float)*BENCH_TRACES);
+	printf("Trace: brushes only, 1 thread: %.3f us/trace, %.1f brushes/trace\n",
+		brush_time*1e6/BENCH_TRACES, (double)b.work[0].n_brush_tests/BENCH_TRACES);
+
+	b.t->use_patches = 1;
+	patch_time = bench_run(&b, 0, 1);
+	for (i=0; i<BENCH_TRACES; i++)
+		if (b.fractions[i] < brush_fractions[i]) n_shortened++;
+	printf("Trace: with patches, 1 thread: %.3f us/trace, patches cost %.3f us/trace\n",
+		patch_time*1e6/BENCH_TRACES, (patch_time - brush_time)*1e6/BENCH_TRACES);
+	printf("Trace: %.2f patches/trace, %.1f%% culled by bounds, %.2f facets/trace, %.1f%% stopped by a patch\n",
+		(double)b.work[0].n_patch_tests/BENCH_TRACES,
+		b.work[0].n_patch_tests ? 100.0*b.work[0].n_patch_culled/b.work[0].n_patch_tests : 0.0,
+		(double)b.work[0].n_facet_tests/BENCH_TRACES, 100.0*n_shortened/BENCH_TRACES);
+
+	parallel_time = bench_run(&b, jobs, jobsThreadCount(jobs));
+	printf("Trace: with patches, %i threads: %.2f Mtraces/s\n",
+		jobsThreadCount(jobs), BENCH_TRACES/parallel_time*1e-6);
+
+	for (i=0; i<jobsThreadCount(jobs); i++) traceWorkFree(&b.work[i]);
+	free(b.work);
+	free(b.starts);
+	free(b.ends);
+	free(b.fractions);
+	free(brush_fractions);
+	tracerFree(b.t);
+	jobsDestroy(jobs);
+
+	return 0;
+	}
@@ -0,0 +1,83 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "bsp.h"
+
+#define CONTENTS_SOLID (1)
+/* Glass and the like, solid but vis sees through it */
+#define CONTENTS_TRANSLUCENT (0x20000000)
+
+/* Subdivisions per 3x3 patch section for collision, coarser than drawn */
+#define TRACE_PATCH_STEPS (4)
+/* Planes per patch facet: surface, back, up to four edges, padding */
+#define TRACE_FACET_PLANES (8)
+
+/***
+Line traces against the solid brushes and curved patches.
+Brush planes are kept as structure of arrays, padded to
+multiples of four, so one brush side test covers four planes.
+Patches have no brushes, so each gets a collision grid at load:
+every quad of it, or both triangles if it isn't flat, becomes a
+thin convex facet whose planes go in the same arrays. A patch is
+only looked at if the line touches its bounds, and then only the
+facets of the 3x3 sections whose bounds it touches too.
+***/
+struct trace_section {
+	float mins[3], maxs[3];
+	int first_plane;
+	int n_facets; /*TRACE_FACET_PLANES planes each*/
+};
+
+struct trace_patch {
+	float mins[3], maxs[3];
+	int first_section; /*one per 3x3 control points*/
+	int n_sections;
+	int n_facets;
+	int face;
+};
+
+struct tracer {
+	struct bsp *bsp;
+	int n_brushes;
+	int *brush_plane; /*first plane of each brush in the arrays below*/
+	int *brush_n_planes; /*padded count, 0 if the brush isn't solid*/
+	float *nx, *ny, *nz, *dist;
+
+	int n_patches;
+	struct trace_patch *patches;
+	int n_sections;
+	struct trace_section *sections;
+	int *face_patch; /*-1 if the face isn't a solid patch*/
+	int n_facets;
+	int use_patches;
+	double patch_build_time;
+};
+
+/* Per thread state, brushes are only tested once per trace */
+struct trace_work {
+	int *brush_stamp;
+	int stamp;
+	int *patch_stamp;
+	unsigned long n_traces;
+	unsigned long n_brush_tests;
+	unsigned long n_patch_tests;
+	unsigned long n_patch_culled; /*bounds missed*/
+	unsigned long n_facet_tests;
+};
+
+struct trace_result {
+	float fraction; /*1 if nothing was hit*/
+	float normal[3];
+	int start_solid;
+	int patch; /*face of the patch hit, -1 for a brush or nothing*/
+};
+
+struct tracer *tracerCreate(struct bsp *bsp);
+void tracerFree(struct tracer *t);
+void traceWorkInit(struct tracer *t, struct trace_work *w);
+void traceWorkFree(struct trace_work *w);
+float traceLine(struct tracer *t, struct trace_work *w, float start[3], float end[3],
+		struct trace_result *result);
+int traceBenchmark(struct bsp *bsp, int n_threads);
+
+#endif /* TRACE_H */
@@ -0,0 +1,346 @@
+#include <config.h>
+
+#include <math.h>
+
+#include "error.h"
+#include "vcache.h"
+
+/***
+Vertex cache optimisation.
+Tom Forsyth, "Linear-Speed Vertex Cache Optimisation", 2006.
+
+Triangles are emitted greedily, always picking the one whose
+vertices score highest: recently used vertices score high and
+vertices with few remaining triangles score higher still, so
+fans get finished instead of left dangling.
+***/
+
+#define LRU_SIZE (32)
+#define CACHE_DECAY_POWER (1.5f)
+#define LAST_TRI_SCORE (0.75f)
+#define VALENCE_BOOST_SCALE (2.0f)
+#define VALENCE_BOOST_POWER (0.5f)
+
+struct vc_vertex {
+	int cache_pos; /* -1 if not in the cache */
+	int n_live; /* triangles not yet emitted */
+	int first_tri; /* offset into the adjacency list */
+	float score;
+};
+
+static float
+vertex_score(struct vc_vertex *v)
+	{
+	float score = 0;
+
+	if (v->n_live == 0) return -1.0f;
+
+	if (v->cache_pos >= 0)
+		{
+		if (v->cache_pos < 3) score = LAST_TRI_SCORE;
+		else
+			{
+			float s = 1.0f - (v->cache_pos-3) * (1.0f/(LRU_SIZE-3));
+			score = powf(s, CACHE_DECAY_POWER);
+			}
+		}
+
+	score += VALENCE_BOOST_SCALE * powf(v->n_live, -VALENCE_BOOST_POWER);
+
+	return score;
+	}
+
+/***
+Average cache miss ratio: transformed vertices per triangle,
+simulating a FIFO cache of cache_size entries.
+1.0 is about the best a mesh can do, 3.0 is no reuse at all.
+***/
+float
+vcacheACMR(int *indices, int n_indices, int cache_size)
+	{
+	int cache[64];
+	int head = 0;
+	int filled = 0;
+	int misses = 0;
+	int i, j;
+
+	if (n_indices < 3) return 0;
+	if (cache_size > 64) cache_size = 64;
+
+	for (i=0; i<n_indices; i++)
+		{
+		int hit = 0;
+		for (j=0; j<filled; j++) if (cache[j] == indices[i]) { hit = 1; break; }
+		if (hit) continue;
+
+		misses++;
+		cache[head] = indices[i];
+		head = (head+1) % cache_size;
+		if (filled < cache_size) filled++;
+		}
+
+	return (float)misses / (n_indices/3);
+	}
+
+/* Reorder the triangles in place, indices are 0..n_vertices-1 */
+void
+vcacheOptimize(int *indices, int n_indices, int n_vertices)
+	{
+	struct vc_vertex *verts;
+	int *adjacency;
+	float *tri_score;
+	char *tri_emitted;
+	int *out;
+	int lru[LRU_SIZE+3];
+	int n_lru = 0;
+	int n_tris = n_indices/3;
+	int best_tri = -1;
+	int emitted;
+	int i, j, k;
+
+	if (n_tris < 2) return;
+
+	verts = calloc(n_vertices, sizeof(struct vc_vertex));
+	adjacency = malloc(sizeof(int)*n_indices);
+	tri_score = malloc(sizeof(float)*n_tris);
+	tri_emitted = calloc(n_tris, 1);
+	out = malloc(sizeof(int)*n_indices);
+
+	/* Build vertex to triangle adjacency */
+	for (i=0; i<n_indices; i++) verts[indices[i]].n_live++;
+	for (i=0, k=0; i<n_vertices; i++)
+		{
+		verts[i].first_tri = k;
+		verts[i].cache_pos = -1;
+		k += verts[i].n_live;
+		verts[i].n_live = 0;
+		}
+	for (i=0; i<n_indices; i++)
+		{
+		struct vc_vertex *v = &verts[indices[i]];
+		adjacency[v->first_tri + v->n_live++] = i/3;
+		}
+
+	for (i=0; i<n_vertices; i++) verts[i].score = vertex_score(&verts[i]);
+
+	for (i=0; i<n_tris; i++)
+		{
+		tri_score[i] = verts[indices[i*3]].score + verts[indices[i*3+1]].score
+			+ verts[indices[i*3+2]].score;
+		}
+
+	for (emitted=0; emitted<n_tris; emitted++)
+		{
+		/* Nothing in the cache touched a live triangle, scan everything */
+		if (best_tri < 0)
+			{
+			float best = -1;
+			for (i=0; i<n_tris; i++)
+				{
+				if (!tri_emitted[i] && tri_score[i] > best)
+					{
+					best = tri_score[i];
+					best_tri = i;
+					}
+				}
+			}
+
+		tri_emitted[best_tri] = 1;
+
+		for (j=0; j<3; j++)
+			{
+			int index = indices[best_tri*3+j];
+			struct vc_vertex *v = &verts[index];
+			int *tris = &adjacency[v->first_tri];
+
+			out[emitted*3+j] = index;
+
+			/* Remove the triangle from the vertex's live list */
+			for (k=0; k<v->n_live; k++)
+				{
+				if (tris[k] == best_tri)
+					{
+					tris[k] = tris[v->n_live-1];
+					break;
+					}
+				}
+			v->n_live--;
+
+			/* Move to the front of the LRU */
+			if (v->cache_pos >= 0)
+				{
+				for (k=v->cache_pos; k>0; k--) lru[k] = lru[k-1];
+				}
+			else
+				{
+				for (k=n_lru; k>0; k--) lru[k] = lru[k-1];
+				n_lru++;
+				}
+			lru[0] = index;
+			for (k=0; k<n_lru; k++) verts[lru[k]].cache_pos = k;
+			}
+
+		/* Vertices pushed off the end leave the cache */
+		for (k=LRU_SIZE; k<n_lru; k++) verts[lru[k]].cache_pos = -1;
+		if (n_lru > LRU_SIZE) n_lru = LRU_SIZE;
+
+		/* Rescore cached vertices and their triangles, pick the best */
+		best_tri = -1;
+			{
+			float best = -1;
+
+			for (k=0; k<n_lru; k++)
+				{
+				struct vc_vertex *v = &verts[lru[k]];
+				float score = vertex_score(v);
+				float diff = score - v->score;
+
+				v->score = score;
+				for (j=0; j<v->n_live; j++) tri_score[adjacency[v->first_tri+j]] += diff;
+				}
+
+			for (k=0; k<n_lru; k++)
+				{
+				struct vc_vertex *v = &verts[lru[k]];
+				for (j=0; j<v->n_live; j++)
+					{
+					int t = adjacency[v->first_tri+j];
+					if (tri_score[t] > best)
+						{
+						best = tri_score[t];
+						best_tri = t;
+						}
+					}
+				}
+			}
+		}
+
+	memcpy(indices, out, sizeof(int)*n_indices);
+
+	free(verts);
+	free(adjacency);
+	free(tri_score);
+	free(tri_emitted);
+	free(out);
+	}
+
+/***
+Number vertices in the order the indices first use them,
+so fetches walk forward through memory.
+remap[old] = new. Unreferenced vertices go at the end.
+The indices are rewritten to the new numbering.
+***/
+void
+vcacheRemapVertices(int *indices, int n_indices, int n_vertices, int *remap)
+	{
+	int next = 0;
+	int i;
+
+	for (i=0; i<n_vertices; i++) remap[i] = -1;
+
+	for (i=0; i<n_indices; i++)
+		{
+		if (remap[indices[i]] < 0) remap[indices[i]] = next++;
+		indices[i] = remap[indices[i]];
+		}
+
+	for (i=0; i<n_vertices; i++) if (remap[i] < 0) remap[i] = next++;
+	}
+
+/***
+Optimise every mesh face (types 1 and 3) in place.
+Each face is its own draw, so each one is optimised on its own.
+MESHVERTS are offsets from face->vertex. A face whose meshverts
+are shared with another face is left alone, and its vertices are
+only reordered when no other face uses them either.
+The ACMR of the whole map before and after is returned.
+***/
+int
+bspOptimizeMeshes(struct bsp *bsp, float *acmr_before, float *acmr_after)
+	{
+	struct bsp_face *faces = bsp->directory[FACES].data;
+	struct bsp_vertex *vertices = bsp->directory[VERTEXES].data;
+	int *meshverts = bsp->directory[MESHVERTS].data;
+	int n_faces = bsp->directory[FACES].length/sizeof(struct bsp_face);
+	int n_vertexes = bsp->directory[VERTEXES].length/sizeof(struct bsp_vertex);
+	int n_meshverts = bsp->directory[MESHVERTS].length/sizeof(int);
+	int *owner;
+	int *mv_owner;
+	int *remap = 0;
+	struct bsp_vertex *scratch = 0;
+	int max_verts = 0;
+	double misses_before = 0, misses_after = 0;
+	int n_tris = 0;
+	int i, j;
+
+	/* Which face owns each vertex and meshvert, -2 if shared */
+	owner = malloc(sizeof(int)*n_vertexes);
+	mv_owner = malloc(sizeof(int)*n_meshverts);
+	for (i=0; i<n_vertexes; i++) owner[i] = -1;
+	for (i=0; i<n_meshverts; i++) mv_owner[i] = -1;
+	for (i=0; i<n_faces; i++)
+		{
+		struct bsp_face *face = &faces[i];
+		if (face->n_vertexes > max_verts) max_verts = face->n_vertexes;
+		for (j=0; j<face->n_vertexes; j++)
+			{
+			int v = face->vertex + j;
+			if (v < 0 || v >= n_vertexes) continue;
+			owner[v] = owner[v] == -1 ? i : -2;
+			}
+		if (face->type != 1 && face->type != 3) continue;
+		for (j=0; j<face->n_meshverts; j++)
+			{
+			int m = face->meshvert + j;
+			if (m < 0 || m >= n_meshverts) continue;
+			mv_owner[m] = mv_owner[m] == -1 ? i : -2;
+			}
+		}
+
+	remap = malloc(sizeof(int)*(max_verts+1));
+	scratch = malloc(sizeof(struct bsp_vertex)*(max_verts+1));
+
+	for (i=0; i<n_faces; i++)
+		{
+		struct bsp_face *face = &faces[i];
+		int *inds = &meshverts[face->meshvert];
+		int n = face->n_meshverts - face->n_meshverts%3;
+		int owned = 1;
+
+		if (face->type != 1 && face->type != 3) continue;
+		if (n < 3) continue;
+		if (face->meshvert < 0 || face->meshvert + face->n_meshverts > n_meshverts) continue;
+		if (face->vertex < 0 || face->vertex + face->n_vertexes > n_vertexes) continue;
+
+		for (j=0; j<face->n_meshverts; j++) if (mv_owner[face->meshvert+j] != i) owned = 0;
+		for (j=0; j<n; j++) if (inds[j] < 0 || inds[j] >= face->n_vertexes) owned = 0;
+		if (!owned) continue;
+
+		misses_before += vcacheACMR(inds, n, VCACHE_SIZE) * (n/3);
+		vcacheOptimize(inds, n, face->n_vertexes);
+		misses_after += vcacheACMR(inds, n, VCACHE_SIZE) * (n/3);
+		n_tris += n/3;
+
+		if (n != face->n_meshverts) continue;
+		for (j=0; j<face->n_vertexes; j++) if (owner[face->vertex+j] != i) owned = 0;
+		if (!owned) continue;
+
+		vcacheRemapVertices(inds, n, face->n_vertexes, remap);
+		for (j=0; j<face->n_vertexes; j++) scratch[remap[j]] = vertices[face->vertex+j];
+		memcpy(&vertices[face->vertex], scratch, sizeof(struct bsp_vertex)*face->n_vertexes);
+		}
+
+	if (n_tris)
+		{
+		*acmr_before = misses_before/n_tris;
+		*acmr_after = misses_after/n_tris;
+		}
+	else *acmr_before = *acmr_after = 0;
+
+	free(owner);
+	free(mv_owner);
+	free(remap);
+	free(scratch);
+
+	return n_tris;
+	}
@@ -0,0 +1,14 @@
+#ifndef VCACHE_H
+#define VCACHE_H
+
+#include "bsp.h"
+
+/* FIFO size used when measuring, close to real post-transform caches */
+#define VCACHE_SIZE (16)
+
+float vcacheACMR(int *indices, int n_indices, int cache_size);
+void vcacheOptimize(int *indices, int n_indices, int n_vertices);
+void vcacheRemapVertices(int *indices, int n_indices, int n_vertices, int *remap);
+int bspOptimizeMeshes(struct bsp *bsp, float *acmr_before, float *acmr_after);
+
+#endif /* VCACHE_H */
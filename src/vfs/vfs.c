@@ -0,0 +1,583 @@
+#include <config.h>
+
+#include <ctype.h>
+#include <dirent.h>
+#include <string.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "../error.h"
+#include "../jobs.h"
+#include "vfs.h"
+
+#define ZIP_LOCAL_SIG (0x04034b50)
+#define ZIP_CENTRAL_SIG (0x02014b50)
+#define ZIP_END_SIG (0x06054b50)
+#define ZIP_STORED (0)
+#define ZIP_DEFLATED (8)
+
+struct vfs_archive {
+	char *filename;
+	unsigned char *data; /*whole file, mmapped*/
+	size_t size;
+};
+
+struct vfs_entry {
+	char *name; /*lower case*/
+	unsigned int hash;
+	int archive;
+	unsigned int header; /*local header offset*/
+	unsigned int compressed;
+	unsigned int length;
+	int method;
+};
+
+struct vfs {
+	char **directories;
+	int n_directories;
+	struct vfs_archive *archives;
+	int n_archives;
+	struct vfs_entry *entries;
+	int n_entries;
+	int *table; /*open addressing, entry index or -1*/
+	int table_size;
+};
+
+static unsigned int
+read16(unsigned char *p)
+	{
+	return p[0] | (p[1] << 8);
+	}
+
+static unsigned int
+read32(unsigned char *p)
+	{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+	}
+
+/* FNV-1a of the lower case path, / and \ are the same */
+static unsigned int
+hash_path(char *path)
+	{
+	unsigned int h = 2166136261u;
+
+	for (; *path; path++)
+		{
+		int c = tolower((unsigned char)*path);
+		if (c == '\\') c = '/';
+		h = (h ^ c) * 16777619u;
+		}
+
+	return h;
+	}
+
+static void
+normalise(char *dest, char *src, int max)
+	{
+	int i;
+
+	for (i=0; src[i] && i<max-1; i++)
+		{
+		dest[i] = tolower((unsigned char)src[i]);
+		if (dest[i] == '\\') dest[i] = '/';
+		}
+	dest[i] = 0;
+	}
+
+static int
+find_entry(struct vfs *vfs, char *path)
+	{
+	char name[256];
+	unsigned int hash;
+	int slot;
+
+	if (vfs->table_size == 0) return -1;
+
+	normalise(name, path, sizeof(name));
+	hash = hash_path(name);
+	slot = hash & (vfs->table_size-1);
+
+	while (vfs->table[slot] >= 0)
+		{
+		struct vfs_entry *e = &vfs->entries[vfs->table[slot]];
+		if (e->hash == hash && !strcmp(e->name, name)) return vfs->table[slot];
+		slot = (slot+1) & (vfs->table_size-1);
+		}
+
+	return -1;
+	}
+
+/* Rebuilt after each mount, later entries replace earlier ones */
+static void
+build_table(struct vfs *vfs)
+	{
+	int i;
+
+	vfs->table_size = 16;
+	while (vfs->table_size < vfs->n_entries*2) vfs->table_size *= 2;
+	vfs->table = realloc(vfs->table, sizeof(int)*vfs->table_size);
+	for (i=0; i<vfs->table_size; i++) vfs->table[i] = -1;
+
+	for (i=0; i<vfs->n_entries; i++)
+		{
+		struct vfs_entry *e = &vfs->entries[i];
+		int slot = e->hash & (vfs->table_size-1);
+
+		while (vfs->table[slot] >= 0)
+			{
+			if (!strcmp(vfs->entries[vfs->table[slot]].name, e->name)) break;
+			slot = (slot+1) & (vfs->table_size-1);
+			}
+		vfs->table[slot] = i;
+		}
+	}
+
+/***
+Map the archive and read its central directory.
+Only the end of the file and the central directory are touched,
+the data is paged in when an entry is read.
+***/
+static int
+mount_archive(struct vfs *vfs, char *filename)
+	{
+	struct vfs_archive *a;
+	unsigned char *end = 0;
+	unsigned char *p;
+	struct stat st;
+	unsigned int n, offset;
+	int fd;
+	long i;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) return -1;
+	if (fstat(fd, &st) != 0 || st.st_size < 22)
+		{
+		close(fd);
+		return -1;
+		}
+
+	vfs->archives = realloc(vfs->archives, sizeof(struct vfs_archive)*(vfs->n_archives+1));
+	a = &vfs->archives[vfs->n_archives];
+	a->size = st.st_size;
+	a->data = mmap(0, a->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (a->data == MAP_FAILED) return -1;
+
+	/* End of central directory, maybe followed by a comment */
+	for (i=a->size-22; i>=0 && i>=(long)a->size-22-65535; i--)
+		{
+		if (read32(a->data+i) == ZIP_END_SIG)
+			{
+			end = a->data+i;
+			break;
+			}
+		}
+	if (!end)
+		{
+		munmap(a->data, a->size);
+		return -1;
+		}
+
+	n = read16(end+10);
+	offset = read32(end+16);
+	if (offset >= a->size)
+		{
+		munmap(a->data, a->size);
+		return -1;
+		}
+
+	a->filename = strdup(filename);
+	vfs->entries = realloc(vfs->entries, sizeof(struct vfs_entry)*(vfs->n_entries+n));
+	p = a->data + offset;
+
+	for (i=0; i<n; i++)
+		{
+		struct vfs_entry *e;
+		unsigned int name_length;
+		char name[256];
+
+		if (p+46 > a->data+a->size || read32(p) != ZIP_CENTRAL_SIG) break;
+		name_length = read16(p+28);
+
+		/* Directories end in / and hold nothing */
+		if (name_length > 0 && name_length < sizeof(name) && p[46+name_length-1] != '/')
+			{
+			memcpy(name, p+46, name_length);
+			name[name_length] = 0;
+
+			e = &vfs->entries[vfs->n_entries++];
+			e->name = malloc(name_length+1);
+			normalise(e->name, name, name_length+1);
+			e->hash = hash_path(e->name);
+			e->archive = vfs->n_archives;
+			e->method = read16(p+10);
+			e->compressed = read32(p+20);
+			e->length = read32(p+24);
+			e->header = read32(p+42);
+			}
+
+		p += 46 + name_length + read16(p+30) + read16(p+32);
+		}
+
+	vfs->n_archives++;
+
+	return 0;
+	}
+
+static int
+compare_names(const void *a, const void *b)
+	{
+	return strcasecmp(*(char **)a, *(char **)b);
+	}
+
+struct vfs *
+vfsCreate(void)
+	{
+	return calloc(1, sizeof(struct vfs));
+	}
+
+void
+vfsDestroy(struct vfs *vfs)
+	{
+	int i;
+
+	if (!vfs) return;
+
+	for (i=0; i<vfs->n_archives; i++)
+		{
+		munmap(vfs->archives[i].data, vfs->archives[i].size);
+		free(vfs->archives[i].filename);
+		}
+	for (i=0; i<vfs->n_entries; i++) free(vfs->entries[i].name);
+	for (i=0; i<vfs->n_directories; i++) free(vfs->directories[i]);
+
+	free(vfs->archives);
+	free(vfs->entries);
+	free(vfs->directories);
+	free(vfs->table);
+	free(vfs);
+	}
+
+/***
+Mount a directory: its loose files and every .pk3 in it.
+Returns the number of archives mounted, -1 if it isn't a directory.
+***/
+int
+vfsMount(struct vfs *vfs, char *directory)
+	{
+	DIR *dir;
+	struct dirent *de;
+	char **names = 0;
+	int n_names = 0;
+	int mounted = 0;
+	int i;
+
+	dir = opendir(directory);
+	if (!dir) return -1;
+
+	while ((de = readdir(dir)))
+		{
+		int len = strlen(de->d_name);
+		if (len < 4 || strcasecmp(de->d_name+len-4, ".pk3")) continue;
+		names = realloc(names, sizeof(char *)*(n_names+1));
+		names[n_names++] = strdup(de->d_name);
+		}
+	closedir(dir);
+
+	qsort(names, n_names, sizeof(char *), compare_names);
+
+	for (i=0; i<n_names; i++)
+		{
+		char path[1024];
+		snprintf(path, sizeof(path), "%s/%s", directory, names[i]);
+		if (mount_archive(vfs, path) == 0) mounted++;
+		else printf("VFS: %s is not a zip file\n", path);
+		free(names[i]);
+		}
+	free(names);
+
+	vfs->directories = realloc(vfs->directories, sizeof(char *)*(vfs->n_directories+1));
+	vfs->directories[vfs->n_directories++] = strdup(directory);
+
+	build_table(vfs);
+
+	return mounted;
+	}
+
+/* Loose file in a mounted directory, newest mount first */
+static int
+loose_path(struct vfs *vfs, char *path, char *out, int max)
+	{
+	struct stat st;
+	int i;
+
+	if (stat(path, &st) == 0 && S_ISREG(st.st_mode))
+		{
+		snprintf(out, max, "%s", path);
+		return 1;
+		}
+
+	for (i=vfs->n_directories-1; i>=0; i--)
+		{
+		snprintf(out, max, "%s/%s", vfs->directories[i], path);
+		if (stat(out, &st) == 0 && S_ISREG(st.st_mode)) return 1;
+		}
+
+	return 0;
+	}
+
+/***
+Where path is on disk if it is a loose file, e.g. to watch it.
+Returns 0 if it only exists inside an archive.
+***/
+int
+vfsLoosePath(struct vfs *vfs, char *path, char *out, int max)
+	{
+	return loose_path(vfs, path, out, max);
+	}
+
+int
+vfsExists(struct vfs *vfs, char *path)
+	{
+	char loose[1024];
+
+	if (loose_path(vfs, path, loose, sizeof(loose))) return 1;
+	return find_entry(vfs, path) >= 0;
+	}
+
+/* Only the archives' hash table, no stat of the loose directories */
+int
+vfsInArchive(struct vfs *vfs, char *path)
+	{
+	return find_entry(vfs, path) >= 0;
+	}
+
+static int
+read_loose(char *path, struct vfs_file *file)
+	{
+	FILE *fp;
+	long length;
+
+	fp = fopen(path, "rb");
+	if (!fp) return -1;
+	fseek(fp, 0, SEEK_END);
+	length = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+
+	file->data = malloc(length+1);
+	file->length = length;
+	file->mapped = 0;
+	if (fread(file->data, 1, length, fp) != length)
+		{
+		fclose(fp);
+		free(file->data);
+		return -1;
+		}
+	((char *)file->data)[length] = 0;
+	fclose(fp);
+
+	return 0;
+	}
+
+/***
+Stored entries are handed over in place, no copy.
+Deflated ones are inflated into a new buffer.
+Either way the data must be released with vfsClose.
+***/
+static int
+read_entry(struct vfs *vfs, struct vfs_entry *e, struct vfs_file *file)
+	{
+	struct vfs_archive *a = &vfs->archives[e->archive];
+	unsigned char *local = a->data + e->header;
+	unsigned char *data;
+	z_stream z = {0};
+
+	if (e->header + 30 > a->size || read32(local) != ZIP_LOCAL_SIG) return -1;
+	data = local + 30 + read16(local+26) + read16(local+28);
+	if (data + e->compressed > a->data + a->size) return -1;
+
+	if (e->method == ZIP_STORED)
+		{
+		file->data = data;
+		file->length = e->length;
+		file->mapped = 1;
+		return 0;
+		}
+
+	if (e->method != ZIP_DEFLATED) return -1;
+
+	file->data = malloc(e->length+1);
+	file->length = e->length;
+	file->mapped = 0;
+
+	/* Raw deflate, zip has its own headers */
+	if (inflateInit2(&z, -MAX_WBITS) != Z_OK) return -1;
+	z.next_in = data;
+	z.avail_in = e->compressed;
+	z.next_out = file->data;
+	z.avail_out = e->length;
+	if (inflate(&z, Z_FINISH) != Z_STREAM_END)
+		{
+		inflateEnd(&z);
+		free(file->data);
+		file->data = 0;
+		return -1;
+		}
+	inflateEnd(&z);
+	((char *)file->data)[e->length] = 0;
+
+	return 0;
+	}
+
+int
+vfsRead(struct vfs *vfs, char *path, struct vfs_file *file)
+	{
+	char loose[1024];
+	int index;
+
+	file->data = 0;
+	file->length = 0;
+	file->mapped = 0;
+
+	if (loose_path(vfs, path, loose, sizeof(loose))) return read_loose(loose, file);
+
+	index = find_entry(vfs, path);
+	if (index < 0) return -1;
+
+	return read_entry(vfs, &vfs->entries[index], file);
+	}
+
+struct read_many {
+	struct vfs *vfs;
+	char **paths;
+	struct vfs_file *files;
+	int failed;
+};
+
+static void
+read_many_range(void *ctx, int begin, int end, int thread)
+	{
+	struct read_many *r = ctx;
+	int i;
+
+	for (i=begin; i<end; i++)
+		if (vfsRead(r->vfs, r->paths[i], &r->files[i]) != 0) r->failed = 1;
+	}
+
+/***
+Read several files at once, inflating on the worker threads.
+Returns -1 if any of them failed; those have null data.
+***/
+int
+vfsReadMany(struct vfs *vfs, char **paths, int n, struct vfs_file *files, struct jobs *jobs)
+	{
+	struct read_many r;
+
+	r.vfs = vfs;
+	r.paths = paths;
+	r.files = files;
+	r.failed = 0;
+
+	jobsParallelFor(jobs, n, 1, read_many_range, &r);
+
+	return r.failed ? -1 : 0;
+	}
+
+void
+vfsClose(struct vfs_file *file)
+	{
+	if (!file->mapped) free(file->data);
+	file->data = 0;
+	file->length = 0;
+	}
+
+static int
+match(char *name, char *prefix, char *suffix)
+	{
+	int len = strlen(name);
+	int slen = suffix ? strlen(suffix) : 0;
+
+	if (prefix && strncasecmp(name, prefix, strlen(prefix))) return 0;
+	if (suffix && (len < slen || strcasecmp(name+len-slen, suffix))) return 0;
+	return 1;
+	}
+
+static int
+add_unique(char ***paths, int n, char *name)
+	{
+	int i;
+
+	for (i=0; i<n; i++) if (!strcasecmp((*paths)[i], name)) return n;
+	*paths = realloc(*paths, sizeof(char *)*(n+1));
+	(*paths)[n] = strdup(name);
+	return n+1;
+	}
+
+/***
+Every path starting with prefix (a directory, e.g. "maps/") and
+ending with suffix, from the archives and the loose directories.
+Returns the count, free the list with vfsFreeList.
+***/
+int
+vfsList(struct vfs *vfs, char *prefix, char *suffix, char ***paths)
+	{
+	int n = 0;
+	int i;
+
+	*paths = 0;
+
+	for (i=0; i<vfs->n_entries; i++)
+		{
+		if (!match(vfs->entries[i].name, prefix, suffix)) continue;
+		/* Only the entry that wins the lookup */
+		if (find_entry(vfs, vfs->entries[i].name) != i) continue;
+		n = add_unique(paths, n, vfs->entries[i].name);
+		}
+
+	for (i=0; i<vfs->n_directories; i++)
+		{
+		char dirname[1024];
+		DIR *dir;
+		struct dirent *de;
+
+		snprintf(dirname, sizeof(dirname), "%s/%s", vfs->directories[i], prefix ? prefix : "");
+		dir = opendir(dirname);
+		if (!dir) continue;
+
+		while ((de = readdir(dir)))
+			{
+			char name[1024];
+			snprintf(name, sizeof(name), "%s%s", prefix ? prefix : "", de->d_name);
+			if (de->d_name[0] == '.' || !match(name, prefix, suffix)) continue;
+			n = add_unique(paths, n, name);
+			}
+		closedir(dir);
+		}
+
+	return n;
+	}
+
+void
+vfsFreeList(char **paths, int n)
+	{
+	int i;
+
+	for (i=0; i<n; i++) free(paths[i]);
+	free(paths);
+	}
+
+int
+vfsEntryCount(struct vfs *vfs)
+	{
+	return vfs->n_entries;
+	}
+
+int
+vfsArchiveCount(struct vfs *vfs)
+	{
+	return vfs->n_archives;
+	}
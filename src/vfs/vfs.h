@@ -0,0 +1,38 @@
+#ifndef VFS_H
+#define VFS_H
+
+/***
+Virtual filesystem over loose files and .pk3 (zip) archives.
+
+Every pk3 in a mounted directory is mmapped and its central
+directory indexed in one hash table keyed by the lower case path.
+pk3s mount in alphabetical order and later ones win, as in Quake 3;
+loose files in a mounted directory win over every archive so a
+freshly compiled map can be tested without repacking.
+***/
+
+struct jobs;
+struct vfs;
+
+/* Inflated and loose data is null terminated, mapped data isn't */
+struct vfs_file {
+	void *data;
+	int length;
+	int mapped; /*points into an archive, don't free*/
+};
+
+struct vfs *vfsCreate(void);
+void vfsDestroy(struct vfs *vfs);
+int vfsMount(struct vfs *vfs, char *directory);
+int vfsExists(struct vfs *vfs, char *path);
+int vfsInArchive(struct vfs *vfs, char *path);
+int vfsLoosePath(struct vfs *vfs, char *path, char *out, int max);
+int vfsRead(struct vfs *vfs, char *path, struct vfs_file *file);
+int vfsReadMany(struct vfs *vfs, char **paths, int n, struct vfs_file *files, struct jobs *jobs);
+void vfsClose(struct vfs_file *file);
+int vfsList(struct vfs *vfs, char *prefix, char *suffix, char ***paths);
+void vfsFreeList(char **paths, int n);
+int vfsEntryCount(struct vfs *vfs);
+int vfsArchiveCount(struct vfs *vfs);
+
+#endif /* VFS_H */
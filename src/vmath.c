@@ -0,0 +1,220 @@
+#include <config.h>
+
+#include <math.h>
+#include <string.h>
+
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+
+#include "vmath.h"
+
+float
+vec3Dot(float a[3], float b[3])
+	{
+	return a[0]*b[0] + a[1]*b[1] + a[2]*b[2];
+	}
+
+void
+vec3Cross(float out[3], float a[3], float b[3])
+	{
+	float r[3];
+
+	r[0] = a[1]*b[2] - a[2]*b[1];
+	r[1] = a[2]*b[0] - a[0]*b[2];
+	r[2] = a[0]*b[1] - a[1]*b[0];
+	memcpy(out, r, sizeof(r));
+	}
+
+/* Returns the old length */
+float
+vec3Normalize(float v[3])
+	{
+	float len = sqrtf(vec3Dot(v, v));
+
+	if (len > 0)
+		{
+		v[0] /= len;
+		v[1] /= len;
+		v[2] /= len;
+		}
+
+	return len;
+	}
+
+void
+vec3Scale(float out[3], float v[3], float s)
+	{
+	out[0] = v[0]*s;
+	out[1] = v[1]*s;
+	out[2] = v[2]*s;
+	}
+
+/* out = add + v*s */
+void
+vec3MultiplyAdd(float out[3], float v[3], float s, float add[3])
+	{
+	out[0] = add[0] + v[0]*s;
+	out[1] = add[1] + v[1]*s;
+	out[2] = add[2] + v[2]*s;
+	}
+
+void
+mat4Identity(float m[16])
+	{
+	memset(m, 0, sizeof(float)*16);
+	m[0] = m[5] = m[10] = m[15] = 1;
+	}
+
+/* out = a*b, out may be a or b */
+void
+mat4Multiply(float out[16], float a[16], float b[16])
+	{
+#ifdef __SSE__
+	__m128 c0 = _mm_loadu_ps(&a[0]);
+	__m128 c1 = _mm_loadu_ps(&a[4]);
+	__m128 c2 = _mm_loadu_ps(&a[8]);
+	__m128 c3 = _mm_loadu_ps(&a[12]);
+	__m128 r[4];
+	int i;
+
+	/* Column i of the result is a times column i of b */
+	for (i=0; i<4; i++)
+		{
+		r[i] = _mm_add_ps(
+			_mm_add_ps(_mm_mul_ps(c0, _mm_set1_ps(b[i*4+0])), _mm_mul_ps(c1, _mm_set1_ps(b[i*4+1]))),
+			_mm_add_ps(_mm_mul_ps(c2, _mm_set1_ps(b[i*4+2])), _mm_mul_ps(c3, _mm_set1_ps(b[i*4+3]))));
+		}
+
+	for (i=0; i<4; i++) _mm_storeu_ps(&out[i*4], r[i]);
+#else
+	float r[16];
+	int i, j;
+
+	for (i=0; i<4; i++)
+		{
+		for (j=0; j<4; j++)
+			{
+			r[i*4+j] = a[0*4+j]*b[i*4+0] + a[1*4+j]*b[i*4+1]
+				+ a[2*4+j]*b[i*4+2] + a[3*4+j]*b[i*4+3];
+			}
+		}
+
+	memcpy(out, r, sizeof(r));
+#endif
+	}
+
+/* Homogeneous result, w in out[3] */
+void
+mat4TransformPoint(float out[4], float m[16], float p[3])
+	{
+	float r[4];
+	int j;
+
+	for (j=0; j<4; j++) r[j] = m[j]*p[0] + m[4+j]*p[1] + m[8+j]*p[2] + m[12+j];
+	memcpy(out, r, sizeof(r));
+	}
+
+/* Same matrix glFrustum builds */
+void
+mat4Frustum(float m[16], float l, float r, float b, float t, float n, float f)
+	{
+	memset(m, 0, sizeof(float)*16);
+	m[0] = 2*n/(r-l);
+	m[5] = 2*n/(t-b);
+	m[8] = (r+l)/(r-l);
+	m[9] = (t+b)/(t-b);
+	m[10] = -(f+n)/(f-n);
+	m[11] = -1;
+	m[14] = -2*f*n/(f-n);
+	}
+
+void
+quatFromAxisAngle(float q[4], float axis[3], float degrees)
+	{
+	float half = DEG2RAD(degrees)*0.5f;
+	float s = sinf(half);
+
+	q[0] = axis[0]*s;
+	q[1] = axis[1]*s;
+	q[2] = axis[2]*s;
+	q[3] = cosf(half);
+	}
+
+/* out = a*b, rotate by b then a */
+void
+quatMultiply(float out[4], float a[4], float b[4])
+	{
+	float r[4];
+
+	r[0] = a[3]*b[0] + a[0]*b[3] + a[1]*b[2] - a[2]*b[1];
+	r[1] = a[3]*b[1] - a[0]*b[2] + a[1]*b[3] + a[2]*b[0];
+	r[2] = a[3]*b[2] + a[0]*b[1] - a[1]*b[0] + a[2]*b[3];
+	r[3] = a[3]*b[3] - a[0]*b[0] - a[1]*b[1] - a[2]*b[2];
+	memcpy(out, r, sizeof(r));
+	}
+
+void
+quatNormalize(float q[4])
+	{
+	float len = sqrtf(q[0]*q[0] + q[1]*q[1] + q[2]*q[2] + q[3]*q[3]);
+	int i;
+
+	if (len == 0) return;
+	for (i=0; i<4; i++) q[i] /= len;
+	}
+
+void
+quatToMatrix(float m[16], float q[4])
+	{
+	float x = q[0], y = q[1], z = q[2], w = q[3];
+
+	m[0] = 1 - 2*(y*y + z*z);
+	m[1] = 2*(x*y + z*w);
+	m[2] = 2*(x*z - y*w);
+	m[3] = 0;
+
+	m[4] = 2*(x*y - z*w);
+	m[5] = 1 - 2*(x*x + z*z);
+	m[6] = 2*(y*z + x*w);
+	m[7] = 0;
+
+	m[8] = 2*(x*z + y*w);
+	m[9] = 2*(y*z - x*w);
+	m[10] = 1 - 2*(x*x + y*y);
+	m[11] = 0;
+
+	m[12] = m[13] = m[14] = 0;
+	m[15] = 1;
+	}
+
+/***
+Quake angles in degrees: yaw about z, then pitch about y
+(positive looks down), then roll about x.
+***/
+void
+quatFromAngles(float q[4], float pitch, float yaw, float roll)
+	{
+	float z_axis[3] = {0,0,1};
+	float y_axis[3] = {0,1,0};
+	float x_axis[3] = {1,0,0};
+	float qy[4], qp[4], qr[4];
+
+	quatFromAxisAngle(qy, z_axis, yaw);
+	quatFromAxisAngle(qp, y_axis, pitch);
+	quatFromAxisAngle(qr, x_axis, roll);
+	quatMultiply(q, qy, qp);
+	quatMultiply(q, q, qr);
+	}
+
+void
+quatRotate(float out[3], float q[4], float v[3])
+	{
+	float m[16];
+	float r[3];
+	int j;
+
+	quatToMatrix(m, q);
+	for (j=0; j<3; j++) r[j] = m[j]*v[0] + m[4+j]*v[1] + m[8+j]*v[2];
+	memcpy(out, r, sizeof(r));
+	}
@@ -0,0 +1,32 @@
+#ifndef VMATH_H
+#define VMATH_H
+
+/***
+Vectors, 4x4 matrices and quaternions.
+Matrices are column major, the same as OpenGL, so they can be
+handed straight to glLoadMatrixf. Quaternions are x,y,z,w.
+The matrix products use SSE when it's available.
+***/
+
+#define DEG2RAD(a) ((a)*(float)(M_PI/180.0))
+
+float vec3Dot(float a[3], float b[3]);
+void vec3Cross(float out[3], float a[3], float b[3]);
+float vec3Normalize(float v[3]);
+void vec3Scale(float out[3], float v[3], float s);
+void vec3MultiplyAdd(float out[3], float v[3], float s, float add[3]);
+
+void mat4Identity(float m[16]);
+void mat4Multiply(float out[16], float a[16], float b[16]);
+void mat4TransformPoint(float out[4], float m[16], float p[3]);
+void mat4Frustum(float m[16], float left, float right, float bottom, float top,
+		float znear, float zfar);
+
+void quatFromAxisAngle(float q[4], float axis[3], float degrees);
+void quatMultiply(float out[4], float a[4], float b[4]);
+void quatNormalize(float q[4]);
+void quatToMatrix(float m[16], float q[4]);
+void quatFromAngles(float q[4], float pitch, float yaw, float roll);
+void quatRotate(float out[3], float q[4], float v[3]);
+
+#endif /* VMATH_H */